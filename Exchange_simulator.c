@@ -1,1534 +1,7876 @@
 #include "spx_exchange.h"
-#include <poll.h>
+#include "spx_plugin.h"
+#include "spx_drop_copy.h"
+#include "spx_depth_feed.h"
+#include "spx_capture.h"
+#include "spx_partition.h"
+#include "spx_archive.h"
+#include <dlfcn.h>
+#include <sys/epoll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <sys/wait.h>
 
-volatile int pipe_signal = FALSE;
-volatile pid_t trader_sig_id = 0;
 volatile pid_t disconnect_child = 0;
 volatile pid_t old_disconnect = 0;
 
+// Time-in-force of an order, given as an optional last field of BUY/SELL
+#define TIF_GTC 0
+#define TIF_IOC 1
+#define TIF_FOK 2
+// GTT <milliseconds>: rests like GTC until it expires
+#define TIF_GTT 3
+#define TIF_RESTS(time_in_force) ((time_in_force) == TIF_GTC || (time_in_force) == TIF_GTT)
+
+// Hierarchical timer wheel: TIMER_LEVELS levels of TIMER_SLOTS slots, 1 ms per level 0 slot
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE ((int64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+#define TIMER_ORDER_EXPIRY 0
+#define TIMER_HOUSEKEEPING 1
+#define TIMER_CHECKPOINT 2
+// Milliseconds between housekeeping runs
+#define HOUSEKEEPING_INTERVAL 250
+
+/* Struct: timer_node
+ * ----------------------------
+ *   A timer, linked into one slot of the timer wheel while armed. expires is in
+ *   get_time_ms milliseconds. Timers are embedded in what they time, e.g. an order_record.
+ */
+struct timer_node
+{
+	int64_t expires;
+	int kind;
+	int armed;
+	struct timer_node **slot;
+	struct timer_node *prev;
+	struct timer_node *next;
+};
+
+/* Struct: timer_wheel
+ * ----------------------------
+ *   Timers due within TIMER_SLOTS ms sit in level 0 by expiry ms. Later timers sit in
+ *   coarser levels, and are cascaded down a level each time the level below wraps,
+ *   so arming, cancelling and expiring a timer are all O(1).
+ *   now is the last ms the wheel was advanced to.
+ */
+struct timer_wheel
+{
+	int64_t now;
+	int count;
+	struct timer_node *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+struct timer_wheel timer_wheel;
+
+struct timer_node housekeeping_timer = {0, TIMER_HOUSEKEEPING, FALSE, NULL, NULL, NULL};
+
+// Size of a cache line, order records are aligned to it
+#define CACHE_LINE 64
+
+/* Struct: order_record
+ * ----------------------------
+ *   Exchange-side bookkeeping kept alongside an order. The order_type must stay
+ *   the first member so an order_type pointer can be converted back to its record.
+ *   Records start on a cache line, and the fields the matcher reads for every resting
+ *   order it passes (trader_id, product_index, time_in_force) come straight after the
+ *   order_type, ahead of the expiry timer, which only GTT orders use.
+ */
+struct order_record
+{
+	struct order_type order;
+	int trader_id;
+	int product_index;
+	int time_in_force;
+	long int sequence;
+	struct timer_node expiry;
+} __attribute__((aligned(CACHE_LINE)));
+
+#define ORDER_RECORD(order_ptr) ((struct order_record *)(order_ptr))
+#define TIMER_ORDER(timer_ptr) ((struct order_type *)((char *)(timer_ptr) - offsetof(struct order_record, expiry)))
+// Trader of an order, read from the record instead of through order->trader
+#define ORDER_TRADER_ID(order_ptr) (ORDER_RECORD(order_ptr)->trader_id)
+
+// Number of order records allocated at once by the order pool
+#define ORDER_SLAB_SIZE 1024
+
+/* Struct: order_pool
+ * ----------------------------
+ *   Order records are carved out of slabs of ORDER_SLAB_SIZE records instead of being
+ *   malloced one by one, so resting orders sit packed together rather than scattered
+ *   between other allocations. Freed records are kept on a free list linked through
+ *   order.next and handed out again most recently freed first, while still in cache.
+ */
+struct order_pool
+{
+	struct order_record **slabs;
+	int number_slabs;
+	int slabs_size;
+	struct order_type *free_list;
+};
+
+struct order_pool order_pool = {NULL, 0, 0, NULL};
+
+// Arrival sequence of accepted and amended orders
+long int order_sequence = 0;
+
+// Initial number of fills a fill batch has room for
+#define FILL_BATCH_SIZE 32
+
+/* Struct: fill_record
+ * ----------------------------
+ *   A fill against one resting order, kept until the sweep has finished.
+ */
+struct fill_record
+{
+	struct trader_struct *trader;
+	int trader_id;
+	int order_id;
+	long int quantity;
+	long int value;
+	long int exchange_fee;
+};
+
+/* Struct: counterparty_total
+ * ----------------------------
+ *   Quantity and value a resting trader traded during one sweep.
+ */
+struct counterparty_total
+{
+	int trader_id;
+	long int quantity;
+	long int value;
+};
+
+/* Struct: fill_batch
+ * ----------------------------
+ *   Fills collected by a sweep, settled and sent together once the sweep is done.
+ */
+struct fill_batch
+{
+	struct fill_record *fills;
+	int number_fills;
+	int fills_size;
+	struct counterparty_total *counterparties;
+	int number_counterparties;
+	int counterparties_size;
+};
+
+// Reused by every sweep so matching does not allocate per order
+struct fill_batch sweep_batch = {NULL, 0, 0, NULL, 0, 0};
+
+// Exchange fee charged to the order that takes liquidity, in percent of the fill value
+#define FEE_PERCENT 1
+
+/* Struct: position_matrix
+ * ----------------------------
+ *   Positions of every trader in every product, stored as contiguous trader x product
+ *   rows so a cell is found by index and whole-session reports are straight loops.
+ */
+struct position_matrix
+{
+	int number_traders;
+	int size;
+	int64_t *quantity;
+	int64_t *cash;
+	int64_t *last_price;
+};
+
+#define POSITION_INDEX(matrix, trader_id, product_index) ((trader_id) * (matrix)->size + (product_index))
+
+struct position_matrix position_book = {0, 0, NULL, NULL, NULL};
+
+// Set to print a P&L and exposure report per trader at the end of the session
+#define SESSION_REPORT_ENV "SPX_SESSION_REPORT"
+
+// Set to print how long each trader took to connect at startup
+#define STARTUP_REPORT_ENV "SPX_STARTUP_REPORT"
+
+// Path of the per-trader pre-trade risk limits file
+#define RISK_LIMITS_ENV "SPX_RISK_LIMITS"
+
+/* Struct: risk_limits
+ * ----------------------------
+ *   Pre-trade limits for one trader. A limit of 0 is not checked.
+ */
+struct risk_limits
+{
+	int64_t max_order_quantity;
+	int64_t max_notional;
+	int64_t max_position;
+	int64_t max_open_orders;
+};
+
+/* Struct: risk_book
+ * ----------------------------
+ *   Limits of every trader and their running exposure, kept up to date as orders
+ *   rest, fill, amend and cancel so each check is a handful of lookups.
+ *   open_buy and open_sell are trader x product like position_book, open_notional is the
+ *   resting price x quantity of each trader across all products.
+ */
+struct risk_book
+{
+	int number_traders;
+	int size;
+	int enabled;
+	struct risk_limits *limits;
+	int64_t *open_buy;
+	int64_t *open_sell;
+	int64_t *open_orders;
+	int64_t *open_notional;
+};
+
+struct risk_book risk_book = {0, 0, FALSE, NULL, NULL, NULL, NULL, NULL};
+
+// Milliseconds between uncrosses in periodic call auction mode, unset for continuous matching
+#define AUCTION_INTERVAL_ENV "SPX_AUCTION_INTERVAL"
+
+/* Struct: call_auction
+ * ----------------------------
+ *   Periodic call auction schedule. While interval is 0 orders match continuously.
+ */
+struct call_auction
+{
+	long int interval;
+	long int next_uncross;
+};
+
+struct call_auction call_auction = {0, 0};
+
+/* Struct: book_quote
+ * ----------------------------
+ *   Best price level of one side of a product's orderbook. orders is 0 while the side is empty.
+ */
+struct book_quote
+{
+	long int price;
+	long int quantity;
+	int orders;
+};
+
+/* Struct: quote_cache
+ * ----------------------------
+ *   Best bid and ask of every product, indexed by product index and kept current by the
+ *   book event hooks so that neither the matcher nor a QUOTE request has to walk the book.
+ */
+struct quote_cache
+{
+	int size;
+	struct book_quote *bid;
+	struct book_quote *ask;
+};
+
+struct quote_cache quote_cache = {0, NULL, NULL};
+
+// Most levels a price ladder may have
+#define LADDER_MAX_LEVELS (1 << 20)
+// Bids are side 0 of a ladder, asks side 1
+#define LADDER_SIDE(type) ((type) == BUY ? 0 : 1)
+#define LADDER_LEVEL(ladder, price) (((price) - (ladder)->base) / (ladder)->tick)
+
+/* Struct: ladder_level
+ * ----------------------------
+ *   The orders resting at one price on one side of a price ladder. first and last are
+ *   the ends of the level's run in the product's order list.
+ */
+struct ladder_level
+{
+	struct order_type *first;
+	struct order_type *last;
+	long int quantity;
+	int orders;
+};
+
+/* Struct: price_ladder
+ * ----------------------------
+ *   Tick-indexed levels of a product whose prices are bounded, level i being the price
+ *   base + i * tick. Each side has a bit per level with orders and a summary bit per
+ *   non-zero word of those, so the best level and the next one are a few count trailing
+ *   or leading zeros away. The order list is kept as well for everything that walks it.
+ */
+struct price_ladder
+{
+	long int base;
+	long int tick;
+	int levels;
+	int words;
+	struct ladder_level *side[2];
+	uint64_t *bits[2];
+	uint64_t *summary[2];
+};
+
+/* Struct: ladder_book
+ * ----------------------------
+ *   The price ladder of every product, NULL for products on the general list ladder.
+ */
+struct ladder_book
+{
+	int size;
+	struct price_ladder **ladders;
+};
+
+struct ladder_book ladder_book = {0, NULL};
+
+/* Struct: list_level
+ * ----------------------------
+ *   The quantity resting at one price on one side of a product on the general ladder,
+ *   and the order at that price with the highest time priority.
+ */
+struct list_level
+{
+	long int price;
+	long int quantity;
+	int orders;
+	struct order_type *first;
+	struct list_level *next;
+};
+
+/* Struct: level_book
+ * ----------------------------
+ *   Price levels of every product on the general ladder, best first: bids descending in
+ *   side 0 and asks ascending in side 1 of a product's pair. Kept by the book event hooks
+ *   so that a fill or kill check sums levels and the matcher starts at the best level
+ *   rather than walking orders.
+ */
+struct level_book
+{
+	int size;
+	struct list_level **sides;
+	struct list_level *spare;
+};
+
+struct level_book level_book = {0, NULL, NULL};
+
+// Shared memory object name of the depth feed, unset to not publish it
+#define DEPTH_FEED_ENV "SPX_DEPTH_FEED"
+
+/* Struct: depth_feed
+ * ----------------------------
+ *   The exchange side of the depth feed (see spx_depth_feed.h). Products are marked
+ *   dirty by the book event hooks and republished once the command that changed them
+ *   has been processed. Subscribed traders read the feed instead of receiving MARKET
+ *   messages.
+ */
+struct depth_feed
+{
+	char *name;
+	struct spx_depth_header *header;
+	struct spx_depth_snapshot *snapshots;
+	size_t length;
+	int size;
+	int *dirty;
+	int *subscribed;
+};
+
+struct depth_feed depth_feed = {NULL, NULL, NULL, 0, 0, NULL, NULL};
+
+// Set to write every fill to a drop-copy ring in this shared memory object
+#define DROP_COPY_ENV "SPX_DROP_COPY"
+
+/* Struct: drop_copy
+ * ----------------------------
+ *   The exchange side of the drop-copy feed (see spx_drop_copy.h). sequence is the
+ *   number of the last record written.
+ */
+struct drop_copy
+{
+	char *name;
+	struct spx_drop_copy_header *header;
+	struct spx_execution *records;
+	size_t length;
+	uint64_t sequence;
+};
+
+struct drop_copy drop_copy = {NULL, NULL, NULL, 0, 0};
+
+// Set to sequence MARKET messages, send TRADE messages and keep both on a replayable tape
+#define TAPE_ENV "SPX_TAPE"
+// Events kept per product, a power of two
+#define TAPE_SIZE 1024
+#define TAPE_MARKET 0
+#define TAPE_TRADE 1
+
+/* Struct: tape_event
+ * ----------------------------
+ *   One public event of a product: an order entering, changing or leaving the book
+ *   (TAPE_MARKET, as sent in MARKET messages) or a trade (TAPE_TRADE).
+ */
+struct tape_event
+{
+	int64_t sequence;
+	int32_t kind;
+	int32_t type;
+	int64_t quantity;
+	int64_t price;
+};
+
+/* Struct: trade_tape
+ * ----------------------------
+ *   Per product ring of the last TAPE_SIZE events. next_sequence is the sequence
+ *   the product's next event gets, so event n sits at n % TAPE_SIZE while n is
+ *   no older than next_sequence - TAPE_SIZE. traders are who trades are sent to.
+ */
+struct trade_tape
+{
+	int size;
+	int enabled;
+	int64_t *next_sequence;
+	struct tape_event *events;
+	struct trader_struct *traders;
+	int number_traders;
+};
+
+struct trade_tape trade_tape = {0, FALSE, NULL, NULL, NULL, 0};
+
+// Path of the CSV bar file, unset to not aggregate bars
+#define BARS_ENV "SPX_BARS"
+// Bar length in milliseconds
+#define BAR_INTERVAL_ENV "SPX_BAR_INTERVAL"
+#define BAR_INTERVAL_DEFAULT 1000
+
+/* Struct: trade_bar
+ * ----------------------------
+ *   OHLCV statistics of one product over one interval. start is the wall clock time
+ *   the interval starts at in milliseconds, VWAP is notional / volume.
+ */
+struct trade_bar
+{
+	int64_t start;
+	int64_t open;
+	int64_t high;
+	int64_t low;
+	int64_t close;
+	int64_t volume;
+	int64_t notional;
+	int64_t trades;
+	int product_index;
+};
+
+/* Struct: bar_writer
+ * ----------------------------
+ *   Per product bars in progress and the queue of closed bars a background thread
+ *   writes to the bar file. The matcher only touches current, and takes the lock to
+ *   queue a bar once its interval is over. The thread swaps pending with writing
+ *   under the lock and formats the bars without it.
+ */
+struct bar_writer
+{
+	int enabled;
+	int size;
+	int64_t interval;
+	char **product_array;
+	struct trade_bar *current;
+	FILE *fp;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct trade_bar *pending;
+	int number_pending;
+	int pending_size;
+	struct trade_bar *writing;
+	int writing_size;
+	int stop;
+};
+
+struct bar_writer bar_writer = {FALSE};
+
+/* Struct: trader_hot
+ * ----------------------------
+ *   The fields of a trader that every fill and message reads, packed four to a cache
+ *   line in the trader index. The rest of trader_struct (pipe paths, the read side,
+ *   positions) is only touched by setup and teardown.
+ */
+struct trader_hot
+{
+	FILE *fp_exchange_t;
+	pid_t pid_child;
+	int alive;
+};
+
+/* Struct: trader_index
+ * ----------------------------
+ *   O(1) lookups of a trader by pid (open addressing with linear probing, the table at
+ *   least twice the number of traders) and by the fd of its trader to exchange pipe
+ *   (a table indexed by fd). The epoll instance watches those fds for hangups so a
+ *   wakeup only touches the traders that are ready. hot holds each trader's trader_hot
+ *   by trader id.
+ */
+struct trader_index
+{
+	int pid_mask;
+	pid_t *pids;
+	int *pid_traders;
+	int fd_size;
+	int *fd_traders;
+	int epoll_fd;
+	struct epoll_event *events;
+	struct trader_hot *hot;
+};
+
+struct trader_index trader_index = {0, NULL, NULL, 0, NULL, -1, NULL, NULL};
+
+// Whether a trader is still connected, read from the trader index instead of its trader_struct
+#define TRADER_ALIVE(trader_id) (trader_index.hot[(trader_id)].alive)
+
+// Commands each trader may have carried out per scheduling round
+#define QUANTUM_ENV "SPX_QUANTUM"
+#define QUANTUM_DEFAULT 4
+// Token buckets, lines of <trader id or *> <commands per second> <burst> [queue]
+#define RATE_LIMITS_ENV "SPX_RATE_LIMITS"
+// Tokens an invalid command takes from its trader's bucket on top of its own
+#define INVALID_PENALTY_ENV "SPX_INVALID_PENALTY"
+// Bytes of commands kept for a trader before its pipe or socket is no longer read
+#define INPUT_SIZE 4096
+
+/* Struct: trader_input
+ * ----------------------------
+ *   Commands a trader has sent that are waiting for the scheduler, as ;-separated text
+ *   whatever they came from, and the trader's token bucket. A rate of 0 is no limit.
+ *   paused is set while the buffer is too full to read more, closed once no more
+ *   input will come and eof once the pipe itself has been read to the end.
+ *   unsignalled is set while the trader has INVALIDs written but not yet delivered.
+ */
+struct trader_input
+{
+	char buffer[INPUT_SIZE];
+	int length;
+	int paused;
+	int closed;
+	int eof;
+	double rate;
+	double burst;
+	double tokens;
+	int64_t refilled;
+	int queue_excess;
+	long int throttled;
+	long int invalid;
+	int unsignalled;
+};
+
+/* Struct: scheduler
+ * ----------------------------
+ *   Serves traders with waiting commands round-robin, up to quantum commands each per
+ *   round. Only the traders in the ready queue are looked at: a trader is put at the
+ *   back of it when it has new input or its input closes, and again after its turn while
+ *   it still has commands waiting. queued marks the traders in the queue, so each is in
+ *   it at most once.
+ */
+struct scheduler
+{
+	int number_traders;
+	int quantum;
+	double invalid_penalty;
+	struct trader_input *inputs;
+	int *ready;
+	int first_ready;
+	int number_ready;
+	char *queued;
+};
+
+struct scheduler scheduler = {0, QUANTUM_DEFAULT, 0, NULL, NULL, 0, 0, NULL};
+
+/* Struct: order_request
+ * ----------------------------
+ *   A BUY or SELL command as parsed, before an order is made from it. lifetime is the
+ *   milliseconds a GTT order rests for.
+ */
+struct order_request
+{
+	int type;
+	int order_id;
+	int product_index;
+	long int quantity;
+	long int price;
+	int time_in_force;
+	long int lifetime;
+};
+
+// Commands a plugin can have waiting for the scheduler
+#define PLUGIN_QUEUE_SIZE 256
+
+/* Struct: plugin_command
+ * ----------------------------
+ *   A command a plugin submitted, kept as fields until the scheduler gets to it. request
+ *   holds the order id, quantity and price of every command and the rest of a BUY or
+ *   SELL but its product, which is looked up from product when the command is served.
+ */
+struct plugin_command
+{
+	int command;
+	struct order_request request;
+	char product[PRODUCT_SIZE];
+};
+
+/* Struct: trader_plugin
+ * ----------------------------
+ *   A trader loaded from a shared object, see spx_plugin.h. Callbacks the plugin does
+ *   not export are NULL.
+ */
+struct trader_plugin
+{
+	void *handle;
+	void *state;
+	struct spx_exchange_api api;
+	void (*on_market_open)(void *state);
+	void (*on_market)(void *state, const struct spx_message *message);
+	void (*on_accepted)(void *state, const struct spx_message *message);
+	void (*on_amended)(void *state, const struct spx_message *message);
+	void (*on_cancelled)(void *state, const struct spx_message *message);
+	void (*on_invalid)(void *state, const struct spx_message *message);
+	void (*on_fill)(void *state, const struct spx_message *message);
+	void (*plugin_finish)(void *state);
+	struct plugin_command commands[PLUGIN_QUEUE_SIZE];
+	int first_command;
+	int number_commands;
+};
+
+/* Struct: plugin_host
+ * ----------------------------
+ *   The plugin of every trader that is one, NULL for other traders. Commands plugins
+ *   submit wait in their plugin's queue and are served in turn with every other
+ *   trader's input.
+ */
+struct plugin_host
+{
+	int number_traders;
+	int connected;
+	struct trader_plugin **plugins;
+};
+
+struct plugin_host plugin_host = {0, 0, NULL};
+
+// Unix domain socket path external traders log in on, and the number of traders it takes
+#define GATEWAY_ENV "SPX_GATEWAY"
+#define GATEWAY_SESSIONS_ENV "SPX_GATEWAY_SESSIONS"
+#define GATEWAY_SESSIONS_DEFAULT 1
+#define GATEWAY_NAME_SIZE 32
+// Messages for a session past this many unsent bytes are dropped
+#define GATEWAY_BUFFER_MAX (1 << 20)
+#define GATEWAY_EVENTS 64
+
+struct gateway_session;
+
+/* Struct: gateway_connection
+ * ----------------------------
+ *   A socket accepted by the gateway. session is NULL until it logs in. A failed
+ *   connection is only marked closing and is closed by gateway_service, so it is never
+ *   freed while another part of the loop still holds it.
+ */
+struct gateway_connection
+{
+	int fd;
+	int closing;
+	int events;
+	struct gateway_session *session;
+	char in[BUFFSIZE];
+	int in_length;
+	struct gateway_connection *next;
+};
+
+/* Struct: gateway_session
+ * ----------------------------
+ *   A trader slot of the gateway. It keeps its trader id, orders and unsent messages
+ *   across connections, so a trader that logs in again with the same name carries on
+ *   where it left off. name is empty until the slot is first logged in to.
+ */
+struct gateway_session
+{
+	int trader_id;
+	char name[GATEWAY_NAME_SIZE];
+	struct gateway_connection *connection;
+	char *out;
+	size_t out_length;
+	size_t out_size;
+	long int missed;
+};
+
+/* Struct: gateway
+ * ----------------------------
+ *   The listening socket, its own epoll instance (itself watched by the trader index)
+ *   and the trader slots, which follow the traders from the command line.
+ */
+struct gateway
+{
+	char *path;
+	int listen_fd;
+	int epoll_fd;
+	int first_trader;
+	int number_sessions;
+	struct gateway_session *sessions;
+	struct gateway_connection *connections;
+};
+
+struct gateway gateway = {NULL, -1, -1, 0, 0, NULL, NULL};
+
+// Set to journal every command the exchange processes to this file, replayed at startup
+#define JOURNAL_ENV "SPX_JOURNAL"
+#define JOURNAL_COMMAND 'C'
+#define JOURNAL_EXPIRY 'E'
+#define JOURNAL_AUCTION 'A'
+
+/* Struct: journal
+ * ----------------------------
+ *   Append-only log of what changed the order book, one "<sequence> <kind> <trader> <text>"
+ *   line per event: a trader command, a GTT expiry or a call auction uncross. Replaying it
+ *   from a checkpoint gives back the exchange state. While replaying nothing is sent to traders.
+ */
+struct journal
+{
+	FILE *fp;
+	int64_t sequence;
+	int replaying;
+};
+
+struct journal journal = {NULL, 0, FALSE};
+
+// Set to record every command traders send to this file, see spx_capture.h
+#define CAPTURE_ENV "SPX_CAPTURE"
+// Bytes of records buffered before they are written out
+#define CAPTURE_BUFFER 1048576
+
+/* Struct: capture
+ * ----------------------------
+ *   The exchange side of session capture. start is the market open, the zero of the
+ *   record times.
+ */
+struct capture
+{
+	FILE *fp;
+	int64_t start;
+	long int records;
+};
+
+struct capture capture = {NULL, 0, 0};
+
+// Set by spx_router to run this exchange as one of its partitions, see spx_partition.h
+#define PARTITION_ENV "SPX_PARTITION"
+#define PARTITION_FDS_ENV "SPX_PARTITION_FDS"
+
+/* Struct: partition
+ * ----------------------------
+ *   The partition end of the router queues. The traders of a partition are the router's,
+ *   with neither a process nor a pipe. pushed is set while messages have gone into the
+ *   ring since the router's doorbell was last rung.
+ */
+struct partition
+{
+	struct spx_partition_queues *queues;
+	int command_fd;
+	int message_fd;
+	int first_trader;
+	int number_traders;
+	int pushed;
+};
+
+struct partition partition = {NULL, -1, -1, 0, 0, FALSE};
+
+// Path of the columnar event archive, unset for none, see spx_archive.h
+#define ARCHIVE_ENV "SPX_ARCHIVE"
+// Rows of a chunk, the unit the background thread compresses and writes
+#define ARCHIVE_CHUNK 16384
+
+/* Struct: archive_chunk
+ * ----------------------------
+ *   Rows of the archive not yet written, one array per column.
+ */
+struct archive_chunk
+{
+	int rows;
+	int64_t *columns[SPX_ARCHIVE_COLUMNS];
+	struct archive_chunk *next;
+};
+
+/* Struct: archive_writer
+ * ----------------------------
+ *   The matcher fills current with plain stores, and takes the lock only to queue it
+ *   once it is full and take a spare chunk, so a slow disk never holds up matching. The
+ *   background thread encodes and writes the queued chunks and puts them back as spares.
+ *   offset is where the thread writes next.
+ */
+struct archive_writer
+{
+	int enabled;
+	FILE *fp;
+	int64_t start;
+	struct archive_chunk *current;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct archive_chunk *full;
+	struct archive_chunk *full_tail;
+	struct archive_chunk *spare;
+	int stop;
+	uint64_t offset;
+	uint64_t *words;
+};
+
+struct archive_writer archive = {FALSE};
+
+// Set to checkpoint the exchange to this file, and to restore from it at startup
+#define CHECKPOINT_ENV "SPX_CHECKPOINT"
+// Milliseconds between checkpoints
+#define CHECKPOINT_INTERVAL_ENV "SPX_CHECKPOINT_INTERVAL"
+#define CHECKPOINT_INTERVAL_DEFAULT 5000
+#define CHECKPOINT_MAGIC "SPXCKPT"
+#define CHECKPOINT_VERSION 1
+// Sections of a checkpoint start on 8 byte boundaries
+#define CHECKPOINT_ALIGN(offset) (((offset) + 7) & ~(int64_t)7)
+
+/* Struct: checkpoint_header
+ * ----------------------------
+ *   Start of a checkpoint file. The file holds no pointers: every section is found by
+ *   its byte offset from the start, so a checkpoint can be mapped and read in place.
+ *   Sections are the product names (PRODUCT_SIZE each), a checkpoint_book per product,
+ *   order_valid per trader, position quantity and cash per trader x product cell, last
+ *   price per product, and the resting orders of every product in book order.
+ *   journal_sequence is the last journal entry the checkpoint includes.
+ */
+struct checkpoint_header
+{
+	char magic[8];
+	int32_t version;
+	int32_t size;
+	int32_t number_traders;
+	int32_t product_size;
+	int64_t length;
+	int64_t journal_sequence;
+	int64_t exchange_fee;
+	int64_t order_sequence;
+	int64_t number_orders;
+	int64_t products_offset;
+	int64_t books_offset;
+	int64_t order_valid_offset;
+	int64_t quantity_offset;
+	int64_t cash_offset;
+	int64_t last_price_offset;
+	int64_t orders_offset;
+};
+
+/* Struct: checkpoint_book
+ * ----------------------------
+ *   Where a product's orders start in the orders section, and how many there are.
+ */
+struct checkpoint_book
+{
+	int64_t first;
+	int32_t buy;
+	int32_t sell;
+};
+
+/* Struct: checkpoint_order
+ * ----------------------------
+ *   A resting order. expires_in is what was left of a GTT order's lifetime in ms.
+ */
+struct checkpoint_order
+{
+	int32_t trader_id;
+	int32_t order_id;
+	int32_t type;
+	int32_t time_in_force;
+	int64_t quantity;
+	int64_t price;
+	int64_t sequence;
+	int64_t expires_in;
+};
+
+/* Struct: checkpointer
+ * ----------------------------
+ *   The matcher copies the exchange into a checkpoint image between commands, so the
+ *   copy is consistent, and leaves it in pending. A writer thread writes the image to
+ *   a temporary file and renames it over the checkpoint, so the checkpoint on disk is
+ *   always whole. An image not yet taken by the thread is replaced by a newer one.
+ */
+struct checkpointer
+{
+	int enabled;
+	int due;
+	char *path;
+	char *temp_path;
+	int64_t interval;
+	struct timer_node timer;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	char *pending;
+	int64_t pending_length;
+	int stop;
+};
+
+struct checkpointer checkpointer = {FALSE};
+
+// Set to a core to pin the matching loop to and poll traders without sleeping, -1 for any core
+#define BUSY_POLL_ENV "SPX_BUSY_POLL"
+// <spin us>,<yield us>: how long an idle loop spins, then yields the core, before it sleeps
+#define BUSY_POLL_BACKOFF_ENV "SPX_BUSY_POLL_BACKOFF"
+#define BUSY_POLL_SPIN_DEFAULT 1000
+#define BUSY_POLL_YIELD_DEFAULT 10000
+// Comma separated cores to pin trader processes to, trader i gets the (i % cores)th
+#define TRADER_CORES_ENV "SPX_TRADER_CORES"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
+
+/* Struct: busy_poll
+ * ----------------------------
+ *   Low-latency mode of the matching loop. While enabled the loop polls the traders
+ *   without waiting, and only sleeps once nothing has come in for spin + yield
+ *   microseconds: for spin it polls flat out, then gives up the core between polls.
+ *   idle_since is when input last came in.
+ */
+struct busy_poll
+{
+	int enabled;
+	int core;
+	int64_t spin;
+	int64_t yield;
+	int64_t idle_since;
+	int *trader_cores;
+	int number_cores;
+};
+
+struct busy_poll busy_poll = {FALSE, -1, BUSY_POLL_SPIN_DEFAULT, BUSY_POLL_YIELD_DEFAULT, 0, NULL, 0};
+
+/* Function: pin_to_core
+ * 	----------------------------
+ *   Pins the calling thread to one core.
+ *
+ *   core: the core
+ *   returns: 0, or -1 if it could not be pinned
+ */
+int pin_to_core(int core)
+{
+	cpu_set_t cores;
+	CPU_ZERO(&cores);
+	CPU_SET(core, &cores);
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cores) == 0 ? 0 : -1;
+}
+
+/* Function: init_busy_poll
+ * 	----------------------------
+ *   Reads the busy poll and core pinning settings. Either may be NULL.
+ *
+ *   busy: the busy poll settings
+ *   core: SPX_BUSY_POLL, the core of the matching loop or -1
+ *   backoff: SPX_BUSY_POLL_BACKOFF, "<spin us>,<yield us>"
+ *   trader_cores: SPX_TRADER_CORES, comma separated cores
+ */
+void init_busy_poll(struct busy_poll *busy, char *core, char *backoff, char *trader_cores)
+{
+	if (core != NULL)
+	{
+		busy->enabled = TRUE;
+		busy->core = atoi(core);
+		if (backoff != NULL)
+		{
+			sscanf(backoff, "%" SCNd64 ",%" SCNd64, &(busy->spin), &(busy->yield));
+		}
+	}
+	if (trader_cores != NULL)
+	{
+		busy->trader_cores = malloc(sizeof(int) * (strlen(trader_cores) / 2 + 1));
+		char *copy = strdup(trader_cores);
+		char *rest = copy;
+		char *item;
+		while ((item = strsep(&rest, ",")) != NULL)
+		{
+			if (item[0] != '\0')
+			{
+				busy->trader_cores[busy->number_cores++] = atoi(item);
+			}
+		}
+		free(copy);
+	}
+}
+
 /* Function: set_up_trader
  * ----------------------------
- *   Opens the pipes for the trader and sets up the trader_struct.
+ *   Creates the pipes for the trader, starts it and sets up the trader_struct.
+ *   The pipes are opened later by connect_trader so all traders can start at once.
+ *
+ *   trader: the executable file name of the trader
+ *   trader_id: the trader's id
+ * 	 exchange_trader: the struct to populate with trader information
+ */
+void set_up_trader(char *trader, int trader_id, struct trader_struct *exchange_trader)
+{
+	int trader_length = snprintf(NULL, 0, "%d", trader_id);
+	char *exchange_t_pipe = malloc(sizeof(char) * (strlen(FIFO_EXCHANGE) - 1 + trader_length));
+	char *trader_e_pipe = malloc(sizeof(char) * (strlen(FIFO_TRADER) - 1 + trader_length));
+	sprintf(exchange_t_pipe, FIFO_EXCHANGE, trader_id);
+	sprintf(trader_e_pipe, FIFO_TRADER, trader_id);
+	mkfifo(exchange_t_pipe, MKFIFO_PERMISSION);
+	mkfifo(trader_e_pipe, MKFIFO_PERMISSION);
+	int pid = fork();
+
+	if (pid == 0)
+	{
+		int core = busy_poll.number_cores > 0 ? busy_poll.trader_cores[trader_id % busy_poll.number_cores] : -1;
+		if (core >= 0 && pin_to_core(core) == -1)
+		{
+			printf("%s Could not pin trader %d to core %d\n", LOG_PREFIX, trader_id, core);
+		}
+		printf("%s Starting trader %d (%s)\n", LOG_PREFIX, trader_id, trader);
+		execl(trader, trader, exchange_t_pipe + strlen(FIFO_EXCHANGE) - 2, NULL);
+		perror("execl failed");
+		_exit(1);
+	}
+	else
+	{
+		exchange_trader->trader_id = trader_id;
+		exchange_trader->pipe_exchange_t = exchange_t_pipe;
+		exchange_trader->pipe_trader_e = trader_e_pipe;
+		exchange_trader->fp_exchange_t = NULL;
+		exchange_trader->fp_trader_e = NULL;
+		// The trader opens its write end after its read end, so ours never has to wait
+		exchange_trader->trader_fd = open(trader_e_pipe, O_RDONLY | O_NONBLOCK);
+		exchange_trader->pid_child = pid;
+		// Positions live in position_book
+		exchange_trader->positions = NULL;
+		exchange_trader->alive = TRUE;
+		exchange_trader->order_valid = 0;
+	}
+}
+
+/* Function: connect_trader
+ * ----------------------------
+ *   Tries to open the exchange end of the trader's pipes without blocking. The write end
+ *   only opens once the trader has opened its read end. Once both are open the write end
+ *   is switched back to blocking, the read end stays non-blocking for the scheduler.
+ *
+ *   exchange_trader: the trader to connect
+ *   returns: TRUE once connected, FALSE if the trader has not opened its pipe yet
+ */
+int connect_trader(struct trader_struct *exchange_trader)
+{
+	int exchange_fd = open(exchange_trader->pipe_exchange_t, O_WRONLY | O_NONBLOCK);
+	if (exchange_fd == -1)
+	{
+		return FALSE;
+	}
+	fcntl(exchange_fd, F_SETFL, fcntl(exchange_fd, F_GETFL) & ~O_NONBLOCK);
+	exchange_trader->fp_exchange_t = fdopen(exchange_fd, "w");
+	exchange_trader->fp_trader_e = fdopen(exchange_trader->trader_fd, "r");
+	return TRUE;
+}
+
+/* Function: get_plugin
+ * 	----------------------------
+ *   Gets the plugin of a trader.
+ *
+ *   trader: the trader
+ *   returns: the plugin, NULL if the trader is a process
+ */
+struct trader_plugin *get_plugin(struct trader_struct *trader)
+{
+	if (plugin_host.plugins == NULL || trader->trader_id >= plugin_host.number_traders)
+	{
+		return NULL;
+	}
+	return plugin_host.plugins[trader->trader_id];
+}
+
+/* Function: input_append
+ * 	----------------------------
+ *   Adds commands to a trader's input.
+ *
+ *   input: the trader's input
+ *   data: the commands, each ending in ;
+ *   length: length of the commands
+ *   returns: TRUE if they fit, FALSE if nothing was added
+ */
+int input_append(struct trader_input *input, char *data, int length)
+{
+	if (length > INPUT_SIZE - input->length)
+	{
+		return FALSE;
+	}
+	memcpy(input->buffer + input->length, data, length);
+	input->length += length;
+	return TRUE;
+}
+
+/* Function: input_has_command
+ * 	----------------------------
+ *   Whether a trader's input holds a complete command.
+ *
+ *   input: the trader's input
+ *   returns: TRUE if it does
+ */
+int input_has_command(struct trader_input *input)
+{
+	return memchr(input->buffer, ';', input->length) != NULL;
+}
+
+/* Function: schedule_trader
+ * 	----------------------------
+ *   Puts a trader at the back of the scheduler's ready queue, unless it is already in it.
+ *
+ *   trader_id: the trader
+ */
+void schedule_trader(int trader_id)
+{
+	if (scheduler.queued[trader_id])
+	{
+		return;
+	}
+	scheduler.queued[trader_id] = TRUE;
+	scheduler.ready[(scheduler.first_ready + scheduler.number_ready) % scheduler.number_traders] = trader_id;
+	scheduler.number_ready++;
+}
+
+/* Function: input_take_command
+ * 	----------------------------
+ *   Takes the first complete command from a trader's input. Commands longer than
+ *   BUFFSIZE are cut short, they are invalid anyway.
+ *
+ *   input: the trader's input, which must hold a complete command
+ *   line: where to put the command, without its ;
+ */
+void input_take_command(struct trader_input *input, char *line)
+{
+	char *end = memchr(input->buffer, ';', input->length);
+	int length = end - input->buffer;
+	int copied = length < BUFFSIZE ? length : BUFFSIZE - 1;
+	memcpy(line, input->buffer, copied);
+	line[copied] = '\0';
+	input->length -= length + 1;
+	memmove(input->buffer, end + 1, input->length);
+}
+
+/* Function: get_session
+ * 	----------------------------
+ *   Gets the gateway session of a trader.
+ *
+ *   trader: the trader
+ *   returns: the session, NULL if the trader is not a gateway trader
+ */
+struct gateway_session *get_session(struct trader_struct *trader)
+{
+	int slot = trader->trader_id - gateway.first_trader;
+	if (gateway.sessions == NULL || slot < 0 || slot >= gateway.number_sessions)
+	{
+		return NULL;
+	}
+	return &(gateway.sessions[slot]);
+}
+
+/* Function: gateway_drop
+ * 	----------------------------
+ *   Detaches a connection from its session and marks it for gateway_service to close.
+ *   The session keeps its orders and buffers its messages until the trader logs in again.
+ *
+ *   connection: the connection
+ */
+void gateway_drop(struct gateway_connection *connection)
+{
+	if (connection->closing)
+	{
+		return;
+	}
+	connection->closing = TRUE;
+	if (connection->session != NULL)
+	{
+		printf("%s Trader %d connection closed\n", LOG_PREFIX, connection->session->trader_id);
+		connection->session->connection = NULL;
+		// A command the connection did not finish is not carried into the next one
+		struct trader_input *input = &(scheduler.inputs[connection->session->trader_id]);
+		while (input->length > 0 && input->buffer[input->length - 1] != ';')
+		{
+			input->length--;
+		}
+	}
+}
+
+/* Function: gateway_watch
+ * 	----------------------------
+ *   Watches a connection for input unless its trader's input is full, and for room to
+ *   send while it has unsent messages.
+ *
+ *   connection: the connection
+ */
+void gateway_watch(struct gateway_connection *connection)
+{
+	struct gateway_session *session = connection->session;
+	int events = 0;
+	if (session == NULL || !scheduler.inputs[session->trader_id].paused)
+	{
+		events |= EPOLLIN;
+	}
+	if (session != NULL && session->out_length > 0)
+	{
+		events |= EPOLLOUT;
+	}
+	if (events != connection->events)
+	{
+		struct epoll_event event = {0};
+		event.events = events;
+		event.data.ptr = connection;
+		epoll_ctl(gateway.epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+		connection->events = events;
+	}
+}
+
+/* Function: gateway_flush
+ * 	----------------------------
+ *   Sends as much of a session's unsent messages as its socket takes without blocking,
+ *   and watches the socket for room while any are left.
+ *
+ *   session: the session
+ */
+void gateway_flush(struct gateway_session *session)
+{
+	struct gateway_connection *connection = session->connection;
+	if (connection == NULL)
+	{
+		return;
+	}
+	while (session->out_length > 0)
+	{
+		ssize_t written = send(connection->fd, session->out, session->out_length, MSG_NOSIGNAL);
+		if (written > 0)
+		{
+			session->out_length -= written;
+			memmove(session->out, session->out + written, session->out_length);
+		}
+		else if (written == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+		else
+		{
+			gateway_drop(connection);
+			return;
+		}
+	}
+
+	gateway_watch(connection);
+}
+
+/* Function: gateway_append
+ * 	----------------------------
+ *   Adds a message to a session's unsent messages. A session more than GATEWAY_BUFFER_MAX
+ *   bytes behind misses the message, and is disconnected if it is connected, as it is
+ *   not keeping up.
+ *
+ *   session: the session
+ *   message: the message
+ *   length: length of the message
+ */
+void gateway_append(struct gateway_session *session, char *message, size_t length)
+{
+	if (session->out_length + length > GATEWAY_BUFFER_MAX)
+	{
+		session->missed++;
+		if (session->connection != NULL)
+		{
+			gateway_drop(session->connection);
+		}
+		return;
+	}
+	if (session->out_length + length > session->out_size)
+	{
+		while (session->out_length + length > session->out_size)
+		{
+			session->out_size = session->out_size == 0 ? BUFFSIZE * 8 : session->out_size * 2;
+		}
+		session->out = realloc(session->out, session->out_size);
+	}
+	memcpy(session->out + session->out_length, message, length);
+	session->out_length += length;
+}
+
+/* Function: get_partition_slot
+ * 	----------------------------
+ *   Gets the router's id of a partition trader.
+ *
+ *   trader: the trader
+ *   returns: the router's id of the trader, -1 if the trader is not a partition trader
+ */
+int get_partition_slot(struct trader_struct *trader)
+{
+	int slot = trader->trader_id - partition.first_trader;
+	if (partition.queues == NULL || slot < 0 || slot >= partition.number_traders)
+	{
+		return -1;
+	}
+	return slot;
+}
+
+/* Function: partition_ring
+ * 	----------------------------
+ *   Rings the router's doorbell if messages went into the ring since it was last rung.
+ *
+ *   part: the partition
+ */
+void partition_ring(struct partition *part)
+{
+	if (part->pushed)
+	{
+		uint64_t one = 1;
+		if (write(part->message_fd, &one, sizeof(uint64_t)) == -1 && errno != EAGAIN)
+		{
+			perror("write failed partition doorbell");
+		}
+		part->pushed = FALSE;
+	}
+}
+
+/* Function: partition_push
+ * 	----------------------------
+ *   Puts a record in the ring to the router, waiting for the router while it is full.
+ *
+ *   part: the partition
+ *   trader_id: the trader the record is for, -1 for none
+ *   type: SPX_PARTITION_MESSAGE, SPX_PARTITION_DONE, SPX_PARTITION_POSITION or SPX_PARTITION_CLOSED
+ *   text: the text of the record, cut short at SPX_PARTITION_TEXT
+ *   length: length of the text
+ */
+void partition_push(struct partition *part, int trader_id, int type, const char *text, int length)
+{
+	struct spx_partition_ring *ring = &(part->queues->messages);
+	uint64_t head = ring->head;
+	while (head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == SPX_PARTITION_SLOTS)
+	{
+		partition_ring(part);
+		sched_yield();
+	}
+	struct spx_partition_record *record = &(ring->records[head & (SPX_PARTITION_SLOTS - 1)]);
+	record->trader_id = trader_id;
+	record->type = type;
+	record->length = length < SPX_PARTITION_TEXT ? length : SPX_PARTITION_TEXT;
+	memcpy(record->text, text, record->length);
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+	part->pushed = TRUE;
+}
+
+/* Function: partition_done
+ * 	----------------------------
+ *   Tells the router a partition trader's command has been carried out, so it can hand
+ *   the trader what came of it in the order of the trader's commands.
+ *
+ *   trader: the trader
+ */
+void partition_done(struct trader_struct *trader)
+{
+	int slot = get_partition_slot(trader);
+	if (slot != -1)
+	{
+		partition_push(&partition, slot, SPX_PARTITION_DONE, "", 0);
+	}
+}
+
+/* Function: write_trader
+ * 	----------------------------
+ *   Writes a message for a trader process, gateway trader or partition trader. It is
+ *   delivered by signal_trader.
+ *
+ *   trader: the trader
+ *   format: printf format of the message
+ */
+void write_trader(struct trader_struct *trader, const char *format, ...)
+{
+	// Replayed commands were answered in the session that journaled them
+	if (journal.replaying)
+	{
+		return;
+	}
+	va_list args;
+	va_start(args, format);
+	struct gateway_session *session = get_session(trader);
+	int slot = get_partition_slot(trader);
+	if (slot != -1)
+	{
+		char message[SPX_PARTITION_TEXT + 1];
+		int length = vsnprintf(message, sizeof(message), format, args);
+		partition_push(&partition, slot, SPX_PARTITION_MESSAGE, message, length);
+	}
+	else if (session != NULL)
+	{
+		char message[BUFFSIZE * 2];
+		int length = vsnprintf(message, sizeof(message), format, args);
+		if (length >= (int)sizeof(message))
+		{
+			length = sizeof(message) - 1;
+		}
+		gateway_append(session, message, length);
+	}
+	else
+	{
+		vfprintf(trader_index.hot[trader->trader_id].fp_exchange_t, format, args);
+	}
+	va_end(args);
+}
+
+/* Function: signal_trader
+ * 	----------------------------
+ *   Delivers what has been written for a trader: flushes the pipe and signals a trader
+ *   process, or sends what the socket of a gateway trader takes.
+ *
+ *   trader: the trader
+ */
+void signal_trader(struct trader_struct *trader)
+{
+	scheduler.inputs[trader->trader_id].unsignalled = FALSE;
+	// The router is rung once per pass of the main loop
+	if (journal.replaying || get_partition_slot(trader) != -1)
+	{
+		return;
+	}
+	struct gateway_session *session = get_session(trader);
+	if (session != NULL)
+	{
+		gateway_flush(session);
+		return;
+	}
+	struct trader_hot *hot = &(trader_index.hot[trader->trader_id]);
+	fflush(hot->fp_exchange_t);
+	kill(hot->pid_child, SIGUSR1);
+}
+
+/* Function: notify_plugin
+ * 	----------------------------
+ *   Passes a message to the plugin's callback for its type, if the plugin has one.
+ *
+ *   plugin: the plugin
+ *   message: the message
+ */
+void notify_plugin(struct trader_plugin *plugin, struct spx_message *message)
+{
+	if (journal.replaying)
+	{
+		return;
+	}
+	void (*callback)(void *state, const struct spx_message *message) = NULL;
+	switch (message->type)
+	{
+	case SPX_MARKET_OPEN:
+		if (plugin->on_market_open != NULL)
+		{
+			plugin->on_market_open(plugin->state);
+		}
+		return;
+	case SPX_MARKET:
+		callback = plugin->on_market;
+		break;
+	case SPX_ACCEPTED:
+		callback = plugin->on_accepted;
+		break;
+	case SPX_AMENDED:
+		callback = plugin->on_amended;
+		break;
+	case SPX_CANCELLED:
+		callback = plugin->on_cancelled;
+		break;
+	case SPX_INVALID:
+		callback = plugin->on_invalid;
+		break;
+	case SPX_FILL:
+		callback = plugin->on_fill;
+		break;
+	}
+	if (callback != NULL)
+	{
+		callback(plugin->state, message);
+	}
+}
+
+/* Function: plugin_submit
+ * 	----------------------------
+ *   The submit function given to plugins. Adds the command to the plugin's queue as
+ *   fields, where the scheduler takes it in turn with the commands of other traders and
+ *   checks it like a command read from a pipe.
+ *
+ *   exchange: the plugin host
+ *   trader_id: the submitting trader
+ *   order: the command
+ *   returns: 0 if queued, -1 if the command is malformed or the queue is full
+ */
+int plugin_submit(void *exchange, int trader_id, const struct spx_order *order)
+{
+	struct plugin_host *host = exchange;
+	if (order == NULL || trader_id < 0 || trader_id >= host->number_traders || host->plugins[trader_id] == NULL)
+	{
+		return -1;
+	}
+	if (order->command < SPX_COMMAND_BUY || order->command > SPX_COMMAND_DISCONNECT)
+	{
+		return -1;
+	}
+	if ((order->command == SPX_COMMAND_BUY || order->command == SPX_COMMAND_SELL) && (order->product == NULL || strlen(order->product) >= PRODUCT_SIZE))
+	{
+		return -1;
+	}
+	struct trader_plugin *plugin = host->plugins[trader_id];
+	if (plugin->number_commands == PLUGIN_QUEUE_SIZE)
+	{
+		return -1;
+	}
+
+	struct plugin_command *command = &(plugin->commands[(plugin->first_command + plugin->number_commands) % PLUGIN_QUEUE_SIZE]);
+	command->command = order->command;
+	command->request.type = order->command == SPX_COMMAND_BUY ? BUY : SELL;
+	command->request.order_id = order->order_id;
+	command->request.product_index = -1;
+	command->request.quantity = order->quantity;
+	command->request.price = order->price;
+	command->request.time_in_force = TIF_GTC;
+	command->request.lifetime = 0;
+	command->product[0] = '\0';
+	if (order->command == SPX_COMMAND_BUY || order->command == SPX_COMMAND_SELL)
+	{
+		strcpy(command->product, order->product);
+	}
+	plugin->number_commands++;
+	schedule_trader(trader_id);
+	return 0;
+}
+
+/* Function: take_plugin_command
+ * 	----------------------------
+ *   Takes the first command from a plugin's queue.
+ *
+ *   plugin: the plugin, which must have a command waiting
+ *   command: where to copy the command to
+ */
+void take_plugin_command(struct trader_plugin *plugin, struct plugin_command *command)
+{
+	*command = plugin->commands[plugin->first_command];
+	plugin->first_command = (plugin->first_command + 1) % PLUGIN_QUEUE_SIZE;
+	plugin->number_commands--;
+}
+
+/* Function: describe_plugin_command
+ * 	----------------------------
+ *   Writes a plugin command as the text command it stands for, for the log and journal.
+ *
+ *   line: buffer of BUFFSIZE for the text
+ *   command: the command
+ */
+void describe_plugin_command(char *line, struct plugin_command *command)
+{
+	struct order_request *request = &(command->request);
+	switch (command->command)
+	{
+	case SPX_COMMAND_BUY:
+	case SPX_COMMAND_SELL:
+		snprintf(line, BUFFSIZE, "%s %d %s %ld %ld", command->command == SPX_COMMAND_BUY ? "BUY" : "SELL", request->order_id, command->product, request->quantity, request->price);
+		break;
+	case SPX_COMMAND_AMEND:
+		snprintf(line, BUFFSIZE, "AMEND %d %ld %ld", request->order_id, request->quantity, request->price);
+		break;
+	case SPX_COMMAND_CANCEL:
+		snprintf(line, BUFFSIZE, "CANCEL %d", request->order_id);
+		break;
+	default:
+		snprintf(line, BUFFSIZE, "LOGOUT");
+		break;
+	}
+}
+
+/* Function: set_up_plugin
+ * 	----------------------------
+ *   Loads a trader plugin and sets up its trader_struct. The trader has no pipes or
+ *   process, so its pid is 0 and its fd -1.
+ *
+ *   file_name: path of the shared object
+ *   trader_id: the trader's id
+ *   exchange_trader: the struct to populate with trader information
+ *   returns: 0 on success, -1 if the plugin could not be loaded
+ */
+int set_up_plugin(char *file_name, int trader_id, struct trader_struct *exchange_trader)
+{
+	exchange_trader->trader_id = trader_id;
+	exchange_trader->pipe_exchange_t = NULL;
+	exchange_trader->pipe_trader_e = NULL;
+	exchange_trader->fp_exchange_t = NULL;
+	exchange_trader->fp_trader_e = NULL;
+	exchange_trader->trader_fd = -1;
+	exchange_trader->pid_child = 0;
+	exchange_trader->positions = NULL;
+	exchange_trader->alive = TRUE;
+	exchange_trader->order_valid = 0;
+
+	struct trader_plugin *plugin = calloc(1, sizeof(struct trader_plugin));
+	plugin->handle = dlopen(file_name, RTLD_NOW | RTLD_LOCAL);
+	void *(*plugin_init)(const struct spx_exchange_api *api) = NULL;
+	if (plugin->handle != NULL)
+	{
+		*(void **)(&plugin_init) = dlsym(plugin->handle, "plugin_init");
+	}
+	if (plugin_init == NULL)
+	{
+		fprintf(stderr, "%s Cannot load trader plugin %s: %s\n", LOG_PREFIX, file_name, dlerror());
+		if (plugin->handle != NULL)
+		{
+			dlclose(plugin->handle);
+		}
+		free(plugin);
+		return -1;
+	}
+	*(void **)(&plugin->on_market_open) = dlsym(plugin->handle, "on_market_open");
+	*(void **)(&plugin->on_market) = dlsym(plugin->handle, "on_market");
+	*(void **)(&plugin->on_accepted) = dlsym(plugin->handle, "on_accepted");
+	*(void **)(&plugin->on_amended) = dlsym(plugin->handle, "on_amended");
+	*(void **)(&plugin->on_cancelled) = dlsym(plugin->handle, "on_cancelled");
+	*(void **)(&plugin->on_invalid) = dlsym(plugin->handle, "on_invalid");
+	*(void **)(&plugin->on_fill) = dlsym(plugin->handle, "on_fill");
+	*(void **)(&plugin->plugin_finish) = dlsym(plugin->handle, "plugin_finish");
+
+	plugin->api.api_version = SPX_PLUGIN_API_VERSION;
+	plugin->api.trader_id = trader_id;
+	plugin->api.exchange = &plugin_host;
+	plugin->api.submit = plugin_submit;
+	plugin_host.plugins[trader_id] = plugin;
+	plugin_host.connected++;
+	plugin->state = plugin_init(&(plugin->api));
+	return 0;
+}
+
+/* Function: is_plugin_file
+ * 	----------------------------
+ *   Whether a trader on the command line is a plugin rather than an executable.
+ *
+ *   file_name: the trader from the command line
+ *   returns: TRUE if it ends in .so
+ */
+int is_plugin_file(char *file_name)
+{
+	size_t length = strlen(file_name);
+	return length > 3 && strcmp(file_name + length - 3, ".so") == 0;
+}
+
+/* Function: get_products_size
+ * ----------------------------
+ *   Reads the first item from the file of how many products there are.
+ *
+ *   file: the name of the file path
+ * 	 returns: numbers of products in the file
+ */
+int get_products_size(char *file)
+{
+	FILE *ptr = fopen(file, "r");
+	char string[PRODUCT_SIZE];
+	fgets(string, PRODUCT_SIZE, ptr);
+	return atoi(string);
+}
+
+/* Function: load_products_file
+ * ----------------------------
+ *   Loads the products of the file into a product array.
+ *
+ *   file_name: the name of the file path
+ * 	 returns: an array of pointers to strings being the product names
+ */
+char **load_products_file(char *file_name)
+{
+	FILE *ptr = fopen(file_name, "r");
+	char string[PRODUCT_SIZE];
+	fgets(string, PRODUCT_SIZE, ptr);
+	char **product_array = (char **)malloc(sizeof(char *) * atoi(string));
+	int i = 0;
+	char line[BUFFSIZE];
+	// %<PRODUCT_SIZE - 1>s, so a long name is cut to fit its PRODUCT_SIZE buffer
+	char format[BUFFSIZE];
+	snprintf(format, BUFFSIZE, "%%%ds", PRODUCT_SIZE - 1);
+	while (i < atoi(string))
+	{
+		product_array[i] = (char *)malloc(sizeof(char) * PRODUCT_SIZE);
+		product_array[i][0] = '\0';
+		// The name may be followed by a price ladder, see init_ladder_book
+		if (fgets(line, BUFFSIZE, ptr) != NULL)
+		{
+			sscanf(line, format, product_array[i]);
+		}
+		i++;
+	}
+	fclose(ptr);
+	return product_array;
+}
+
+/* Function: init_trader_index
+ * 	----------------------------
+ *   Builds the pid and fd maps of the started traders, copies their hot fields out and
+ *   registers their pipes with epoll. The traders must be connected.
+ *
+ *   index: the trader index to set up
+ *   exchange_traders: linked list of trader_struct(s)
+ *   number_traders: the number of traders
+ */
+void init_trader_index(struct trader_index *index, struct trader_struct *exchange_traders, int number_traders)
+{
+	int pid_size = 1;
+	while (pid_size < 2 * number_traders)
+	{
+		pid_size <<= 1;
+	}
+	index->pid_mask = pid_size - 1;
+	index->pids = calloc(pid_size, sizeof(pid_t));
+	index->pid_traders = malloc(sizeof(int) * pid_size);
+
+	index->fd_size = 0;
+	for (int i = 0; i < number_traders; i++)
+	{
+		if (exchange_traders[i].trader_fd >= index->fd_size)
+		{
+			index->fd_size = exchange_traders[i].trader_fd + 1;
+		}
+	}
+	index->fd_traders = malloc(sizeof(int) * index->fd_size);
+	memset(index->fd_traders, -1, sizeof(int) * index->fd_size);
+	index->hot = malloc(sizeof(struct trader_hot) * (number_traders > 0 ? number_traders : 1));
+	for (int i = 0; i < number_traders; i++)
+	{
+		index->hot[i].fp_exchange_t = exchange_traders[i].fp_exchange_t;
+		index->hot[i].pid_child = exchange_traders[i].pid_child;
+		index->hot[i].alive = exchange_traders[i].alive;
+	}
+
+	index->epoll_fd = epoll_create1(0);
+	index->events = malloc(sizeof(struct epoll_event) * (number_traders > 0 ? number_traders : 1));
+	for (int i = 0; i < number_traders; i++)
+	{
+		// Plugins have neither a process nor a pipe
+		if (exchange_traders[i].pid_child == 0)
+		{
+			continue;
+		}
+		unsigned int slot = ((unsigned int)exchange_traders[i].pid_child * 2654435761u) & index->pid_mask;
+		while (index->pids[slot] != 0)
+		{
+			slot = (slot + 1) & index->pid_mask;
+		}
+		index->pids[slot] = exchange_traders[i].pid_child;
+		index->pid_traders[slot] = i;
+
+		index->fd_traders[exchange_traders[i].trader_fd] = i;
+		// Hangups are always reported as well
+		struct epoll_event event = {0};
+		event.events = EPOLLIN;
+		event.data.fd = exchange_traders[i].trader_fd;
+		epoll_ctl(index->epoll_fd, EPOLL_CTL_ADD, exchange_traders[i].trader_fd, &event);
+	}
+}
+
+/* Function: free_trader_index
+ * 	----------------------------
+ *   Frees the memory of the trader index and closes its epoll instance.
+ *
+ *   index: the trader index
+ */
+void free_trader_index(struct trader_index *index)
+{
+	free(index->pids);
+	free(index->pid_traders);
+	free(index->fd_traders);
+	free(index->events);
+	free(index->hot);
+	if (index->epoll_fd != -1)
+	{
+		close(index->epoll_fd);
+	}
+}
+
+/* Function: find_trader_pid
+ * 	----------------------------
+ *   Looks a trader up by pid.
+ *
+ *   index: the trader index
+ *   pid: the pid to find
+ *   returns: the trader's position in exchange_traders, -1 if no trader has that pid
+ */
+int find_trader_pid(struct trader_index *index, pid_t pid)
+{
+	if (index->pids == NULL || pid == 0)
+	{
+		return -1;
+	}
+	unsigned int slot = ((unsigned int)pid * 2654435761u) & index->pid_mask;
+	while (index->pids[slot] != 0)
+	{
+		if (index->pids[slot] == pid)
+		{
+			return index->pid_traders[slot];
+		}
+		slot = (slot + 1) & index->pid_mask;
+	}
+	return -1;
+}
+
+/* Function: forget_trader_fd
+ * 	----------------------------
+ *   Stops watching a disconnected trader's pipe, so its hangup does not wake the exchange again.
+ *
+ *   index: the trader index
+ *   exchange_trader: the disconnected trader
+ */
+void forget_trader_fd(struct trader_index *index, struct trader_struct *exchange_trader)
+{
+	epoll_ctl(index->epoll_fd, EPOLL_CTL_DEL, exchange_trader->trader_fd, NULL);
+}
+
+/* Function: te_sig
+ * ----------------------------
+ *   The signal handeler for trader writing to the exchange. It only has to interrupt the
+ *   wait, the trader's pipe is read once epoll reports it readable.
+ *
+ *   signo: signal number corresponding to the signal that needs to be handled
+ *   sinfo: pointer to the signal handler function
+ *   context: void pointer
+ */
+void te_sig(int signo, siginfo_t *sinfo, void *context)
+{
+}
+
+/* Function: child_sig
+ * ----------------------------
+ *   The signal handeler for exchange writing to the trader.
+ *
+ *   signo: signal number corresponding to the signal that needs to be handled
+ *   sinfo: pointer to the signal handler function
+ *   context: void pointer
+ */
+void child_sig(int signo, siginfo_t *sinfo, void *context)
+{
+	disconnect_child = sinfo->si_pid;
+}
+
+/* Function: get_time_ms
+ * ----------------------------
+ *   Reads the monotonic clock.
+ *
+ * 	 returns: the time in milliseconds
+ */
+long int get_time_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Function: timer_wheel_init
+ * 	----------------------------
+ *   Empties the timer wheel and starts it at the current time.
+ *
+ *   wheel: the timer wheel
+ *   now: the current time in ms
+ */
+void timer_wheel_init(struct timer_wheel *wheel, int64_t now)
+{
+	memset(wheel, 0, sizeof(struct timer_wheel));
+	wheel->now = now;
+}
+
+/* Function: timer_wheel_link
+ * 	----------------------------
+ *   Links a timer into the slot for its expiry relative to the wheel's time. A timer due
+ *   now goes in the current level 0 slot, which is run after cascading. Timers beyond the wheel's range are parked in the last level and placed again
+ *   when they cascade.
+ *
+ *   wheel: the timer wheel
+ *   timer: the timer to link
+ */
+void timer_wheel_link(struct timer_wheel *wheel, struct timer_node *timer)
+{
+	int64_t expires = timer->expires;
+	if (expires - wheel->now >= TIMER_RANGE)
+	{
+		expires = wheel->now + TIMER_RANGE - 1;
+	}
+
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && (expires - wheel->now) >> (TIMER_SLOT_BITS * (level + 1)))
+	{
+		level++;
+	}
+	struct timer_node **slot = &(wheel->slots[level][(expires >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK]);
+	timer->slot = slot;
+	timer->prev = NULL;
+	timer->next = *slot;
+	if (*slot != NULL)
+	{
+		(*slot)->prev = timer;
+	}
+	*slot = timer;
+}
+
+/* Function: timer_wheel_unlink
+ * 	----------------------------
+ *   Unlinks a timer from the slot it is in.
+ *
+ *   timer: the timer to unlink
+ */
+void timer_wheel_unlink(struct timer_node *timer)
+{
+	if (timer->prev == NULL)
+	{
+		*(timer->slot) = timer->next;
+	}
+	else
+	{
+		timer->prev->next = timer->next;
+	}
+	if (timer->next != NULL)
+	{
+		timer->next->prev = timer->prev;
+	}
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+/* Function: timer_wheel_add
+ * 	----------------------------
+ *   Arms a timer. Its expires and kind must already be set.
+ *
+ *   wheel: the timer wheel
+ *   timer: the timer to arm
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *timer)
+{
+	// The current ms has already been run, so anything overdue goes in the next one
+	if (timer->expires <= wheel->now)
+	{
+		timer->expires = wheel->now + 1;
+	}
+	timer_wheel_link(wheel, timer);
+	timer->armed = TRUE;
+	wheel->count++;
+}
+
+/* Function: timer_wheel_cancel
+ * 	----------------------------
+ *   Disarms a timer if it is armed.
+ *
+ *   wheel: the timer wheel
+ *   timer: the timer to disarm
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_node *timer)
+{
+	if (!timer->armed)
+	{
+		return;
+	}
+	timer_wheel_unlink(timer);
+	timer->armed = FALSE;
+	wheel->count--;
+}
+
+/* Function: timer_wheel_advance
+ * 	----------------------------
+ *   Advances the wheel to now and returns the timers that expired on the way,
+ *   disarmed and linked through next in expiry order.
+ *
+ *   wheel: the timer wheel
+ *   now: the current time in ms
+ *   returns: the expired timers, NULL if none
+ */
+struct timer_node *timer_wheel_advance(struct timer_wheel *wheel, int64_t now)
+{
+	struct timer_node *expired = NULL;
+	struct timer_node **expired_tail = &expired;
+	if (wheel->count == 0 && now > wheel->now)
+	{
+		wheel->now = now;
+	}
+	while (wheel->now < now)
+	{
+		wheel->now++;
+		// Cascade every level whose lower level just wrapped, coarsest first
+		int level = 0;
+		while (level < TIMER_LEVELS - 1 && ((wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK) == 0)
+		{
+			level++;
+		}
+		for (; level > 0; level--)
+		{
+			struct timer_node **slot = &(wheel->slots[level][(wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_SLOT_MASK]);
+			struct timer_node *timer = *slot;
+			*slot = NULL;
+			while (timer != NULL)
+			{
+				struct timer_node *next = timer->next;
+				timer_wheel_link(wheel, timer);
+				timer = next;
+			}
+		}
+
+		struct timer_node **slot = &(wheel->slots[0][wheel->now & TIMER_SLOT_MASK]);
+		struct timer_node *timer = *slot;
+		*slot = NULL;
+		while (timer != NULL)
+		{
+			struct timer_node *next = timer->next;
+			if (timer->expires > wheel->now)
+			{
+				// Parked timer still beyond the range
+				timer_wheel_link(wheel, timer);
+			}
+			else
+			{
+				timer->armed = FALSE;
+				timer->prev = NULL;
+				timer->next = NULL;
+				wheel->count--;
+				*expired_tail = timer;
+				expired_tail = &(timer->next);
+			}
+			timer = next;
+		}
+	}
+	return expired;
+}
+
+/* Function: timer_wheel_timeout
+ * 	----------------------------
+ *   Milliseconds the event loop can wait before the wheel needs advancing: up to the
+ *   next occupied level 0 slot, or the next cascade if there is none before it.
+ *
+ *   wheel: the timer wheel
+ *   now: the current time in ms
+ *   returns: the wait in ms, -1 if no timer is armed
+ */
+int timer_wheel_timeout(struct timer_wheel *wheel, int64_t now)
+{
+	if (wheel->count == 0)
+	{
+		return -1;
+	}
+	int64_t tick = wheel->now + 1;
+	while (wheel->slots[0][tick & TIMER_SLOT_MASK] == NULL && (tick & TIMER_SLOT_MASK) != 0)
+	{
+		tick++;
+	}
+	return tick > now ? tick - now : 0;
+}
+
+/* Function: get_time_us
+ * 	----------------------------
+ *   Gets the current monotonic time in microseconds.
+ *
+ *   returns: the time in us
+ */
+int64_t get_time_us()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Function: get_time_ns
+ * 	----------------------------
+ *   Gets the current monotonic time in nanoseconds.
+ *
+ *   returns: the time in ns
+ */
+int64_t get_time_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Function: start_busy_poll
+ * 	----------------------------
+ *   Pins the matching loop, called from it once the helper threads are running so they
+ *   stay off its core. Trader signals are ignored, the loop does not need waking.
+ *
+ *   busy: the busy poll settings
+ */
+void start_busy_poll(struct busy_poll *busy)
+{
+	if (!busy->enabled)
+	{
+		return;
+	}
+	if (busy->core >= 0 && pin_to_core(busy->core) == -1)
+	{
+		printf("%s Could not pin the matching loop to core %d\n", LOG_PREFIX, busy->core);
+	}
+	signal(SIGUSR1, SIG_IGN);
+	busy->idle_since = get_time_us();
+}
+
+/* Function: busy_poll_timeout
+ * 	----------------------------
+ *   How long the matching loop may wait for traders this pass. While the loop has not
+ *   been idle for long it does not wait, it spins or yields instead.
+ *
+ *   busy: the busy poll settings
+ *   timeout: milliseconds the loop would otherwise wait, -1 for no limit
+ *   returns: the milliseconds to wait
+ */
+int busy_poll_timeout(struct busy_poll *busy, int timeout)
+{
+	if (!busy->enabled || timeout == 0)
+	{
+		return timeout;
+	}
+	int64_t idle = get_time_us() - busy->idle_since;
+	if (idle < busy->spin)
+	{
+		CPU_RELAX();
+		return 0;
+	}
+	if (idle < busy->spin + busy->yield)
+	{
+		sched_yield();
+		return 0;
+	}
+	return timeout;
+}
+
+/* Function: busy_poll_ready
+ * 	----------------------------
+ *   Notes that input came in, which restarts the spinning.
+ *
+ *   busy: the busy poll settings
+ *   ready: number of traders or gateway events that were ready
+ */
+void busy_poll_ready(struct busy_poll *busy, int ready)
+{
+	if (busy->enabled && ready > 0)
+	{
+		busy->idle_since = get_time_us();
+	}
+}
+
+/* Function: free_busy_poll
+ * 	----------------------------
+ *   Frees the busy poll settings.
+ *
+ *   busy: the busy poll settings
+ */
+void free_busy_poll(struct busy_poll *busy)
+{
+	free(busy->trader_cores);
+	busy->trader_cores = NULL;
+}
+
+/* Function: get_epoch_ms
+ * 	----------------------------
+ *   Gets the wall clock time in milliseconds since the epoch.
+ *
+ *   returns: the time in ms
+ */
+int64_t get_epoch_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Function: get_product_index
+ * ----------------------------
+ *   Finds a product in the product array
+ *
+ *   product: the product to find
+ *   product_array: the product array
+ *   size: the size of the product array
+ * 	 returns: the index of the product in the array, and -1 if it is not in the array
+ */
+int get_product_index(char *product, char **product_array, int size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		if (strcmp(product, product_array[i]) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Function: market_open
+ * ----------------------------
+ *   Loops over traders and writes market open, then loops over traders and sends signals
+ *
+ *   number_traders: the number of traders
+ *   exchange_traders: the linked list of trader_struct(s)
+ */
+void market_open(int number_traders, struct trader_struct *exchange_traders)
+{
+	// Loop over traders and write market open
+	for (size_t i = 0; i < number_traders; i++)
+	{
+		if (get_plugin(&(exchange_traders[i])) == NULL)
+		{
+			write_trader(&(exchange_traders[i]), "MARKET OPEN;");
+		}
+	}
+	// Loop over traders and send signals
+	for (size_t i = 0; i < number_traders; i++)
+	{
+		struct trader_plugin *plugin = get_plugin(&(exchange_traders[i]));
+		if (plugin == NULL)
+		{
+			signal_trader(&(exchange_traders[i]));
+		}
+		else
+		{
+			struct spx_message message = {SPX_MARKET_OPEN, 0, 0, NULL, 0, 0};
+			notify_plugin(plugin, &message);
+		}
+	}
+}
+
+/* Function: print_trading
+ * ----------------------------
+ *   Prints the items in the product array
+ *
+ *   size: the number of products
+ */
+void print_trading(char **product_array, int size)
+{
+	printf("%s Trading %d products:", LOG_PREFIX, size);
+	for (size_t i = 0; i < size; i++)
+	{
+		printf(" %s", product_array[i]);
+	}
+	printf("\n");
+}
+
+/* Function: abort_startup
+ * 	----------------------------
+ *   Gives up on starting the market: stops the trader processes already started,
+ *   removes their pipes and exits.
+ *
+ *   number_traders: the number of traders
+ *   exchange_traders: linked list of traders
+ */
+void abort_startup(int number_traders, struct trader_struct *exchange_traders)
+{
+	for (int i = 0; i < number_traders; i++)
+	{
+		if (get_plugin(&(exchange_traders[i])) != NULL)
+		{
+			continue;
+		}
+		kill(exchange_traders[i].pid_child, SIGKILL);
+		remove(exchange_traders[i].pipe_exchange_t);
+		remove(exchange_traders[i].pipe_trader_e);
+	}
+	exit(1);
+}
+
+/* Function: initalise_traders
+ * ----------------------------
+ *   Starts every trader, then connects their pipes as each trader becomes ready, so
+ *   startup takes as long as the slowest trader rather than the sum of them. The market
+ *   does not open if a trader exits before connecting.
+ *
+ *   argv: the trader binaries from the command line
+ *   exchange_traders: linked list of trader_struct(s)
+ */
+void initalise_traders(char **argv, int argc, struct trader_struct *exchange_traders)
+{
+	int number_traders = argc - 2;
+	int64_t *started = malloc(sizeof(int64_t) * number_traders);
+	int64_t *connected = calloc(number_traders, sizeof(int64_t));
+	int64_t start = get_time_us();
+
+	plugin_host.number_traders = number_traders;
+	plugin_host.plugins = calloc(number_traders > 0 ? number_traders : 1, sizeof(struct trader_plugin *));
+
+	int waiting = number_traders;
+	for (int i = 0; i < number_traders; i++)
+	{
+		started[i] = get_time_us();
+		if (is_plugin_file(argv[i + 2]))
+		{
+			if (set_up_plugin(argv[i + 2], i, &(exchange_traders[i])) == -1)
+			{
+				exit(1);
+			}
+			connected[i] = get_time_us();
+			waiting--;
+		}
+		else
+		{
+			set_up_trader(argv[i + 2], i, &(exchange_traders[i]));
+		}
+	}
+
+	while (waiting > 0)
+	{
+		for (int i = 0; i < number_traders; i++)
+		{
+			if (connected[i] == 0 && connect_trader(&(exchange_traders[i])))
+			{
+				connected[i] = get_time_us();
+				waiting--;
+			}
+			// A trader that could not start or died before opening its pipe never will
+			else if (connected[i] == 0 && waitpid(exchange_traders[i].pid_child, NULL, WNOHANG) == exchange_traders[i].pid_child)
+			{
+				printf("%s Trader %d (%s) exited before connecting\n", LOG_PREFIX, i, argv[i + 2]);
+				abort_startup(number_traders, exchange_traders);
+			}
+		}
+		if (waiting > 0)
+		{
+			struct timespec pause_time = {0, 200000};
+			nanosleep(&pause_time, NULL);
+		}
+	}
+
+	for (int i = 0; i < number_traders; i++)
+	{
+		if (get_plugin(&(exchange_traders[i])) != NULL)
+		{
+			printf("%s Loaded plugin %s as Trader %d\n", LOG_PREFIX, argv[i + 2], i);
+			continue;
+		}
+		printf("%s Connected to %s\n", LOG_PREFIX, exchange_traders[i].pipe_exchange_t);
+		printf("%s Connected to %s\n", LOG_PREFIX, exchange_traders[i].pipe_trader_e);
+	}
+	if (getenv(STARTUP_REPORT_ENV) != NULL)
+	{
+		int slowest = 0;
+		for (int i = 0; i < number_traders; i++)
+		{
+			printf("%s Startup: Trader %d (%s) connected in %.3f ms\n", LOG_PREFIX, i, argv[i + 2], (connected[i] - started[i]) / 1000.0);
+			slowest = connected[i] - started[i] > connected[slowest] - started[slowest] ? i : slowest;
+		}
+		if (number_traders > 0)
+		{
+			printf("%s Startup: %d traders in %.3f ms, slowest Trader %d\n", LOG_PREFIX, number_traders, (get_time_us() - start) / 1000.0, slowest);
+		}
+	}
+	free(started);
+	free(connected);
+}
+
+/* Function: get_trader_id
+ * ----------------------------
+ *   Gets a trader from its trader id.
+ *
+ *   sent_id: the trader the sent a signal to the exchange
+ *   exchange_traders: linked list of trader_struct(s)
+ *   size: the number of products
+ *   returns: the trader_struct of the trader with the id
+ */
+struct trader_struct *get_trader_id(int sent_id, struct trader_struct *exchange_traders, int size)
+{
+
+	if (sent_id >= size)
+	{
+		return NULL;
+	}
+	else
+	{
+		return exchange_traders + sent_id;
+	}
+}
+
+/* Function: send_message
+ * 	----------------------------
+ *   Sends a message to a trader: written to its pipe and signalled for a process,
+ *   passed to the callback for a plugin.
+ *
+ *   trader: the trader
+ *   message: the message
+ */
+void send_message(struct trader_struct *trader, struct spx_message *message)
+{
+	struct trader_plugin *plugin = get_plugin(trader);
+	if (plugin != NULL)
+	{
+		notify_plugin(plugin, message);
+		return;
+	}
+	switch (message->type)
+	{
+	case SPX_MARKET_OPEN:
+		write_trader(trader, "MARKET OPEN;");
+		break;
+	case SPX_ACCEPTED:
+		write_trader(trader, "ACCEPTED %d;", message->order_id);
+		break;
+	case SPX_AMENDED:
+		write_trader(trader, "AMENDED %d;", message->order_id);
+		break;
+	case SPX_CANCELLED:
+		write_trader(trader, "CANCELLED %d;", message->order_id);
+		break;
+	case SPX_INVALID:
+		write_trader(trader, "INVALID;");
+		break;
+	case SPX_FILL:
+		write_trader(trader, "FILL %d %ld;", message->order_id, message->quantity);
+		break;
+	}
+	signal_trader(trader);
+}
+
+/* Function: queue_invalid
+ * 	----------------------------
+ *   Writes invalid for the trader without delivering it. The scheduler delivers a
+ *   trader's INVALIDs together once its turn is over, or they go with the next message
+ *   that is signalled. Plugins get theirs straight away.
+ *
+ *   trader: the trader
+ */
+void queue_invalid(struct trader_struct *trader)
+{
+	struct spx_message message = {SPX_INVALID, 0, 0, NULL, 0, 0};
+	if (get_plugin(trader) != NULL)
+	{
+		send_message(trader, &message);
+		return;
+	}
+	write_trader(trader, "INVALID;");
+	scheduler.inputs[trader->trader_id].unsignalled = TRUE;
+}
+
+/* Function: send_invalid
+ * 	----------------------------
+ *   Rejects a trader's command: counts it against the trader, takes the invalid
+ *   penalty from its token bucket and queues invalid.
+ *
+ *   trader: the trader
+ */
+void send_invalid(struct trader_struct *trader)
+{
+	struct trader_input *input = &(scheduler.inputs[trader->trader_id]);
+	input->invalid++;
+	if (input->rate > 0)
+	{
+		input->tokens -= scheduler.invalid_penalty;
+	}
+	queue_invalid(trader);
+}
+
+/* Function: send_cancel
+ * 	----------------------------
+ *   Sends cancel to the trader.
+ *
+ *   trader: the trader
+ *   order_id: the order id of the cancelled order
+ */
+void send_cancel(struct trader_struct *trader, int order_id)
+{
+	struct spx_message message = {SPX_CANCELLED, order_id, 0, NULL, 0, 0};
+	send_message(trader, &message);
+}
+
+/* Function: send_fill
+ * 	----------------------------
+ *   Sends a fill order to the trader.
+ *
+ *   trader: the trader
+ *   order_id: the order id of the cancelled order
+ *   quantity: quantity of the filled order
+ */
+void send_fill(struct trader_struct *trader, int order_id, long int quantity)
+{
+	struct spx_message message = {SPX_FILL, order_id, 0, NULL, quantity, 0};
+	send_message(trader, &message);
+}
+
+/* Function: init_risk_book
+ * 	----------------------------
+ *   Sets up the exposure counters and loads the limits file, if there is one. Each line
+ *   of the file is a trader id, or * for every trader without a line of its own, then
+ *   the max order quantity, max resting notional across all products, max net position
+ *   per product and max open orders.
+ *
+ *   risk: the risk book to set up
+ *   number_traders: the number of traders
+ *   size: the number of products
+ *   file_name: the limits file, or NULL for no limits
+ */
+void init_risk_book(struct risk_book *risk, int number_traders, int size, char *file_name)
+{
+	risk->number_traders = number_traders;
+	risk->size = size;
+	risk->enabled = FALSE;
+	risk->limits = calloc(number_traders, sizeof(struct risk_limits));
+	risk->open_buy = calloc((size_t)number_traders * size, sizeof(int64_t));
+	risk->open_sell = calloc((size_t)number_traders * size, sizeof(int64_t));
+	risk->open_orders = calloc(number_traders, sizeof(int64_t));
+	risk->open_notional = calloc(number_traders, sizeof(int64_t));
+
+	if (file_name == NULL)
+	{
+		return;
+	}
+	FILE *ptr = fopen(file_name, "r");
+	if (ptr == NULL)
+	{
+		perror("fopen failed risk limits");
+		return;
+	}
+
+	char line[BUFFSIZE];
+	char trader[BUFFSIZE];
+	struct risk_limits limits;
+	int *has_line = calloc(number_traders, sizeof(int));
+	while (fgets(line, BUFFSIZE, ptr) != NULL)
+	{
+		if (sscanf(line, "%s %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64, trader, &limits.max_order_quantity, &limits.max_notional, &limits.max_position, &limits.max_open_orders) != 5)
+		{
+			continue;
+		}
+		risk->enabled = TRUE;
+		if (strcmp(trader, "*") == 0)
+		{
+			for (int i = 0; i < number_traders; i++)
+			{
+				if (!has_line[i])
+				{
+					risk->limits[i] = limits;
+				}
+			}
+		}
+		else if (atoi(trader) >= 0 && atoi(trader) < number_traders)
+		{
+			risk->limits[atoi(trader)] = limits;
+			has_line[atoi(trader)] = TRUE;
+		}
+	}
+	free(has_line);
+	fclose(ptr);
+}
+
+/* Function: free_risk_book
+ * 	----------------------------
+ *   Frees the memory of the risk book.
+ *
+ *   risk: the risk book
+ */
+void free_risk_book(struct risk_book *risk)
+{
+	free(risk->limits);
+	free(risk->open_buy);
+	free(risk->open_sell);
+	free(risk->open_orders);
+	free(risk->open_notional);
+}
+
+/* Function: check_risk_limits
+ * 	----------------------------
+ *   Checks an order against its trader's limits using the running exposure counters.
+ *   The net position check assumes every open order on the same side fills, and the
+ *   notional check counts the order on top of everything the trader already has resting.
+ *
+ *   risk: the risk book
+ *   trader_id: the trader placing the order
+ *   product_index: the product of the order
+ *   type: BUY or SELL
+ *   quantity: quantity of the order
+ *   price: price of the order
+ *   replaced: the resting order being amended, or NULL for a new order
+ *   returns: the limit that was broken, or NULL if the order is within limits
+ */
+char *check_risk_limits(struct risk_book *risk, int trader_id, int product_index, int type, long int quantity, long int price, struct order_type *replaced)
+{
+	if (!risk->enabled)
+	{
+		return NULL;
+	}
+	struct risk_limits *limits = &(risk->limits[trader_id]);
+	int cell = POSITION_INDEX(risk, trader_id, product_index);
+
+	if (limits->max_order_quantity != 0 && quantity > limits->max_order_quantity)
+	{
+		return "max order quantity";
+	}
+	int64_t replaced_notional = replaced == NULL ? 0 : (int64_t)replaced->quantity * replaced->price;
+	if (limits->max_notional != 0 && risk->open_notional[trader_id] - replaced_notional + (int64_t)quantity * price > limits->max_notional)
+	{
+		return "max notional";
+	}
+	if (limits->max_open_orders != 0 && replaced == NULL && risk->open_orders[trader_id] >= limits->max_open_orders)
+	{
+		return "max open orders";
+	}
+	if (limits->max_position != 0)
+	{
+		int64_t replaced_quantity = replaced == NULL ? 0 : replaced->quantity;
+		int64_t position = position_book.quantity[cell];
+		if (type == BUY && position + risk->open_buy[cell] - replaced_quantity + quantity > limits->max_position)
+		{
+			return "max position";
+		}
+		if (type == SELL && position - risk->open_sell[cell] + replaced_quantity - quantity < -limits->max_position)
+		{
+			return "max position";
+		}
+	}
+	return NULL;
+}
+
+/* Function: update_risk_exposure
+ * 	----------------------------
+ *   Adds to or takes away from a trader's open quantity, open notional and open order count.
+ *
+ *   risk: the risk book
+ *   order: the resting order that changed
+ *   quantity: open quantity to add (negative to take away)
+ *   orders: open orders to add (negative to take away)
+ */
+void update_risk_exposure(struct risk_book *risk, struct order_type *order, long int quantity, int orders)
+{
+	int trader_id = ORDER_TRADER_ID(order);
+	int cell = POSITION_INDEX(risk, trader_id, ORDER_RECORD(order)->product_index);
+	if (order->type == BUY)
+	{
+		risk->open_buy[cell] += quantity;
+	}
+	else
+	{
+		risk->open_sell[cell] += quantity;
+	}
+	risk->open_orders[trader_id] += orders;
+	risk->open_notional[trader_id] += (int64_t)quantity * order->price;
+}
+
+/* Function: init_ladder_book
+ * 	----------------------------
+ *   Sets up a price ladder for every product whose line in the products file gives its
+ *   lowest price, highest price and tick after its name, e.g. GPU 100 500 5.
+ *
+ *   book: the ladder book to set up
+ *   file_name: the products file
+ *   size: the number of products
+ */
+void init_ladder_book(struct ladder_book *book, char *file_name, int size)
+{
+	book->size = size;
+	book->ladders = calloc(size > 0 ? size : 1, sizeof(struct price_ladder *));
+
+	FILE *ptr = fopen(file_name, "r");
+	char line[BUFFSIZE];
+	fgets(line, BUFFSIZE, ptr);
+	for (int i = 0; i < size && fgets(line, BUFFSIZE, ptr) != NULL; i++)
+	{
+		char name[BUFFSIZE];
+		long int low;
+		long int high;
+		long int tick;
+		int fields = sscanf(line, "%s %ld %ld %ld", name, &low, &high, &tick);
+		if (fields < 2)
+		{
+			continue;
+		}
+		if (fields != 4 || tick <= 0 || low <= 0 || high < low || high >= UPPER_BOUND || (high - low) % tick != 0 || (high - low) / tick >= LADDER_MAX_LEVELS)
+		{
+			fprintf(stderr, "%s Invalid price ladder for %s, using the general ladder\n", LOG_PREFIX, name);
+			continue;
+		}
+
+		struct price_ladder *ladder = malloc(sizeof(struct price_ladder));
+		ladder->base = low;
+		ladder->tick = tick;
+		ladder->levels = (high - low) / tick + 1;
+		ladder->words = (ladder->levels + 63) / 64;
+		for (int side = 0; side < 2; side++)
+		{
+			ladder->side[side] = calloc(ladder->levels, sizeof(struct ladder_level));
+			ladder->bits[side] = calloc(ladder->words, sizeof(uint64_t));
+			ladder->summary[side] = calloc((ladder->words + 63) / 64, sizeof(uint64_t));
+		}
+		book->ladders[i] = ladder;
+	}
+	fclose(ptr);
+}
+
+/* Function: free_ladder_book
+ * 	----------------------------
+ *   Frees the memory of the ladder book.
+ *
+ *   book: the ladder book
+ */
+void free_ladder_book(struct ladder_book *book)
+{
+	for (int i = 0; i < book->size; i++)
+	{
+		struct price_ladder *ladder = book->ladders[i];
+		if (ladder == NULL)
+		{
+			continue;
+		}
+		for (int side = 0; side < 2; side++)
+		{
+			free(ladder->side[side]);
+			free(ladder->bits[side]);
+			free(ladder->summary[side]);
+		}
+		free(ladder);
+	}
+	free(book->ladders);
+}
+
+/* Function: get_ladder
+ * 	----------------------------
+ *   Gets the price ladder of a product.
+ *
+ *   product_index: the product
+ *   returns: the ladder, NULL for a product on the general ladder
+ */
+struct price_ladder *get_ladder(int product_index)
+{
+	if (ladder_book.ladders == NULL)
+	{
+		return NULL;
+	}
+	return ladder_book.ladders[product_index];
+}
+
+/* Function: ladder_accepts
+ * 	----------------------------
+ *   Whether a price can rest on a product's book: any price on the general ladder, a
+ *   price on one of its ticks for a price ladder.
+ *
+ *   product_index: the product
+ *   price: the price
+ *   returns: TRUE if it can
+ */
+int ladder_accepts(int product_index, long int price)
+{
+	struct price_ladder *ladder = get_ladder(product_index);
+	if (ladder == NULL)
+	{
+		return TRUE;
+	}
+	return price >= ladder->base && (price - ladder->base) % ladder->tick == 0 && LADDER_LEVEL(ladder, price) < ladder->levels;
+}
+
+/* Function: ladder_mark
+ * 	----------------------------
+ *   Sets or clears the bits of a level in a ladder's bitmap and its summary.
+ *
+ *   ladder: the ladder
+ *   side: LADDER_SIDE of the level
+ *   level: index of the level
+ *   set: TRUE if the level now has orders, FALSE if it is empty
+ */
+void ladder_mark(struct price_ladder *ladder, int side, int level, int set)
+{
+	int word = level >> 6;
+	if (set)
+	{
+		ladder->bits[side][word] |= (uint64_t)1 << (level & 63);
+		ladder->summary[side][word >> 6] |= (uint64_t)1 << (word & 63);
+	}
+	else
+	{
+		ladder->bits[side][word] &= ~((uint64_t)1 << (level & 63));
+		if (ladder->bits[side][word] == 0)
+		{
+			ladder->summary[side][word >> 6] &= ~((uint64_t)1 << (word & 63));
+		}
+	}
+}
+
+/* Function: ladder_scan_up
+ * 	----------------------------
+ *   Finds the lowest level with orders at or above a level.
+ *
+ *   ladder: the ladder
+ *   side: LADDER_SIDE to look on
+ *   from: the level to start at
+ *   returns: the level, -1 if there is none
+ */
+int ladder_scan_up(struct price_ladder *ladder, int side, int from)
+{
+	if (from >= ladder->levels)
+	{
+		return -1;
+	}
+	from = from < 0 ? 0 : from;
+	uint64_t *bits = ladder->bits[side];
+	int word = from >> 6;
+	uint64_t mask = bits[word] & (~(uint64_t)0 << (from & 63));
+	if (mask != 0)
+	{
+		return (word << 6) + __builtin_ctzll(mask);
+	}
+
+	word++;
+	int summary_words = (ladder->words + 63) >> 6;
+	int summary = word >> 6;
+	if (word >= ladder->words)
+	{
+		return -1;
+	}
+	mask = ladder->summary[side][summary] & (~(uint64_t)0 << (word & 63));
+	while (mask == 0)
+	{
+		if (++summary >= summary_words)
+		{
+			return -1;
+		}
+		mask = ladder->summary[side][summary];
+	}
+	word = (summary << 6) + __builtin_ctzll(mask);
+	return (word << 6) + __builtin_ctzll(bits[word]);
+}
+
+/* Function: ladder_scan_down
+ * 	----------------------------
+ *   Finds the highest level with orders at or below a level.
+ *
+ *   ladder: the ladder
+ *   side: LADDER_SIDE to look on
+ *   from: the level to start at
+ *   returns: the level, -1 if there is none
+ */
+int ladder_scan_down(struct price_ladder *ladder, int side, int from)
+{
+	if (from < 0)
+	{
+		return -1;
+	}
+	from = from >= ladder->levels ? ladder->levels - 1 : from;
+	uint64_t *bits = ladder->bits[side];
+	int word = from >> 6;
+	uint64_t mask = bits[word] & (~(uint64_t)0 >> (63 - (from & 63)));
+	if (mask != 0)
+	{
+		return (word << 6) + 63 - __builtin_clzll(mask);
+	}
+
+	word--;
+	if (word < 0)
+	{
+		return -1;
+	}
+	int summary = word >> 6;
+	mask = ladder->summary[side][summary] & (~(uint64_t)0 >> (63 - (word & 63)));
+	while (mask == 0)
+	{
+		if (--summary < 0)
+		{
+			return -1;
+		}
+		mask = ladder->summary[side][summary];
+	}
+	word = (summary << 6) + 63 - __builtin_clzll(mask);
+	return (word << 6) + 63 - __builtin_clzll(bits[word]);
+}
+
+/* Function: ladder_best
+ * 	----------------------------
+ *   Finds the best level of one side of a ladder: the highest bid or lowest ask.
+ *
+ *   ladder: the ladder
+ *   type: BUY or SELL
+ *   returns: the level, -1 if the side is empty
+ */
+int ladder_best(struct price_ladder *ladder, int type)
+{
+	if (type == BUY)
+	{
+		return ladder_scan_down(ladder, LADDER_SIDE(BUY), ladder->levels - 1);
+	}
+	return ladder_scan_up(ladder, LADDER_SIDE(SELL), 0);
+}
+
+/* Function: ladder_insert_after
+ * 	----------------------------
+ *   Finds where an order goes in the product's order list, which has the sells in
+ *   ascending price order followed by the buys in descending price order, each price
+ *   in arrival order. The order goes at the end of its own level, or after the nearest
+ *   level before it in the list.
+ *
+ *   product_node: the product
+ *   ladder: the product's ladder
+ *   order: the order to insert
+ *   returns: the order to link it after, NULL to make it the first order
+ */
+struct order_type *ladder_insert_after(struct product_info *product_node, struct price_ladder *ladder, struct order_type *order)
+{
+	int level = LADDER_LEVEL(ladder, order->price);
+	int found;
+	if (order->type == SELL)
+	{
+		found = ladder_scan_down(ladder, LADDER_SIDE(SELL), level);
+		return found == -1 ? NULL : ladder->side[LADDER_SIDE(SELL)][found].last;
+	}
+	found = ladder_scan_up(ladder, LADDER_SIDE(BUY), level);
+	if (found != -1)
+	{
+		return ladder->side[LADDER_SIDE(BUY)][found].last;
+	}
+	// No buy at this price or better, so it goes at the end of the sells
+	found = ladder_scan_down(ladder, LADDER_SIDE(SELL), ladder->levels - 1);
+	return found == -1 ? NULL : ladder->side[LADDER_SIDE(SELL)][found].last;
+}
+
+/* Function: ladder_order_added
+ * 	----------------------------
+ *   Adds an order just linked at the end of its level to the ladder.
+ *
+ *   ladder: the ladder
+ *   order: the order
+ */
+void ladder_order_added(struct price_ladder *ladder, struct order_type *order)
+{
+	int index = LADDER_LEVEL(ladder, order->price);
+	struct ladder_level *level = &(ladder->side[LADDER_SIDE(order->type)][index]);
+	if (level->orders == 0)
+	{
+		level->first = order;
+		ladder_mark(ladder, LADDER_SIDE(order->type), index, TRUE);
+	}
+	level->last = order;
+	level->quantity += order->quantity;
+	level->orders++;
+}
+
+/* Function: ladder_order_removed
+ * 	----------------------------
+ *   Takes an order just unlinked from the order list off the ladder. The order's own
+ *   prev and next still point at its old neighbours.
+ *
+ *   ladder: the ladder
+ *   order: the order
+ */
+void ladder_order_removed(struct price_ladder *ladder, struct order_type *order)
+{
+	int index = LADDER_LEVEL(ladder, order->price);
+	struct ladder_level *level = &(ladder->side[LADDER_SIDE(order->type)][index]);
+	level->quantity -= order->quantity;
+	level->orders--;
+	if (level->orders == 0)
+	{
+		level->first = NULL;
+		level->last = NULL;
+		ladder_mark(ladder, LADDER_SIDE(order->type), index, FALSE);
+		return;
+	}
+	if (level->first == order)
+	{
+		level->first = order->next;
+	}
+	if (level->last == order)
+	{
+		level->last = order->prev;
+	}
+}
+
+/* Function: init_level_book
+ * 	----------------------------
+ *   Sets up empty bid and ask levels for every product.
+ *
+ *   book: the level book
+ *   size: the number of products
+ */
+void init_level_book(struct level_book *book, int size)
+{
+	book->size = size;
+	book->sides = calloc(2 * size, sizeof(struct list_level *));
+	book->spare = NULL;
+}
+
+/* Function: free_level_book
+ * 	----------------------------
+ *   Frees the levels of the level book.
+ *
+ *   book: the level book
+ */
+void free_level_book(struct level_book *book)
+{
+	for (int i = 0; i < 2 * book->size; i++)
+	{
+		while (book->sides[i] != NULL)
+		{
+			struct list_level *next = book->sides[i]->next;
+			free(book->sides[i]);
+			book->sides[i] = next;
+		}
+	}
+	while (book->spare != NULL)
+	{
+		struct list_level *next = book->spare->next;
+		free(book->spare);
+		book->spare = next;
+	}
+	free(book->sides);
+}
+
+/* Function: get_list_levels
+ * 	----------------------------
+ *   Gets the best level of one side of a product on the general ladder.
+ *
+ *   product_index: the product
+ *   type: BUY for the bids, SELL for the asks
+ *   returns: the address of the side's first level pointer
+ */
+struct list_level **get_list_levels(int product_index, int type)
+{
+	return &(level_book.sides[2 * product_index + LADDER_SIDE(type)]);
+}
+
+/* Function: list_order_added
+ * 	----------------------------
+ *   Adds an order to the quantity of its level, making the level if it is the first order
+ *   at its price.
+ *
+ *   order: the order
+ */
+void list_order_added(struct order_type *order)
+{
+	struct list_level **link = get_list_levels(ORDER_RECORD(order)->product_index, order->type);
+	while (*link != NULL && (order->type == BUY ? (*link)->price > order->price : (*link)->price < order->price))
+	{
+		link = &((*link)->next);
+	}
+	if (*link == NULL || (*link)->price != order->price)
+	{
+		struct list_level *level = level_book.spare;
+		if (level != NULL)
+		{
+			level_book.spare = level->next;
+		}
+		else
+		{
+			level = malloc(sizeof(struct list_level));
+		}
+		level->price = order->price;
+		level->quantity = 0;
+		level->orders = 0;
+		// Later orders at the price rest behind this one
+		level->first = order;
+		level->next = *link;
+		*link = level;
+	}
+	(*link)->quantity += order->quantity;
+	(*link)->orders++;
+}
+
+/* Function: list_order_reduced
+ * 	----------------------------
+ *   Takes quantity off the level of an order, dropping the level once its last order is gone.
+ *   A removed order's own next still points at its old neighbour.
+ *
+ *   order: the order
+ *   quantity: the quantity taken off
+ *   removed: TRUE if the order left the book
+ */
+void list_order_reduced(struct order_type *order, long int quantity, int removed)
+{
+	struct list_level **link = get_list_levels(ORDER_RECORD(order)->product_index, order->type);
+	while (*link != NULL && (*link)->price != order->price)
+	{
+		link = &((*link)->next);
+	}
+	if (*link == NULL)
+	{
+		return;
+	}
+	struct list_level *level = *link;
+	level->quantity -= quantity;
+	if (removed)
+	{
+		level->orders--;
+		if (level->first == order)
+		{
+			level->first = order->next;
+		}
+	}
+	if (level->orders == 0)
+	{
+		*link = level->next;
+		level->next = level_book.spare;
+		level_book.spare = level;
+	}
+}
+
+/* Function: alloc_order
+ * 	----------------------------
+ *   Takes an order record from the order pool, adding a slab when the pool is empty.
+ *
+ *   pool: the order pool
+ *   returns: the order_type of the record
+ */
+struct order_type *alloc_order(struct order_pool *pool)
+{
+	if (pool->free_list == NULL)
+	{
+		if (pool->number_slabs == pool->slabs_size)
+		{
+			pool->slabs_size = pool->slabs_size == 0 ? 16 : pool->slabs_size * 2;
+			pool->slabs = realloc(pool->slabs, sizeof(struct order_record *) * pool->slabs_size);
+		}
+		struct order_record *slab = aligned_alloc(CACHE_LINE, sizeof(struct order_record) * ORDER_SLAB_SIZE);
+		pool->slabs[pool->number_slabs++] = slab;
+		// Thread the free list in address order so a fresh slab is handed out front to back
+		for (int i = ORDER_SLAB_SIZE - 1; i >= 0; i--)
+		{
+			slab[i].order.next = pool->free_list;
+			pool->free_list = &(slab[i].order);
+		}
+	}
+	struct order_type *order = pool->free_list;
+	pool->free_list = order->next;
+	return order;
+}
+
+/* Function: free_order
+ * 	----------------------------
+ *   Gives an order record back to the order pool.
+ *
+ *   order: the order to free
+ */
+void free_order(struct order_type *order)
+{
+	order->next = order_pool.free_list;
+	order_pool.free_list = order;
+}
+
+/* Function: free_order_pool
+ * 	----------------------------
+ *   Frees every slab of the order pool, and with them every order still in the book.
+ *
+ *   pool: the order pool
+ */
+void free_order_pool(struct order_pool *pool)
+{
+	for (int i = 0; i < pool->number_slabs; i++)
+	{
+		free(pool->slabs[i]);
+	}
+	free(pool->slabs);
+	pool->slabs = NULL;
+	pool->number_slabs = 0;
+	pool->slabs_size = 0;
+	pool->free_list = NULL;
+}
+
+/* Function: check_order_request
+ * 	----------------------------
+ *   Checks the order id, product, quantity, price and lifetime of a BUY or SELL,
+ *   without taking an order record or touching the book, so a bad command costs no
+ *   more than its parsing.
+ *
+ *   trader: the trader that sent it
+ *   request: the command's fields
+ *   returns: TRUE if the command is a valid order, FALSE if it must be rejected
+ */
+int check_order_request(struct trader_struct *trader, struct order_request *request)
+{
+	// The router keeps order ids in sequence across all partitions
+	if (get_partition_slot(trader) == -1 && trader->order_valid != request->order_id && request->order_id != UPPER_BOUND)
+	{
+		return FALSE;
+	}
+	if (request->product_index == -1)
+	{
+		return FALSE;
+	}
+	if (request->quantity <= 0 || request->quantity >= UPPER_BOUND)
+	{
+		return FALSE;
+	}
+	if (request->price <= 0 || request->price >= UPPER_BOUND || !ladder_accepts(request->product_index, request->price))
+	{
+		return FALSE;
+	}
+	if (request->time_in_force == TIF_GTT && (request->lifetime <= 0 || request->lifetime >= TIMER_RANGE))
+	{
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Function: parse_order_request
+ * 	----------------------------
+ *   Parses a BUY or SELL command and checks it with check_order_request.
+ *
+ *   buff: the command, split up in place
+ *   trader: the trader that sent it
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ *   request: filled in with the command's fields
+ *   returns: TRUE if the command is a valid order, FALSE if it must be rejected
+ */
+int parse_order_request(char *buff, struct trader_struct *trader, char **product_array, int size, struct order_request *request)
+{
+	char *fields[LINE_ITEMS];
+	for (int i = 0; i < LINE_ITEMS; i++)
+	{
+		fields[i] = strsep(&buff, " ");
+		if (fields[i] == NULL)
+		{
+			return FALSE;
+		}
+	}
+
+	request->type = strcmp(fields[0], "BUY") == 0 ? BUY : strcmp(fields[0], "SELL") == 0 ? SELL : 0;
+	request->order_id = atoi(fields[1]);
+	request->product_index = get_product_index(fields[2], product_array, size);
+	request->quantity = atoi(fields[3]);
+	char *strdod_ptr;
+	request->price = strtod(fields[4], &strdod_ptr);
+
+	// Optional time-in-force
+	request->time_in_force = TIF_GTC;
+	request->lifetime = 0;
+	char *line = strsep(&buff, " ");
+	if (line != NULL && strcmp(line, "IOC") == 0)
+	{
+		request->time_in_force = TIF_IOC;
+		line = strsep(&buff, " ");
+	}
+	else if (line != NULL && strcmp(line, "FOK") == 0)
+	{
+		request->time_in_force = TIF_FOK;
+		line = strsep(&buff, " ");
+	}
+	else if (line != NULL && strcmp(line, "GTT") == 0)
+	{
+		line = strsep(&buff, " ");
+		request->lifetime = line == NULL ? 0 : atol(line);
+		request->time_in_force = TIF_GTT;
+		line = strsep(&buff, " ");
+	}
+	return line == NULL && check_order_request(trader, request);
+}
+
+/* Function: make_order
+ * 	----------------------------
+ *   Makes an order from a checked BUY or SELL once it is within its trader's risk limits.
+ *   An order over a limit is answered with INVALID.
+ *
+ *   request: the command's fields
+ *   sent_id: the id of the trader that sent the order
+ *   trader: the trader that sent the order
+ *   product_array: the array that stores the products as strings
+ *   returns: the order, NULL if it was rejected
+ */
+struct order_type *make_order(struct order_request *request, int sent_id, struct trader_struct *trader, char **product_array)
+{
+	char *risk_reason = check_risk_limits(&risk_book, sent_id, request->product_index, request->type, request->quantity, request->price, NULL);
+	if (risk_reason != NULL)
+	{
+		printf("%s [T%d] Order %d rejected: %s\n", LOG_PREFIX, sent_id, request->order_id, risk_reason);
+		send_invalid(trader);
+		return NULL;
+	}
+
+	struct order_type *current_order = alloc_order(&order_pool);
+	struct order_record *record = ORDER_RECORD(current_order);
+	record->trader_id = sent_id;
+	record->product_index = request->product_index;
+	record->time_in_force = request->time_in_force;
+	if (request->time_in_force == TIF_GTT)
+	{
+		record->expiry.expires = get_time_ms() + request->lifetime;
+		record->expiry.kind = TIMER_ORDER_EXPIRY;
+		record->expiry.armed = FALSE;
+	}
+	current_order->type = request->type;
+	current_order->order_id = request->order_id;
+	// Orders share the product array's name instead of keeping a copy
+	current_order->product = product_array[request->product_index];
+	current_order->quantity = request->quantity;
+	current_order->price = request->price;
+	current_order->trader = trader;
+	current_order->level = 1;
+	current_order->prev = NULL;
+	current_order->next = NULL;
+
+	trader->order_valid++;
+	record->sequence = order_sequence++;
+
+	return current_order;
+}
+
+/* Function: make_current_order
+ * 	----------------------------
+ *   Create an 'order' by populating an order_type struct. The command is checked in
+ *   full before an order record is taken for it.
+ *
+ *   size: the number of products
+ *   number_traders: the number of traders
+ *   product_array: the array that stores the products as strings
+ *   buff: the array which stores the order characters to be processed
+ *   sent_id: the id of the trader that sent the order
+ *   exchange_traders: linked list of trader_struct(s)
+ */
+struct order_type *make_current_order(int size, int number_traders, char **product_array, char *buff, int sent_id, struct trader_struct *exchange_traders)
+{
+	struct trader_struct *trader = get_trader_id(sent_id, exchange_traders, number_traders);
+	struct order_request request;
+	if (!parse_order_request(buff, trader, product_array, size, &request))
+	{
+		send_invalid(trader);
+		return NULL;
+	}
+	return make_order(&request, sent_id, trader, product_array);
+}
+
+/* Function: free_traders
+ * 	----------------------------
+ *   Frees the memory of the trader_struct(s).
+ *
+ *   number_traders: the number of traders
+ *   exchange_traders: linked list of trader_struct(s)
+ */
+void free_traders(int number_traders, struct trader_struct *exchange_traders)
+{
+	for (size_t i = 0; i < number_traders; i++)
+	{
+		struct trader_plugin *plugin = get_plugin(&(exchange_traders[i]));
+		if (plugin != NULL)
+		{
+			if (plugin->plugin_finish != NULL)
+			{
+				plugin->plugin_finish(plugin->state);
+			}
+			dlclose(plugin->handle);
+			free(plugin);
+			continue;
+		}
+		if (get_session(&(exchange_traders[i])) != NULL || get_partition_slot(&(exchange_traders[i])) != -1)
+		{
+			continue;
+		}
+		fclose(exchange_traders[i].fp_exchange_t);
+		fclose(exchange_traders[i].fp_trader_e);
+		remove(exchange_traders[i].pipe_exchange_t);
+		remove(exchange_traders[i].pipe_trader_e);
+		free(exchange_traders[i].pipe_exchange_t);
+		free(exchange_traders[i].pipe_trader_e);
+	}
+	free(exchange_traders);
+	free(plugin_host.plugins);
+}
+
+/* Function: free_order_book
+ * 	----------------------------
+ *   Frees the memory of the order book.
+ *
+ *   order_book: array of orders
+ *   size: the number of products
+ */
+void free_order_book(struct product_info *order_book, int size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		struct order_type *orders = order_book[i].first_order;
+		struct order_type *order_before;
+		while (orders != NULL)
+		{
+			order_before = orders;
+			orders = orders->next;
+			free_order(order_before);
+		}
+	}
+	free(order_book);
+}
+
+/* Function: free_product_array
+ * 	----------------------------
+ *   Frees the memory of the product array.
+ *
+ *   size: the number of products
+ *   product_array: the array that stores the products as strings
+ */
+void free_product_array(int size, char **product_array)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		free(product_array[i]);
+	}
+	free(product_array);
+}
+
+/* Function: init_position_matrix
+ * 	----------------------------
+ *   Allocates a zeroed position matrix.
+ *
+ *   matrix: the position matrix to set up
+ *   number_traders: the number of traders
+ *   size: the number of products
+ */
+void init_position_matrix(struct position_matrix *matrix, int number_traders, int size)
+{
+	matrix->number_traders = number_traders;
+	matrix->size = size;
+	matrix->quantity = calloc((size_t)number_traders * size, sizeof(int64_t));
+	matrix->cash = calloc((size_t)number_traders * size, sizeof(int64_t));
+	matrix->last_price = calloc(size, sizeof(int64_t));
+}
+
+/* Function: free_position_matrix
+ * 	----------------------------
+ *   Frees the memory of the position matrix.
+ *
+ *   matrix: the position matrix
+ */
+void free_position_matrix(struct position_matrix *matrix)
+{
+	free(matrix->quantity);
+	free(matrix->cash);
+	free(matrix->last_price);
+}
+
+/* Function: get_exchange_fee
+ * 	----------------------------
+ *   Works out the exchange fee for a fill, rounded half up to the nearest dollar
+ *   in integer arithmetic.
+ *
+ *   value: the value of the fill
+ *   returns: the exchange fee
+ */
+long int get_exchange_fee(long int value)
+{
+	return (value * FEE_PERCENT + 50) / 100;
+}
+
+/* Function: init_quote_cache
+ * 	----------------------------
+ *   Allocates an empty quote for both sides of every product.
+ *
+ *   cache: the quote cache to set up
+ *   size: the number of products
+ */
+void init_quote_cache(struct quote_cache *cache, int size)
+{
+	cache->size = size;
+	cache->bid = calloc(size, sizeof(struct book_quote));
+	cache->ask = calloc(size, sizeof(struct book_quote));
+}
+
+/* Function: free_quote_cache
+ * 	----------------------------
+ *   Frees the memory of the quote cache.
+ *
+ *   cache: the quote cache
+ */
+void free_quote_cache(struct quote_cache *cache)
+{
+	free(cache->bid);
+	free(cache->ask);
+}
+
+/* Function: init_trade_tape
+ * 	----------------------------
+ *   Sets up an empty tape for every product. Nothing is allocated unless the tape is enabled.
+ *
+ *   tape: the tape to set up
+ *   size: the number of products
+ *   enabled: whether events are sequenced and kept
+ *   exchange_traders: linked list of traders
+ *   number_traders: the number of traders
+ */
+void init_trade_tape(struct trade_tape *tape, int size, int enabled, struct trader_struct *exchange_traders, int number_traders)
+{
+	tape->size = size;
+	tape->enabled = enabled;
+	tape->traders = exchange_traders;
+	tape->number_traders = number_traders;
+	if (enabled)
+	{
+		tape->next_sequence = calloc(size, sizeof(int64_t));
+		tape->events = malloc(sizeof(struct tape_event) * TAPE_SIZE * size);
+	}
+}
+
+/* Function: free_trade_tape
+ * 	----------------------------
+ *   Frees the memory of the tape.
+ *
+ *   tape: the tape
+ */
+void free_trade_tape(struct trade_tape *tape)
+{
+	free(tape->next_sequence);
+	free(tape->events);
+}
+
+/* Function: tape_record
+ * 	----------------------------
+ *   Gives an event the product's next sequence number and keeps it on the tape,
+ *   overwriting the oldest event once the product's ring is full.
+ *
+ *   tape: the tape
+ *   event: the event, its sequence is filled in
+ *   product_index: index of the event's product
+ */
+void tape_record(struct trade_tape *tape, struct tape_event *event, int product_index)
+{
+	if (!tape->enabled)
+	{
+		event->sequence = -1;
+		return;
+	}
+	event->sequence = tape->next_sequence[product_index]++;
+	tape->events[product_index * TAPE_SIZE + (event->sequence & (TAPE_SIZE - 1))] = *event;
+}
+
+/* Function: bar_writer_thread
+ * 	----------------------------
+ *   Background thread of the bar writer. Waits for closed bars and appends them to the
+ *   bar file as CSV until it is told to stop and the queue is empty.
+ *
+ *   arg: the bar writer
+ *   returns: NULL
+ */
+void *bar_writer_thread(void *arg)
+{
+	struct bar_writer *writer = arg;
+	pthread_mutex_lock(&(writer->lock));
+	while (TRUE)
+	{
+		while (writer->number_pending == 0 && !writer->stop)
+		{
+			pthread_cond_wait(&(writer->ready), &(writer->lock));
+		}
+		if (writer->number_pending == 0)
+		{
+			break;
+		}
+
+		// Take the queued bars and leave the matcher an empty buffer
+		struct trade_bar *bars = writer->pending;
+		int number_bars = writer->number_pending;
+		int bars_size = writer->pending_size;
+		writer->pending = writer->writing;
+		writer->pending_size = writer->writing_size;
+		writer->number_pending = 0;
+		writer->writing = bars;
+		writer->writing_size = bars_size;
+		pthread_mutex_unlock(&(writer->lock));
+
+		for (int i = 0; i < number_bars; i++)
+		{
+			struct trade_bar *bar = &(bars[i]);
+			fprintf(writer->fp, "%" PRId64 ",%s,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%.4f,%" PRId64 "\n",
+					bar->start, writer->product_array[bar->product_index], bar->open, bar->high, bar->low, bar->close,
+					bar->volume, (double)bar->notional / bar->volume, bar->trades);
+		}
+		fflush(writer->fp);
+		pthread_mutex_lock(&(writer->lock));
+	}
+	pthread_mutex_unlock(&(writer->lock));
+	return NULL;
+}
+
+/* Function: init_bar_writer
+ * 	----------------------------
+ *   Opens the bar file and starts the background thread that writes it.
+ *
+ *   writer: the bar writer to set up
+ *   file_name: path of the bar file, NULL to leave bars off
+ *   interval: bar length in milliseconds
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ */
+void init_bar_writer(struct bar_writer *writer, char *file_name, int64_t interval, char **product_array, int size)
+{
+	writer->enabled = FALSE;
+	if (file_name == NULL || interval <= 0)
+	{
+		return;
+	}
+	writer->fp = fopen(file_name, "w");
+	if (writer->fp == NULL)
+	{
+		perror("fopen failed bar file");
+		return;
+	}
+	fprintf(writer->fp, "start_ms,product,open,high,low,close,volume,vwap,trades\n");
+
+	writer->size = size;
+	writer->interval = interval;
+	writer->product_array = product_array;
+	writer->current = calloc(size, sizeof(struct trade_bar));
+	writer->pending_size = size;
+	writer->pending = malloc(sizeof(struct trade_bar) * writer->pending_size);
+	writer->number_pending = 0;
+	writer->writing_size = size;
+	writer->writing = malloc(sizeof(struct trade_bar) * writer->writing_size);
+	writer->stop = FALSE;
+	pthread_mutex_init(&(writer->lock), NULL);
+	pthread_cond_init(&(writer->ready), NULL);
+	pthread_create(&(writer->thread), NULL, bar_writer_thread, writer);
+	writer->enabled = TRUE;
+}
+
+/* Function: queue_bar
+ * 	----------------------------
+ *   Hands a closed bar to the background thread.
+ *
+ *   writer: the bar writer
+ *   bar: the closed bar
+ */
+void queue_bar(struct bar_writer *writer, struct trade_bar *bar)
+{
+	pthread_mutex_lock(&(writer->lock));
+	if (writer->number_pending == writer->pending_size)
+	{
+		writer->pending_size *= 2;
+		writer->pending = realloc(writer->pending, sizeof(struct trade_bar) * writer->pending_size);
+	}
+	writer->pending[writer->number_pending++] = *bar;
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+}
+
+/* Function: bar_add_trade
+ * 	----------------------------
+ *   Adds a trade to its product's bar, first closing the bar if the trade falls in a
+ *   later interval. Intervals without trades get no bar.
+ *
+ *   writer: the bar writer
+ *   product_index: index of the traded product
+ *   quantity: quantity traded
+ *   price: price traded at
+ *   now: wall clock time of the trade in ms
+ */
+void bar_add_trade(struct bar_writer *writer, int product_index, int64_t quantity, int64_t price, int64_t now)
+{
+	struct trade_bar *bar = &(writer->current[product_index]);
+	if (bar->trades > 0 && now >= bar->start + writer->interval)
+	{
+		queue_bar(writer, bar);
+		bar->trades = 0;
+	}
+	if (bar->trades == 0)
+	{
+		bar->start = now - now % writer->interval;
+		bar->open = price;
+		bar->high = price;
+		bar->low = price;
+		bar->volume = 0;
+		bar->notional = 0;
+		bar->product_index = product_index;
+	}
+
+	bar->high = price > bar->high ? price : bar->high;
+	bar->low = price < bar->low ? price : bar->low;
+	bar->close = price;
+	bar->volume += quantity;
+	bar->notional += quantity * price;
+	bar->trades++;
+}
+
+/* Function: bar_flush_stale
+ * 	----------------------------
+ *   Queues the bars whose interval is over, so that a product that stops trading
+ *   still gets its last bar written on time.
+ *
+ *   writer: the bar writer
+ *   now: wall clock time in ms
+ */
+void bar_flush_stale(struct bar_writer *writer, int64_t now)
+{
+	for (int i = 0; i < writer->size; i++)
+	{
+		struct trade_bar *bar = &(writer->current[i]);
+		if (bar->trades > 0 && now >= bar->start + writer->interval)
+		{
+			queue_bar(writer, bar);
+			bar->trades = 0;
+		}
+	}
+}
+
+/* Function: free_bar_writer
+ * 	----------------------------
+ *   Queues the bars still open, waits for the background thread to write everything
+ *   and closes the bar file.
+ *
+ *   writer: the bar writer
+ */
+void free_bar_writer(struct bar_writer *writer)
+{
+	if (!writer->enabled)
+	{
+		return;
+	}
+	for (int i = 0; i < writer->size; i++)
+	{
+		if (writer->current[i].trades > 0)
+		{
+			queue_bar(writer, &(writer->current[i]));
+		}
+	}
+	pthread_mutex_lock(&(writer->lock));
+	writer->stop = TRUE;
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+	pthread_join(writer->thread, NULL);
+
+	fclose(writer->fp);
+	free(writer->current);
+	free(writer->pending);
+	free(writer->writing);
+	pthread_mutex_destroy(&(writer->lock));
+	pthread_cond_destroy(&(writer->ready));
+}
+
+/* Function: alloc_archive_chunk
+ * 	----------------------------
+ *   Allocates an empty chunk, its columns in one block.
+ *
+ *   returns: the chunk
+ */
+struct archive_chunk *alloc_archive_chunk()
+{
+	struct archive_chunk *chunk = malloc(sizeof(struct archive_chunk));
+	chunk->columns[0] = malloc(sizeof(int64_t) * ARCHIVE_CHUNK * SPX_ARCHIVE_COLUMNS);
+	for (int i = 1; i < SPX_ARCHIVE_COLUMNS; i++)
+	{
+		chunk->columns[i] = chunk->columns[0] + i * ARCHIVE_CHUNK;
+	}
+	chunk->rows = 0;
+	chunk->next = NULL;
+	return chunk;
+}
+
+/* Function: bit_width
+ * 	----------------------------
+ *   Bits needed to store an unsigned number.
+ *
+ *   value: the number
+ *   returns: 0 to 64
+ */
+int bit_width(uint64_t value)
+{
+	return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+/* Function: encode_column
+ * 	----------------------------
+ *   Bit packs a column as offsets from its minimum or as deltas from the previous row,
+ *   whichever is narrower.
+ *
+ *   values: the column
+ *   rows: number of rows
+ *   column: set to the column's encoding, width, base and first value
+ *   words: room for rows 64-bit words, set to the packed column
+ *   returns: number of words used
+ */
+int encode_column(int64_t *values, int rows, struct spx_archive_column *column, uint64_t *words)
+{
+	int64_t low = values[0];
+	int64_t high = values[0];
+	int64_t delta_low = 0;
+	int64_t delta_high = 0;
+	for (int i = 1; i < rows; i++)
+	{
+		int64_t delta = (int64_t)((uint64_t)values[i] - (uint64_t)values[i - 1]);
+		low = values[i] < low ? values[i] : low;
+		high = values[i] > high ? values[i] : high;
+		delta_low = i == 1 || delta < delta_low ? delta : delta_low;
+		delta_high = i == 1 || delta > delta_high ? delta : delta_high;
+	}
+	int width = bit_width((uint64_t)high - (uint64_t)low);
+	int delta_width = bit_width((uint64_t)delta_high - (uint64_t)delta_low);
+	column->first = values[0];
+	if (delta_width < width)
+	{
+		column->encoding = SPX_ARCHIVE_DELTA;
+		column->width = delta_width;
+		column->base = delta_low;
+	}
+	else
+	{
+		column->encoding = SPX_ARCHIVE_PACKED;
+		column->width = width;
+		column->base = low;
+	}
+
+	int number_words = (int)(((int64_t)rows * column->width + 63) / 64);
+	memset(words, 0, sizeof(uint64_t) * number_words);
+	if (column->width == 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i < rows; i++)
+	{
+		uint64_t packed;
+		if (column->encoding == SPX_ARCHIVE_PACKED)
+		{
+			packed = (uint64_t)values[i] - (uint64_t)column->base;
+		}
+		else
+		{
+			packed = i == 0 ? 0 : (uint64_t)values[i] - (uint64_t)values[i - 1] - (uint64_t)column->base;
+		}
+		uint64_t bit = (uint64_t)i * column->width;
+		int shift = bit & 63;
+		words[bit >> 6] |= packed << shift;
+		if (shift + column->width > 64)
+		{
+			words[(bit >> 6) + 1] |= packed >> (64 - shift);
+		}
+	}
+	return number_words;
+}
+
+/* Function: write_archive_chunk
+ * 	----------------------------
+ *   Encodes a chunk and appends it to the archive: the chunk header with its column
+ *   table first, then every column.
+ *
+ *   writer: the archive writer
+ *   chunk: the chunk, with at least one row
+ */
+void write_archive_chunk(struct archive_writer *writer, struct archive_chunk *chunk)
+{
+	struct spx_archive_chunk header;
+	memset(&header, 0, sizeof(struct spx_archive_chunk));
+	memcpy(header.magic, SPX_ARCHIVE_CHUNK_MAGIC, sizeof(header.magic));
+	header.rows = chunk->rows;
+	header.number_columns = SPX_ARCHIVE_COLUMNS;
+	header.first_time = chunk->columns[SPX_ARCHIVE_TIME][0];
+	header.last_time = chunk->columns[SPX_ARCHIVE_TIME][chunk->rows - 1];
+
+	// Columns go into words one after another, the header is written in front of them
+	uint64_t *words = writer->words;
+	uint64_t offset = writer->offset + sizeof(struct spx_archive_chunk);
+	int used = 0;
+	for (int i = 0; i < SPX_ARCHIVE_COLUMNS; i++)
+	{
+		int number_words = encode_column(chunk->columns[i], chunk->rows, &(header.columns[i]), words + used);
+		header.columns[i].offset = offset + used * sizeof(uint64_t);
+		header.columns[i].length = number_words * sizeof(uint64_t);
+		used += number_words;
+	}
+	header.length = sizeof(struct spx_archive_chunk) + used * sizeof(uint64_t);
+	fwrite(&header, sizeof(struct spx_archive_chunk), 1, writer->fp);
+	fwrite(words, sizeof(uint64_t), used, writer->fp);
+	writer->offset += header.length;
+}
+
+/* Function: archive_thread
+ * 	----------------------------
+ *   Background thread of the archive writer. Writes the queued chunks in order until it
+ *   is told to stop and the queue is empty.
+ *
+ *   arg: the archive writer
+ *   returns: NULL
+ */
+void *archive_thread(void *arg)
+{
+	struct archive_writer *writer = arg;
+	pthread_mutex_lock(&(writer->lock));
+	while (TRUE)
+	{
+		while (writer->full == NULL && !writer->stop)
+		{
+			pthread_cond_wait(&(writer->ready), &(writer->lock));
+		}
+		if (writer->full == NULL)
+		{
+			break;
+		}
+		struct archive_chunk *chunk = writer->full;
+		writer->full = chunk->next;
+		if (writer->full == NULL)
+		{
+			writer->full_tail = NULL;
+		}
+		pthread_mutex_unlock(&(writer->lock));
+
+		write_archive_chunk(writer, chunk);
+		fflush(writer->fp);
+		chunk->rows = 0;
+
+		pthread_mutex_lock(&(writer->lock));
+		chunk->next = writer->spare;
+		writer->spare = chunk;
+	}
+	pthread_mutex_unlock(&(writer->lock));
+	return NULL;
+}
+
+/* Function: init_archive
+ * 	----------------------------
+ *   Opens the archive, writes its header and product names and starts the background
+ *   thread that writes it.
+ *
+ *   writer: the archive writer to set up
+ *   path: path of the archive
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ */
+void init_archive(struct archive_writer *writer, char *path, char **product_array, int size)
+{
+	writer->enabled = FALSE;
+	writer->fp = fopen(path, "w");
+	if (writer->fp == NULL)
+	{
+		perror("fopen failed archive");
+		return;
+	}
+	struct spx_archive_header header;
+	memset(&header, 0, sizeof(struct spx_archive_header));
+	memcpy(header.magic, SPX_ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = SPX_ARCHIVE_VERSION;
+	header.number_products = size;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.start = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	fwrite(&header, sizeof(struct spx_archive_header), 1, writer->fp);
+	for (int i = 0; i < size; i++)
+	{
+		char name[SPX_ARCHIVE_PRODUCT] = {0};
+		strncpy(name, product_array[i], SPX_ARCHIVE_PRODUCT - 1);
+		fwrite(name, SPX_ARCHIVE_PRODUCT, 1, writer->fp);
+	}
+	writer->offset = sizeof(struct spx_archive_header) + (uint64_t)size * SPX_ARCHIVE_PRODUCT;
+	writer->start = get_time_ns();
+
+	writer->current = alloc_archive_chunk();
+	writer->full = NULL;
+	writer->full_tail = NULL;
+	writer->spare = alloc_archive_chunk();
+	writer->words = malloc(sizeof(uint64_t) * ARCHIVE_CHUNK * SPX_ARCHIVE_COLUMNS);
+	writer->stop = FALSE;
+	pthread_mutex_init(&(writer->lock), NULL);
+	pthread_cond_init(&(writer->ready), NULL);
+	pthread_create(&(writer->thread), NULL, archive_thread, writer);
+	writer->enabled = TRUE;
+}
+
+/* Function: queue_archive_chunk
+ * 	----------------------------
+ *   Hands the matcher's chunk to the background thread and takes a spare in its place,
+ *   or a new one if the thread has none to give back yet.
+ *
+ *   writer: the archive writer
+ */
+void queue_archive_chunk(struct archive_writer *writer)
+{
+	struct archive_chunk *chunk = writer->current;
+	pthread_mutex_lock(&(writer->lock));
+	chunk->next = NULL;
+	if (writer->full_tail == NULL)
+	{
+		writer->full = chunk;
+	}
+	else
+	{
+		writer->full_tail->next = chunk;
+	}
+	writer->full_tail = chunk;
+	writer->current = writer->spare;
+	if (writer->spare != NULL)
+	{
+		writer->spare = writer->spare->next;
+	}
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+	if (writer->current == NULL)
+	{
+		writer->current = alloc_archive_chunk();
+	}
+}
+
+/* Function: archive_row
+ * 	----------------------------
+ *   Adds a row to the archive.
+ *
+ *   writer: the archive writer
+ *   kind: SPX_ARCHIVE_NEW, SPX_ARCHIVE_AMEND, SPX_ARCHIVE_CANCEL or SPX_ARCHIVE_FILL
+ *   order: the order of the event, the aggressor of a fill
+ *   price: price of the event
+ *   quantity: quantity of the event
+ *   contra_trader: trader of the resting order of a fill, -1 for an order event
+ *   contra_order: id of the resting order of a fill, -1 for an order event
+ *   now: get_time_ns time of the event
+ */
+void archive_row(struct archive_writer *writer, int kind, struct order_type *order, int64_t price, int64_t quantity, int contra_trader, int contra_order, int64_t now)
+{
+	struct archive_chunk *chunk = writer->current;
+	int row = chunk->rows++;
+	chunk->columns[SPX_ARCHIVE_TIME][row] = now - writer->start;
+	chunk->columns[SPX_ARCHIVE_KIND][row] = kind;
+	chunk->columns[SPX_ARCHIVE_TRADER][row] = ORDER_TRADER_ID(order);
+	chunk->columns[SPX_ARCHIVE_ORDER][row] = order->order_id;
+	chunk->columns[SPX_ARCHIVE_PRODUCT_INDEX][row] = ORDER_RECORD(order)->product_index;
+	chunk->columns[SPX_ARCHIVE_SIDE][row] = order->type;
+	chunk->columns[SPX_ARCHIVE_PRICE][row] = price;
+	chunk->columns[SPX_ARCHIVE_QUANTITY][row] = quantity;
+	chunk->columns[SPX_ARCHIVE_CONTRA_TRADER][row] = contra_trader;
+	chunk->columns[SPX_ARCHIVE_CONTRA_ORDER][row] = contra_order;
+	if (chunk->rows == ARCHIVE_CHUNK)
+	{
+		queue_archive_chunk(writer);
+	}
+}
+
+/* Function: archive_order
+ * 	----------------------------
+ *   Adds an order event to the archive, if there is one.
+ *
+ *   kind: SPX_ARCHIVE_NEW, SPX_ARCHIVE_AMEND or SPX_ARCHIVE_CANCEL
+ *   order: the order, as it is after the event
+ */
+void archive_order(int kind, struct order_type *order)
+{
+	if (archive.enabled)
+	{
+		archive_row(&archive, kind, order, order->price, order->quantity, -1, -1, get_time_ns());
+	}
+}
+
+/* Function: free_archive
+ * 	----------------------------
+ *   Queues the last rows, waits for the background thread to write everything and
+ *   closes the archive.
+ *
+ *   writer: the archive writer
+ */
+void free_archive(struct archive_writer *writer)
+{
+	if (!writer->enabled)
+	{
+		return;
+	}
+	if (writer->current->rows > 0)
+	{
+		queue_archive_chunk(writer);
+	}
+	pthread_mutex_lock(&(writer->lock));
+	writer->stop = TRUE;
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+	pthread_join(writer->thread, NULL);
+
+	fclose(writer->fp);
+	struct archive_chunk *chunk = writer->spare;
+	while (chunk != NULL)
+	{
+		struct archive_chunk *next = chunk->next;
+		free(chunk->columns[0]);
+		free(chunk);
+		chunk = next;
+	}
+	free(writer->current->columns[0]);
+	free(writer->current);
+	free(writer->words);
+	pthread_mutex_destroy(&(writer->lock));
+	pthread_cond_destroy(&(writer->ready));
+	writer->enabled = FALSE;
+}
+
+/* Function: checkpoint_thread
+ * 	----------------------------
+ *   Writer thread of the checkpointer. Writes each pending image to the temporary file,
+ *   syncs it and renames it over the checkpoint.
+ *
+ *   arg: the checkpointer
+ */
+void *checkpoint_thread(void *arg)
+{
+	struct checkpointer *writer = arg;
+	pthread_mutex_lock(&(writer->lock));
+	while (TRUE)
+	{
+		while (writer->pending == NULL && !writer->stop)
+		{
+			pthread_cond_wait(&(writer->ready), &(writer->lock));
+		}
+		if (writer->pending == NULL)
+		{
+			break;
+		}
+		char *image = writer->pending;
+		int64_t length = writer->pending_length;
+		writer->pending = NULL;
+		pthread_mutex_unlock(&(writer->lock));
+
+		int fd = open(writer->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int64_t written = 0;
+		while (fd != -1 && written < length)
+		{
+			ssize_t result = write(fd, image + written, length - written);
+			if (result == -1)
+			{
+				break;
+			}
+			written += result;
+		}
+		if (fd == -1 || written < length || fsync(fd) == -1 || rename(writer->temp_path, writer->path) == -1)
+		{
+			perror("checkpoint write failed");
+		}
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		free(image);
+		pthread_mutex_lock(&(writer->lock));
+	}
+	pthread_mutex_unlock(&(writer->lock));
+	return NULL;
+}
+
+/* Function: init_checkpointer
+ * 	----------------------------
+ *   Starts the checkpoint writer thread and arms the checkpoint timer.
+ *
+ *   writer: the checkpointer
+ *   path: the checkpoint file
+ *   interval: milliseconds between checkpoints
+ */
+void init_checkpointer(struct checkpointer *writer, char *path, int64_t interval)
+{
+	writer->path = path;
+	writer->temp_path = malloc(strlen(path) + strlen(".tmp") + 1);
+	sprintf(writer->temp_path, "%s.tmp", path);
+	writer->interval = interval > 0 ? interval : CHECKPOINT_INTERVAL_DEFAULT;
+	writer->due = FALSE;
+	writer->pending = NULL;
+	writer->pending_length = 0;
+	writer->stop = FALSE;
+	pthread_mutex_init(&(writer->lock), NULL);
+	pthread_cond_init(&(writer->ready), NULL);
+	pthread_create(&(writer->thread), NULL, checkpoint_thread, writer);
+
+	memset(&(writer->timer), 0, sizeof(struct timer_node));
+	writer->timer.kind = TIMER_CHECKPOINT;
+	writer->timer.expires = get_time_ms() + writer->interval;
+	timer_wheel_add(&timer_wheel, &(writer->timer));
+	writer->enabled = TRUE;
+}
+
+/* Function: capture_checkpoint
+ * 	----------------------------
+ *   Copies the order books, positions, order_valid counters and the exchange fee into a
+ *   checkpoint image and hands it to the writer thread.
+ *
+ *   writer: the checkpointer
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ *   number_traders: the number of traders
+ *   exchange_traders: array of trader_struct(s)
+ *   exchange_fee: the fees collected so far
+ */
+void capture_checkpoint(struct checkpointer *writer, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders, long int exchange_fee)
+{
+	struct checkpoint_header header;
+	memset(&header, 0, sizeof(struct checkpoint_header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.size = size;
+	header.number_traders = number_traders;
+	header.product_size = PRODUCT_SIZE;
+	header.journal_sequence = journal.sequence;
+	header.exchange_fee = exchange_fee;
+	header.order_sequence = order_sequence;
+	for (int i = 0; i < size; i++)
+	{
+		header.number_orders += order_book[i].buy + order_book[i].sell;
+	}
+	int64_t cells = (int64_t)number_traders * size;
+	header.products_offset = CHECKPOINT_ALIGN(sizeof(struct checkpoint_header));
+	header.books_offset = CHECKPOINT_ALIGN(header.products_offset + (int64_t)size * PRODUCT_SIZE);
+	header.order_valid_offset = header.books_offset + size * sizeof(struct checkpoint_book);
+	header.quantity_offset = CHECKPOINT_ALIGN(header.order_valid_offset + number_traders * sizeof(int32_t));
+	header.cash_offset = header.quantity_offset + cells * sizeof(int64_t);
+	header.last_price_offset = header.cash_offset + cells * sizeof(int64_t);
+	header.orders_offset = header.last_price_offset + size * sizeof(int64_t);
+	header.length = header.orders_offset + header.number_orders * sizeof(struct checkpoint_order);
+
+	char *image = calloc(1, header.length);
+	memcpy(image, &header, sizeof(struct checkpoint_header));
+	for (int i = 0; i < size; i++)
+	{
+		strncpy(image + header.products_offset + (int64_t)i * PRODUCT_SIZE, product_array[i], PRODUCT_SIZE - 1);
+	}
+	int32_t *order_valid = (int32_t *)(image + header.order_valid_offset);
+	for (int i = 0; i < number_traders; i++)
+	{
+		order_valid[i] = exchange_traders[i].order_valid;
+	}
+	memcpy(image + header.quantity_offset, position_book.quantity, cells * sizeof(int64_t));
+	memcpy(image + header.cash_offset, position_book.cash, cells * sizeof(int64_t));
+	memcpy(image + header.last_price_offset, position_book.last_price, size * sizeof(int64_t));
+
+	// The order list is already in price-time order, sells then buys
+	struct checkpoint_book *books = (struct checkpoint_book *)(image + header.books_offset);
+	struct checkpoint_order *orders = (struct checkpoint_order *)(image + header.orders_offset);
+	int64_t now = get_time_ms();
+	int64_t number_orders = 0;
+	for (int i = 0; i < size; i++)
+	{
+		books[i].first = number_orders;
+		books[i].buy = order_book[i].buy;
+		books[i].sell = order_book[i].sell;
+		for (struct order_type *node = order_book[i].first_order; node != NULL; node = node->next)
+		{
+			struct order_record *record = ORDER_RECORD(node);
+			struct checkpoint_order *order = &(orders[number_orders++]);
+			order->trader_id = record->trader_id;
+			order->order_id = node->order_id;
+			order->type = node->type;
+			order->time_in_force = record->time_in_force;
+			order->quantity = node->quantity;
+			order->price = node->price;
+			order->sequence = record->sequence;
+			order->expires_in = record->time_in_force == TIF_GTT ? record->expiry.expires - now : 0;
+		}
+	}
+
+	pthread_mutex_lock(&(writer->lock));
+	free(writer->pending);
+	writer->pending = image;
+	writer->pending_length = header.length;
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+}
+
+/* Function: free_checkpointer
+ * 	----------------------------
+ *   Waits for the writer thread to write the last checkpoint and stops it.
+ *
+ *   writer: the checkpointer
+ */
+void free_checkpointer(struct checkpointer *writer)
+{
+	if (!writer->enabled)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(writer->lock));
+	writer->stop = TRUE;
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+	pthread_join(writer->thread, NULL);
+
+	free(writer->temp_path);
+	pthread_mutex_destroy(&(writer->lock));
+	pthread_cond_destroy(&(writer->ready));
+	writer->enabled = FALSE;
+}
+
+/* Function: get_quote
+ * 	----------------------------
+ *   Returns the cached quote for the side of the book an order rests on.
+ *
+ *   cache: the quote cache
+ *   order: an order of the product
+ *   returns: best bid for a buy order, best ask for a sell order
+ */
+struct book_quote *get_quote(struct quote_cache *cache, struct order_type *order)
+{
+	int product_index = ORDER_RECORD(order)->product_index;
+	return order->type == BUY ? &(cache->bid[product_index]) : &(cache->ask[product_index]);
+}
+
+/* Function: refresh_quote
+ * 	----------------------------
+ *   Rebuilds one side's quote once its best level has emptied, from the new best level
+ *   of the price ladder or of the level book.
+ *
+ *   quote: the quote to rebuild
+ *   ladder: the product's price ladder, NULL for the general ladder
+ *   product_index: the product
+ *   type: BUY or SELL
+ */
+void refresh_quote(struct book_quote *quote, struct price_ladder *ladder, int product_index, int type)
+{
+	if (ladder != NULL)
+	{
+		int best = ladder_best(ladder, type);
+		quote->quantity = best == -1 ? 0 : ladder->side[LADDER_SIDE(type)][best].quantity;
+		quote->orders = best == -1 ? 0 : ladder->side[LADDER_SIDE(type)][best].orders;
+		quote->price = ladder->base + best * ladder->tick;
+		return;
+	}
+
+	struct list_level *level = *get_list_levels(product_index, type);
+	quote->quantity = level == NULL ? 0 : level->quantity;
+	quote->orders = level == NULL ? 0 : level->orders;
+	if (level != NULL)
+	{
+		quote->price = level->price;
+	}
+}
+
+/* Function: init_depth_feed
+ * 	----------------------------
+ *   Creates the shared memory region of the depth feed with an empty snapshot per product.
+ *
+ *   feed: the depth feed to set up
+ *   name: the shared memory object name
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ *   number_traders: the number of traders
+ *   returns: 0 on success, -1 if the region could not be created
+ */
+int init_depth_feed(struct depth_feed *feed, char *name, char **product_array, int size, int number_traders)
+{
+	size_t length = sizeof(struct spx_depth_header) + sizeof(struct spx_depth_snapshot) * size;
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		perror("shm_open failed");
+		return -1;
+	}
+	if (ftruncate(fd, length) == -1)
+	{
+		perror("ftruncate failed");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED)
+	{
+		perror("mmap failed");
+		shm_unlink(name);
+		return -1;
+	}
+
+	feed->name = name;
+	feed->length = length;
+	feed->size = size;
+	feed->header = region;
+	feed->snapshots = (struct spx_depth_snapshot *)(feed->header + 1);
+	feed->dirty = calloc(size, sizeof(int));
+	feed->subscribed = calloc(number_traders, sizeof(int));
+	for (int i = 0; i < size; i++)
+	{
+		strncpy(feed->snapshots[i].product, product_array[i], SPX_DEPTH_PRODUCT - 1);
+	}
+	feed->header->levels = SPX_DEPTH_LEVELS;
+	// Readers treat a region with no products as not ready yet
+	__atomic_store_n(&(feed->header->products), size, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Function: free_depth_feed
+ * 	----------------------------
+ *   Unmaps and removes the depth feed region.
+ *
+ *   feed: the depth feed
+ */
+void free_depth_feed(struct depth_feed *feed)
+{
+	if (feed->header == NULL)
+	{
+		return;
+	}
+	munmap(feed->header, feed->length);
+	shm_unlink(feed->name);
+	free(feed->dirty);
+	free(feed->subscribed);
+}
+
+/* Function: init_drop_copy
+ * 	----------------------------
+ *   Creates the shared memory region of the drop-copy feed.
+ *
+ *   copy: the drop-copy feed to set up
+ *   name: the shared memory object name
+ *   returns: 0 on success, -1 if the region could not be created
+ */
+int init_drop_copy(struct drop_copy *copy, char *name)
+{
+	size_t length = sizeof(struct spx_drop_copy_header) + sizeof(struct spx_execution) * SPX_DROP_COPY_RECORDS;
+	int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		perror("shm_open failed drop copy");
+		return -1;
+	}
+	if (ftruncate(fd, length) == -1)
+	{
+		perror("ftruncate failed drop copy");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED)
+	{
+		perror("mmap failed drop copy");
+		shm_unlink(name);
+		return -1;
+	}
+
+	copy->name = name;
+	copy->length = length;
+	copy->header = region;
+	copy->records = (struct spx_execution *)(copy->header + 1);
+	copy->sequence = 0;
+	copy->header->capacity = SPX_DROP_COPY_RECORDS;
+	// Consumers treat a region without a version as not ready yet
+	__atomic_store_n(&(copy->header->version), SPX_DROP_COPY_VERSION, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Function: drop_copy_fill
+ * 	----------------------------
+ *   Writes an execution record for a fill into the drop-copy ring. Never waits: a
+ *   consumer that has fallen a whole ring behind loses the oldest records.
+ *
+ *   copy: the drop-copy feed
+ *   execution: the fill, its sequence and time are filled in here
+ */
+void drop_copy_fill(struct drop_copy *copy, struct spx_execution *execution)
+{
+	// Replayed fills were sent by the session that journaled them
+	if (copy->header == NULL || journal.replaying)
+	{
+		return;
+	}
+	copy->sequence++;
+	struct spx_execution *record = &(copy->records[(copy->sequence - 1) & (SPX_DROP_COPY_RECORDS - 1)]);
+	__atomic_store_n(&(record->sequence), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	record->time = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	record->buy_trader = execution->buy_trader;
+	record->buy_order = execution->buy_order;
+	record->sell_trader = execution->sell_trader;
+	record->sell_order = execution->sell_order;
+	record->product_index = execution->product_index;
+	record->aggressor = execution->aggressor;
+	record->price = execution->price;
+	record->quantity = execution->quantity;
+	record->fee = execution->fee;
+
+	__atomic_store_n(&(record->sequence), copy->sequence, __ATOMIC_RELEASE);
+	__atomic_store_n(&(copy->header->written), copy->sequence, __ATOMIC_RELEASE);
+}
+
+/* Function: free_drop_copy
+ * 	----------------------------
+ *   Marks the drop-copy feed closed, then unmaps and removes it. A consumer that has
+ *   it mapped can still read what is left.
+ *
+ *   copy: the drop-copy feed
+ */
+void free_drop_copy(struct drop_copy *copy)
+{
+	if (copy->header == NULL)
+	{
+		return;
+	}
+	__atomic_store_n(&(copy->header->closed), TRUE, __ATOMIC_RELEASE);
+	munmap(copy->header, copy->length);
+	shm_unlink(copy->name);
+	copy->header = NULL;
+}
+
+/* Function: publish_depth_side
+ * 	----------------------------
+ *   Copies the best price levels of one side of a product into its snapshot, from the
+ *   price ladder or the level book, which already keep them aggregated.
+ *
+ *   side: the snapshot levels of that side
+ *   levels: set to the number of levels written
+ *   product_index: the product
+ *   type: BUY or SELL
+ */
+void publish_depth_side(struct spx_depth_level *side, int32_t *levels, int product_index, int type)
+{
+	int count = 0;
+	struct price_ladder *ladder = get_ladder(product_index);
+	if (ladder != NULL)
+	{
+		int level = ladder_best(ladder, type);
+		while (level != -1 && count < SPX_DEPTH_LEVELS)
+		{
+			struct ladder_level *ladder_level = &(ladder->side[LADDER_SIDE(type)][level]);
+			side[count].price = ladder->base + level * ladder->tick;
+			side[count].quantity = ladder_level->quantity;
+			side[count].orders = ladder_level->orders;
+			count++;
+			level = type == BUY ? ladder_scan_down(ladder, LADDER_SIDE(type), level - 1) : ladder_scan_up(ladder, LADDER_SIDE(type), level + 1);
+		}
+	}
+	else
+	{
+		for (struct list_level *level = *get_list_levels(product_index, type); level != NULL && count < SPX_DEPTH_LEVELS; level = level->next)
+		{
+			side[count].price = level->price;
+			side[count].quantity = level->quantity;
+			side[count].orders = level->orders;
+			count++;
+		}
+	}
+	*levels = count;
+}
+
+/* Function: publish_depth
+ * 	----------------------------
+ *   Rewrites one product's snapshot from its price levels under the snapshot's seqlock.
+ *
+ *   snapshot: the product's snapshot in the depth feed
+ *   product_index: the product
+ */
+void publish_depth(struct spx_depth_snapshot *snapshot, int product_index)
+{
+	uint32_t sequence = snapshot->sequence;
+	__atomic_store_n(&(snapshot->sequence), sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	publish_depth_side(snapshot->ask, &(snapshot->sell_levels), product_index, SELL);
+	publish_depth_side(snapshot->bid, &(snapshot->buy_levels), product_index, BUY);
+
+	__atomic_store_n(&(snapshot->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Function: publish_depth_feed
+ * 	----------------------------
+ *   Republishes every product whose orderbook changed since the last publish.
+ *
+ *   feed: the depth feed
+ */
+void publish_depth_feed(struct depth_feed *feed)
+{
+	if (feed->header == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < feed->size; i++)
+	{
+		if (feed->dirty[i])
+		{
+			publish_depth(&(feed->snapshots[i]), i);
+			feed->dirty[i] = FALSE;
+		}
+	}
+}
+
+/* Function: mark_depth_dirty
+ * 	----------------------------
+ *   Marks the product of an order for republishing.
+ *
+ *   feed: the depth feed
+ *   order: the order that changed
+ */
+void mark_depth_dirty(struct depth_feed *feed, struct order_type *order)
+{
+	if (feed->header != NULL)
+	{
+		feed->dirty[ORDER_RECORD(order)->product_index] = TRUE;
+	}
+}
+
+/* Function: depth_subscribed
+ * 	----------------------------
+ *   Whether a trader reads the depth feed instead of receiving MARKET messages.
+ *
+ *   feed: the depth feed
+ *   trader_id: the trader
+ */
+int depth_subscribed(struct depth_feed *feed, int trader_id)
+{
+	return feed->header != NULL && feed->subscribed[trader_id];
+}
+
+/* Function: book_order_added
+ * 	----------------------------
+ *   Called once an order rests in the order book.
+ *
+ *   product_node: product_info for the product orderbook
+ *   order: the order that was added
+ */
+void book_order_added(struct product_info *product_node, struct order_type *order)
+{
+	struct price_ladder *ladder = get_ladder(ORDER_RECORD(order)->product_index);
+	if (ladder != NULL)
+	{
+		ladder_order_added(ladder, order);
+	}
+	else
+	{
+		list_order_added(order);
+	}
+	update_risk_exposure(&risk_book, order, order->quantity, 1);
+	mark_depth_dirty(&depth_feed, order);
+	if (ORDER_RECORD(order)->time_in_force == TIF_GTT)
+	{
+		timer_wheel_add(&timer_wheel, &(ORDER_RECORD(order)->expiry));
+	}
+
+	struct book_quote *quote = get_quote(&quote_cache, order);
+	if (quote->orders == 0 || (order->type == BUY && order->price > quote->price) || (order->type == SELL && order->price < quote->price))
+	{
+		quote->price = order->price;
+		quote->quantity = order->quantity;
+		quote->orders = 1;
+	}
+	else if (order->price == quote->price)
+	{
+		quote->quantity += order->quantity;
+		quote->orders++;
+	}
+}
+
+/* Function: book_order_filled
+ * 	----------------------------
+ *   Called when a resting order is partly or fully filled, before its quantity is reduced.
+ *
+ *   product_node: product_info for the product orderbook
+ *   order: the resting order
+ *   quantity: the quantity filled
+ */
+void book_order_filled(struct product_info *product_node, struct order_type *order, long int quantity)
+{
+	struct price_ladder *ladder = get_ladder(ORDER_RECORD(order)->product_index);
+	if (ladder != NULL)
+	{
+		ladder->side[LADDER_SIDE(order->type)][LADDER_LEVEL(ladder, order->price)].quantity -= quantity;
+	}
+	else
+	{
+		list_order_reduced(order, quantity, FALSE);
+	}
+	update_risk_exposure(&risk_book, order, -quantity, 0);
+	mark_depth_dirty(&depth_feed, order);
+
+	struct book_quote *quote = get_quote(&quote_cache, order);
+	if (order->price == quote->price)
+	{
+		quote->quantity -= quantity;
+	}
+}
+
+/* Function: book_order_removed
+ * 	----------------------------
+ *   Called once an order has been taken out of the order book, with whatever quantity it had left.
+ *
+ *   product_node: product_info for the product orderbook
+ *   order: the order that was removed
+ */
+void book_order_removed(struct product_info *product_node, struct order_type *order)
+{
+	struct price_ladder *ladder = get_ladder(ORDER_RECORD(order)->product_index);
+	if (ladder != NULL)
+	{
+		ladder_order_removed(ladder, order);
+	}
+	else
+	{
+		list_order_reduced(order, order->quantity, TRUE);
+	}
+	update_risk_exposure(&risk_book, order, -order->quantity, -1);
+	mark_depth_dirty(&depth_feed, order);
+	if (ORDER_RECORD(order)->time_in_force == TIF_GTT)
+	{
+		timer_wheel_cancel(&timer_wheel, &(ORDER_RECORD(order)->expiry));
+	}
+
+	struct book_quote *quote = get_quote(&quote_cache, order);
+	if (order->price == quote->price)
+	{
+		quote->quantity -= order->quantity;
+		quote->orders--;
+		if (quote->orders == 0)
+		{
+			refresh_quote(quote, get_ladder(ORDER_RECORD(order)->product_index), ORDER_RECORD(order)->product_index, order->type);
+		}
+	}
+}
+
+/* Function: remove_match_node
+ * 	----------------------------
+ *   Unlinks an order from the order book and frees it.
+ *
+ *   match_node: the order to remove
+ *   product_node: product_info for the product orderbook
+ */
+void remove_match_node(struct order_type *match_node, struct product_info *product_node)
+{
+	if (match_node->prev == NULL)
+	{
+		product_node->first_order = match_node->next;
+	}
+	else
+	{
+		match_node->prev->next = match_node->next;
+	}
+	if (match_node->next != NULL)
+	{
+		match_node->next->prev = match_node->prev;
+	}
+
+	if (match_node->type == SELL)
+	{
+		product_node->sell -= 1;
+	}
+	else
+	{
+		product_node->buy -= 1;
+	}
+	book_order_removed(product_node, match_node);
+	free_order(match_node);
+}
+
+/* Function: format_trade
+ * 	----------------------------
+ *   Formats a trade as sent to traders, without the trailing semicolon:
+ *   TRADE <product> <quantity> <price> <sequence>
+ *
+ *   message: buffer of BUFFSIZE for the message
+ *   event: the trade
+ *   product: the trade's product
+ */
+void format_trade(char *message, struct tape_event *event, char *product)
+{
+	snprintf(message, BUFFSIZE, "TRADE %s %" PRId64 " %" PRId64 " %" PRId64, product, event->quantity, event->price, event->sequence);
+}
+
+/* Function: send_trade_update
+ * 	----------------------------
+ *   Sends a trade just recorded on the tape to every live trader that gets MARKET
+ *   messages, so their sequence of the product has no gaps. Nothing is sent while the
+ *   tape is disabled, and plugins, which see no sequences, only get their fills.
+ *
+ *   trade: the trade, as recorded on the tape
+ *   product: the trade's product
+ */
+void send_trade_update(struct tape_event *trade, char *product)
+{
+	if (!trade_tape.enabled)
+	{
+		return;
+	}
+	char message[BUFFSIZE];
+	format_trade(message, trade, product);
+	for (int i = 0; i < trade_tape.number_traders; i++)
+	{
+		struct trader_struct *trader = &(trade_tape.traders[i]);
+		if (TRADER_ALIVE(i) && !depth_subscribed(&depth_feed, i) && get_plugin(trader) == NULL)
+		{
+			write_trader(trader, "%s;", message);
+			signal_trader(trader);
+		}
+	}
+}
+
+/* Function: add_fill
+ * 	----------------------------
+ *   Records a fill against a resting order in the fill batch, and adds it to the
+ *   running total of that order's trader.
+ *
+ *   batch: the fill batch
+ *   match_node: the resting order that was filled
+ *   quantity: quantity filled
+ *   value: value of the fill
+ *   exchange_fee: fee charged for the fill
+ */
+void add_fill(struct fill_batch *batch, struct order_type *match_node, long int quantity, long int value, long int exchange_fee)
+{
+	if (batch->number_fills == batch->fills_size)
+	{
+		batch->fills_size = batch->fills_size == 0 ? FILL_BATCH_SIZE : batch->fills_size * 2;
+		batch->fills = realloc(batch->fills, sizeof(struct fill_record) * batch->fills_size);
+	}
+	struct fill_record *fill = &(batch->fills[batch->number_fills]);
+	fill->trader = match_node->trader;
+	fill->trader_id = ORDER_TRADER_ID(match_node);
+	fill->order_id = match_node->order_id;
+	fill->quantity = quantity;
+	fill->value = value;
+	fill->exchange_fee = exchange_fee;
+	batch->number_fills++;
+
+	// One running total per counterparty, so positions are only touched once per sweep
+	int i = 0;
+	while (i < batch->number_counterparties && batch->counterparties[i].trader_id != fill->trader_id)
+	{
+		i++;
+	}
+	if (i == batch->number_counterparties)
+	{
+		if (batch->number_counterparties == batch->counterparties_size)
+		{
+			batch->counterparties_size = batch->counterparties_size == 0 ? FILL_BATCH_SIZE : batch->counterparties_size * 2;
+			batch->counterparties = realloc(batch->counterparties, sizeof(struct counterparty_total) * batch->counterparties_size);
+		}
+		batch->counterparties[i].trader_id = fill->trader_id;
+		batch->counterparties[i].quantity = 0;
+		batch->counterparties[i].value = 0;
+		batch->number_counterparties++;
+	}
+	batch->counterparties[i].quantity += quantity;
+	batch->counterparties[i].value += value;
+}
+
+/* Function: sweep_order
+ * 	----------------------------
+ *   Walks the opposite side of the order book from the best price and fills the current
+ *   order level by level into the fill batch, until it is filled or no longer crosses.
+ *   Filled resting orders are removed from the book as the sweep passes them.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: current order we want to match
+ *   batch: the fill batch to record the fills in
+ *   returns: the exchange fee for the fills
+ */
+long int sweep_order(struct product_info *product_node, struct order_type *current_order, struct fill_batch *batch)
+{
+	long int exchange_fee = 0;
+
+	// Nothing to walk unless the cached best opposite price crosses
+	int product_index = ORDER_RECORD(current_order)->product_index;
+	struct book_quote *best = current_order->type == SELL ? &(quote_cache.bid[product_index]) : &(quote_cache.ask[product_index]);
+	if (best->orders == 0 || (current_order->type == SELL && best->price < current_order->price) || (current_order->type == BUY && best->price > current_order->price))
+	{
+		return exchange_fee;
+	}
+
+	// Start at the first order of the best opposite level
+	struct order_type *match_node = NULL;
+	struct price_ladder *ladder = get_ladder(product_index);
+	if (ladder != NULL)
+	{
+		int level = ladder_best(ladder, current_order->type == SELL ? BUY : SELL);
+		match_node = level == -1 ? NULL : ladder->side[LADDER_SIDE(current_order->type == SELL ? BUY : SELL)][level].first;
+	}
+	else
+	{
+		struct list_level *level = *get_list_levels(product_index, current_order->type == SELL ? BUY : SELL);
+		match_node = level == NULL ? NULL : level->first;
+	}
+
+	while (match_node != NULL && match_node->type != current_order->type && current_order->quantity > 0)
+	{
+		if ((current_order->type == SELL && match_node->price < current_order->price) || (current_order->type == BUY && match_node->price > current_order->price))
+		{
+			break;
+		}
+
+		long int quantity = match_node->quantity < current_order->quantity ? match_node->quantity : current_order->quantity;
+		// A sell that exactly fills a resting buy has always been valued at its own price
+		long int price = current_order->type == SELL && match_node->quantity == current_order->quantity ? current_order->price : match_node->price;
+		long int value = price * quantity;
+		long int fee = get_exchange_fee(value);
+		add_fill(batch, match_node, quantity, value, fee);
+		book_order_filled(product_node, match_node, quantity);
+		exchange_fee += fee;
+
+		match_node->quantity -= quantity;
+		current_order->quantity -= quantity;
+
+		struct order_type *next_node = match_node->next;
+		if (match_node->quantity == 0)
+		{
+			remove_match_node(match_node, product_node);
+		}
+		match_node = next_node;
+	}
+	return exchange_fee;
+}
+
+/* Function: settle_fill_batch
+ * 	----------------------------
+ *   Applies the fill batch to positions, once per counterparty and once for the current
+ *   order (which pays the fees), then sends all the fill messages and empties the batch.
+ *
+ *   batch: the fill batch
+ *   current_order: the order that swept the book
+ */
+void settle_fill_batch(struct fill_batch *batch, struct order_type *current_order)
+{
+	if (batch->number_fills == 0)
+	{
+		return;
+	}
+
+	// Buying adds quantity and costs cash, selling the opposite
+	int side = current_order->type == BUY ? 1 : -1;
+	int product_index = ORDER_RECORD(current_order)->product_index;
+	int64_t total_quantity = 0;
+	int64_t total_value = 0;
+	int64_t total_fee = 0;
+	for (int i = 0; i < batch->number_counterparties; i++)
+	{
+		struct counterparty_total *counterparty = &(batch->counterparties[i]);
+		int cell = POSITION_INDEX(&position_book, counterparty->trader_id, product_index);
+		position_book.quantity[cell] -= side * counterparty->quantity;
+		position_book.cash[cell] += side * counterparty->value;
+		total_quantity += counterparty->quantity;
+		total_value += counterparty->value;
+	}
+	for (int i = 0; i < batch->number_fills; i++)
+	{
+		total_fee += batch->fills[i].exchange_fee;
+	}
+	int cell = POSITION_INDEX(&position_book, ORDER_TRADER_ID(current_order), product_index);
+	position_book.quantity[cell] += side * total_quantity;
+	position_book.cash[cell] -= side * total_value + total_fee;
+	struct fill_record *last_fill = &(batch->fills[batch->number_fills - 1]);
+	position_book.last_price[product_index] = last_fill->value / last_fill->quantity;
+	// One clock read for the whole sweep
+	int64_t now = bar_writer.enabled ? get_epoch_ms() : 0;
+	int64_t archive_now = archive.enabled ? get_time_ns() : 0;
+
+	for (int i = 0; i < batch->number_fills; i++)
+	{
+		struct fill_record *fill = &(batch->fills[i]);
+		struct tape_event trade = {0, TAPE_TRADE, current_order->type, fill->quantity, fill->value / fill->quantity};
+		tape_record(&trade_tape, &trade, product_index);
+		if (bar_writer.enabled)
+		{
+			bar_add_trade(&bar_writer, product_index, trade.quantity, trade.price, now);
+		}
+		if (archive.enabled)
+		{
+			archive_row(&archive, SPX_ARCHIVE_FILL, current_order, trade.price, fill->quantity, fill->trader_id, fill->order_id, archive_now);
+		}
+		printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, fill->order_id, fill->trader_id, current_order->order_id, ORDER_TRADER_ID(current_order), fill->value, fill->exchange_fee);
+		if (drop_copy.header != NULL)
+		{
+			struct spx_execution execution = {0};
+			int buying = current_order->type == BUY;
+			execution.buy_trader = buying ? ORDER_TRADER_ID(current_order) : fill->trader_id;
+			execution.buy_order = buying ? current_order->order_id : fill->order_id;
+			execution.sell_trader = buying ? fill->trader_id : ORDER_TRADER_ID(current_order);
+			execution.sell_order = buying ? fill->order_id : current_order->order_id;
+			execution.product_index = product_index;
+			execution.aggressor = buying ? SPX_AGGRESSOR_BUY : SPX_AGGRESSOR_SELL;
+			execution.price = trade.price;
+			execution.quantity = fill->quantity;
+			execution.fee = fill->exchange_fee;
+			drop_copy_fill(&drop_copy, &execution);
+		}
+		// A buyer hears about its fill first, a seller after the resting buyer
+		if (current_order->type == BUY)
+		{
+			send_fill(current_order->trader, current_order->order_id, fill->quantity);
+		}
+		if (TRADER_ALIVE(fill->trader_id))
+		{
+			send_fill(fill->trader, fill->order_id, fill->quantity);
+		}
+		if (current_order->type == SELL)
+		{
+			send_fill(current_order->trader, current_order->order_id, fill->quantity);
+		}
+		send_trade_update(&trade, current_order->product);
+	}
+
+	batch->number_fills = 0;
+	batch->number_counterparties = 0;
+}
+
+/* Function: free_fill_batch
+ * 	----------------------------
+ *   Frees the memory of the fill batch.
+ *
+ *   batch: the fill batch
+ */
+void free_fill_batch(struct fill_batch *batch)
+{
+	free(batch->fills);
+	free(batch->counterparties);
+}
+
+/* Function: insert_sell_order
+ * 	----------------------------
+ *   Rests a sell order in the order book. Sells come first in ascending price order,
+ *   behind any sells at the same price.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: the order to rest
+ */
+void insert_sell_order(struct product_info *product_node, struct order_type *current_order)
+{
+	struct order_type *node = product_node->first_order;
+	struct order_type *prev_node = NULL;
+	struct price_ladder *ladder = get_ladder(ORDER_RECORD(current_order)->product_index);
+	if (ladder != NULL)
+	{
+		prev_node = ladder_insert_after(product_node, ladder, current_order);
+		node = prev_node == NULL ? product_node->first_order : prev_node->next;
+	}
+	while (ladder == NULL && node != NULL && node->type == SELL && node->price <= current_order->price)
+	{
+		prev_node = node;
+		node = node->next;
+	}
+
+	current_order->prev = prev_node;
+	current_order->next = node;
+	if (prev_node == NULL)
+	{
+		product_node->first_order = current_order;
+	}
+	else
+	{
+		prev_node->next = current_order;
+	}
+	if (node != NULL)
+	{
+		node->prev = current_order;
+	}
+	product_node->sell += 1;
+	book_order_added(product_node, current_order);
+}
+
+/* Function: insert_buy_order
+ * 	----------------------------
+ *   Rests a buy order in the order book. Buys come after the sells in descending price
+ *   order, behind any buys at the same price.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: the order to rest
+ */
+void insert_buy_order(struct product_info *product_node, struct order_type *current_order)
+{
+	struct order_type *node = product_node->first_order;
+	struct order_type *prev_node = NULL;
+	struct price_ladder *ladder = get_ladder(ORDER_RECORD(current_order)->product_index);
+	if (ladder != NULL)
+	{
+		prev_node = ladder_insert_after(product_node, ladder, current_order);
+		node = prev_node == NULL ? product_node->first_order : prev_node->next;
+	}
+	while (ladder == NULL && node != NULL && (node->type == SELL || node->price >= current_order->price))
+	{
+		prev_node = node;
+		node = node->next;
+	}
+
+	current_order->prev = prev_node;
+	current_order->next = node;
+	if (prev_node == NULL)
+	{
+		product_node->first_order = current_order;
+	}
+	else
+	{
+		prev_node->next = current_order;
+	}
+	if (node != NULL)
+	{
+		node->prev = current_order;
+	}
+	product_node->buy += 1;
+	book_order_added(product_node, current_order);
+}
+
+/* Function: process_sell_order
+ * 	----------------------------
+ *   Sweeps the buy side for the current order that is a sell order, then rests any remainder.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: current order we want to match
+ *   size: size of the product array
+ *   unfilled: set to the current order if it is IOC/FOK and has a remainder that must not rest
+ *   returns: exchange fee for the order if matched
+ */
+long int process_sell_order(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **unfilled)
+{
+	long int exchange_fee = sweep_order(product_node, current_order, &sweep_batch);
+	settle_fill_batch(&sweep_batch, current_order);
+
+	// Filled completely
+	if (current_order->quantity == 0)
+	{
+		free_order(current_order);
+	}
+	// IOC/FOK remainder: leave the book untouched and hand it back
+	else if (!TIF_RESTS(ORDER_RECORD(current_order)->time_in_force))
+	{
+		*unfilled = current_order;
+	}
+	// Remainder: add to order linked list
+	else
+	{
+		insert_sell_order(product_node, current_order);
+	}
+
+	return exchange_fee;
+}
+
+/* Function: process_buy_order
+ * 	----------------------------
+ *   Sweeps the sell side for the current order that is a buy order, then rests any remainder.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: current order we want to match
+ *   size: size of the product array
+ *   unfilled: set to the current order if it is IOC/FOK and has a remainder that must not rest
+ *   returns: exchange fee for the order if matched
+ */
+long int process_buy_order(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **unfilled)
+{
+	long int exchange_fee = sweep_order(product_node, current_order, &sweep_batch);
+	settle_fill_batch(&sweep_batch, current_order);
+
+	// Filled completely
+	if (current_order->quantity == 0)
+	{
+		free_order(current_order);
+	}
+	// IOC/FOK remainder: leave the book untouched and hand it back
+	else if (!TIF_RESTS(ORDER_RECORD(current_order)->time_in_force))
+	{
+		*unfilled = current_order;
+	}
+	// Remainder: add to order linked list
+	else
+	{
+		insert_buy_order(product_node, current_order);
+	}
+
+	return exchange_fee;
+}
+
+/* Function: match_order
+ * 	----------------------------
+ *   Match an order depending on whether it's a buy or sell order.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: current order we want to match
+ *   size: size of the product array
+ *   unfilled: set to the current order if it is IOC/FOK and has a remainder that must not rest
+ *   returns: exchange fee for the order if matched
+ */
+long int match_order(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **unfilled)
+{
+	long int exchange_fee = 0;
+	if (current_order->type == SELL)
+	{
+		exchange_fee = process_sell_order(product_node, current_order, size, unfilled);
+	}
+	else
+	{
+		exchange_fee = process_buy_order(product_node, current_order, size, unfilled);
+	}
+	return exchange_fee;
+}
+
+/* Function: check_fill_or_kill
+ * 	----------------------------
+ *   Checks whether the opposite side holds enough crossing quantity to fill an order completely.
+ *   Sums the opposite side's price levels from the best and stops as soon as the quantity is covered.
+ *
+ *   product_node: product_info for the product orderbook
+ *   current_order: the order to check
+ *   returns: TRUE if the order can be filled completely, FALSE otherwise
+ */
+int check_fill_or_kill(struct product_info *product_node, struct order_type *current_order)
+{
+	long int available = 0;
+	struct price_ladder *ladder = get_ladder(ORDER_RECORD(current_order)->product_index);
+	if (ladder != NULL)
+	{
+		// Whole levels at a time, best first
+		int side = LADDER_SIDE(current_order->type == SELL ? BUY : SELL);
+		int level = ladder_best(ladder, current_order->type == SELL ? BUY : SELL);
+		while (level != -1)
+		{
+			long int price = ladder->base + level * ladder->tick;
+			if ((current_order->type == SELL && price < current_order->price) || (current_order->type == BUY && price > current_order->price))
+			{
+				break;
+			}
+			available += ladder->side[side][level].quantity;
+			if (available >= current_order->quantity)
+			{
+				return TRUE;
+			}
+			level = current_order->type == SELL ? ladder_scan_down(ladder, side, level - 1) : ladder_scan_up(ladder, side, level + 1);
+		}
+		return FALSE;
+	}
+	// Level totals of the general ladder, best first
+	struct list_level *level = *get_list_levels(ORDER_RECORD(current_order)->product_index, current_order->type == SELL ? BUY : SELL);
+	while (level != NULL && (current_order->type == SELL ? level->price >= current_order->price : level->price <= current_order->price))
+	{
+		available += level->quantity;
+		if (available >= current_order->quantity)
+		{
+			return TRUE;
+		}
+		level = level->next;
+	}
+	return FALSE;
+}
+
+/* Function: get_type
+ * 	----------------------------
+ *   Returns a string "BUY" or "SELL" depending on the type.
+ *
+ *   type: type to compare against
+ *   returns: A string corresponding to the encoded value
+ */
+char *get_type(int type)
+{
+	if (type == SELL)
+	{
+		return ("SELL");
+	}
+
+	return ("BUY");
+}
+
+/* Function: format_tape_event
+ * 	----------------------------
+ *   Formats an event as sent to traders, without the trailing semicolon:
+ *   MARKET <type> <product> <quantity> <price> [sequence] or TRADE <product> <quantity> <price> <sequence>.
+ *   The sequence is left off MARKET messages while the tape is disabled.
+ *
+ *   message: buffer of BUFFSIZE for the message
+ *   event: the event
+ *   product: the event's product
+ */
+void format_tape_event(char *message, struct tape_event *event, char *product)
+{
+	if (event->kind == TAPE_TRADE)
+	{
+		format_trade(message, event, product);
+	}
+	else if (event->sequence < 0)
+	{
+		snprintf(message, BUFFSIZE, "MARKET %s %s %" PRId64 " %" PRId64, get_type(event->type), product, event->quantity, event->price);
+	}
+	else
+	{
+		snprintf(message, BUFFSIZE, "MARKET %s %s %" PRId64 " %" PRId64 " %" PRId64, get_type(event->type), product, event->quantity, event->price, event->sequence);
+	}
+}
+
+/* Function: print_order_positions
+ * 	----------------------------
+ *   Prints the orderbook and positions for each trader.
+ *
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ */
+void print_order_positions(struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
+{
+	printf("%s\t--ORDERBOOK--\n", LOG_PREFIX);
+
+	for (int i = 0; i < size; i++)
+	{
+
+		int buy_level = 0;
+		int sell_level = 0;
+
+		struct order_type *current_order = order_book[i].first_order;
+
+		while (current_order != NULL)
+		{
+			// printf("%ld\n", current_order->price);
+			if (current_order->type == BUY && !(current_order->next != NULL && current_order->next->type == BUY && current_order->next->price == current_order->price))
+			{
+				buy_level++;
+			}
+			else if (current_order->type == SELL && !(current_order->next != NULL && current_order->next->type == SELL && current_order->next->price == current_order->price))
+			{
+				sell_level++;
+			}
+			current_order = current_order->next;
+		}
+
+		printf("%s\tProduct: %s; Buy levels: %d; Sell levels: %d\n", LOG_PREFIX, product_array[i], buy_level, sell_level);
+
+		current_order = order_book[i].first_order;
+		struct order_type *prev_order = NULL;
+
+		long int number_orders = 0;
+		long int level_quantity = 0;
+
+		struct order_type *buy_start = order_book[i].first_order;
+
+		// Go to the end of the sell list
+		if (current_order != NULL && current_order->type == SELL)
+		{
+			for (int j = 0; current_order->next != NULL && current_order->next->type == SELL; j++)
+			{
+				current_order = current_order->next;
+			}
+			buy_start = current_order->next;
+
+			while (current_order != NULL)
+			{
+
+				number_orders += 1;
+				if (prev_order != NULL)
+				{
+
+					if (prev_order->type != current_order->type || prev_order->price != current_order->price)
+					{
+						char *type = get_type(prev_order->type);
+
+						if (number_orders - 1 == 1)
+						{
+							printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, level_quantity, prev_order->price);
+						}
+						else
+						{
+							printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity, prev_order->price, number_orders - 1);
+						}
+
+						number_orders = 1;
+						level_quantity = 0;
+					}
+				}
+
+				if (current_order->prev == NULL)
+				{
+					char *type = get_type(current_order->type);
+
+					if (number_orders == 1)
+					{
+						printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, current_order->quantity, current_order->price);
+					}
+					else
+					{
+						printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity + current_order->quantity, prev_order->price, number_orders);
+					}
+				}
+
+				level_quantity += current_order->quantity;
+
+				prev_order = current_order;
+				current_order = current_order->prev;
+			}
+		}
+		if (buy_start != NULL)
+		{
+			current_order = buy_start;
+			prev_order = NULL;
+			number_orders = 0;
+			level_quantity = 0;
+			while (current_order != NULL)
+			{
+				number_orders += 1;
+				if (prev_order != NULL)
+				{
+
+					if (prev_order->type != current_order->type || prev_order->price != current_order->price)
+					{
+						char *type = get_type(prev_order->type);
+
+						if (number_orders - 1 == 1)
+						{
+							printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, level_quantity, prev_order->price);
+						}
+						else
+						{
+							printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity, prev_order->price, number_orders - 1);
+						}
+
+						number_orders = 1;
+						level_quantity = 0;
+					}
+				}
+
+				if (current_order->next == NULL)
+				{
+					char *type = get_type(current_order->type);
+
+					if (number_orders == 1)
+					{
+						printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, current_order->quantity, current_order->price);
+					}
+					else
+					{
+						printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity + current_order->quantity, prev_order->price, number_orders);
+					}
+				}
+
+				level_quantity += current_order->quantity;
+
+				prev_order = current_order;
+				current_order = current_order->next;
+			}
+		}
+	}
+
+	printf("%s\t--POSITIONS--\n", LOG_PREFIX);
+	for (int i = 0; i < number_traders; i++)
+	{
+		printf("%s\tTrader %d: ", LOG_PREFIX, i);
+		int64_t *quantity = &(position_book.quantity[POSITION_INDEX(&position_book, i, 0)]);
+		int64_t *cash = &(position_book.cash[POSITION_INDEX(&position_book, i, 0)]);
+		for (int j = 0; j < size; j++)
+		{
+			if (j == 0)
+			{
+				printf("%s %" PRId64 " ($%" PRId64 ")", product_array[j], quantity[j], cash[j]);
+			}
+			else
+			{
+				printf(", %s %" PRId64 " ($%" PRId64 ")", product_array[j], quantity[j], cash[j]);
+			}
+		}
+		printf("\n");
+	}
+}
+
+/* Function: compute_trader_totals
+ * 	----------------------------
+ *   Works out each trader's profit and loss (cash plus holdings at the last traded price)
+ *   and gross exposure (absolute holdings at the last traded price) across all products.
+ *
+ *   matrix: the position matrix
+ *   profit_loss: array with room for one total per trader
+ *   exposure: array with room for one total per trader
+ */
+void compute_trader_totals(struct position_matrix *matrix, int64_t *profit_loss, int64_t *exposure)
+{
+	for (int i = 0; i < matrix->number_traders; i++)
+	{
+		const int64_t *quantity = &(matrix->quantity[POSITION_INDEX(matrix, i, 0)]);
+		const int64_t *cash = &(matrix->cash[POSITION_INDEX(matrix, i, 0)]);
+		int64_t trader_profit_loss = 0;
+		int64_t trader_exposure = 0;
+		// Straight loop over one contiguous row, no branches so it vectorises
+		for (int j = 0; j < matrix->size; j++)
+		{
+			int64_t holding = quantity[j] * matrix->last_price[j];
+			int64_t mask = holding >> 63;
+			trader_profit_loss += cash[j] + holding;
+			trader_exposure += (holding ^ mask) - mask;
+		}
+		profit_loss[i] = trader_profit_loss;
+		exposure[i] = trader_exposure;
+	}
+}
+
+/* Function: print_session_report
+ * 	----------------------------
+ *   Prints the end-of-session profit and loss and exposure of every trader.
+ *
+ *   matrix: the position matrix
+ */
+void print_session_report(struct position_matrix *matrix)
+{
+	int64_t *profit_loss = malloc(sizeof(int64_t) * matrix->number_traders);
+	int64_t *exposure = malloc(sizeof(int64_t) * matrix->number_traders);
+	compute_trader_totals(matrix, profit_loss, exposure);
+
+	printf("%s\t--SESSION REPORT--\n", LOG_PREFIX);
+	for (int i = 0; i < matrix->number_traders; i++)
+	{
+		printf("%s\tTrader %d: P&L $%" PRId64 ", exposure $%" PRId64 "\n", LOG_PREFIX, i, profit_loss[i], exposure[i]);
+		struct trader_input *input = &(scheduler.inputs[i]);
+		if (input->invalid > 0 || input->throttled > 0)
+		{
+			printf("%s\tTrader %d: %ld invalid, %ld rate limited\n", LOG_PREFIX, i, input->invalid, input->throttled);
+		}
+	}
+	free(profit_loss);
+	free(exposure);
+}
+
+/* Function: find_order
+ * 	----------------------------
+ *   Finds a trader's order in the orderbook without removing it.
+ *
+ *   trader_id: trader that owns the order
+ *   order_id: order id to find
+ *   order_book: the orderbook array
+ *   size: size of the product array
+ *   returns: the order, or NULL if the trader has no such order resting
+ */
+struct order_type *find_order(int trader_id, int order_id, struct product_info *order_book, int size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		if (order_book[i].buy + order_book[i].sell == 0)
+		{
+			continue;
+		}
+		struct order_type *node = order_book[i].first_order;
+		while (node != NULL)
+		{
+			if (node->order_id == order_id && ORDER_TRADER_ID(node) == trader_id)
+			{
+				return node;
+			}
+			node = node->next;
+		}
+	}
+	return NULL;
+}
+
+/* Function: unlink_order
+ * 	----------------------------
+ *   Takes an order out of its product's orderbook without freeing it.
  *
- *   trader: the executable file name of the trader
- *   trader_id: the trader's id
- * 	 exchange_trader: the struct to populate with trader information
- *   size: the size of thej product array
- *   product_array: the array that stores the products as strings
+ *   node: the order to take out
+ *   order_book: the orderbook array
  */
-void set_up_trader(char *trader, int trader_id, struct trader_struct *exchange_trader, int size, char **product_array)
+void unlink_order(struct order_type *node, struct product_info *order_book)
 {
-	int trader_length = snprintf(NULL, 0, "%d", trader_id);
-	char *exchange_t_pipe = malloc(sizeof(char) * (strlen(FIFO_EXCHANGE) - 1 + trader_length));
-	char *trader_e_pipe = malloc(sizeof(char) * (strlen(FIFO_TRADER) - 1 + trader_length));
-	sprintf(exchange_t_pipe, FIFO_EXCHANGE, trader_id);
-	sprintf(trader_e_pipe, FIFO_TRADER, trader_id);
-	mkfifo(exchange_t_pipe, MKFIFO_PERMISSION);
-	mkfifo(trader_e_pipe, MKFIFO_PERMISSION);
-	int pid = fork();
+	struct product_info *product_node = &(order_book[ORDER_RECORD(node)->product_index]);
+	if (node->prev == NULL)
+	{
+		product_node->first_order = node->next;
+		if (node->next != NULL)
+		{
+			node->next->prev = NULL;
+		}
+	}
+	else
+	{
+		if (node->next != NULL)
+		{
+			node->next->prev = node->prev;
+		}
+		node->prev->next = node->next;
+	}
 
-	if (pid == 0)
+	if (node->type == SELL)
 	{
-		printf("%s Starting trader %d (%s)\n", LOG_PREFIX, trader_id, trader);
-		execl(trader, trader, exchange_t_pipe + strlen(FIFO_EXCHANGE) - 2, NULL);
+		product_node->sell--;
 	}
 	else
 	{
-		int exchange_fd = open(exchange_t_pipe, O_WRONLY);
-		FILE *exchange_t_fp = fdopen(exchange_fd, "w");
-		printf("%s Connected to %s\n", LOG_PREFIX, exchange_t_pipe);
+		product_node->buy--;
+	}
+	book_order_removed(product_node, node);
+}
+
+/* Function: get_order
+ * 	----------------------------
+ *   Removes the order from the orderbook and returns it.
+ *
+ *   trader_id: trader that wanted the order removed
+ *   order_id: order id to remove
+ *   order_book: the orderbook array
+ *   size: size of the product array
+ */
+struct order_type *get_order(int trader_id, int order_id, struct product_info *order_book, int size)
+{
+	struct order_type *node = find_order(trader_id, order_id, order_book, size);
+	if (node != NULL)
+	{
+		unlink_order(node, order_book);
+	}
+	return node;
+}
 
-		exchange_trader->trader_fd = open(trader_e_pipe, O_RDONLY);
-		FILE *trader_e_fp = fdopen(exchange_trader->trader_fd, "r");
-		printf("%s Connected to %s\n", LOG_PREFIX, trader_e_pipe);
+/* Function: send_market_update
+ * 	----------------------------
+ *   Sends a MARKET update to every other live trader not reading the depth feed. While
+ *   the tape is on the order's own trader gets it too, as every sequence number has to
+ *   reach every trader that follows the tape. The text is formatted once for all the
+ *   trader processes.
+ *
+ *   event: the update, as recorded on the tape
+ *   current_order: the order the update is about
+ *   exchange_traders: linked list of traders
+ *   number_traders: the number of traders
+ */
+void send_market_update(struct tape_event *event, struct order_type *current_order, struct trader_struct *exchange_traders, int number_traders)
+{
+	char message[BUFFSIZE];
+	format_tape_event(message, event, current_order->product);
+	struct spx_message update = {SPX_MARKET, 0, event->type == BUY ? SPX_BUY : SPX_SELL, current_order->product, event->quantity, event->price};
 
-		exchange_trader->trader_id = trader_id;
-		exchange_trader->pipe_exchange_t = exchange_t_pipe;
-		exchange_trader->pipe_trader_e = trader_e_pipe;
-		exchange_trader->fp_exchange_t = exchange_t_fp;
-		exchange_trader->fp_trader_e = trader_e_fp;
-		exchange_trader->pid_child = pid;
-		exchange_trader->positions = malloc(sizeof(struct trader_positions) * size);
-		exchange_trader->alive = TRUE;
-		exchange_trader->order_valid = 0;
-		for (size_t i = 0; i < size; i++)
+	for (size_t i = 0; i < number_traders; i++)
+	{
+		int own = &(exchange_traders[i]) == current_order->trader;
+		if (TRADER_ALIVE(i) && !depth_subscribed(&depth_feed, i))
 		{
-
-			exchange_trader->positions[i].product = product_array[i];
-			exchange_trader->positions[i].quantity = 0;
-			exchange_trader->positions[i].price = 0;
+			struct trader_plugin *plugin = get_plugin(&(exchange_traders[i]));
+			if (plugin != NULL)
+			{
+				if (!own)
+				{
+					notify_plugin(plugin, &update);
+				}
+				continue;
+			}
+			if (own && !trade_tape.enabled)
+			{
+				continue;
+			}
+			write_trader(&(exchange_traders[i]), "%s;", message);
+			signal_trader(&(exchange_traders[i]));
 		}
 	}
 }
 
-/* Function: get_products_size
- * ----------------------------
- *   Reads the first item from the file of how many products there are.
+/* Function: send_market_cancel
+ * 	----------------------------
+ *   Tells every other live trader that an order has left the book without trading.
  *
- *   file: the name of the file path
- * 	 returns: numbers of products in the file
+ *   current_order: the order that was removed
+ *   exchange_traders: linked list of traders
+ *   number traders: the number of traders
  */
-int get_products_size(char *file)
+void send_market_cancel(struct order_type *current_order, struct trader_struct *exchange_traders, int number_traders)
 {
-	FILE *ptr = fopen(file, "r");
-	char string[PRODUCT_SIZE];
-	fgets(string, PRODUCT_SIZE, ptr);
-	return atoi(string);
+	struct tape_event event = {0, TAPE_MARKET, current_order->type, 0, 0};
+	tape_record(&trade_tape, &event, ORDER_RECORD(current_order)->product_index);
+	send_market_update(&event, current_order, exchange_traders, number_traders);
 }
 
-/* Function: load_products_file
- * ----------------------------
- *   Loads the products of the file into a product array.
+/* Function: cancel_order
+ * 	----------------------------
+ *   Takes one of a trader's orders off the book and tells every trader.
  *
- *   file_name: the name of the file path
- * 	 returns: an array of pointers to strings being the product names
+ *   trader: the trader with the order to cancel
+ *   sent_id: the id of the trader
+ *   order_id: order id to remove
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   returns: TRUE if the order was cancelled, FALSE if the trader has no such order resting
  */
-char **load_products_file(char *file_name)
+int cancel_order(struct trader_struct *trader, int sent_id, int order_id, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
-	FILE *ptr = fopen(file_name, "r");
-	char string[PRODUCT_SIZE];
-	fgets(string, PRODUCT_SIZE, ptr);
-	char **product_array = (char **)malloc(sizeof(char *) * atoi(string));
-	int i = 0;
-	while (i < atoi(string))
+	struct order_type *current_order = get_order(sent_id, order_id, order_book, size);
+	if (current_order == NULL)
 	{
-		product_array[i] = (char *)malloc(sizeof(char) * PRODUCT_SIZE);
-		fgets(product_array[i], PRODUCT_SIZE, ptr);
-		product_array[i][strlen(product_array[i]) - 1] = '\0';
-		i++;
+		return FALSE;
 	}
-	fclose(ptr);
-	return product_array;
+	send_cancel(trader, order_id);
+	archive_order(SPX_ARCHIVE_CANCEL, current_order);
+	send_market_cancel(current_order, exchange_traders, number_traders);
+	print_order_positions(order_book, product_array, size, number_traders, exchange_traders);
+	free_order(current_order);
+	return TRUE;
 }
 
-/* Function: get_id_pid
- * ----------------------------
- *   Get the trader ID of a trader given their PID.
+/* Function: amend_order
+ * 	----------------------------
+ *   Checks an amend against the trader's limits and the product's ladder and takes the
+ *   order out of the book with its new quantity and price, to go back in like a new
+ *   order. An amend that is rejected, or for an order the trader does not have resting,
+ *   is answered with INVALID.
  *
- *   disconnect_child: the PID to match with the trader
- *   exchange_traders: linked list of trader_struct(s)
- *   size: number of products
- * 	 returns: the trader ID that belongs to a PID, FALSE if no match.
+ *   trader: the trader that sent the amend
+ *   sent_id: the id of the trader
+ *   order_id: order id to amend
+ *   quantity: the new quantity
+ *   price: the new price
+ *   order_book: the orderbook array
+ *   size: size of the product array
+ *   returns: the amended order, NULL if there is none
  */
-int get_id_pid(pid_t disconnect_child, struct trader_struct *exchange_traders, int size)
+struct order_type *amend_order(struct trader_struct *trader, int sent_id, int order_id, long int quantity, long int price, struct product_info *order_book, int size)
 {
-	for (size_t i = 0; i < size; i++)
+	struct order_type *amended = NULL;
+	if (quantity > 0 && quantity < UPPER_BOUND && price > 0 && price < UPPER_BOUND)
 	{
-		if (exchange_traders[i].pid_child == disconnect_child)
-		{
-			return exchange_traders[i].trader_id;
-		}
+		amended = find_order(sent_id, order_id, order_book, size);
 	}
-	return FALSE;
+	if (amended == NULL)
+	{
+		send_invalid(trader);
+		return NULL;
+	}
+	char *risk_reason = check_risk_limits(&risk_book, sent_id, ORDER_RECORD(amended)->product_index, amended->type, quantity, price, amended);
+	if (risk_reason == NULL && !ladder_accepts(ORDER_RECORD(amended)->product_index, price))
+	{
+		risk_reason = "price not on the ladder";
+	}
+	if (risk_reason != NULL)
+	{
+		printf("%s [T%d] Amend %d rejected: %s\n", LOG_PREFIX, sent_id, amended->order_id, risk_reason);
+		send_invalid(trader);
+		return NULL;
+	}
+	unlink_order(amended, order_book);
+	ORDER_RECORD(amended)->sequence = order_sequence++;
+	amended->price = price;
+	amended->quantity = quantity;
+	return amended;
 }
 
-/* Function: te_sig
- * ----------------------------
- *   The signal handeler for trader writing to the exchange.
+/* Function: process_cancel
+ * 	----------------------------
+ *   Removes the order from the order linked list.
  *
- *   signo: signal number corresponding to the signal that needs to be handled
- *   sinfo: pointer to the signal handler function
- *   context: void pointer
+ *   buff_check: input of the command
+ *   sent_id: pointer to the id of the trader that sent the command
+ *   trader_id: trader that wanted the order removed
+ *   order_id: order id to remove
+ *   order_book: the orderbook array
+ *   size: size of the product array
+ *   trader: the trader with the order to cancel
+ *   current_order: current order we want to match
+ *   product_array: the array that stores the products as strings
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   match: pointer to indicate whether to process buy/sell
  */
-void te_sig(int signo, siginfo_t *sinfo, void *context)
+void process_cancel(char *buff_check, int *sent_id, struct trader_struct *trader, struct order_type *current_order, struct trader_struct *exchange_traders, char **product_array, int number_traders, struct product_info *order_book, int *match, int size, char *order_id)
 {
-	pipe_signal = TRUE;
-	trader_sig_id = sinfo->si_pid;
+	char *check_next = strsep(&buff_check, " ");
+	if (check_next != NULL)
+	{
+		send_invalid(trader);
+	}
+	else if (cancel_order(trader, *sent_id, atoi(order_id), order_book, product_array, size, number_traders, exchange_traders))
+	{
+		*match = FALSE;
+	}
 }
 
-/* Function: child_sig
- * ----------------------------
- *   The signal handeler for exchange writing to the trader.
+/* Function: process_quote
+ * 	----------------------------
+ *   Answers a QUOTE request from the quote cache with the best bid and ask of a product:
+ *   QUOTE <product> <bid price> <bid quantity> <bid orders> <ask price> <ask quantity> <ask orders>;
+ *   An empty side is sent as 0 0 0.
  *
- *   signo: signal number corresponding to the signal that needs to be handled
- *   sinfo: pointer to the signal handler function
- *   context: void pointer
+ *   buff_check: input of the command after QUOTE
+ *   trader: the trader that sent the request
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
  */
-void child_sig(int signo, siginfo_t *sinfo, void *context)
+void process_quote(char *buff_check, struct trader_struct *trader, char **product_array, int size)
 {
-	disconnect_child = sinfo->si_pid;
+	char *product = strsep(&buff_check, " ");
+	int product_index = product == NULL ? -1 : get_product_index(product, product_array, size);
+	if (product_index == -1 || buff_check != NULL)
+	{
+		send_invalid(trader);
+		return;
+	}
+
+	struct book_quote *bid = &(quote_cache.bid[product_index]);
+	struct book_quote *ask = &(quote_cache.ask[product_index]);
+	write_trader(trader, "QUOTE %s %ld %ld %d %ld %ld %d;", product,
+			bid->orders ? bid->price : 0, bid->quantity, bid->orders,
+			ask->orders ? ask->price : 0, ask->quantity, ask->orders);
+	signal_trader(trader);
 }
 
-/* Function: get_trader_e_fp
- * ----------------------------
- *   Get the file pointer to the trader to exchange pipe who sent a signal to the exchange.
+/* Function: process_replay
+ * 	----------------------------
+ *   Answers a REPLAY <product> <sequence> request with the product's events from that
+ *   sequence onwards that are still on the tape, led by
+ *   REPLAY <product> <first sequence sent> <next sequence>;
+ *   A first sequence later than the one asked for means the gap is no longer on the tape.
  *
- *   pid: the pid to match
- *   exchange_traders: linked list of trader_struct(s)
- *   num_traders: number of traders in the exchange
- *   sent_id: pointer to an integer of the trader id that sent the signal
- * 	 returns: the file pointer to the trader to exchange pipe for the trader who sent a signal to the exchange.
+ *   buff_check: input of the command after REPLAY
+ *   trader: the trader that sent the request
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
  */
-FILE *get_trader_e_fp(int pid, struct trader_struct *exchange_traders, int num_traders, int *sent_id)
+void process_replay(char *buff_check, struct trader_struct *trader, char **product_array, int size)
 {
-	for (size_t i = 0; i < num_traders; i++)
+	char *product = strsep(&buff_check, " ");
+	char *from = strsep(&buff_check, " ");
+	int product_index = product == NULL ? -1 : get_product_index(product, product_array, size);
+	if (!trade_tape.enabled || product_index == -1 || from == NULL || buff_check != NULL || atol(from) < 0)
 	{
-		if (exchange_traders[i].pid_child == pid)
-		{
-			*sent_id = exchange_traders[i].trader_id;
-			return exchange_traders[i].fp_trader_e;
-		}
+		send_invalid(trader);
+		return;
 	}
-	return NULL;
+
+	int64_t next = trade_tape.next_sequence[product_index];
+	int64_t first = atol(from);
+	if (first < next - TAPE_SIZE)
+	{
+		first = next - TAPE_SIZE;
+	}
+	if (first > next)
+	{
+		first = next;
+	}
+
+	write_trader(trader, "REPLAY %s %" PRId64 " %" PRId64 ";", product, first, next);
+	char message[BUFFSIZE];
+	for (int64_t sequence = first; sequence < next; sequence++)
+	{
+		format_tape_event(message, &(trade_tape.events[product_index * TAPE_SIZE + (sequence & (TAPE_SIZE - 1))]), product);
+		write_trader(trader, "%s;", message);
+	}
+	signal_trader(trader);
 }
 
-/* Function: get_exchange_t_fp
- * ----------------------------
- *   Get the file pointer to the exchange to trader pipe for the trader who sent a signal to the exchange.
+/* Function: process_depth_subscribe
+ * 	----------------------------
+ *   Subscribes the trader to the depth feed. The trader is told where the feed is with
+ *   DEPTH <shared memory name> <levels>; and gets no more MARKET messages. The request
+ *   may name a product, which must be traded here, so that the router can send it to the
+ *   partition whose feed has that product.
+ *
+ *   buff_check: input of the command after DEPTH
+ *   trader: the trader that sent the request
+ *   feed: the depth feed
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ */
+void process_depth_subscribe(char *buff_check, struct trader_struct *trader, struct depth_feed *feed, char **product_array, int size)
+{
+	char *product = strsep(&buff_check, " ");
+	if (feed->header == NULL || (product != NULL && get_product_index(product, product_array, size) == -1) || buff_check != NULL)
+	{
+		send_invalid(trader);
+		return;
+	}
+
+	feed->subscribed[trader->trader_id] = TRUE;
+	write_trader(trader, "DEPTH %s %d;", feed->name, SPX_DEPTH_LEVELS);
+	signal_trader(trader);
+}
+
+/* Function: journal_record
+ * 	----------------------------
+ *   Appends an event to the journal, if there is one.
+ *
+ *   log: the journal
+ *   kind: JOURNAL_COMMAND, JOURNAL_EXPIRY or JOURNAL_AUCTION
+ *   trader_id: the trader the event is for, -1 for none
+ *   text: the command, or the order id of an expiry
+ */
+void journal_record(struct journal *log, char kind, int trader_id, char *text)
+{
+	if (log->fp == NULL || log->replaying)
+	{
+		return;
+	}
+	log->sequence++;
+	fprintf(log->fp, "%" PRId64 " %c %d %s\n", log->sequence, kind, trader_id, text);
+}
+
+/* Function: journal_flush
+ * 	----------------------------
+ *   Hands what was journaled so far to the kernel, once per pass of the main loop.
+ *
+ *   log: the journal
+ */
+void journal_flush(struct journal *log)
+{
+	if (log->fp != NULL)
+	{
+		fflush(log->fp);
+	}
+}
+
+/* Function: init_capture
+ * 	----------------------------
+ *   Starts a capture file, at the market open.
+ *
+ *   log: the capture
+ *   path: the capture file
+ *   number_traders: the number of traders
+ */
+void init_capture(struct capture *log, char *path, int number_traders)
+{
+	log->fp = fopen(path, "w");
+	if (log->fp == NULL)
+	{
+		perror("fopen failed capture");
+		return;
+	}
+	setvbuf(log->fp, NULL, _IOFBF, CAPTURE_BUFFER);
+
+	struct spx_capture_header header;
+	memset(&header, 0, sizeof(struct spx_capture_header));
+	memcpy(header.magic, SPX_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = SPX_CAPTURE_VERSION;
+	header.number_traders = number_traders;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.start = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	fwrite(&header, sizeof(struct spx_capture_header), 1, log->fp);
+	log->start = get_time_ns();
+	log->records = 0;
+}
+
+/* Function: capture_event
+ * 	----------------------------
+ *   Appends a record to the capture.
+ *
+ *   log: the capture
+ *   trader_id: the trader
+ *   type: SPX_CAPTURE_COMMAND or SPX_CAPTURE_DISCONNECT
+ *   text: the command, without its ;
+ *   length: length of the command
+ *   time: when it was read, in ns since the market opened
+ */
+void capture_event(struct capture *log, int trader_id, int type, char *text, int length, int64_t time)
+{
+	struct spx_capture_record record = {time, trader_id, type, length};
+	fwrite(&record, sizeof(struct spx_capture_record), 1, log->fp);
+	fwrite(text, 1, length, log->fp);
+	log->records++;
+}
+
+/* Function: capture_input
+ * 	----------------------------
+ *   Records the commands a read completed in a trader's input. The first of them may
+ *   have started in an earlier read.
  *
- *   pid: the pid to match
- *   exchange_traders: linkes list of trader_struct(s)
- *   num_traders: number of traders in the exchange
- * 	 returns: the file pointer to the exchange to trader pipe for the trader who sent a signal to the exchange.
+ *   log: the capture
+ *   trader_id: the trader
+ *   input: the trader's input
+ *   from: where the read put its first byte
  */
-FILE *get_exchange_t_fp(int pid, struct trader_struct *exchange_traders, int num_traders)
+void capture_input(struct capture *log, int trader_id, struct trader_input *input, int from)
 {
-	for (size_t i = 0; i < num_traders; i++)
+	if (log->fp == NULL || from >= input->length)
+	{
+		return;
+	}
+	int64_t time = get_time_ns() - log->start;
+	int start = from;
+	while (start > 0 && input->buffer[start - 1] != ';')
+	{
+		start--;
+	}
+	for (int i = from; i < input->length; i++)
 	{
-		if (exchange_traders[i].pid_child == pid)
+		if (input->buffer[i] == ';')
 		{
-			return exchange_traders[i].fp_exchange_t;
+			capture_event(log, trader_id, SPX_CAPTURE_COMMAND, input->buffer + start, i - start, time);
+			start = i + 1;
 		}
 	}
-	return NULL;
 }
 
-/* Function: varstin
- * ----------------------------
- *   Reallocate a buffer if more input is required.
- *   Citation: Richard McKenzie: Week 9 Question 4, from atm.c https://edstem.org/au/courses/7900/workspaces/pqh57Fru0l6V2qlVV9zmrK8mVMVx4MXi
+/* Function: capture_disconnect
+ * 	----------------------------
+ *   Records that a trader has disconnected.
+ *
+ *   log: the capture
+ *   trader_id: the trader
+ */
+void capture_disconnect(struct capture *log, int trader_id)
+{
+	if (log->fp != NULL)
+	{
+		capture_event(log, trader_id, SPX_CAPTURE_DISCONNECT, "", 0, get_time_ns() - log->start);
+	}
+}
+
+/* Function: close_capture
+ * 	----------------------------
+ *   Writes out and closes the capture file.
+ *
+ *   log: the capture
+ */
+void close_capture(struct capture *log)
+{
+	if (log->fp != NULL)
+	{
+		fclose(log->fp);
+		log->fp = NULL;
+	}
+}
+
+/* Function: init_partition
+ * 	----------------------------
+ *   Maps the queues the router set up for this partition and takes its doorbells.
+ *
+ *   part: the partition to set up
+ *   name: shared memory name of the queues
+ *   fds: "<in>,<out>", the inherited eventfds of the commands and messages rings
+ *   first_trader: the exchange's id of the router's first trader
+ *   returns: the number of the router's traders, -1 on error
+ */
+int init_partition(struct partition *part, char *name, char *fds, int first_trader)
+{
+	if (fds == NULL || sscanf(fds, "%d,%d", &(part->command_fd), &(part->message_fd)) != 2)
+	{
+		fprintf(stderr, "%s %s must be <in>,<out>\n", LOG_PREFIX, PARTITION_FDS_ENV);
+		return -1;
+	}
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd == -1)
+	{
+		perror("shm_open failed partition");
+		return -1;
+	}
+	void *region = mmap(NULL, sizeof(struct spx_partition_queues), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED)
+	{
+		perror("mmap failed partition");
+		return -1;
+	}
+	part->queues = region;
+	if (part->queues->version != SPX_PARTITION_VERSION)
+	{
+		fprintf(stderr, "%s Unsupported partition version %u\n", LOG_PREFIX, part->queues->version);
+		munmap(region, sizeof(struct spx_partition_queues));
+		part->queues = NULL;
+		return -1;
+	}
+	fcntl(part->command_fd, F_SETFL, fcntl(part->command_fd, F_GETFL) | O_NONBLOCK);
+	part->first_trader = first_trader;
+	part->number_traders = part->queues->number_traders;
+	return part->number_traders;
+}
+
+/* Function: set_up_partition_traders
+ * 	----------------------------
+ *   Sets up the trader_struct(s) of the router's traders. Like plugins they have neither
+ *   a process nor a pipe, so their pid is 0 and their fd -1.
  *
- *   fp: file pointer of where to get the input for the buffer from
- * 	 returns: a buffer of characters taken from the file
+ *   part: the partition
+ *   exchange_traders: linked list of trader_struct(s)
  */
-char *varstin(FILE *fp)
+void set_up_partition_traders(struct partition *part, struct trader_struct *exchange_traders)
 {
-	int size = 1;
-	int rs = BUFFSIZE;
-	char *mstrout = malloc(rs);
-	char gc;
-	while (((gc = getc(fp)) != ';'))
+	for (int i = 0; i < part->number_traders; i++)
 	{
-		if (gc == EOF)
-		{
-			free(mstrout);
-			return NULL;
-		}
-		mstrout[size - 1] = gc;
-		size++;
-		if (size == rs)
-		{
-			rs += BUFFSIZE;
-			mstrout = realloc(mstrout, rs);
-		}
+		struct trader_struct *exchange_trader = &(exchange_traders[part->first_trader + i]);
+		exchange_trader->trader_id = part->first_trader + i;
+		exchange_trader->pipe_exchange_t = NULL;
+		exchange_trader->pipe_trader_e = NULL;
+		exchange_trader->fp_exchange_t = NULL;
+		exchange_trader->fp_trader_e = NULL;
+		exchange_trader->trader_fd = -1;
+		exchange_trader->pid_child = 0;
+		exchange_trader->positions = NULL;
+		exchange_trader->alive = TRUE;
+		exchange_trader->order_valid = 0;
 	}
-	mstrout[size - 1] = '\0';
-	return mstrout;
+	printf("%s Partition of %s for Traders %d to %d\n", LOG_PREFIX, getenv(PARTITION_ENV), part->first_trader, part->first_trader + part->number_traders - 1);
 }
 
-/* Function: check_product
- * ----------------------------
- *   Checks whether a product is in the product array
+/* Function: partition_receive
+ * 	----------------------------
+ *   Moves the commands the router has queued into the inputs of its traders. A trader's
+ *   full input leaves the rest of the ring for a later pass, once the scheduler has
+ *   made room.
  *
- *   product: the product to check
- *   product_array: the product array
- *   size: the size of the product array
- * 	 returns: TRUE (1) if the product is in the array, and FALSE (0) otherwise
+ *   part: the partition
  */
-int check_product(char *product, char **product_array, int size)
+void partition_receive(struct partition *part)
 {
-	for (size_t i = 0; i < size; i++)
+	if (part->queues == NULL)
 	{
-		if (strcmp(product, product_array[i]) == 0)
+		return;
+	}
+	uint64_t count;
+	while (read(part->command_fd, &count, sizeof(uint64_t)) == -1 && errno == EINTR)
+	{
+	}
+	struct spx_partition_ring *ring = &(part->queues->commands);
+	uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+	while (tail != head)
+	{
+		struct spx_partition_record *record = &(ring->records[tail & (SPX_PARTITION_SLOTS - 1)]);
+		int id = part->first_trader + record->trader_id;
+		struct trader_input *input = &(scheduler.inputs[id]);
+		if (record->type == SPX_PARTITION_COMMAND)
 		{
-			return TRUE;
+			if (record->length + 1 > INPUT_SIZE - input->length)
+			{
+				break;
+			}
+			int from = input->length;
+			input_append(input, record->text, record->length);
+			input_append(input, ";", 1);
+			capture_input(&capture, id, input, from);
+		}
+		else if (record->type == SPX_PARTITION_DISCONNECT)
+		{
+			input->closed = TRUE;
 		}
+		schedule_trader(id);
+		tail++;
 	}
-	return FALSE;
+	__atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
 }
 
-/* Function: market_open
- * ----------------------------
- *   Loops over traders and writes market open, then loops over traders and sends signals
+/* Function: partition_report
+ * 	----------------------------
+ *   Sends the router the positions of its traders in this partition's products and the
+ *   fees collected, for the router's report of the whole session.
  *
- *   number_traders: the number of traders
- *   exchange_traders: the linked list of trader_struct(s)
+ *   part: the partition
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ *   exchange_fee: fees collected
  */
-void market_open(int number_traders, struct trader_struct *exchange_traders)
+void partition_report(struct partition *part, char **product_array, int size, long int exchange_fee)
 {
-	// Loop over traders and write market open
-	for (size_t i = 0; i < number_traders; i++)
+	if (part->queues == NULL)
 	{
-		fprintf(exchange_traders[i].fp_exchange_t, "MARKET OPEN;");
-		fflush(exchange_traders[i].fp_exchange_t);
+		return;
 	}
-	// Loop over traders and send signals
-	for (size_t i = 0; i < number_traders; i++)
+	char text[SPX_PARTITION_TEXT + 1];
+	for (int i = 0; i < part->number_traders; i++)
 	{
-		kill(exchange_traders[i].pid_child, SIGUSR1);
+		for (int j = 0; j < size; j++)
+		{
+			int cell = POSITION_INDEX(&position_book, part->first_trader + i, j);
+			int length = snprintf(text, sizeof(text), "%s %" PRId64 " %" PRId64, product_array[j], position_book.quantity[cell], position_book.cash[cell]);
+			partition_push(part, i, SPX_PARTITION_POSITION, text, length);
+		}
 	}
+	int length = snprintf(text, sizeof(text), "%ld", exchange_fee);
+	partition_push(part, -1, SPX_PARTITION_CLOSED, text, length);
+	partition_ring(part);
 }
 
-/* Function: print_trading
- * ----------------------------
- *   Prints the items in the product array
+/* Function: free_partition
+ * 	----------------------------
+ *   Unmaps the queues and closes the doorbells. The router removes the queues.
  *
- *   size: the number of products
+ *   part: the partition
  */
-void print_trading(char **product_array, int size)
+void free_partition(struct partition *part)
 {
-	printf("%s Trading %d products:", LOG_PREFIX, size);
-	for (size_t i = 0; i < size; i++)
+	if (part->queues == NULL)
 	{
-		printf(" %s", product_array[i]);
+		return;
 	}
-	printf("\n");
+	munmap(part->queues, sizeof(struct spx_partition_queues));
+	part->queues = NULL;
+	close(part->command_fd);
+	close(part->message_fd);
 }
 
-/* Function: initalise_traders
- * ----------------------------
- *   Loops over the traders and calls set_up_trader.
+/* Function: expire_order
+ * 	----------------------------
+ *   Cancels a GTT order whose time is up, the same way as a CANCEL from its trader.
  *
- *   argv: the trader binaries from the command line
- *   exchange_traders: linked list of trader_struct(s)
- *   size: the number of products
+ *   current_order: the expired order, still in the orderbook
+ *   order_book: the orderbook array
  *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
  */
-void initalise_traders(char **argv, int argc, struct trader_struct *exchange_traders, int size, char **product_array)
+void expire_order(struct order_type *current_order, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
-	int trader_id = 0;
-	for (size_t i = 2; i < argc; i++)
+	printf("%s [T%d] Order %d expired\n", LOG_PREFIX, current_order->trader->trader_id, current_order->order_id);
+	unlink_order(current_order, order_book);
+	if (TRADER_ALIVE(ORDER_TRADER_ID(current_order)))
 	{
-		set_up_trader(argv[i], trader_id, &(exchange_traders[i - 2]), size, product_array);
-		trader_id++;
+		send_cancel(current_order->trader, current_order->order_id);
 	}
+	archive_order(SPX_ARCHIVE_CANCEL, current_order);
+	send_market_cancel(current_order, exchange_traders, number_traders);
+	print_order_positions(order_book, product_array, size, number_traders, exchange_traders);
+	free_order(current_order);
 }
 
-/* Function: get_trader_id
- * ----------------------------
- *   Gets a trader from its trader id.
+/* Function: run_timers
+ * 	----------------------------
+ *   Advances the timer wheel to now and runs whatever expired: GTT orders are cancelled
+ *   and housekeeping runs and is armed again.
  *
- *   sent_id: the trader the sent a signal to the exchange
- *   exchange_traders: linked list of trader_struct(s)
- *   size: the number of products
- *   returns: the trader_struct of the trader with the id
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
  */
-struct trader_struct *get_trader_id(int sent_id, struct trader_struct *exchange_traders, int size)
+void run_timers(struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
-
-	if (sent_id >= size)
-	{
-		return NULL;
-	}
-	else
+	struct timer_node *timer = timer_wheel_advance(&timer_wheel, get_time_ms());
+	while (timer != NULL)
 	{
-		return exchange_traders + sent_id;
+		struct timer_node *next = timer->next;
+		if (timer->kind == TIMER_ORDER_EXPIRY)
+		{
+			char order_id[BUFFSIZE];
+			snprintf(order_id, BUFFSIZE, "%d", TIMER_ORDER(timer)->order_id);
+			journal_record(&journal, JOURNAL_EXPIRY, ORDER_TRADER_ID(TIMER_ORDER(timer)), order_id);
+			expire_order(TIMER_ORDER(timer), order_book, product_array, size, number_traders, exchange_traders);
+		}
+		else if (timer->kind == TIMER_CHECKPOINT)
+		{
+			// Taken by the main loop, which knows the exchange fee
+			checkpointer.due = TRUE;
+			timer->expires += checkpointer.interval;
+			timer_wheel_add(&timer_wheel, timer);
+		}
+		else if (timer->kind == TIMER_HOUSEKEEPING)
+		{
+			if (bar_writer.enabled)
+			{
+				bar_flush_stale(&bar_writer, get_epoch_ms());
+			}
+			fflush(stdout);
+			timer->expires += HOUSEKEEPING_INTERVAL;
+			timer_wheel_add(&timer_wheel, timer);
+		}
+		timer = next;
 	}
 }
 
-/* Function: send_invalid
+/* Function: send_market_signals
  * 	----------------------------
- *   Sends invalid to the trader.
+ *   Sends accepted or amend.
  *
- *   pipe: the exchanage to trader pipe of the trader
- *   child: the PID of the trader
+ *   current_order: current order we want to match
+ *   match: pointer to indicate whether the order is of type 'accept' or 'amend'
  */
-void send_invalid(FILE *pipe, int child)
+void send_market_signals(int *append, struct order_type *current_order, struct trader_struct *exchange_traders, int number_traders)
 {
-	fprintf(pipe, "INVALID;");
-	fflush(pipe);
-	kill(child, SIGUSR1);
+	struct spx_message message = {*append == FALSE ? SPX_ACCEPTED : SPX_AMENDED, current_order->order_id, 0, NULL, 0, 0};
+	send_message(current_order->trader, &message);
+	archive_order(*append == FALSE ? SPX_ARCHIVE_NEW : SPX_ARCHIVE_AMEND, current_order);
+
+	// Formatted once for every trader
+	struct tape_event event = {0, TAPE_MARKET, current_order->type, current_order->quantity, current_order->price};
+	tape_record(&trade_tape, &event, ORDER_RECORD(current_order)->product_index);
+	send_market_update(&event, current_order, exchange_traders, number_traders);
 }
 
-/* Function: send_cancel
+/* Function: process_matching
  * 	----------------------------
- *   Sends cancel to the trader.
+ *   Processes the order matching.
  *
- *   pipe: the exchanage to trader pipe of the trader
- *   child: the PID of the trader
- *   order_id: the order id of the cancelled order
+ *   order_book: the orderbook array
+ *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   current_order: current order we want to match
+ *   returns: exchange fee for the order
  */
-void send_cancel(FILE *pipe, int child, int order_id)
+long int process_matching(struct product_info *order_book, int size, int number_traders, struct trader_struct *exchange_traders, struct order_type *current_order)
 {
-	fprintf(pipe, "CANCELLED %d;", order_id);
-	fflush(pipe);
-	kill(child, SIGUSR1);
-}
+	long int exchange_fee = 0;
+	struct order_type *unfilled = NULL;
+	struct product_info *product_node = &(order_book[ORDER_RECORD(current_order)->product_index]);
+	// Nothing to match against, or orders are only collected until the next uncross
+	int rest_only = product_node->first_order == NULL || call_auction.interval > 0;
+	if (rest_only && !TIF_RESTS(ORDER_RECORD(current_order)->time_in_force))
+	{
+		unfilled = current_order;
+	}
+	else if (rest_only && current_order->type == SELL)
+	{
+		insert_sell_order(product_node, current_order);
+	}
+	else if (rest_only)
+	{
+		insert_buy_order(product_node, current_order);
+	}
+	else
+	{
+		current_order->prev = NULL;
+		current_order->next = NULL;
+		exchange_fee += match_order(product_node, current_order, size, &unfilled);
+	}
 
-/* Function: send_fill
- * 	----------------------------
- *   Sends a fill order to the trader.
- *
- *   pipe: the exchanage to trader pipe of the trader
- *   child: the PID of the trader
- *   order_id: the order id of the cancelled order
- *   quantity: quantity of the filled order
- */
-void send_fill(FILE *pipe, int child, int order_id, long int quantity)
-{
-	fprintf(pipe, "FILL %d %ld;", order_id, quantity);
-	fflush(pipe);
-	kill(child, SIGUSR1);
+	// Drop what is left of an IOC/FOK order instead of resting it
+	if (unfilled != NULL)
+	{
+		send_cancel(unfilled->trader, unfilled->order_id);
+		archive_order(SPX_ARCHIVE_CANCEL, unfilled);
+		send_market_cancel(unfilled, exchange_traders, number_traders);
+		free_order(unfilled);
+	}
+	return exchange_fee;
 }
 
-/* Function: make_current_order
+/* Function: find_clearing_price
  * 	----------------------------
- *   Create an 'order' by populating an order_type struct.
+ *   Finds the single price that executes the most volume from the cumulative bid and ask
+ *   curves of a (possibly crossed) orderbook. Ties go to the smallest imbalance, then the
+ *   price closest to the last traded price, then the lowest price.
  *
- *   size: the number of products
- *   number_traders: the number of traders
- *   product_array: the array that stores the products as strings
- *   buff: the array which stores the order characters to be processed
- *   sent_id: the id of the trader that sent the order
- *   exchange_traders: linked list of trader_struct(s)
+ *   product_node: product_info for the product orderbook
+ *   product_index: the index of the product
+ *   volume: set to the volume that executes at the clearing price
+ *   returns: the clearing price, or 0 if the book does not cross
  */
-struct order_type *make_current_order(int size, int number_traders, char **product_array, char *buff, int sent_id, struct trader_struct *exchange_traders)
+long int find_clearing_price(struct product_info *product_node, int product_index, long int *volume)
 {
+	*volume = 0;
+	if (product_node->buy == 0 || product_node->sell == 0)
+	{
+		return 0;
+	}
 
-	struct order_type *current_order = malloc(sizeof(struct order_type));
-	current_order->trader = get_trader_id(sent_id, exchange_traders, number_traders);
-	current_order->level = 1;
-	current_order->prev = NULL;
-	current_order->next = NULL;
-	current_order->product = malloc(sizeof(char) * PRODUCT_SIZE);
-	int line_num = 0;
-	while (line_num < LINE_ITEMS)
+	// Price levels of each side, asks ascending and bids descending
+	long int *ask_price = malloc(sizeof(long int) * product_node->sell);
+	long int *ask_quantity = malloc(sizeof(long int) * product_node->sell);
+	long int *bid_price = malloc(sizeof(long int) * product_node->buy);
+	long int *bid_quantity = malloc(sizeof(long int) * product_node->buy);
+	int ask_levels = 0;
+	int bid_levels = 0;
+	long int total_bid = 0;
+	struct order_type *node = product_node->first_order;
+	while (node != NULL && node->type == SELL)
 	{
-		char *line = strsep(&buff, " ");
-		if (line == NULL)
+		if (ask_levels == 0 || ask_price[ask_levels - 1] != node->price)
 		{
-			send_invalid(current_order->trader->fp_exchange_t, current_order->trader->pid_child);
-			free(current_order->product);
-			free(current_order);
-			return NULL;
+			ask_price[ask_levels] = node->price;
+			ask_quantity[ask_levels] = 0;
+			ask_levels++;
 		}
-		// Command
-		if (line_num == 0)
+		ask_quantity[ask_levels - 1] += node->quantity;
+		node = node->next;
+	}
+	while (node != NULL)
+	{
+		if (bid_levels == 0 || bid_price[bid_levels - 1] != node->price)
 		{
-			int order_type_int = 0;
-			if (strcmp(line, "BUY") == 0)
-			{
-				order_type_int = BUY;
-			}
-			else if (strcmp(line, "SELL") == 0)
-			{
-				order_type_int = SELL;
-			}
+			bid_price[bid_levels] = node->price;
+			bid_quantity[bid_levels] = 0;
+			bid_levels++;
+		}
+		bid_quantity[bid_levels - 1] += node->quantity;
+		total_bid += node->quantity;
+		node = node->next;
+	}
 
-			current_order->type = order_type_int;
+	// Every level price is a candidate, merged into ascending order
+	long int *candidates = malloc(sizeof(long int) * (ask_levels + bid_levels));
+	int number_candidates = 0;
+	int a = 0;
+	int b = bid_levels - 1;
+	while (a < ask_levels || b >= 0)
+	{
+		long int price;
+		if (b < 0 || (a < ask_levels && ask_price[a] <= bid_price[b]))
+		{
+			price = ask_price[a++];
 		}
-		// Order id
-		if (line_num == 1)
+		else
 		{
-			int order_id = atoi(line);
-			if (current_order->trader->order_valid == order_id || order_id == UPPER_BOUND)
-			{
-				current_order->order_id = order_id;
-			}
-			else
-			{
-				send_invalid(current_order->trader->fp_exchange_t, current_order->trader->pid_child);
-				free(current_order->product);
-				free(current_order);
-				return NULL;
-			}
+			price = bid_price[b--];
 		}
-		// Product
-		else if (line_num == 2)
+		if (number_candidates == 0 || candidates[number_candidates - 1] != price)
 		{
-			int product_exists = check_product(line, product_array, size);
-			if (product_exists == FALSE)
-			{
-				send_invalid(current_order->trader->fp_exchange_t, current_order->trader->pid_child);
-				free(current_order->product);
-				free(current_order);
-				return NULL;
-			}
-			else
-			{
+			candidates[number_candidates++] = price;
+		}
+	}
 
-				strcpy(current_order->product, line);
-			}
+	// Asks at or below a price sell at it, bids at or above it buy at it
+	long int clearing_price = 0;
+	long int best_imbalance = 0;
+	long int cumulative_ask = 0;
+	long int dropped_bid = 0;
+	long int last_price = position_book.last_price[product_index];
+	a = 0;
+	b = bid_levels - 1;
+	for (int i = 0; i < number_candidates; i++)
+	{
+		long int price = candidates[i];
+		while (a < ask_levels && ask_price[a] <= price)
+		{
+			cumulative_ask += ask_quantity[a++];
 		}
-		// Quantity
-		else if (line_num == 3)
+		while (b >= 0 && bid_price[b] < price)
 		{
-			long int quantity = atoi(line);
-			if (quantity > 0 && quantity < UPPER_BOUND)
-			{
-				current_order->quantity = atoi(line);
-			}
-			else
-			{
-				send_invalid(current_order->trader->fp_exchange_t, current_order->trader->pid_child);
-				free(current_order->product);
-				free(current_order);
-				return NULL;
-			}
+			dropped_bid += bid_quantity[b--];
 		}
-		// Price
-		else if (line_num == 4)
+		long int cumulative_bid = total_bid - dropped_bid;
+		long int executable = cumulative_ask < cumulative_bid ? cumulative_ask : cumulative_bid;
+		long int imbalance = labs(cumulative_ask - cumulative_bid);
+		if (executable == 0)
 		{
-			char *strdod_ptr;
-			long int price = strtod(line, &strdod_ptr);
-			if (price > 0 && price < UPPER_BOUND)
-			{
-				current_order->price = price;
-			}
-			else
-			{
-				send_invalid(current_order->trader->fp_exchange_t, current_order->trader->pid_child);
-				free(current_order->product);
-				free(current_order);
-				return NULL;
-			}
+			continue;
+		}
+		if (executable > *volume || (executable == *volume && imbalance < best_imbalance) || (executable == *volume && imbalance == best_imbalance && last_price != 0 && labs(price - last_price) < labs(clearing_price - last_price)))
+		{
+			*volume = executable;
+			best_imbalance = imbalance;
+			clearing_price = price;
 		}
-		line_num++;
-	}
-
-	char *line = strsep(&buff, " ");
-
-	if (line != NULL)
-	{
-
-		send_invalid(current_order->trader->fp_exchange_t, current_order->trader->pid_child);
-		free(current_order->product);
-		free(current_order);
-		return NULL;
 	}
 
-	current_order->trader->order_valid++;
-
-	return current_order;
+	free(ask_price);
+	free(ask_quantity);
+	free(bid_price);
+	free(bid_quantity);
+	free(candidates);
+	return clearing_price;
 }
 
-/* Function: free_traders
+/* Function: auction_fill
  * 	----------------------------
- *   Frees the memory of the trader_struct(s).
+ *   Fills a buy and a sell against each other at the clearing price. The order that
+ *   arrived later pays the exchange fee, as it would have in continuous matching.
  *
- *   number_traders: the number of traders
- *   exchange_traders: linked list of trader_struct(s)
+ *   product_node: product_info for the product orderbook
+ *   buy_order: the buy order
+ *   sell_order: the sell order
+ *   quantity: quantity filled
+ *   price: the clearing price
+ *   returns: the exchange fee for the fill
  */
-void free_traders(int number_traders, struct trader_struct *exchange_traders)
+long int auction_fill(struct product_info *product_node, struct order_type *buy_order, struct order_type *sell_order, long int quantity, long int price)
 {
-	for (size_t i = 0; i < number_traders; i++)
+	int product_index = ORDER_RECORD(buy_order)->product_index;
+	struct order_type *earlier = buy_order;
+	struct order_type *later = sell_order;
+	if (ORDER_RECORD(buy_order)->sequence > ORDER_RECORD(sell_order)->sequence)
 	{
-		fclose(exchange_traders[i].fp_exchange_t);
-		fclose(exchange_traders[i].fp_trader_e);
-		remove(exchange_traders[i].pipe_exchange_t);
-		remove(exchange_traders[i].pipe_trader_e);
-		free(exchange_traders[i].pipe_exchange_t);
-		free(exchange_traders[i].pipe_trader_e);
-		free(exchange_traders[i].positions);
+		earlier = sell_order;
+		later = buy_order;
+	}
+	long int value = price * quantity;
+	long int exchange_fee = get_exchange_fee(value);
+
+	int buy_cell = POSITION_INDEX(&position_book, ORDER_TRADER_ID(buy_order), product_index);
+	int sell_cell = POSITION_INDEX(&position_book, ORDER_TRADER_ID(sell_order), product_index);
+	position_book.quantity[buy_cell] += quantity;
+	position_book.cash[buy_cell] -= value;
+	position_book.quantity[sell_cell] -= quantity;
+	position_book.cash[sell_cell] += value;
+	position_book.cash[POSITION_INDEX(&position_book, ORDER_TRADER_ID(later), product_index)] -= exchange_fee;
+	position_book.last_price[product_index] = price;
+	struct tape_event trade = {0, TAPE_TRADE, later->type, quantity, price};
+	tape_record(&trade_tape, &trade, product_index);
+	if (bar_writer.enabled)
+	{
+		bar_add_trade(&bar_writer, product_index, quantity, price, get_epoch_ms());
+	}
+	if (archive.enabled)
+	{
+		archive_row(&archive, SPX_ARCHIVE_FILL, later, price, quantity, ORDER_TRADER_ID(earlier), earlier->order_id, get_time_ns());
 	}
-	free(exchange_traders);
-}
 
-/* Function: free_order_book
- * 	----------------------------
- *   Frees the memory of the order book.
- *
- *   order_book: array of orders
- *   size: the number of products
- */
-void free_order_book(struct product_info *order_book, int size)
-{
-	for (size_t i = 0; i < size; i++)
+	printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, earlier->order_id, ORDER_TRADER_ID(earlier), later->order_id, ORDER_TRADER_ID(later), value, exchange_fee);
+	if (drop_copy.header != NULL)
 	{
-		struct order_type *orders = order_book[i].first_order;
-		struct order_type *order_before;
-		while (orders != NULL)
-		{
-			order_before = orders;
-			orders = orders->next;
-			free(order_before->product);
-			free(order_before);
-		}
+		struct spx_execution execution = {0};
+		execution.buy_trader = ORDER_TRADER_ID(buy_order);
+		execution.buy_order = buy_order->order_id;
+		execution.sell_trader = ORDER_TRADER_ID(sell_order);
+		execution.sell_order = sell_order->order_id;
+		execution.product_index = product_index;
+		execution.aggressor = later == buy_order ? SPX_AGGRESSOR_BUY : SPX_AGGRESSOR_SELL;
+		execution.price = price;
+		execution.quantity = quantity;
+		execution.fee = exchange_fee;
+		drop_copy_fill(&drop_copy, &execution);
 	}
-	free(order_book);
+	if (TRADER_ALIVE(ORDER_TRADER_ID(buy_order)))
+	{
+		send_fill(buy_order->trader, buy_order->order_id, quantity);
+	}
+	if (TRADER_ALIVE(ORDER_TRADER_ID(sell_order)))
+	{
+		send_fill(sell_order->trader, sell_order->order_id, quantity);
+	}
+	send_trade_update(&trade, later->product);
+
+	book_order_filled(product_node, buy_order, quantity);
+	book_order_filled(product_node, sell_order, quantity);
+	buy_order->quantity -= quantity;
+	sell_order->quantity -= quantity;
+	return exchange_fee;
 }
 
-/* Function: free_product_array
+/* Function: uncross_product
  * 	----------------------------
- *   Frees the memory of the product array.
+ *   Uncrosses one product's orderbook at its clearing price. Bids and asks are allocated
+ *   in price-time priority from the top of each side until the clearing volume is filled.
  *
- *   size: the number of products
- *   product_array: the array that stores the products as strings
+ *   product_node: product_info for the product orderbook
+ *   product_index: the index of the product
+ *   product: the name of the product
+ *   returns: the exchange fee for the fills
  */
-void free_product_array(int size, char **product_array)
+long int uncross_product(struct product_info *product_node, int product_index, char *product)
 {
-	for (size_t i = 0; i < size; i++)
+	long int volume = 0;
+	long int price = find_clearing_price(product_node, product_index, &volume);
+	if (volume == 0)
 	{
-		free(product_array[i]);
+		return 0;
 	}
-	free(product_array);
-}
+	printf("%s Uncross %s: %ld @ $%ld\n", LOG_PREFIX, product, volume, price);
 
-/* Function: update_product_info
- * 	----------------------------
- *   Updates the product info buy and sell numbers for a product orderbook.
- *
- *   type: update buy or sell quantity
- *   product_node: the product_info struct to update
- */
-void update_product_info(int type, struct product_info *product_node)
-{
-	if (type == BUY)
+	long int exchange_fee = 0;
+	struct order_type *sell_order = product_node->first_order;
+	struct order_type *buy_order = product_node->first_order;
+	for (int i = 0; i < product_node->sell; i++)
 	{
-		(product_node->buy)++;
+		buy_order = buy_order->next;
 	}
-	else if (type == SELL)
+	while (volume > 0)
 	{
-		(product_node->sell)++;
+		long int quantity = sell_order->quantity < buy_order->quantity ? sell_order->quantity : buy_order->quantity;
+		if (volume < quantity)
+		{
+			quantity = volume;
+		}
+		exchange_fee += auction_fill(product_node, buy_order, sell_order, quantity, price);
+		volume -= quantity;
+
+		if (sell_order->quantity == 0)
+		{
+			struct order_type *next_node = sell_order->next;
+			remove_match_node(sell_order, product_node);
+			sell_order = next_node;
+		}
+		if (buy_order->quantity == 0)
+		{
+			struct order_type *next_node = buy_order->next;
+			remove_match_node(buy_order, product_node);
+			buy_order = next_node;
+		}
 	}
+	return exchange_fee;
 }
 
-/* Function: get_trader_positions
+/* Function: run_call_auction
  * 	----------------------------
- *   Gets the trader's position for a product.
+ *   Uncrosses every product and prints the orderbook if anything traded.
  *
- *   match_array: a trader_positions object which we compare to the product
- *   size: the number of products
- *   product: the product to match against
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   returns: exchange fee for the auction
  */
-struct trader_positions *get_trader_positions(struct trader_positions *match_array, int size, char *product)
+long int run_call_auction(struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
-
-	size_t i = 0;
-	for (i = 0; i < size; i++)
+	long int exchange_fee = 0;
+	int traded = FALSE;
+	for (int i = 0; i < size; i++)
 	{
-		if (strcmp(match_array[i].product, product) == 0)
+		int resting = order_book[i].buy + order_book[i].sell;
+		exchange_fee += uncross_product(&(order_book[i]), i, product_array[i]);
+		// Every uncross fills at least one order completely
+		if (order_book[i].buy + order_book[i].sell != resting)
 		{
-			return &(match_array[i]);
+			traded = TRUE;
 		}
 	}
-	return &(match_array[i]);
+	if (traded)
+	{
+		print_order_positions(order_book, product_array, size, number_traders, exchange_traders);
+	}
+	return exchange_fee;
 }
 
-/* Function: custom_round
+/* Function: read_trader_pipe
  * 	----------------------------
- *   Rounds the exchange fee to the nearest dollar.
+ *   Reads what a trader process has written into its input, until the pipe is empty or
+ *   the input is full. A full input stops the pipe being watched until the scheduler
+ *   makes room, which in turn blocks the trader once the pipe fills.
  *
- *   to_round: the double to round
- *   returns: the rounded long int
+ *   trader: the trader
  */
-long int custom_round(double to_round)
+void read_trader_pipe(struct trader_struct *trader)
 {
-	long int semi_round = (long int)to_round;
-	if (to_round - semi_round >= 0.5)
+	struct trader_input *input = &(scheduler.inputs[trader->trader_id]);
+	while (!input->eof)
 	{
-		return semi_round + 1;
+		if (input->length == INPUT_SIZE)
+		{
+			if (!input_has_command(input))
+			{
+				// No command is this long
+				input->length = 0;
+				continue;
+			}
+			if (!input->paused)
+			{
+				struct epoll_event event = {0};
+				event.data.fd = trader->trader_fd;
+				epoll_ctl(trader_index.epoll_fd, EPOLL_CTL_MOD, trader->trader_fd, &event);
+				input->paused = TRUE;
+			}
+			return;
+		}
+		ssize_t length = read(trader->trader_fd, input->buffer + input->length, INPUT_SIZE - input->length);
+		if (length > 0)
+		{
+			input->length += length;
+			capture_input(&capture, trader->trader_id, input, input->length - length);
+			schedule_trader(trader->trader_id);
+		}
+		else if (length == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		else
+		{
+			input->eof = TRUE;
+			input->closed = TRUE;
+			forget_trader_fd(&trader_index, trader);
+			schedule_trader(trader->trader_id);
+		}
 	}
-
-	return semi_round;
 }
 
-/* Function: remove_match_node
+/* Function: poll_traders
  * 	----------------------------
- *   Removes an order from the order book.
+ *   Waits for traders and reads whatever the ready ones have written. Traders that hung
+ *   up or exited are marked closed, the scheduler disconnects them once their last
+ *   commands are done.
  *
- *   match_node: the order to remove
- *   index_node: pointer to next order to match
- *   product_node: product_info for the product orderbook
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   timeout: milliseconds to wait for a trader, -1 to wait until one is ready
+ *   returns: the number of traders and gateway events that were ready
  */
-void remove_match_node(struct order_type *match_node, struct order_type **index_node, struct product_info *product_node)
+int poll_traders(int number_traders, struct trader_struct *exchange_traders, int timeout)
 {
-	struct order_type *match_order_before = match_node->prev;
-	if (match_order_before == NULL && match_node->next != NULL)
+	int ready = epoll_wait(trader_index.epoll_fd, trader_index.events, number_traders, timeout);
+	for (int i = 0; i < ready; i++)
 	{
-		product_node->first_order = match_node->next;
-		match_node->next->prev = NULL;
-	}
-	else if (match_node->next != NULL)
-	{
-		match_order_before->next = match_node->next;
-		match_node->next->prev = match_order_before;
+		if (trader_index.events[i].data.fd == gateway.epoll_fd || trader_index.events[i].data.fd == partition.command_fd)
+		{
+			continue;
+		}
+		int id = trader_index.fd_traders[trader_index.events[i].data.fd];
+		if (id != -1)
+		{
+			read_trader_pipe(&(exchange_traders[id]));
+		}
 	}
-	else if (match_node->next == NULL)
+	// Child disconnect
+	if (old_disconnect != disconnect_child)
 	{
-		product_node->first_order = NULL;
+		int id = find_trader_pid(&trader_index, disconnect_child);
+		if (id != -1)
+		{
+			read_trader_pipe(&(exchange_traders[id]));
+			scheduler.inputs[id].closed = TRUE;
+			schedule_trader(id);
+		}
+		old_disconnect = disconnect_child;
 	}
-	*index_node = (*index_node)->next;
-	free(match_node->product);
-	free(match_node);
+	return ready;
 }
 
-/* Function: match_sell_equal_quan
+/* Function: enter_order
  * 	----------------------------
- *   Match a sell order to a buy order that has the same quantity.
+ *   Sends a new or amended order to the market: acknowledges it, matches it and lets
+ *   what is left rest.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
+ *   current_order: the order
+ *   amended: TRUE for an amended order, FALSE for a new one
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
  *   size: size of the product array
- *   index_node: pointer to next order to match
- *   match_node: the order we have matched against
- *   returns: the exchange fee for this fill
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   returns: exchange fee for the order
  */
-long int match_sell_equal_quan(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **index_node, struct order_type *match_node)
+long int enter_order(struct order_type *current_order, int amended, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
-	long int exchange_fee = 0;
-	struct trader_positions *buy_trader_positions = get_trader_positions(match_node->trader->positions, size, current_order->product);
-	buy_trader_positions->quantity += current_order->quantity;
-	long int quantity = current_order->price * current_order->quantity;
-	buy_trader_positions->price -= quantity;
-	struct trader_positions *sell_trader_positions = get_trader_positions(current_order->trader->positions, size, current_order->product);
-	exchange_fee = custom_round(0.01 * (quantity));
-	sell_trader_positions->quantity -= current_order->quantity;
-	sell_trader_positions->price -= exchange_fee;
-	sell_trader_positions->price += quantity;
-
-	if (match_node->trader->alive)
+	// FOK orders that cannot fill completely never touch the book
+	if (ORDER_RECORD(current_order)->time_in_force == TIF_FOK && !check_fill_or_kill(&(order_book[ORDER_RECORD(current_order)->product_index]), current_order))
 	{
-		send_fill(match_node->trader->fp_exchange_t, match_node->trader->pid_child, match_node->order_id, match_node->quantity);
+		send_cancel(current_order->trader, current_order->order_id);
+		archive_order(SPX_ARCHIVE_CANCEL, current_order);
+		free_order(current_order);
+		return 0;
 	}
-
-	send_fill(current_order->trader->fp_exchange_t, current_order->trader->pid_child, current_order->order_id, current_order->quantity);
-
-	printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, match_node->order_id, match_node->trader->trader_id, current_order->order_id, current_order->trader->trader_id, quantity, exchange_fee);
-	free(current_order->product);
-	free(current_order);
-
-	product_node->buy -= 1;
-	remove_match_node(match_node, index_node, product_node);
+	send_market_signals(&amended, current_order, exchange_traders, number_traders);
+	long int exchange_fee = process_matching(order_book, size, number_traders, exchange_traders, current_order);
+	print_order_positions(order_book, product_array, size, number_traders, exchange_traders);
 	return exchange_fee;
 }
 
-/* Function: match_buy_equal_quan
+/* Function: process_command
  * 	----------------------------
- *   Match a buy order to a sell order that has the same quantity.
+ *   Parses and carries out one command from a trader, whether it came down the trader's
+ *   pipe or was submitted by a plugin.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
+ *   buff: the command, without the trailing ;
+ *   id: the trader that sent the command
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
  *   size: size of the product array
- *   index_node: pointer to next order to match
- *   match_node: the order we have matched against
- *   returns: the exchange fee for this fill
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   returns: exchange fees collected by the command
  */
-long int match_buy_equal_quan(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **index_node, struct order_type *match_node)
+long int process_command(char *buff, int id, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
 	long int exchange_fee = 0;
-	struct trader_positions *buy_trader_positions = get_trader_positions(current_order->trader->positions, size, current_order->product);
-	buy_trader_positions->quantity += current_order->quantity;
-	long int quantity = match_node->price * match_node->quantity;
-	buy_trader_positions->price -= quantity;
-	struct trader_positions *sell_trader_positions = get_trader_positions(match_node->trader->positions, size, current_order->product);
-	exchange_fee = custom_round(0.01 * (quantity));
-	sell_trader_positions->quantity -= current_order->quantity;
-	buy_trader_positions->price -= exchange_fee;
-	sell_trader_positions->price += quantity;
-
-	send_fill(current_order->trader->fp_exchange_t, current_order->trader->pid_child, current_order->order_id, current_order->quantity);
+	int *sent_id = &id;
+	int match_val = TRUE;
+	int *match = &match_val;
+	int append_val = FALSE;
+	int *append = &append_val;
+	// Commands from the scheduler are shorter than BUFFSIZE, so their copy fits on the stack
+	char buff_copy[BUFFSIZE];
+	size_t buff_length = strlen(buff);
+	char *buff_check = buff_length < BUFFSIZE ? buff_copy : malloc(buff_length + 1);
+	memcpy(buff_check, buff, buff_length + 1);
+	char *buff_check_ptr = buff_check;
+	struct order_type *current_order = NULL;
+
+	printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX, *sent_id, buff);
+	char *command = strsep(&buff_check, " ");
+	// --------------------AMEND AND CANCEL----------------------------
+	if (strcmp(command, "AMEND") == 0 || strcmp(command, "CANCEL") == 0)
+	{
+		struct trader_struct *trader = get_trader_id(*sent_id, exchange_traders, number_traders);
+		char *order_id = strsep(&buff_check, " ");
+		if (order_id != NULL)
+		{
 
-	if (match_node->trader->alive)
+			if (strcmp(command, "CANCEL") == 0)
+			{
+				process_cancel(buff_check, sent_id, trader, current_order, exchange_traders, product_array, number_traders, order_book, match, size, order_id);
+			}
+			else if (strcmp(command, "AMEND") == 0)
+			{
+				char *sep = strsep(&buff_check, " ");
+				if (sep != NULL)
+				{
+					long int quantity = atoi(sep);
+					if (quantity > 0 && quantity < UPPER_BOUND)
+					{
+						sep = strsep(&buff_check, " ");
+						if (sep != NULL)
+						{
+							long int price = atoi(sep);
+							if (price > 0 && price < UPPER_BOUND)
+							{
+								current_order = amend_order(trader, *sent_id, atoi(order_id), quantity, price, order_book, size);
+								*match = current_order != NULL;
+								*append = current_order != NULL;
+							}
+						}
+					}
+				}
+				else
+				{
+					send_invalid(trader);
+				}
+			}
+		}
+	}
+	else if (strcmp(command, "QUOTE") == 0)
 	{
-		send_fill(match_node->trader->fp_exchange_t, match_node->trader->pid_child, match_node->order_id, match_node->quantity);
+		// --------------------QUOTE----------------------------
+		process_quote(buff_check, get_trader_id(*sent_id, exchange_traders, number_traders), product_array, size);
+		*match = FALSE;
+	}
+	else if (strcmp(command, "DEPTH") == 0)
+	{
+		// --------------------DEPTH FEED----------------------------
+		process_depth_subscribe(buff_check, get_trader_id(*sent_id, exchange_traders, number_traders), &depth_feed, product_array, size);
+		*match = FALSE;
+	}
+	else if (strcmp(command, "REPLAY") == 0)
+	{
+		// --------------------TAPE REPLAY----------------------------
+		process_replay(buff_check, get_trader_id(*sent_id, exchange_traders, number_traders), product_array, size);
+		*match = FALSE;
+	}
+	// --------------------BUY AND SELL----------------------------
+	if (*match)
+	{
+		if (*append == FALSE)
+		{
+			current_order = make_current_order(size, number_traders, product_array, buff, *sent_id, exchange_traders);
+		}
+		if (current_order != NULL)
+		{
+			exchange_fee += enter_order(current_order, *append, order_book, product_array, size, number_traders, exchange_traders);
+		}
 	}
 
-	printf("%s Match Order: %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, current_order->order_id, current_order->trader->trader_id, match_node->order_id, match_node->trader->trader_id, quantity, exchange_fee);
-	free(current_order->product);
-	free(current_order);
+	publish_depth_feed(&depth_feed);
+
+	if (buff_check_ptr != buff_copy)
+	{
+		free(buff_check_ptr);
+	}
 
-	product_node->sell -= 1;
-	remove_match_node(match_node, index_node, product_node);
 	return exchange_fee;
 }
 
-/* Function: match_sell_buy_bigger
+/* Function: process_plugin_command
  * 	----------------------------
- *   Match a sell order to a buy order that has a bigger quantity than the sell order.
+ *   Processes a command a plugin submitted straight from its fields, the way
+ *   process_command would the same command as text.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
+ *   command: the command
+ *   id: the plugin's trader id
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
  *   size: size of the product array
- *   index_node: pointer to next order to match
- *   match_node: the order we have matched against
- *   returns: the exchange fee for this fill
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   returns: exchange fee for the command
  */
-long int match_sell_buy_bigger(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **index_node, struct order_type *match_node)
+long int process_plugin_command(struct plugin_command *command, int id, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
 	long int exchange_fee = 0;
-	struct trader_positions *buy_trader_positions = get_trader_positions(match_node->trader->positions, size, current_order->product);
-	buy_trader_positions->quantity += current_order->quantity;
-	long int quantity = match_node->price * current_order->quantity;
-	buy_trader_positions->price -= quantity;
-	match_node->quantity -= current_order->quantity;
-	struct trader_positions *sell_trader_positions = get_trader_positions(current_order->trader->positions, size, current_order->product);
-	exchange_fee = custom_round(0.01 * (quantity));
-	sell_trader_positions->quantity -= current_order->quantity;
-	sell_trader_positions->price -= exchange_fee;
-	sell_trader_positions->price += quantity;
-	if (match_node->trader->alive)
-	{
-		send_fill(match_node->trader->fp_exchange_t, match_node->trader->pid_child, match_node->order_id, current_order->quantity);
-	}
-	send_fill(current_order->trader->fp_exchange_t, current_order->trader->pid_child, current_order->order_id, current_order->quantity);
-
-	printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, match_node->order_id, match_node->trader->trader_id, current_order->order_id, current_order->trader->trader_id, quantity, exchange_fee);
-	free(current_order->product);
-	free(current_order);
-	*index_node = (*index_node)->next;
+	struct trader_struct *trader = &(exchange_traders[id]);
+	struct order_request *request = &(command->request);
+	struct order_type *current_order = NULL;
+	char line[BUFFSIZE];
+	describe_plugin_command(line, command);
+	journal_record(&journal, JOURNAL_COMMAND, id, line);
+	printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX, id, line);
+
+	switch (command->command)
+	{
+	case SPX_COMMAND_BUY:
+	case SPX_COMMAND_SELL:
+		request->product_index = get_product_index(command->product, product_array, size);
+		if (!check_order_request(trader, request))
+		{
+			send_invalid(trader);
+			break;
+		}
+		current_order = make_order(request, id, trader, product_array);
+		if (current_order != NULL)
+		{
+			exchange_fee += enter_order(current_order, FALSE, order_book, product_array, size, number_traders, exchange_traders);
+		}
+		break;
+	case SPX_COMMAND_AMEND:
+		current_order = amend_order(trader, id, request->order_id, request->quantity, request->price, order_book, size);
+		if (current_order != NULL)
+		{
+			exchange_fee += enter_order(current_order, TRUE, order_book, product_array, size, number_traders, exchange_traders);
+		}
+		break;
+	case SPX_COMMAND_CANCEL:
+		if (!cancel_order(trader, id, request->order_id, order_book, product_array, size, number_traders, exchange_traders))
+		{
+			send_invalid(trader);
+		}
+		break;
+	}
+
+	publish_depth_feed(&depth_feed);
 	return exchange_fee;
 }
 
-/* Function: match_buy_sell_bigger
+/* Function: init_gateway
  * 	----------------------------
- *   Match a buy order to a sell order that has a bigger quantity than the buy order.
+ *   Listens for gateway traders on a Unix domain socket and sets up their trader slots,
+ *   which have neither a process nor a pipe.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
- *   size: size of the product array
- *   index_node: pointer to next order to match
- *   match_node: the order we have matched against
- *   returns: the exchange fee for this fill
+ *   path: path of the socket
+ *   number_sessions: the number of gateway traders
+ *   exchange_traders: linked list of trader_struct(s)
+ *   first_trader: trader id of the first slot
+ *   returns: 0 on success, -1 if the socket could not be set up
  */
-long int match_buy_sell_bigger(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **index_node, struct order_type *match_node)
+int init_gateway(char *path, int number_sessions, struct trader_struct *exchange_traders, int first_trader)
 {
-	long int exchange_fee = 0;
-	struct trader_positions *buy_trader_positions = get_trader_positions(current_order->trader->positions, size, current_order->product);
-	buy_trader_positions->quantity += current_order->quantity;
-	long int quantity = match_node->price * current_order->quantity;
-	buy_trader_positions->price -= quantity;
-	match_node->quantity -= current_order->quantity;
-	struct trader_positions *sell_trader_positions = get_trader_positions(match_node->trader->positions, size, match_node->product);
-	exchange_fee = custom_round(0.01 * (quantity));
-	sell_trader_positions->quantity -= current_order->quantity;
-	buy_trader_positions->price -= exchange_fee;
-	sell_trader_positions->price += quantity;
-	send_fill(current_order->trader->fp_exchange_t, current_order->trader->pid_child, current_order->order_id, current_order->quantity);
-
-	printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, match_node->order_id, match_node->trader->trader_id, current_order->order_id, current_order->trader->trader_id, quantity, exchange_fee);
-
-	if (match_node->trader->alive)
+	struct sockaddr_un address = {0};
+	if (strlen(path) >= sizeof(address.sun_path))
 	{
-
-		send_fill(match_node->trader->fp_exchange_t, match_node->trader->pid_child, match_node->order_id, current_order->quantity);
+		fprintf(stderr, "%s Gateway socket path too long: %s\n", LOG_PREFIX, path);
+		return -1;
 	}
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
 
-	free(current_order->product);
-	free(current_order);
-	*index_node = (*index_node)->next;
-	return exchange_fee;
+	gateway.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (gateway.listen_fd == -1 || bind(gateway.listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(gateway.listen_fd, SOMAXCONN) == -1)
+	{
+		perror("gateway socket failed");
+		return -1;
+	}
+	fcntl(gateway.listen_fd, F_SETFL, fcntl(gateway.listen_fd, F_GETFL) | O_NONBLOCK);
+
+	gateway.epoll_fd = epoll_create1(0);
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(gateway.epoll_fd, EPOLL_CTL_ADD, gateway.listen_fd, &event);
+
+	gateway.path = path;
+	gateway.first_trader = first_trader;
+	gateway.number_sessions = number_sessions;
+	gateway.sessions = calloc(number_sessions, sizeof(struct gateway_session));
+	for (int i = 0; i < number_sessions; i++)
+	{
+		struct trader_struct *exchange_trader = &(exchange_traders[first_trader + i]);
+		gateway.sessions[i].trader_id = first_trader + i;
+		exchange_trader->trader_id = first_trader + i;
+		exchange_trader->pipe_exchange_t = NULL;
+		exchange_trader->pipe_trader_e = NULL;
+		exchange_trader->fp_exchange_t = NULL;
+		exchange_trader->fp_trader_e = NULL;
+		exchange_trader->trader_fd = -1;
+		exchange_trader->pid_child = 0;
+		exchange_trader->positions = NULL;
+		exchange_trader->alive = TRUE;
+		exchange_trader->order_valid = 0;
+	}
+	printf("%s Gateway listening on %s for Traders %d to %d\n", LOG_PREFIX, path, first_trader, first_trader + number_sessions - 1);
+	return 0;
 }
 
-/* Function: match_sell_sell_bigger
+/* Function: free_gateway
  * 	----------------------------
- *   Match a sell order to a buy where the sell order has a bigger quantity than the buy order.
- *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
- *   size: size of the product array
- *   index_node: pointer to next order to match
- *   match_node: the order we have matched against
- *   returns: the exchange fee for this fill
+ *   Closes every gateway connection and the listening socket, and frees the sessions.
  */
-long int match_sell_sell_bigger(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **index_node, struct order_type *match_node)
+void free_gateway()
 {
-	long int exchange_fee = 0;
-	struct trader_positions *buy_trader_positions = get_trader_positions(match_node->trader->positions, size, current_order->product);
-	buy_trader_positions->quantity += match_node->quantity;
-	long int quantity = match_node->price * match_node->quantity;
-	buy_trader_positions->price -= quantity;
-	struct trader_positions *sell_trader_positions = get_trader_positions(current_order->trader->positions, size, current_order->product);
-	exchange_fee = custom_round(0.01 * (quantity));
-	sell_trader_positions->quantity -= match_node->quantity;
-	sell_trader_positions->price -= exchange_fee;
-	sell_trader_positions->price += quantity;
-	current_order->quantity -= match_node->quantity;
-	if (match_node->trader->alive)
+	while (gateway.connections != NULL)
 	{
-		send_fill(match_node->trader->fp_exchange_t, match_node->trader->pid_child, match_node->order_id, match_node->quantity);
+		struct gateway_connection *connection = gateway.connections;
+		gateway.connections = connection->next;
+		close(connection->fd);
+		free(connection);
 	}
-
-	send_fill(current_order->trader->fp_exchange_t, current_order->trader->pid_child, current_order->order_id, match_node->quantity);
-
-	printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, match_node->order_id, match_node->trader->trader_id, current_order->order_id, current_order->trader->trader_id, quantity, exchange_fee);
-	if (match_node->level == 1)
+	for (int i = 0; i < gateway.number_sessions; i++)
 	{
-		product_node->buy -= 1;
+		free(gateway.sessions[i].out);
+	}
+	free(gateway.sessions);
+	if (gateway.listen_fd != -1)
+	{
+		close(gateway.listen_fd);
+		unlink(gateway.path);
+	}
+	if (gateway.epoll_fd != -1)
+	{
+		close(gateway.epoll_fd);
 	}
-	remove_match_node(match_node, index_node, product_node);
-	return exchange_fee;
 }
 
-/* Function: match_buy_buy_bigger
+/* Function: gateway_accept
  * 	----------------------------
- *   Match a buy order to a sell where the buy order has a bigger quantity than the sell order.
- *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
- *   size: size of the product array
- *   index_node: pointer to next order to match
- *   match_node: the order we have matched against
- *   returns: the exchange fee for this fill
+ *   Accepts every pending connection on the gateway socket.
  */
-long int match_buy_buy_bigger(struct product_info *product_node, struct order_type *current_order, int size, struct order_type **index_node, struct order_type *match_node)
+void gateway_accept()
 {
-	long int exchange_fee = 0;
-	struct trader_positions *buy_trader_positions = get_trader_positions(current_order->trader->positions, size, current_order->product);
-	buy_trader_positions->quantity += match_node->quantity;
-	long int quantity = match_node->price * match_node->quantity;
-	buy_trader_positions->price -= quantity;
-	struct trader_positions *sell_trader_positions = get_trader_positions(match_node->trader->positions, size, current_order->product);
-	exchange_fee = custom_round(0.01 * (quantity));
-	sell_trader_positions->quantity -= match_node->quantity;
-	buy_trader_positions->price -= exchange_fee;
-	sell_trader_positions->price += quantity;
-	current_order->quantity -= match_node->quantity;
-
-	send_fill(current_order->trader->fp_exchange_t, current_order->trader->pid_child, current_order->order_id, match_node->quantity);
-
-	if (match_node->trader->alive)
-	{
-		send_fill(match_node->trader->fp_exchange_t, match_node->trader->pid_child, match_node->order_id, match_node->quantity);
-	}
-	printf("%s Match: Order %d [T%d], New Order %d [T%d], value: $%ld, fee: $%ld.\n", LOG_PREFIX, match_node->order_id, match_node->trader->trader_id, current_order->order_id, current_order->trader->trader_id, quantity, exchange_fee);
-	if (match_node->level == 1)
+	int fd;
+	while ((fd = accept(gateway.listen_fd, NULL, NULL)) != -1)
 	{
-		product_node->sell -= 1;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		struct gateway_connection *connection = calloc(1, sizeof(struct gateway_connection));
+		connection->fd = fd;
+		connection->events = EPOLLIN;
+		connection->next = gateway.connections;
+		gateway.connections = connection;
+
+		struct epoll_event event = {0};
+		event.events = EPOLLIN;
+		event.data.ptr = connection;
+		epoll_ctl(gateway.epoll_fd, EPOLL_CTL_ADD, fd, &event);
 	}
-	remove_match_node(match_node, index_node, product_node);
-	return exchange_fee;
 }
 
-/* Function: process_sell_order
+/* Function: gateway_reject
  * 	----------------------------
- *   Find a potential match for the current order that is a sell order and then process it.
+ *   Tells a connection why its login failed and drops it.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
- *   size: size of the product array
- *   returns: exchange fee for the order if matched
+ *   connection: the connection
+ *   reason: why the login failed
  */
-long int process_sell_order(struct product_info *product_node, struct order_type *current_order, int size)
+void gateway_reject(struct gateway_connection *connection, char *reason)
 {
+	char message[BUFFSIZE];
+	int length = snprintf(message, BUFFSIZE, "LOGIN_REJECTED %s;", reason);
+	send(connection->fd, message, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+	gateway_drop(connection);
+}
 
-	struct order_type *index_node = product_node->first_order;
-	long int exchange_fee = 0;
-	int place_order = FALSE;
-	int straight_insert = FALSE;
-	if (product_node->buy == 0)
+/* Function: gateway_login
+ * 	----------------------------
+ *   Handles the LOGIN <name> handshake. A name seen before gets its old slot back, with
+ *   its resting orders and the messages it missed, a new name gets the next free slot.
+ *   The reply LOGGED_IN <trader id> comes before anything buffered for the slot.
+ *
+ *   connection: the connection logging in
+ *   buff_check: the rest of the LOGIN command
+ *   exchange_traders: linked list of traders
+ */
+void gateway_login(struct gateway_connection *connection, char *buff_check, struct trader_struct *exchange_traders)
+{
+	char *name = strsep(&buff_check, " ");
+	if (name == NULL || name[0] == '\0' || buff_check != NULL || strlen(name) >= GATEWAY_NAME_SIZE)
 	{
-		straight_insert = TRUE;
+		gateway_reject(connection, "name");
+		return;
 	}
 
-	if (product_node->buy != 0)
+	struct gateway_session *session = NULL;
+	int reconnect = FALSE;
+	for (int i = 0; i < gateway.number_sessions && session == NULL; i++)
+	{
+		if (strcmp(gateway.sessions[i].name, name) == 0)
+		{
+			session = &(gateway.sessions[i]);
+			reconnect = TRUE;
+		}
+	}
+	for (int i = 0; i < gateway.number_sessions && session == NULL; i++)
 	{
-		size_t i;
-		for (i = 0; i < product_node->sell; i++)
+		if (gateway.sessions[i].name[0] == '\0')
 		{
-			index_node = index_node->next;
+			session = &(gateway.sessions[i]);
+			strcpy(session->name, name);
 		}
+	}
+	if (session == NULL)
+	{
+		gateway_reject(connection, "full");
+		return;
+	}
+	if (!TRADER_ALIVE(session->trader_id))
+	{
+		gateway_reject(connection, "logged out");
+		return;
+	}
+	if (session->connection != NULL)
+	{
+		gateway_reject(connection, "in use");
+		return;
+	}
+
+	char reply[BUFFSIZE];
+	int length = snprintf(reply, BUFFSIZE, "LOGGED_IN %d;", session->trader_id);
+	if (session->out_length + length > GATEWAY_BUFFER_MAX)
+	{
+		// Too far behind to catch up, it starts again from the reply
+		session->missed++;
+		session->out_length = 0;
+	}
+	gateway_append(session, reply, length);
+	memmove(session->out + length, session->out, session->out_length - length);
+	memcpy(session->out, reply, length);
+
+	connection->session = session;
+	session->connection = connection;
+	printf("%s Trader %d %s as %s\n", LOG_PREFIX, session->trader_id, reconnect ? "logged in again" : "logged in", name);
+	if (session->missed > 0)
+	{
+		printf("%s Trader %d missed %ld messages while behind\n", LOG_PREFIX, session->trader_id, session->missed);
+		session->missed = 0;
+	}
+	gateway_flush(session);
+}
 
-		while (index_node != NULL)
+/* Function: gateway_read
+ * 	----------------------------
+ *   Reads what a connection has sent. The first command must be LOGIN, everything after
+ *   it goes to the trader's input for the scheduler. Reading stops while the input is
+ *   full, leaving the rest in the socket.
+ *
+ *   connection: the connection
+ *   exchange_traders: linked list of traders
+ */
+void gateway_read(struct gateway_connection *connection, struct trader_struct *exchange_traders)
+{
+	while (!connection->closing)
+	{
+		char *buffer = connection->in;
+		int *filled = &(connection->in_length);
+		int size = BUFFSIZE;
+		if (connection->session != NULL)
 		{
-			struct order_type *match_node = index_node;
-			if ((match_node->quantity == current_order->quantity) && (match_node->price >= current_order->price))
-			{
-				exchange_fee += match_sell_equal_quan(product_node, current_order, size, &index_node, match_node);
-				place_order = FALSE;
-				break;
-			}
-			else if ((match_node->quantity > current_order->quantity) && (match_node->price >= current_order->price))
+			struct trader_input *input = &(scheduler.inputs[connection->session->trader_id]);
+			if (input->length == INPUT_SIZE)
 			{
-				exchange_fee += match_sell_buy_bigger(product_node, current_order, size, &index_node, match_node);
-				place_order = FALSE;
+				if (!input_has_command(input))
+				{
+					// No command is this long
+					gateway_drop(connection);
+					break;
+				}
+				input->paused = TRUE;
+				gateway_watch(connection);
 				break;
 			}
-			else if ((match_node->quantity < current_order->quantity) && (match_node->price >= current_order->price))
-			{
-				exchange_fee += match_sell_sell_bigger(product_node, current_order, size, &index_node, match_node);
-				place_order = TRUE;
-			}
-			else
-			{
-				index_node = index_node->next;
-				place_order = TRUE;
-			}
+			buffer = input->buffer;
+			filled = &(input->length);
+			size = INPUT_SIZE;
 		}
-	}
-	// No match: add to order linked list
-	if (place_order || straight_insert)
-	{
-		if (product_node->sell == 0)
+
+		ssize_t length = read(connection->fd, buffer + *filled, size - *filled);
+		if (length == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+		if (length <= 0)
+		{
+			gateway_drop(connection);
+			break;
+		}
+		*filled += length;
+		if (connection->session != NULL)
+		{
+			capture_input(&capture, connection->session->trader_id, &(scheduler.inputs[connection->session->trader_id]), *filled - length);
+			schedule_trader(connection->session->trader_id);
+			continue;
+		}
+
+		char *end = memchr(connection->in, ';', connection->in_length);
+		if (end == NULL)
 		{
-			if (product_node->buy != 0)
+			if (connection->in_length == BUFFSIZE)
 			{
-				product_node->first_order->prev = current_order;
-				current_order->next = product_node->first_order;
+				gateway_drop(connection);
 			}
-			product_node->first_order = current_order;
+			continue;
+		}
+		*end = '\0';
+		char *buff_check = connection->in;
+		char *command = strsep(&buff_check, " ");
+		if (strcmp(command, "LOGIN") == 0)
+		{
+			gateway_login(connection, buff_check, exchange_traders);
 		}
 		else
 		{
-			struct order_type *node = product_node->first_order;
-			struct order_type *prev_node = NULL;
-			while (node != NULL && node->type == SELL)
-			{
-				if (node->price > current_order->price)
-				{
-					if (node->prev != NULL)
-					{
-						node->prev->next = current_order;
-						current_order->prev = node->prev;
-					}
-					if (node->prev == NULL)
-					{
-						product_node->first_order = current_order;
-					}
-					node->prev = current_order;
-					current_order->next = node;
-					break;
-				}
-				prev_node = node;
-				node = node->next;
-			}
-
-			if (node == NULL || node->type == BUY)
+			gateway_reject(connection, "login first");
+		}
+		// Commands sent along with the login are the trader's first input
+		if (connection->session != NULL)
+		{
+			struct trader_input *input = &(scheduler.inputs[connection->session->trader_id]);
+			int from = input->length;
+			if (!input_append(input, end + 1, connection->in + connection->in_length - (end + 1)))
 			{
-				current_order->prev = prev_node;
-				prev_node->next = current_order;
+				gateway_drop(connection);
 			}
+			capture_input(&capture, connection->session->trader_id, input, from);
+			schedule_trader(connection->session->trader_id);
+		}
+		connection->in_length = 0;
+	}
+}
 
-			if (node != NULL && node->type == BUY)
-			{
+/* Function: gateway_service
+ * 	----------------------------
+ *   Handles whatever is ready on the gateway without waiting: new connections, input
+ *   and room to send buffered messages. Connections dropped along the way are closed here.
+ *
+ *   exchange_traders: linked list of traders
+ */
+void gateway_service(struct trader_struct *exchange_traders)
+{
+	if (gateway.epoll_fd == -1)
+	{
+		return;
+	}
 
-				current_order->next = node;
-				node->prev = current_order;
-			}
+	struct epoll_event events[GATEWAY_EVENTS];
+	int ready = epoll_wait(gateway.epoll_fd, events, GATEWAY_EVENTS, 0);
+	for (int i = 0; i < ready; i++)
+	{
+		struct gateway_connection *connection = events[i].data.ptr;
+		if (connection == NULL)
+		{
+			gateway_accept();
+			continue;
+		}
+		if (connection->closing)
+		{
+			continue;
+		}
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		{
+			gateway_read(connection, exchange_traders);
+		}
+		if (events[i].events & EPOLLOUT && !connection->closing)
+		{
+			gateway_flush(connection->session);
 		}
-		product_node->sell += 1;
 	}
 
-	return exchange_fee;
+	struct gateway_connection **link = &(gateway.connections);
+	while (*link != NULL)
+	{
+		struct gateway_connection *connection = *link;
+		if (connection->closing)
+		{
+			*link = connection->next;
+			epoll_ctl(gateway.epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+			close(connection->fd);
+			free(connection);
+		}
+		else
+		{
+			link = &(connection->next);
+		}
+	}
 }
 
-/* Function: process_buy_order
+/* Function: init_scheduler
  * 	----------------------------
- *   Find a potential match for the current order that is a buy order and then process it.
+ *   Sets up every trader's input and loads the rate limits file, if there is one. Each
+ *   line of the file is a trader id, or * for every trader without a line of its own,
+ *   then the commands per second and burst of its token bucket, and optionally queue
+ *   to hold excess commands back instead of rejecting them.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
- *   size: size of the product array
- *   returns: exchange fee for the order if matched
+ *   sched: the scheduler to set up
+ *   number_traders: the number of traders
+ *   quantum: commands per trader per round
+ *   file_name: the rate limits file, or NULL for no limits
  */
-long int process_buy_order(struct product_info *product_node, struct order_type *current_order, int size)
+void init_scheduler(struct scheduler *sched, int number_traders, int quantum, char *file_name)
 {
-
-	struct order_type *index_node = product_node->first_order;
-	long int exchange_fee = 0;
-	int place_order = FALSE;
-	int straight_insert = FALSE;
-	if (product_node->sell == 0)
+	sched->number_traders = number_traders;
+	sched->quantum = quantum > 0 ? quantum : QUANTUM_DEFAULT;
+	sched->inputs = calloc(number_traders > 0 ? number_traders : 1, sizeof(struct trader_input));
+	sched->ready = malloc(sizeof(int) * (number_traders > 0 ? number_traders : 1));
+	sched->first_ready = 0;
+	sched->number_ready = 0;
+	sched->queued = calloc(number_traders > 0 ? number_traders : 1, sizeof(char));
+
+	if (file_name == NULL)
 	{
-		straight_insert = TRUE;
+		return;
 	}
-	else if (product_node->sell != 0)
+	FILE *ptr = fopen(file_name, "r");
+	if (ptr == NULL)
 	{
-		while (index_node != NULL && index_node->type != BUY)
-		{
-			struct order_type *match_node = index_node;
-			if ((match_node->quantity == current_order->quantity) && (match_node->price <= current_order->price))
-			{
-				exchange_fee += match_buy_equal_quan(product_node, current_order, size, &index_node, match_node);
-				place_order = FALSE;
-				break;
-			}
-			else if ((match_node->quantity > current_order->quantity) && (match_node->price <= current_order->price))
-			{
-				exchange_fee += match_buy_sell_bigger(product_node, current_order, size, &index_node, match_node);
-				place_order = FALSE;
-				break;
-			}
-			else if ((match_node->quantity < current_order->quantity) && (match_node->price <= current_order->price))
-			{
-				exchange_fee += match_buy_buy_bigger(product_node, current_order, size, &index_node, match_node);
-				place_order = TRUE;
-			}
-			else
-			{
-				index_node = index_node->next;
-				place_order = TRUE;
-			}
-		}
+		perror("fopen failed rate limits");
+		return;
 	}
-	// No match: add to order linked list
-	if (place_order || straight_insert)
-	{
 
-		struct order_type *node = product_node->first_order;
-		if (node != NULL && node->type != BUY)
+	char line[BUFFSIZE];
+	char trader[BUFFSIZE];
+	char mode[BUFFSIZE];
+	double rate;
+	double burst;
+	int *has_line = calloc(number_traders, sizeof(int));
+	while (fgets(line, BUFFSIZE, ptr) != NULL)
+	{
+		int fields = sscanf(line, "%s %lf %lf %s", trader, &rate, &burst, mode);
+		if (fields < 3 || rate < 0)
 		{
-			while (node->type != BUY && node->next != NULL)
-			{
-				node = node->next;
-			}
+			continue;
 		}
-		struct order_type *prev_node = NULL;
-		while (node != NULL)
+		for (int i = 0; i < number_traders; i++)
 		{
-			if (node->price < current_order->price)
+			if (strcmp(trader, "*") == 0 ? has_line[i] : atoi(trader) != i)
 			{
-				if (node->prev != NULL)
-				{
-					node->prev->next = current_order;
-					current_order->prev = node->prev;
-				}
-				if (node->prev == NULL)
-				{
-					product_node->first_order = current_order;
-				}
-				node->prev = current_order;
-				current_order->next = node;
-				break;
+				continue;
 			}
-			prev_node = node;
-			node = node->next;
+			struct trader_input *input = &(sched->inputs[i]);
+			input->rate = rate;
+			input->burst = burst < 1 ? 1 : burst;
+			input->tokens = input->burst;
+			input->refilled = get_time_us();
+			input->queue_excess = fields == 4 && strcmp(mode, "queue") == 0;
+			has_line[i] = has_line[i] || strcmp(trader, "*") != 0;
 		}
+	}
+	free(has_line);
+	fclose(ptr);
+}
 
-		if (prev_node == NULL && node == product_node->first_order)
-		{
-			product_node->first_order = current_order;
-		}
+/* Function: free_scheduler
+ * 	----------------------------
+ *   Frees the memory of the scheduler.
+ *
+ *   sched: the scheduler
+ */
+void free_scheduler(struct scheduler *sched)
+{
+	free(sched->inputs);
+	free(sched->ready);
+	free(sched->queued);
+}
+
+/* Function: refill_tokens
+ * 	----------------------------
+ *   Works out how many tokens a trader's bucket holds now.
+ *
+ *   input: the trader's input
+ *   now: get_time_us microseconds
+ *   returns: the tokens
+ */
+double refill_tokens(struct trader_input *input, int64_t now)
+{
+	double tokens = input->tokens + (now - input->refilled) * input->rate / 1000000.0;
+	return tokens < input->burst ? tokens : input->burst;
+}
 
-		else if (node == NULL)
+/* Function: take_token
+ * 	----------------------------
+ *   Takes a token from a trader's bucket for one command.
+ *
+ *   input: the trader's input
+ *   now: get_time_us microseconds
+ *   returns: TRUE if the command may go ahead
+ */
+int take_token(struct trader_input *input, int64_t now)
+{
+	if (input->rate <= 0)
+	{
+		return TRUE;
+	}
+	input->tokens = refill_tokens(input, now);
+	input->refilled = now;
+	if (input->tokens < 1)
+	{
+		return FALSE;
+	}
+	input->tokens -= 1;
+	return TRUE;
+}
+
+/* Function: resume_input
+ * 	----------------------------
+ *   Starts reading a trader's pipe or socket again once its input has room.
+ *
+ *   trader: the trader
+ */
+void resume_input(struct trader_struct *trader)
+{
+	struct trader_input *input = &(scheduler.inputs[trader->trader_id]);
+	input->paused = FALSE;
+	struct gateway_session *session = get_session(trader);
+	if (session != NULL)
+	{
+		if (session->connection != NULL)
 		{
-			prev_node->next = current_order;
-			current_order->prev = prev_node;
+			gateway_watch(session->connection);
 		}
-		product_node->buy++;
 	}
-
-	return exchange_fee;
+	else if (!input->eof && trader->trader_fd != -1)
+	{
+		struct epoll_event event = {0};
+		event.events = EPOLLIN;
+		event.data.fd = trader->trader_fd;
+		epoll_ctl(trader_index.epoll_fd, EPOLL_CTL_MOD, trader->trader_fd, &event);
+	}
 }
 
-/* Function: match_order
+/* Function: end_trader
  * 	----------------------------
- *   Match an order depending on whether it's a buy or sell order.
+ *   Disconnects a trader for good: a trader process once its pipe is closed and its
+ *   commands are done, a plugin or gateway trader when it logs out.
  *
- *   product_node: product_info for the product orderbook
- *   current_order: current order we want to match
- *   size: size of the product array
- *   returns: exchange fee for the order if matched
+ *   trader: the trader
+ *   dead_children: incremented
  */
-long int match_order(struct product_info *product_node, struct order_type *current_order, int size)
+void end_trader(struct trader_struct *trader, int *dead_children)
 {
-	long int exchange_fee = 0;
-	if (current_order->type == SELL)
+	struct trader_input *input = &(scheduler.inputs[trader->trader_id]);
+	struct gateway_session *session = get_session(trader);
+	if (session != NULL && session->connection != NULL)
 	{
-		exchange_fee = process_sell_order(product_node, current_order, size);
+		struct gateway_connection *connection = session->connection;
+		gateway_flush(session);
+		gateway_drop(connection);
 	}
-	else
+	printf("%s Trader %d disconnected\n", LOG_PREFIX, trader->trader_id);
+	if (get_plugin(trader) == NULL)
 	{
-		exchange_fee = process_buy_order(product_node, current_order, size);
+		capture_disconnect(&capture, trader->trader_id);
+	}
+	trader->alive = FALSE;
+	TRADER_ALIVE(trader->trader_id) = FALSE;
+	(*dead_children)++;
+	if (get_plugin(trader) != NULL)
+	{
+		plugin_host.connected--;
+	}
+	else if (session == NULL && get_partition_slot(trader) == -1)
+	{
+		if (!input->eof)
+		{
+			forget_trader_fd(&trader_index, trader);
+			input->eof = TRUE;
+		}
+		kill(trader->pid_child, SIGKILL);
 	}
-	return exchange_fee;
 }
 
-/* Function: get_type
+/* Function: trader_has_command
  * 	----------------------------
- *   Returns a string "BUY" or "SELL" depending on the type.
+ *   Whether a trader has a command waiting for the scheduler: in its plugin's queue for
+ *   a plugin, in its input for any other trader.
  *
- *   type: type to compare against
- *   returns: A string corresponding to the encoded value
+ *   trader: the trader
+ *   input: the trader's input
+ *   returns: TRUE if it does
  */
-char *get_type(int type)
+int trader_has_command(struct trader_struct *trader, struct trader_input *input)
 {
-	if (type == SELL)
+	struct trader_plugin *plugin = get_plugin(trader);
+	if (plugin != NULL)
 	{
-		return ("SELL");
+		return plugin->number_commands > 0;
 	}
-
-	return ("BUY");
+	return input_has_command(input);
 }
 
-/* Function: print_order_positions
+/* Function: run_scheduler
  * 	----------------------------
- *   Prints the orderbook and positions for each trader.
+ *   Carries out one round of waiting commands: every trader in the ready queue in turn
+ *   gets up to quantum of its commands done, so one busy trader delays the others by at
+ *   most a quantum each round. Commands over a trader's rate limit are rejected with
+ *   INVALID, or left waiting for a token if the trader's limit queues them. A trader
+ *   with commands left goes to the back of the queue for the next round.
  *
  *   order_book: the orderbook array
  *   product_array: the array that stores the products as strings
  *   size: size of the product array
  *   number traders: the number of traders
  *   exchange_traders: linked list of traders
+ *   dead_children: incremented for every trader that ends
+ *   returns: exchange fees collected
  */
-void print_order_positions(struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
+long int run_scheduler(struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders, int *dead_children)
 {
-	printf("%s\t--ORDERBOOK--\n", LOG_PREFIX);
-
-	for (int i = 0; i < size; i++)
+	long int exchange_fee = 0;
+	int64_t now = get_time_us();
+	char line[BUFFSIZE];
+	// Traders queued while the round runs wait for the next one
+	for (int turns = scheduler.number_ready; turns > 0; turns--)
 	{
-
-		int buy_level = 0;
-		int sell_level = 0;
-
-		struct order_type *current_order = order_book[i].first_order;
-
-		while (current_order != NULL)
-		{
-			// printf("%ld\n", current_order->price);
-			if (current_order->type == BUY && !(current_order->next != NULL && current_order->next->type == BUY && current_order->next->price == current_order->price))
-			{
-				buy_level++;
-			}
-			else if (current_order->type == SELL && !(current_order->next != NULL && current_order->next->type == SELL && current_order->next->price == current_order->price))
-			{
-				sell_level++;
-			}
-			current_order = current_order->next;
-		}
-
-		printf("%s\tProduct: %s; Buy levels: %d; Sell levels: %d\n", LOG_PREFIX, product_array[i], buy_level, sell_level);
-
-		current_order = order_book[i].first_order;
-		struct order_type *prev_order = NULL;
-
-		long int number_orders = 0;
-		long int level_quantity = 0;
-
-		struct order_type *buy_start = order_book[i].first_order;
-
-		// Go to the end of the sell list
-		if (current_order != NULL && current_order->type == SELL)
+		int id = scheduler.ready[scheduler.first_ready];
+		scheduler.first_ready = (scheduler.first_ready + 1) % number_traders;
+		scheduler.number_ready--;
+		scheduler.queued[id] = FALSE;
+		struct trader_struct *trader = &(exchange_traders[id]);
+		struct trader_input *input = &(scheduler.inputs[id]);
+		struct trader_plugin *plugin = get_plugin(trader);
+		struct plugin_command command;
+		for (int served = 0; served < scheduler.quantum && TRADER_ALIVE(trader->trader_id) && trader_has_command(trader, input); served++)
 		{
-			for (int j = 0; current_order->next != NULL && current_order->next->type == SELL; j++)
-			{
-				current_order = current_order->next;
-			}
-			buy_start = current_order->next;
-
-			while (current_order != NULL)
+			if (!take_token(input, now))
 			{
-
-				number_orders += 1;
-				if (prev_order != NULL)
+				if (input->queue_excess)
 				{
-
-					if (prev_order->type != current_order->type || prev_order->price != current_order->price)
-					{
-						char *type = get_type(prev_order->type);
-
-						if (number_orders - 1 == 1)
-						{
-							printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, level_quantity, prev_order->price);
-						}
-						else
-						{
-							printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity, prev_order->price, number_orders - 1);
-						}
-
-						number_orders = 1;
-						level_quantity = 0;
-					}
+					break;
 				}
-
-				if (current_order->prev == NULL)
+				if (plugin != NULL)
 				{
-					char *type = get_type(current_order->type);
-
-					if (number_orders == 1)
-					{
-						printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, current_order->quantity, current_order->price);
-					}
-					else
-					{
-						printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity + current_order->quantity, prev_order->price, number_orders);
-					}
+					take_plugin_command(plugin, &command);
+					describe_plugin_command(line, &command);
 				}
-
-				level_quantity += current_order->quantity;
-
-				prev_order = current_order;
-				current_order = current_order->prev;
+				else
+				{
+					input_take_command(input, line);
+				}
+				input->throttled++;
+				printf("%s [T%d] Rate limited: <%s>\n", LOG_PREFIX, id, line);
+				queue_invalid(trader);
+				partition_done(trader);
+				continue;
 			}
-		}
-		if (buy_start != NULL)
-		{
-			current_order = buy_start;
-			prev_order = NULL;
-			number_orders = 0;
-			level_quantity = 0;
-			while (current_order != NULL)
+			if (plugin != NULL)
 			{
-				number_orders += 1;
-				if (prev_order != NULL)
+				take_plugin_command(plugin, &command);
+				if (command.command == SPX_COMMAND_DISCONNECT)
 				{
-
-					if (prev_order->type != current_order->type || prev_order->price != current_order->price)
-					{
-						char *type = get_type(prev_order->type);
-
-						if (number_orders - 1 == 1)
-						{
-							printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, level_quantity, prev_order->price);
-						}
-						else
-						{
-							printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity, prev_order->price, number_orders - 1);
-						}
-
-						number_orders = 1;
-						level_quantity = 0;
-					}
+					end_trader(trader, dead_children);
 				}
-
-				if (current_order->next == NULL)
+				else
 				{
-					char *type = get_type(current_order->type);
-
-					if (number_orders == 1)
-					{
-						printf("%s\t\t%s %ld @ $%ld (1 order)\n", LOG_PREFIX, type, current_order->quantity, current_order->price);
-					}
-					else
-					{
-						printf("%s\t\t%s %ld @ $%ld (%ld orders)\n", LOG_PREFIX, type, level_quantity + current_order->quantity, prev_order->price, number_orders);
-					}
+					exchange_fee += process_plugin_command(&command, id, order_book, product_array, size, number_traders, exchange_traders);
 				}
-
-				level_quantity += current_order->quantity;
-
-				prev_order = current_order;
-				current_order = current_order->next;
+				continue;
+			}
+			input_take_command(input, line);
+			if (strcmp(line, "LOGOUT") == 0 && get_session(trader) != NULL)
+			{
+				end_trader(trader, dead_children);
+			}
+			else
+			{
+				journal_record(&journal, JOURNAL_COMMAND, id, line);
+				exchange_fee += process_command(line, id, order_book, product_array, size, number_traders, exchange_traders);
+				partition_done(trader);
 			}
 		}
-	}
 
-	printf("%s\t--POSITIONS--\n", LOG_PREFIX);
-	for (int i = 0; i < number_traders; i++)
-	{
-		printf("%s\tTrader %d: ", LOG_PREFIX, i);
-		struct trader_positions *position = exchange_traders[i].positions;
-		for (int j = 0; j < size; j++)
+		if (input->unsignalled)
+		{
+			signal_trader(trader);
+		}
+		if (TRADER_ALIVE(trader->trader_id) && input->closed && !trader_has_command(trader, input))
+		{
+			end_trader(trader, dead_children);
+		}
+		else if (input->paused && INPUT_SIZE - input->length >= BUFFSIZE)
+		{
+			resume_input(trader);
+		}
+		if (TRADER_ALIVE(id) && trader_has_command(trader, input))
 		{
-			if (j == 0)
-			{
-				printf("%s %ld ($%ld)", position[j].product, position[j].quantity, position[j].price);
-			}
-			else
-			{
-				printf(", %s %ld ($%ld)", position[j].product, position[j].quantity, position[j].price);
-			}
+			schedule_trader(id);
 		}
-		printf("\n");
 	}
+	return exchange_fee;
 }
 
-/* Function: get_order
+/* Function: scheduler_timeout
  * 	----------------------------
- *   Removes the order from the orderbook and returns it.
+ *   How long the loop may wait before the scheduler has work, from the traders in the
+ *   ready queue.
  *
- *   trader_id: trader that wanted the order removed
- *   order_id: order id to remove
- *   order_book: the orderbook array
- *   size: size of the product array
+ *   number traders: the number of traders
+ *   exchange_traders: linked list of traders
+ *   now: get_time_us microseconds
+ *   returns: 0 if a trader can be served now, the milliseconds until a rate limited
+ *   trader's next token, -1 if no trader is waiting
  */
-struct order_type *get_order(int trader_id, int order_id, struct product_info *order_book, int size)
+int scheduler_timeout(int number_traders, struct trader_struct *exchange_traders, int64_t now)
 {
-	for (size_t i = 0; i < size; i++)
+	int timeout = -1;
+	for (int queued = 0; queued < scheduler.number_ready; queued++)
 	{
-		if (order_book[i].buy + order_book[i].sell == 0)
+		int i = scheduler.ready[(scheduler.first_ready + queued) % number_traders];
+		struct trader_input *input = &(scheduler.inputs[i]);
+		if (!TRADER_ALIVE(i))
 		{
 			continue;
 		}
-		struct order_type *node = order_book[i].first_order;
-		while (node != NULL)
+		if (!trader_has_command(&(exchange_traders[i]), input))
 		{
-			if (node->trader->trader_id == trader_id && node->order_id == order_id)
+			if (input->closed)
 			{
-				if (node->prev == NULL)
-				{
-					order_book[i].first_order = node->next;
-					if (node->next != NULL)
-					{
-						node->next->prev = NULL;
-					}
-				}
-				else
-				{
-					if (node->next != NULL)
-					{
-						node->next->prev = node->prev;
-					}
-					node->prev->next = node->next;
-				}
-
-				if (node->type == SELL)
-				{
-					order_book[i].sell--;
-				}
-				else
-				{
-					order_book[i].buy--;
-				}
-
-				return node;
+				return 0;
 			}
-			node = node->next;
+			continue;
+		}
+		if (input->rate <= 0 || !input->queue_excess)
+		{
+			return 0;
+		}
+		double tokens = refill_tokens(input, now);
+		if (tokens >= 1)
+		{
+			return 0;
 		}
+		int wait = (int)((1 - tokens) * 1000.0 / input->rate) + 1;
+		timeout = timeout == -1 || wait < timeout ? wait : timeout;
 	}
-	return NULL;
+	return timeout;
 }
 
-/* Function: process_cancel
+/* Function: disconnect_idle_plugins
  * 	----------------------------
- *   Removes the order from the order linked list.
+ *   When no other trader is left and the plugins have no commands waiting, disconnects
+ *   the remaining plugins so the session can end.
  *
- *   buff_check: input of the command
- *   sent_id: pointer to the id of the trader that sent the command
- *   trader_id: trader that wanted the order removed
- *   order_id: order id to remove
- *   order_book: the orderbook array
- *   size: size of the product array
- *   trader: the trader with the order to cancel
- *   current_order: current order we want to match
- *   product_array: the array that stores the products as strings
  *   number traders: the number of traders
  *   exchange_traders: linked list of traders
- *   match: pointer to indicate whether to process buy/sell
+ *   dead_children: incremented for every plugin disconnected
  */
-void process_cancel(char *buff_check, int *sent_id, struct trader_struct *trader, struct order_type *current_order, struct trader_struct *exchange_traders, char **product_array, int number_traders, struct product_info *order_book, int *match, int size, char *order_id)
+void disconnect_idle_plugins(int number_traders, struct trader_struct *exchange_traders, int *dead_children)
 {
-	char *check_next = strsep(&buff_check, " ");
-	if (check_next != NULL)
+	if (plugin_host.connected == 0 || *dead_children + plugin_host.connected != number_traders)
 	{
-		send_invalid(trader->fp_exchange_t, trader->pid_child);
+		return;
 	}
-	else
+	for (int i = 0; i < number_traders; i++)
+	{
+		if (TRADER_ALIVE(i) && trader_has_command(&(exchange_traders[i]), &(scheduler.inputs[i])))
+		{
+			return;
+		}
+	}
+	for (int i = 0; i < number_traders; i++)
 	{
+		if (TRADER_ALIVE(i))
+		{
+			end_trader(&(exchange_traders[i]), dead_children);
+		}
+	}
+}
 
-		current_order = get_order(*sent_id, atoi(order_id), order_book, size);
-		if (current_order != NULL)
+/* Function: restore_checkpoint
+ * 	----------------------------
+ *   Maps a checkpoint and rebuilds the order books, positions, order_valid counters and
+ *   the exchange fee from it. A checkpoint from a different set of products or traders
+ *   is ignored.
+ *
+ *   path: the checkpoint file
+ *   order_book: the empty orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ *   number_traders: the number of traders
+ *   exchange_traders: array of trader_struct(s)
+ *   exchange_fee: set to the fees collected before the checkpoint
+ *   returns: the last journal entry the checkpoint includes, 0 if nothing was restored
+ */
+int64_t restore_checkpoint(char *path, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders, long int *exchange_fee)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return 0;
+	}
+	struct stat info;
+	if (fstat(fd, &info) == -1 || info.st_size < (off_t)sizeof(struct checkpoint_header))
+	{
+		fprintf(stderr, "Ignoring checkpoint %s: too short\n", path);
+		close(fd);
+		return 0;
+	}
+	char *image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+	{
+		perror("mmap failed checkpoint");
+		return 0;
+	}
+
+	struct checkpoint_header *header = (struct checkpoint_header *)image;
+	char *reason = NULL;
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || header->version != CHECKPOINT_VERSION || header->product_size != PRODUCT_SIZE)
+	{
+		reason = "not a checkpoint of this version";
+	}
+	else if (header->length != info.st_size)
+	{
+		reason = "truncated";
+	}
+	else if (header->size != size || header->number_traders != number_traders)
+	{
+		reason = "different number of products or traders";
+	}
+	for (int i = 0; reason == NULL && i < size; i++)
+	{
+		if (strncmp(image + header->products_offset + (int64_t)i * PRODUCT_SIZE, product_array[i], PRODUCT_SIZE) != 0)
+		{
+			reason = "different products";
+		}
+	}
+	struct checkpoint_book *books = (struct checkpoint_book *)(image + header->books_offset);
+	struct checkpoint_order *orders = (struct checkpoint_order *)(image + header->orders_offset);
+	for (int i = 0; reason == NULL && i < size; i++)
+	{
+		if (books[i].first < 0 || books[i].buy < 0 || books[i].sell < 0 || books[i].first + books[i].buy + books[i].sell > header->number_orders)
+		{
+			reason = "bad book";
+		}
+		for (int64_t j = books[i].first; reason == NULL && j < books[i].first + books[i].buy + books[i].sell; j++)
 		{
+			struct checkpoint_order *order = &(orders[j]);
+			if (order->trader_id < 0 || order->trader_id >= number_traders || (order->type != BUY && order->type != SELL) || !ladder_accepts(i, order->price))
+			{
+				reason = "bad order";
+			}
+		}
+	}
+	if (reason != NULL)
+	{
+		fprintf(stderr, "Ignoring checkpoint %s: %s\n", path, reason);
+		munmap(image, info.st_size);
+		return 0;
+	}
 
-			send_cancel(trader->fp_exchange_t, trader->pid_child, atoi(order_id));
-			char *type = get_type(current_order->type);
+	int32_t *order_valid = (int32_t *)(image + header->order_valid_offset);
+	for (int i = 0; i < number_traders; i++)
+	{
+		exchange_traders[i].order_valid = order_valid[i];
+	}
+	int64_t cells = (int64_t)number_traders * size;
+	memcpy(position_book.quantity, image + header->quantity_offset, cells * sizeof(int64_t));
+	memcpy(position_book.cash, image + header->cash_offset, cells * sizeof(int64_t));
+	memcpy(position_book.last_price, image + header->last_price_offset, size * sizeof(int64_t));
+	*exchange_fee = header->exchange_fee;
+	order_sequence = header->order_sequence;
+
+	// Orders were saved in book order, so each one goes at the end of its product's list
+	int64_t now = get_time_ms();
+	for (int i = 0; i < size; i++)
+	{
+		struct order_type *last = NULL;
+		for (int64_t j = books[i].first; j < books[i].first + books[i].buy + books[i].sell; j++)
+		{
+			struct checkpoint_order *saved = &(orders[j]);
+			struct order_type *order = alloc_order(&order_pool);
+			struct order_record *record = ORDER_RECORD(order);
+			order->type = saved->type;
+			order->order_id = saved->order_id;
+			order->product = product_array[i];
+			order->quantity = saved->quantity;
+			order->price = saved->price;
+			order->trader = &(exchange_traders[saved->trader_id]);
+			order->level = 1;
+			order->prev = last;
+			order->next = NULL;
+			record->trader_id = saved->trader_id;
+			record->product_index = i;
+			record->time_in_force = saved->time_in_force;
+			record->sequence = saved->sequence;
+			if (record->time_in_force == TIF_GTT)
+			{
+				record->expiry.expires = now + (saved->expires_in > 0 ? saved->expires_in : 0);
+				record->expiry.kind = TIMER_ORDER_EXPIRY;
+				record->expiry.armed = FALSE;
+			}
 
-			for (size_t i = 0; i < number_traders; i++)
+			if (last == NULL)
 			{
-				if (&(exchange_traders[i]) != current_order->trader && exchange_traders[i].alive)
-				{
-					fprintf(exchange_traders[i].fp_exchange_t, "MARKET %s %s 0 0;", type, current_order->product);
-					fflush(exchange_traders[i].fp_exchange_t);
-					kill(exchange_traders[i].pid_child, SIGUSR1);
-				}
+				order_book[i].first_order = order;
+			}
+			else
+			{
+				last->next = order;
+			}
+			last = order;
+			if (order->type == SELL)
+			{
+				order_book[i].sell++;
+			}
+			else
+			{
+				order_book[i].buy++;
 			}
-			print_order_positions(order_book, product_array, size, number_traders, exchange_traders);
-			free(current_order->product);
-			free(current_order);
-			*match = FALSE;
+			book_order_added(&(order_book[i]), order);
 		}
 	}
+
+	int64_t journal_sequence = header->journal_sequence;
+	printf("%s Restored checkpoint: %" PRId64 " orders, journal entry %" PRId64 "\n", LOG_PREFIX, header->number_orders, journal_sequence);
+	munmap(image, info.st_size);
+	return journal_sequence;
 }
 
-/* Function: send_market_signals
+/* Function: replay_event
  * 	----------------------------
- *   Sends accepted or amend.
+ *   Applies one journal entry to the exchange again.
  *
- *   current_order: current order we want to match
- *   match: pointer to indicate whether the order is of type 'accept' or 'amend'
+ *   kind: the kind of entry
+ *   trader_id: the trader of the entry
+ *   text: the rest of the entry
+ *   order_book: the orderbook array
+ *   product_array: the array that stores the products as strings
+ *   size: the number of products
+ *   number_traders: the number of traders
+ *   exchange_traders: array of trader_struct(s)
+ *   returns: exchange fees collected by the entry
  */
-void send_market_signals(int *append, struct order_type *current_order, struct trader_struct *exchange_traders, int number_traders)
+long int replay_event(char kind, int trader_id, char *text, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
-	if (*append == FALSE)
+	if (kind == JOURNAL_AUCTION)
 	{
-		fprintf(current_order->trader->fp_exchange_t, "ACCEPTED %d;", current_order->order_id);
+		return run_call_auction(order_book, product_array, size, number_traders, exchange_traders);
 	}
-	else
+	if (trader_id < 0 || trader_id >= number_traders)
 	{
-		fprintf(current_order->trader->fp_exchange_t, "AMENDED %d;", current_order->order_id);
+		return 0;
 	}
-	fflush(current_order->trader->fp_exchange_t);
-	kill(current_order->trader->pid_child, SIGUSR1);
-
-	char *type = get_type(current_order->type);
-	for (size_t i = 0; i < number_traders; i++)
+	if (kind == JOURNAL_COMMAND)
+	{
+		return process_command(text, trader_id, order_book, product_array, size, number_traders, exchange_traders);
+	}
+	if (kind == JOURNAL_EXPIRY)
 	{
-		if (&(exchange_traders[i]) != current_order->trader && exchange_traders[i].alive)
+		struct order_type *order = find_order(trader_id, atoi(text), order_book, size);
+		if (order != NULL)
 		{
-			fprintf(exchange_traders[i].fp_exchange_t, "MARKET %s %s %ld %ld;", type, current_order->product, current_order->quantity, current_order->price);
-			fflush(exchange_traders[i].fp_exchange_t);
-			kill(exchange_traders[i].pid_child, SIGUSR1);
+			expire_order(order, order_book, product_array, size, number_traders, exchange_traders);
 		}
 	}
+	return 0;
 }
 
-/* Function: process_matching
+/* Function: open_journal
  * 	----------------------------
- *   Processes the order matching.
+ *   Replays the journal entries after the given one, with the exchange log and every
+ *   message to traders switched off, then opens the journal for appending. A torn last
+ *   line left by a crash is dropped.
  *
+ *   log: the journal
+ *   path: the journal file
+ *   from_sequence: the last entry already applied (by a checkpoint)
  *   order_book: the orderbook array
  *   product_array: the array that stores the products as strings
- *   size: size of the product array
- *   number traders: the number of traders
- *   exchange_traders: linked list of traders
- *   current_order: current order we want to match
- *   returns: exchange fee for the order
+ *   size: the number of products
+ *   number_traders: the number of traders
+ *   exchange_traders: array of trader_struct(s)
+ *   returns: exchange fees collected by the replayed entries
  */
-long int process_matching(struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders, struct order_type *current_order)
+long int open_journal(struct journal *log, char *path, int64_t from_sequence, struct product_info *order_book, char **product_array, int size, int number_traders, struct trader_struct *exchange_traders)
 {
 	long int exchange_fee = 0;
-	for (size_t i = 0; i < size; i++)
+	log->sequence = from_sequence;
+	FILE *fp = fopen(path, "r");
+	if (fp != NULL)
 	{
-		if (strcmp(product_array[i], current_order->product) == 0)
+		fflush(stdout);
+		int saved_stdout = dup(STDOUT_FILENO);
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+		int bars = bar_writer.enabled;
+		bar_writer.enabled = FALSE;
+		log->replaying = TRUE;
+
+		char line[BUFFSIZE * 2];
+		long int complete = 0;
+		int64_t replayed = 0;
+		while (fgets(line, sizeof(line), fp) != NULL)
 		{
-			if (order_book[i].first_order == NULL)
+			int length = strlen(line);
+			if (line[length - 1] != '\n')
 			{
-				order_book[i].first_order = current_order;
-				update_product_info(current_order->type, &(order_book[i]));
-				current_order->prev = NULL;
+				break;
 			}
-			else
+			complete = ftell(fp);
+			line[length - 1] = '\0';
+
+			int64_t sequence;
+			char kind;
+			int trader_id;
+			int offset = 0;
+			if (sscanf(line, "%" SCNd64 " %c %d %n", &sequence, &kind, &trader_id, &offset) < 3 || offset == 0 || sequence <= log->sequence)
 			{
-				current_order->prev = NULL;
-				current_order->next = NULL;
-				exchange_fee += match_order(&order_book[i], current_order, size);
+				continue;
 			}
-			break;
+			log->sequence = sequence;
+			exchange_fee += replay_event(kind, trader_id, line + offset, order_book, product_array, size, number_traders, exchange_traders);
+			replayed++;
+		}
+		fclose(fp);
+		if (truncate(path, complete) == -1)
+		{
+			perror("truncate failed journal");
 		}
+
+		log->replaying = FALSE;
+		bar_writer.enabled = bars;
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+		printf("%s Replayed %" PRId64 " journal entries\n", LOG_PREFIX, replayed);
+	}
+
+	log->fp = fopen(path, "a");
+	if (log->fp == NULL)
+	{
+		perror("fopen failed journal");
 	}
 	return exchange_fee;
 }
 
-/* Function: manage_disconnect
+/* Function: close_journal
  * 	----------------------------
- *   Manages the messages for disconnected traders.
+ *   Flushes and closes the journal.
  *
- *   filedes: poll file description
- *   number traders: the number of traders
- *   exchange_traders: linked list of traders
- *   returns: number of disconnected traders
+ *   log: the journal
  */
-int manage_disconnect(struct pollfd *filedes, int number_traders, struct trader_struct *exchange_traders)
+void close_journal(struct journal *log)
 {
-	int dead_children = 0;
-	poll(filedes, number_traders, -1);
-
-	if (!pipe_signal && old_disconnect == disconnect_child)
-	{
-		for (int i = 0; i < number_traders; i++)
-		{
-			if (filedes[i].revents & POLLHUP && exchange_traders[i].alive)
-			{
-				printf("%s Trader %d disconnected\n", LOG_PREFIX, i);
-				exchange_traders[i].alive = FALSE;
-				kill(exchange_traders[i].pid_child, SIGKILL);
-				dead_children++;
-			}
-		}
-	}
-	// Child disconnect
-	if (old_disconnect != disconnect_child)
+	if (log->fp != NULL)
 	{
-		int id = get_id_pid(disconnect_child, exchange_traders, number_traders);
-		if (exchange_traders[id].alive == TRUE)
-		{
-			printf("%s Trader %d disconnected\n", LOG_PREFIX, id);
-			exchange_traders[id].alive = FALSE;
-			dead_children++;
-		}
-		old_disconnect = disconnect_child;
+		fclose(log->fp);
+		log->fp = NULL;
 	}
-	return dead_children;
 }
 
 #ifndef TESTING
@@ -1539,17 +7881,31 @@ int main(int argc, char **argv)
 	printf("%s Starting\n", LOG_PREFIX);
 
 	int number_traders = argc - 2;
+	int number_sessions = 0;
+	if (getenv(GATEWAY_ENV) != NULL)
+	{
+		number_sessions = getenv(GATEWAY_SESSIONS_ENV) != NULL ? atoi(getenv(GATEWAY_SESSIONS_ENV)) : GATEWAY_SESSIONS_DEFAULT;
+		number_sessions = number_sessions > 0 ? number_sessions : GATEWAY_SESSIONS_DEFAULT;
+		number_traders += number_sessions;
+	}
+	int number_partition_traders = 0;
+	if (getenv(PARTITION_ENV) != NULL)
+	{
+		number_partition_traders = init_partition(&partition, getenv(PARTITION_ENV), getenv(PARTITION_FDS_ENV), number_traders);
+		if (number_partition_traders == -1)
+		{
+			return 1;
+		}
+		number_traders += number_partition_traders;
+	}
 	int size = get_products_size(argv[1]);
 	long int exchange_fee = 0;
 
 	char **product_array = load_products_file(argv[1]);
 	print_trading(product_array, size);
+	init_ladder_book(&ladder_book, argv[1], size);
 
-	struct trader_struct *exchange_traders = malloc(sizeof(struct trader_struct) * number_traders);
-	initalise_traders(argv, argc, exchange_traders, size, product_array);
-
-	market_open(number_traders, exchange_traders);
-
+	// Traders may answer as soon as they are connected, so the handlers go in first
 	struct sigaction te_sign;
 	memset(&te_sign, 0, sizeof(struct sigaction));
 	te_sign.sa_sigaction = te_sig;
@@ -1570,6 +7926,50 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	struct trader_struct *exchange_traders = malloc(sizeof(struct trader_struct) * number_traders);
+	init_busy_poll(&busy_poll, getenv(BUSY_POLL_ENV), getenv(BUSY_POLL_BACKOFF_ENV), getenv(TRADER_CORES_ENV));
+	init_scheduler(&scheduler, number_traders, getenv(QUANTUM_ENV) != NULL ? atoi(getenv(QUANTUM_ENV)) : QUANTUM_DEFAULT, getenv(RATE_LIMITS_ENV));
+	scheduler.invalid_penalty = getenv(INVALID_PENALTY_ENV) != NULL ? atof(getenv(INVALID_PENALTY_ENV)) : 0;
+	initalise_traders(argv, argc, exchange_traders);
+	if (number_sessions > 0 && init_gateway(getenv(GATEWAY_ENV), number_sessions, exchange_traders, argc - 2) == -1)
+	{
+		return 1;
+	}
+	if (number_partition_traders > 0)
+	{
+		set_up_partition_traders(&partition, exchange_traders);
+	}
+	init_position_matrix(&position_book, number_traders, size);
+	init_quote_cache(&quote_cache, size);
+	init_level_book(&level_book, size);
+	init_trade_tape(&trade_tape, size, getenv(TAPE_ENV) != NULL, exchange_traders, number_traders);
+	init_bar_writer(&bar_writer, getenv(BARS_ENV), getenv(BAR_INTERVAL_ENV) != NULL ? atol(getenv(BAR_INTERVAL_ENV)) : BAR_INTERVAL_DEFAULT, product_array, size);
+	init_risk_book(&risk_book, number_traders, size, getenv(RISK_LIMITS_ENV));
+	if (getenv(DEPTH_FEED_ENV) != NULL)
+	{
+		init_depth_feed(&depth_feed, getenv(DEPTH_FEED_ENV), product_array, size, number_traders);
+	}
+	if (getenv(DROP_COPY_ENV) != NULL)
+	{
+		init_drop_copy(&drop_copy, getenv(DROP_COPY_ENV));
+	}
+
+	if (getenv(CAPTURE_ENV) != NULL)
+	{
+		init_capture(&capture, getenv(CAPTURE_ENV), number_traders);
+	}
+	if (getenv(ARCHIVE_ENV) != NULL)
+	{
+		init_archive(&archive, getenv(ARCHIVE_ENV), product_array, size);
+	}
+	// Messages are written through the hot fields of the index from market open on
+	init_trader_index(&trader_index, exchange_traders, number_traders);
+	market_open(number_traders, exchange_traders);
+	partition_ring(&partition);
+
+	// Auction fills are sent on a timer, so a trader may already have exited when they go out
+	signal(SIGPIPE, SIG_IGN);
+
 	struct product_info *order_book = malloc(sizeof(struct product_info) * size);
 	for (size_t i = 0; i < size; i++)
 	{
@@ -1578,115 +7978,146 @@ int main(int argc, char **argv)
 		order_book[i].first_order = NULL;
 	}
 
-	struct pollfd *filedes = malloc(sizeof(struct pollfd) * number_traders);
-
-	for (int i = 0; i < number_traders; i++)
+	if (gateway.epoll_fd != -1)
+	{
+		struct epoll_event event = {0};
+		event.events = EPOLLIN;
+		event.data.fd = gateway.epoll_fd;
+		epoll_ctl(trader_index.epoll_fd, EPOLL_CTL_ADD, gateway.epoll_fd, &event);
+	}
+	if (partition.queues != NULL)
 	{
-		filedes[i].fd = exchange_traders[i].trader_fd;
-		filedes[i].events = 0;
+		struct epoll_event event = {0};
+		event.events = EPOLLIN;
+		event.data.fd = partition.command_fd;
+		epoll_ctl(trader_index.epoll_fd, EPOLL_CTL_ADD, partition.command_fd, &event);
 	}
 	int dead_children = 0;
 
+	timer_wheel_init(&timer_wheel, get_time_ms());
+	if (bar_writer.enabled)
+	{
+		housekeeping_timer.expires = get_time_ms() + HOUSEKEEPING_INTERVAL;
+		timer_wheel_add(&timer_wheel, &housekeeping_timer);
+	}
+
+	if (getenv(AUCTION_INTERVAL_ENV) != NULL)
+	{
+		call_auction.interval = atol(getenv(AUCTION_INTERVAL_ENV));
+		call_auction.next_uncross = get_time_ms() + call_auction.interval;
+	}
+
+	// --------------------RECOVERY----------------------------
+	int64_t journal_sequence = 0;
+	if (getenv(CHECKPOINT_ENV) != NULL)
+	{
+		journal_sequence = restore_checkpoint(getenv(CHECKPOINT_ENV), order_book, product_array, size, number_traders, exchange_traders, &exchange_fee);
+	}
+	if (getenv(JOURNAL_ENV) != NULL)
+	{
+		exchange_fee += open_journal(&journal, getenv(JOURNAL_ENV), journal_sequence, order_book, product_array, size, number_traders, exchange_traders);
+	}
+	if (getenv(CHECKPOINT_ENV) != NULL)
+	{
+		init_checkpointer(&checkpointer, getenv(CHECKPOINT_ENV), getenv(CHECKPOINT_INTERVAL_ENV) != NULL ? atol(getenv(CHECKPOINT_INTERVAL_ENV)) : CHECKPOINT_INTERVAL_DEFAULT);
+	}
+	publish_depth_feed(&depth_feed);
+
 	// --------------------PROCESSING----------------------------
+	start_busy_poll(&busy_poll);
 	while (dead_children < number_traders)
 	{
-		if (!pipe_signal)
-		{
-			dead_children += manage_disconnect(filedes, number_traders, exchange_traders);
-		}
-		if (pipe_signal)
-		{
-			pipe_signal = FALSE;
-			int id = 0;
-			int *sent_id = &id;
-			FILE *pipe = get_trader_e_fp(trader_sig_id, exchange_traders, number_traders, sent_id);
-			char *buff = varstin(pipe);
-			int match_val = TRUE;
-			int *match = &match_val;
-			int append_val = FALSE;
-			int *append = &append_val;
-			char *buff_check = malloc(sizeof(char) * strlen(buff) + 1);
-			strcpy(buff_check, buff);
-			char *buff_check_ptr = buff_check;
-			struct order_type *current_order = NULL;
-
-			printf("%s [T%d] Parsing command: <%s>\n", LOG_PREFIX, *sent_id, buff);
-			char *command = strsep(&buff_check, " ");
-			// --------------------AMEND AND CANCEL----------------------------
-			if (strcmp(command, "AMEND") == 0 || strcmp(command, "CANCEL") == 0)
-			{
-				struct trader_struct *trader = get_trader_id(*sent_id, exchange_traders, size);
-				char *order_id = strsep(&buff_check, " ");
-				if (order_id != NULL)
-				{
-
-					if (strcmp(command, "CANCEL") == 0)
-					{
-						process_cancel(buff_check, sent_id, trader, current_order, exchange_traders, product_array, number_traders, order_book, match, size, order_id);
-					}
-					else if (strcmp(command, "AMEND") == 0)
-					{
-						char *sep = strsep(&buff_check, " ");
-						if (sep != NULL)
-						{
-							long int quantity = atoi(sep);
-							if (quantity > 0 && quantity < UPPER_BOUND)
-							{
-								sep = strsep(&buff_check, " ");
-								if (sep != NULL)
-								{
-									long int price = atoi(sep);
-									if (price > 0 && price < UPPER_BOUND)
-									{
-										current_order = get_order(*sent_id, atoi(order_id), order_book, size);
-										if (current_order != NULL)
-										{
-											current_order->price = price;
-											current_order->quantity = quantity;
-											*match = TRUE;
-											*append = TRUE;
-										}
-									}
-								}
-							}
-						}
-						else
-						{
-							send_invalid(trader->fp_exchange_t, trader->pid_child);
-						}
-					}
-				}
-			}
-			// --------------------BUY AND SELL----------------------------
-			if (*match)
+		int timeout = timer_wheel_timeout(&timer_wheel, get_time_ms());
+		if (call_auction.interval > 0)
+		{
+			long int wait = call_auction.next_uncross - get_time_ms();
+			wait = wait > 0 ? wait : 0;
+			timeout = timeout == -1 || wait < timeout ? wait : timeout;
+		}
+		// Waiting commands are served without waiting
+		int scheduled = scheduler_timeout(number_traders, exchange_traders, get_time_us());
+		timeout = scheduled != -1 && (timeout == -1 || scheduled < timeout) ? scheduled : timeout;
+		timeout = busy_poll_timeout(&busy_poll, timeout);
+		busy_poll_ready(&busy_poll, poll_traders(number_traders, exchange_traders, timeout));
+		partition_receive(&partition);
+		// --------------------GATEWAY----------------------------
+		gateway_service(exchange_traders);
+		// --------------------TIMERS----------------------------
+		run_timers(order_book, product_array, size, number_traders, exchange_traders);
+		publish_depth_feed(&depth_feed);
+		// --------------------CALL AUCTION----------------------------
+		if (call_auction.interval > 0 && get_time_ms() >= call_auction.next_uncross)
+		{
+			journal_record(&journal, JOURNAL_AUCTION, -1, "UNCROSS");
+			exchange_fee += run_call_auction(order_book, product_array, size, number_traders, exchange_traders);
+			publish_depth_feed(&depth_feed);
+			call_auction.next_uncross += call_auction.interval;
+			if (call_auction.next_uncross <= get_time_ms())
 			{
-				if (*append == FALSE)
-				{
-					current_order = make_current_order(size, number_traders, product_array, buff, *sent_id, exchange_traders);
-				}
-				if (current_order != NULL)
-				{
-					send_market_signals(append, current_order, exchange_traders, number_traders);
-					exchange_fee += process_matching(order_book, product_array, size, number_traders, exchange_traders, current_order);
-					print_order_positions(order_book, product_array, size, number_traders, exchange_traders);
-				}
+				call_auction.next_uncross = get_time_ms() + call_auction.interval;
 			}
-
-			free(buff);
-			free(buff_check_ptr);
+		}
+		// --------------------SCHEDULER----------------------------
+		exchange_fee += run_scheduler(order_book, product_array, size, number_traders, exchange_traders, &dead_children);
+		disconnect_idle_plugins(number_traders, exchange_traders, &dead_children);
+		journal_flush(&journal);
+		partition_ring(&partition);
+		// --------------------CHECKPOINT----------------------------
+		if (checkpointer.due)
+		{
+			capture_checkpoint(&checkpointer, order_book, product_array, size, number_traders, exchange_traders, exchange_fee);
+			checkpointer.due = FALSE;
 		}
 	}
 	wait(NULL);
 
+	// Closing uncross of whatever was collected since the last one
+	if (call_auction.interval > 0)
+	{
+		journal_record(&journal, JOURNAL_AUCTION, -1, "UNCROSS");
+		exchange_fee += run_call_auction(order_book, product_array, size, number_traders, exchange_traders);
+	}
+	// The next session starts from where this one ended
+	if (checkpointer.enabled)
+	{
+		capture_checkpoint(&checkpointer, order_book, product_array, size, number_traders, exchange_traders, exchange_fee);
+	}
+
+	partition_report(&partition, product_array, size, exchange_fee);
+
 	// --------------------FREEING----------------------------
+	free_bar_writer(&bar_writer);
+	free_checkpointer(&checkpointer);
+	close_journal(&journal);
+	close_capture(&capture);
+	free_archive(&archive);
 	free_traders(number_traders, exchange_traders);
+	free_gateway();
+	free_scheduler(&scheduler);
 	free_order_book(order_book, size);
+	free_order_pool(&order_pool);
 	free_product_array(size, product_array);
-	free(filedes);
+	free_ladder_book(&ladder_book);
+	free_fill_batch(&sweep_batch);
+	free_trader_index(&trader_index);
 
 	printf("%s Trading completed\n", LOG_PREFIX);
 	printf("%s Exchange fees collected: $%ld\n", LOG_PREFIX, exchange_fee);
 
+	if (getenv(SESSION_REPORT_ENV) != NULL)
+	{
+		print_session_report(&position_book);
+	}
+	free_position_matrix(&position_book);
+	free_quote_cache(&quote_cache);
+	free_level_book(&level_book);
+	free_depth_feed(&depth_feed);
+	free_drop_copy(&drop_copy);
+	free_trade_tape(&trade_tape);
+	free_risk_book(&risk_book);
+	free_busy_poll(&busy_poll);
+	free_partition(&partition);
+
 	return 0;
 }
 
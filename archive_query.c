@@ -0,0 +1,350 @@
+#include "spx_archive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Reads a columnar event archive of the SPX exchange (see spx_archive.h). The file is
+ * memory mapped and only the columns a query needs are decoded, one chunk at a time:
+ *
+ *   archive_query <archive>                  chunks, column encodings and per product totals
+ *   archive_query <archive> csv [product]    every row, or the rows of one product, as CSV
+ *
+ * The CSV is meant for notebooks: it loads with pandas.read_csv as it is.
+ */
+
+/* Struct: archive_file
+ * ----------------------------
+ *   A mapped archive.
+ */
+struct archive_file
+{
+	const char *data;
+	size_t length;
+	const struct spx_archive_header *header;
+	const char *products;
+	uint64_t first_chunk;
+};
+
+/* Struct: product_totals
+ * ----------------------------
+ *   What the summary adds up per product.
+ */
+struct product_totals
+{
+	int64_t orders;
+	int64_t amends;
+	int64_t cancels;
+	int64_t fills;
+	int64_t volume;
+	int64_t notional;
+};
+
+const char *KIND_NAMES[] = {"", "NEW", "AMEND", "CANCEL", "FILL"};
+const char *COLUMN_NAMES[SPX_ARCHIVE_COLUMNS] = {"time_ns", "kind", "trader", "order", "product", "side", "price", "quantity", "contra_trader", "contra_order"};
+
+/* Function: open_archive
+ * 	----------------------------
+ *   Maps an archive and checks its header.
+ *
+ *   path: the archive
+ *   file: set to the mapped archive
+ *   returns: 0 on success, -1 on error
+ */
+int open_archive(char *path, struct archive_file *file)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd == -1 || fstat(fd, &info) == -1)
+	{
+		perror("open failed archive");
+		return -1;
+	}
+	if ((size_t)info.st_size < sizeof(struct spx_archive_header))
+	{
+		fprintf(stderr, "%s is not an archive\n", path);
+		close(fd);
+		return -1;
+	}
+	void *region = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED)
+	{
+		perror("mmap failed archive");
+		return -1;
+	}
+	file->data = region;
+	file->length = info.st_size;
+	file->header = region;
+	if (memcmp(file->header->magic, SPX_ARCHIVE_MAGIC, sizeof(file->header->magic)) != 0 || file->header->version != SPX_ARCHIVE_VERSION)
+	{
+		fprintf(stderr, "%s is not a version %d archive\n", path, SPX_ARCHIVE_VERSION);
+		munmap(region, info.st_size);
+		return -1;
+	}
+	file->products = file->data + sizeof(struct spx_archive_header);
+	file->first_chunk = sizeof(struct spx_archive_header) + (uint64_t)file->header->number_products * SPX_ARCHIVE_PRODUCT;
+	return 0;
+}
+
+/* Function: get_chunk
+ * 	----------------------------
+ *   Gets the chunk at an offset, if all of it is in the file. The last chunk of an
+ *   archive whose exchange did not finish may be cut short.
+ *
+ *   file: the archive
+ *   offset: where the chunk starts
+ *   returns: the chunk, NULL at the end of the archive
+ */
+const struct spx_archive_chunk *get_chunk(struct archive_file *file, uint64_t offset)
+{
+	if (offset + sizeof(struct spx_archive_chunk) > file->length)
+	{
+		return NULL;
+	}
+	const struct spx_archive_chunk *chunk = (const struct spx_archive_chunk *)(file->data + offset);
+	if (memcmp(chunk->magic, SPX_ARCHIVE_CHUNK_MAGIC, sizeof(chunk->magic)) != 0 || offset + chunk->length > file->length)
+	{
+		return NULL;
+	}
+	return chunk;
+}
+
+/* Function: decode_column
+ * 	----------------------------
+ *   Unpacks a column of a chunk straight from the mapping.
+ *
+ *   file: the archive
+ *   column: the column's entry in the chunk's column table
+ *   rows: rows of the chunk
+ *   values: room for rows values, set to the column
+ */
+void decode_column(struct archive_file *file, const struct spx_archive_column *column, int rows, int64_t *values)
+{
+	const uint64_t *words = (const uint64_t *)(file->data + column->offset);
+	uint64_t mask = column->width == 64 ? ~(uint64_t)0 : ((uint64_t)1 << column->width) - 1;
+	uint64_t previous = (uint64_t)column->first;
+	for (int i = 0; i < rows; i++)
+	{
+		uint64_t packed = 0;
+		if (column->width > 0)
+		{
+			uint64_t bit = (uint64_t)i * column->width;
+			int shift = bit & 63;
+			packed = words[bit >> 6] >> shift;
+			if (shift + column->width > 64)
+			{
+				packed |= words[(bit >> 6) + 1] << (64 - shift);
+			}
+			packed &= mask;
+		}
+		if (column->encoding == SPX_ARCHIVE_DELTA)
+		{
+			previous = i == 0 ? previous : previous + (uint64_t)column->base + packed;
+			values[i] = (int64_t)previous;
+		}
+		else
+		{
+			values[i] = (int64_t)((uint64_t)column->base + packed);
+		}
+	}
+}
+
+/* Function: get_product_index
+ * 	----------------------------
+ *   Finds a product in the archive's product names.
+ *
+ *   file: the archive
+ *   product: the product name
+ *   returns: its index, -1 if there is no such product
+ */
+int get_product_index(struct archive_file *file, char *product)
+{
+	for (uint32_t i = 0; i < file->header->number_products; i++)
+	{
+		if (strncmp(file->products + i * SPX_ARCHIVE_PRODUCT, product, SPX_ARCHIVE_PRODUCT) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Function: print_summary
+ * 	----------------------------
+ *   Prints every chunk with the encoding of its columns, then the totals per product,
+ *   which only need the kind, product, price and quantity columns.
+ *
+ *   file: the archive
+ */
+void print_summary(struct archive_file *file)
+{
+	int number_products = file->header->number_products;
+	struct product_totals *totals = calloc(number_products > 0 ? number_products : 1, sizeof(struct product_totals));
+	int64_t *kind = NULL;
+	int64_t *product = NULL;
+	int64_t *price = NULL;
+	int64_t *quantity = NULL;
+	uint32_t capacity = 0;
+	int64_t rows = 0;
+	int number_chunks = 0;
+
+	uint64_t offset = file->first_chunk;
+	const struct spx_archive_chunk *chunk;
+	while ((chunk = get_chunk(file, offset)) != NULL)
+	{
+		printf("Chunk %d: %u rows, %.3f to %.3f s, %" PRIu64 " bytes\n", number_chunks, chunk->rows, chunk->first_time / 1e9, chunk->last_time / 1e9, chunk->length);
+		for (int i = 0; i < SPX_ARCHIVE_COLUMNS; i++)
+		{
+			const struct spx_archive_column *column = &(chunk->columns[i]);
+			printf("\t%-14s %-6s %2u bits\n", COLUMN_NAMES[i], column->encoding == SPX_ARCHIVE_DELTA ? "delta" : "packed", column->width);
+		}
+		if (chunk->rows > capacity)
+		{
+			capacity = chunk->rows;
+			kind = realloc(kind, sizeof(int64_t) * capacity);
+			product = realloc(product, sizeof(int64_t) * capacity);
+			price = realloc(price, sizeof(int64_t) * capacity);
+			quantity = realloc(quantity, sizeof(int64_t) * capacity);
+		}
+		decode_column(file, &(chunk->columns[SPX_ARCHIVE_KIND]), chunk->rows, kind);
+		decode_column(file, &(chunk->columns[SPX_ARCHIVE_PRODUCT_INDEX]), chunk->rows, product);
+		decode_column(file, &(chunk->columns[SPX_ARCHIVE_PRICE]), chunk->rows, price);
+		decode_column(file, &(chunk->columns[SPX_ARCHIVE_QUANTITY]), chunk->rows, quantity);
+		for (uint32_t i = 0; i < chunk->rows; i++)
+		{
+			if (product[i] < 0 || product[i] >= number_products)
+			{
+				continue;
+			}
+			struct product_totals *total = &(totals[product[i]]);
+			switch (kind[i])
+			{
+			case SPX_ARCHIVE_NEW:
+				total->orders++;
+				break;
+			case SPX_ARCHIVE_AMEND:
+				total->amends++;
+				break;
+			case SPX_ARCHIVE_CANCEL:
+				total->cancels++;
+				break;
+			case SPX_ARCHIVE_FILL:
+				total->fills++;
+				total->volume += quantity[i];
+				total->notional += quantity[i] * price[i];
+				break;
+			}
+		}
+		rows += chunk->rows;
+		number_chunks++;
+		offset += chunk->length;
+	}
+
+	printf("%" PRId64 " rows in %d chunks, %zu bytes, %.2f bytes per row\n", rows, number_chunks, file->length, rows > 0 ? (double)file->length / rows : 0.0);
+	for (int i = 0; i < number_products; i++)
+	{
+		struct product_totals *total = &(totals[i]);
+		printf("%.*s: %" PRId64 " orders, %" PRId64 " amends, %" PRId64 " cancels, %" PRId64 " fills, volume %" PRId64 ", VWAP %.2f\n",
+			   SPX_ARCHIVE_PRODUCT, file->products + i * SPX_ARCHIVE_PRODUCT, total->orders, total->amends, total->cancels, total->fills,
+			   total->volume, total->volume > 0 ? (double)total->notional / total->volume : 0.0);
+	}
+	free(totals);
+	free(kind);
+	free(product);
+	free(price);
+	free(quantity);
+}
+
+/* Function: print_csv
+ * 	----------------------------
+ *   Prints the rows of the archive as CSV, all of them or those of one product.
+ *
+ *   file: the archive
+ *   product_index: the product, -1 for every product
+ */
+void print_csv(struct archive_file *file, int product_index)
+{
+	int64_t *columns[SPX_ARCHIVE_COLUMNS] = {NULL};
+	uint32_t capacity = 0;
+	printf("time_ns,kind,trader,order,product,side,price,quantity,contra_trader,contra_order\n");
+
+	uint64_t offset = file->first_chunk;
+	const struct spx_archive_chunk *chunk;
+	while ((chunk = get_chunk(file, offset)) != NULL)
+	{
+		offset += chunk->length;
+		if (chunk->rows > capacity)
+		{
+			capacity = chunk->rows;
+			for (int i = 0; i < SPX_ARCHIVE_COLUMNS; i++)
+			{
+				columns[i] = realloc(columns[i], sizeof(int64_t) * capacity);
+			}
+		}
+		// A product whose index is out of the chunk's range has no rows in it
+		const struct spx_archive_column *products = &(chunk->columns[SPX_ARCHIVE_PRODUCT_INDEX]);
+		if (product_index != -1 && products->encoding == SPX_ARCHIVE_PACKED &&
+			(product_index < products->base || (products->width < 63 && product_index - products->base >= ((int64_t)1 << products->width))))
+		{
+			continue;
+		}
+		for (int i = 0; i < SPX_ARCHIVE_COLUMNS; i++)
+		{
+			decode_column(file, &(chunk->columns[i]), chunk->rows, columns[i]);
+		}
+		for (uint32_t row = 0; row < chunk->rows; row++)
+		{
+			int64_t product = columns[SPX_ARCHIVE_PRODUCT_INDEX][row];
+			int64_t kind = columns[SPX_ARCHIVE_KIND][row];
+			if ((product_index != -1 && product != product_index) || product < 0 || product >= file->header->number_products)
+			{
+				continue;
+			}
+			printf("%" PRId64 ",%s,%" PRId64 ",%" PRId64 ",%.*s,%s,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n",
+				   columns[SPX_ARCHIVE_TIME][row], kind >= SPX_ARCHIVE_NEW && kind <= SPX_ARCHIVE_FILL ? KIND_NAMES[kind] : "?",
+				   columns[SPX_ARCHIVE_TRADER][row], columns[SPX_ARCHIVE_ORDER][row], SPX_ARCHIVE_PRODUCT, file->products + product * SPX_ARCHIVE_PRODUCT,
+				   columns[SPX_ARCHIVE_SIDE][row] == 1 ? "BUY" : "SELL", columns[SPX_ARCHIVE_PRICE][row], columns[SPX_ARCHIVE_QUANTITY][row],
+				   columns[SPX_ARCHIVE_CONTRA_TRADER][row], columns[SPX_ARCHIVE_CONTRA_ORDER][row]);
+		}
+	}
+	for (int i = 0; i < SPX_ARCHIVE_COLUMNS; i++)
+	{
+		free(columns[i]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 4 || (argc > 2 && strcmp(argv[2], "csv") != 0))
+	{
+		fprintf(stderr, "Usage: %s <archive> [csv [product]]\n", argv[0]);
+		return 1;
+	}
+	struct archive_file file;
+	if (open_archive(argv[1], &file) == -1)
+	{
+		return 1;
+	}
+	if (argc == 2)
+	{
+		print_summary(&file);
+	}
+	else
+	{
+		int product_index = -1;
+		if (argc == 4 && (product_index = get_product_index(&file, argv[3])) == -1)
+		{
+			fprintf(stderr, "No product %s in the archive\n", argv[3]);
+			munmap((void *)file.data, file.length);
+			return 1;
+		}
+		print_csv(&file, product_index);
+	}
+	munmap((void *)file.data, file.length);
+	return 0;
+}
@@ -0,0 +1,323 @@
+/* Matching benchmark of the SPX exchange: builds the exchange with TESTING, so its main
+ * is left out, rests a book of sells on one product and times buys that sweep the top of
+ * it. Reports per matched order the time and, where the kernel allows perf_event_open,
+ * the cache misses of sweep_order walking the resting orders and of settle_fill_batch
+ * reading the traders they belong to.
+ *
+ *   bench_match [resting orders] [rounds] [cold]
+ *
+ * cold flushes the caches before every sweep, as after the exchange has been waiting on
+ * its traders. Build it next to the exchange:
+ *
+ *   gcc -O2 -pthread -I. -o bench_match bench_match.c -ldl
+ *
+ * -DSPX_SOURCE='"<file>"' builds it against another copy of Exchange_simulator.c to
+ * compare layouts.
+ */
+
+#define TESTING
+#ifndef SPX_SOURCE
+#define SPX_SOURCE "Exchange_simulator.c"
+#endif
+#include SPX_SOURCE
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#define BENCH_RESTING 20000
+#define BENCH_ROUNDS 2000
+#define BENCH_TRADERS 8
+// Resting sells are spread over this many prices
+#define BENCH_PRICES 400
+// Bytes written to push the book out of every cache level, a line at a time
+#define BENCH_FLUSH (32 << 20)
+#define BENCH_LINE 64
+
+/* Struct: bench_counters
+ * ----------------------------
+ *   Hardware counters of a measured section: last level cache misses and level 1 data
+ *   read misses. An fd of -1 is a counter the kernel would not open. Each round's time
+ *   per matched order is kept as well, the median being steadier than the mean on a
+ *   shared host.
+ */
+struct bench_counters
+{
+	int fd[2];
+	uint64_t total[2];
+	int64_t ns;
+	int64_t start;
+	double *samples;
+	int number_samples;
+};
+
+/* Function: open_counter
+ * 	----------------------------
+ *   Opens a disabled hardware counter of this process.
+ *
+ *   type: perf event type
+ *   config: perf event config
+ *   returns: the counter's fd, -1 if it is not available
+ */
+int open_counter(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(struct perf_event_attr));
+	attr.size = sizeof(struct perf_event_attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Function: now_ns
+ * 	----------------------------
+ *   Reads CLOCK_MONOTONIC.
+ *
+ *   returns: the time in nanoseconds
+ */
+int64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Function: init_counters
+ * 	----------------------------
+ *   Opens the counters of a section.
+ *
+ *   counters: the counters to open
+ *   rounds: the number of rounds
+ */
+void init_counters(struct bench_counters *counters, int rounds)
+{
+	memset(counters, 0, sizeof(struct bench_counters));
+	counters->samples = malloc(sizeof(double) * rounds);
+	counters->fd[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	counters->fd[1] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+/* Function: start_counters
+ * 	----------------------------
+ *   Resets and starts the counters of a section.
+ *
+ *   counters: the counters
+ */
+void start_counters(struct bench_counters *counters)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (counters->fd[i] != -1)
+		{
+			ioctl(counters->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counters->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	counters->start = now_ns();
+}
+
+/* Function: stop_counters
+ * 	----------------------------
+ *   Stops the counters of a section and adds what they counted to its totals.
+ *
+ *   counters: the counters
+ *   fills: orders matched in the round
+ */
+void stop_counters(struct bench_counters *counters, int fills)
+{
+	int64_t ns = now_ns() - counters->start;
+	counters->ns += ns;
+	if (fills > 0)
+	{
+		counters->samples[counters->number_samples++] = (double)ns / fills;
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		uint64_t count = 0;
+		if (counters->fd[i] != -1)
+		{
+			ioctl(counters->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(counters->fd[i], &count, sizeof(uint64_t)) == sizeof(uint64_t))
+			{
+				counters->total[i] += count;
+			}
+		}
+	}
+}
+
+/* Function: compare_samples
+ * 	----------------------------
+ *   qsort comparison of two samples.
+ *
+ *   a: the first sample
+ *   b: the second sample
+ *   returns: -1, 0 or 1 as a is less than, equal to or greater than b
+ */
+int compare_samples(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Function: print_counters
+ * 	----------------------------
+ *   Prints a section's time and misses per matched order.
+ *
+ *   report: where to print
+ *   name: the section
+ *   counters: its counters
+ *   fills: matched orders
+ */
+void print_counters(FILE *report, char *name, struct bench_counters *counters, long int fills)
+{
+	qsort(counters->samples, counters->number_samples, sizeof(double), compare_samples);
+	double median = counters->number_samples > 0 ? counters->samples[counters->number_samples / 2] : 0;
+	fprintf(report, "%-8s %8.1f ns (median %8.1f)", name, (double)counters->ns / fills, median);
+	char *labels[2] = {"LLC misses", "L1D misses"};
+	for (int i = 0; i < 2; i++)
+	{
+		if (counters->fd[i] == -1)
+		{
+			fprintf(report, "  %s n/a", labels[i]);
+		}
+		else
+		{
+			fprintf(report, "  %s %6.2f", labels[i], (double)counters->total[i] / fills);
+		}
+	}
+	fprintf(report, "  per matched order\n");
+}
+
+/* Function: rest_sell
+ * 	----------------------------
+ *   Rests a random sell through the command path, with an unrelated allocation after it
+ *   as in a long session.
+ *
+ *   order_book: the order book
+ *   product_array: the products
+ *   size: the number of products
+ *   traders: the traders
+ *   junk: the unrelated allocations
+ *   number_junk: how many there are
+ *   junk_size: how many there may be
+ */
+void rest_sell(struct product_info *order_book, char **product_array, int size, struct trader_struct *traders, void **junk, int *number_junk, int junk_size)
+{
+	char command[BUFFSIZE];
+	int trader = rand() % BENCH_TRADERS;
+	snprintf(command, BUFFSIZE, "SELL %d %s %d %d", traders[trader].order_valid, product_array[0], 1 + rand() % 20, 1000 + rand() % BENCH_PRICES);
+	process_command(command, trader, order_book, product_array, size, BENCH_TRADERS, traders);
+	if (*number_junk < junk_size)
+	{
+		junk[(*number_junk)++] = malloc(16 + rand() % 200);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int resting = argc > 1 ? atoi(argv[1]) : BENCH_RESTING;
+	int rounds = argc > 2 ? atoi(argv[2]) : BENCH_ROUNDS;
+	int cold = argc > 3 && strcmp(argv[3], "cold") == 0;
+	if (resting <= 0 || rounds <= 0 || (argc > 3 && !cold) || argc > 4)
+	{
+		fprintf(stderr, "Usage: %s [resting orders] [rounds] [cold]\n", argv[0]);
+		return 1;
+	}
+	// The exchange logs every match to stdout
+	FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+	signal(SIGUSR1, SIG_IGN);
+
+	char products[] = "/tmp/bench_match_XXXXXX";
+	int products_fd = mkstemp(products);
+	dprintf(products_fd, "1\nGPU\n");
+	close(products_fd);
+	int size = get_products_size(products);
+	char **product_array = load_products_file(products);
+	unlink(products);
+
+	// Traders write to /dev/null and are signalled with an ignored SIGUSR1
+	FILE *null_pipe = fopen("/dev/null", "w");
+	struct trader_struct *traders = calloc(BENCH_TRADERS, sizeof(struct trader_struct));
+	for (int i = 0; i < BENCH_TRADERS; i++)
+	{
+		traders[i].trader_id = i;
+		traders[i].fp_exchange_t = null_pipe;
+		traders[i].trader_fd = fileno(null_pipe);
+		traders[i].pid_child = getpid();
+		traders[i].alive = TRUE;
+	}
+	init_scheduler(&scheduler, BENCH_TRADERS, QUANTUM_DEFAULT, NULL);
+	init_position_matrix(&position_book, BENCH_TRADERS, size);
+	init_quote_cache(&quote_cache, size);
+	init_risk_book(&risk_book, BENCH_TRADERS, size, NULL);
+#ifdef ORDER_SLAB_SIZE
+	init_level_book(&level_book, size);
+	init_trade_tape(&trade_tape, size, FALSE, traders, BENCH_TRADERS);
+#else
+	// Sources from before the order pool
+	init_trade_tape(&trade_tape, size, FALSE);
+#endif
+	init_trader_index(&trader_index, traders, BENCH_TRADERS);
+	timer_wheel_init(&timer_wheel, get_time_ms());
+	struct product_info *order_book = calloc(size, sizeof(struct product_info));
+
+	srand(7);
+	int junk_size = 4 * resting;
+	void **junk = malloc(sizeof(void *) * junk_size);
+	int number_junk = 0;
+	for (int i = 0; i < resting; i++)
+	{
+		rest_sell(order_book, product_array, size, traders, junk, &number_junk, junk_size);
+	}
+
+	char *flush = malloc(BENCH_FLUSH);
+	memset(flush, 0, BENCH_FLUSH);
+	struct bench_counters sweep;
+	struct bench_counters settle;
+	init_counters(&sweep, rounds);
+	init_counters(&settle, rounds);
+	long int fills = 0;
+	char command[BUFFSIZE];
+	for (int round = 0; round < rounds; round++)
+	{
+		int trader = rand() % BENCH_TRADERS;
+		snprintf(command, BUFFSIZE, "BUY %d %s %d %d", traders[trader].order_valid, product_array[0], 40, 1000 + BENCH_PRICES - 1);
+		struct order_type *current_order = make_current_order(size, BENCH_TRADERS, product_array, command, trader, traders);
+		if (cold)
+		{
+			for (int i = 0; i < BENCH_FLUSH; i += BENCH_LINE)
+			{
+				flush[i]++;
+			}
+		}
+		start_counters(&sweep);
+		sweep_order(&(order_book[0]), current_order, &sweep_batch);
+		int round_fills = sweep_batch.number_fills;
+		stop_counters(&sweep, round_fills);
+		fills += round_fills;
+		start_counters(&settle);
+		settle_fill_batch(&sweep_batch, current_order);
+		stop_counters(&settle, round_fills);
+#ifdef ORDER_SLAB_SIZE
+		free_order(current_order);
+#else
+		free(current_order->product);
+		free(current_order);
+#endif
+		while (order_book[0].sell < resting)
+		{
+			rest_sell(order_book, product_array, size, traders, junk, &number_junk, junk_size);
+		}
+	}
+
+	fprintf(report, "%d resting orders, %d rounds, %ld matched orders, %s caches\n", resting, rounds, fills, cold ? "cold" : "warm");
+	print_counters(report, "sweep", &sweep, fills);
+	print_counters(report, "settle", &settle, fills);
+	fclose(report);
+	return 0;
+}
@@ -0,0 +1,162 @@
+#include "spx_depth_feed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Sample consumer of the SPX depth feed: maps the depth region of a running exchange and
+ * prints the book of a product, or of every product, each time it is republished.
+ *
+ *   depth_feed_consumer <shared memory name> [product]
+ */
+
+#define TRUE 1
+#define FALSE 0
+// Wait between looks at the snapshots, in microseconds
+#define POLL_WAIT 1000
+
+volatile sig_atomic_t stopping = FALSE;
+
+/* Function: stop
+ * 	----------------------------
+ *   SIGINT/SIGTERM handler, finishes the current pass and exits.
+ *
+ *   signo: the signal number
+ */
+void stop(int signo)
+{
+	stopping = TRUE;
+}
+
+/* Function: pause_us
+ * 	----------------------------
+ *   Sleeps for the given number of microseconds.
+ *
+ *   wait: microseconds to sleep
+ */
+void pause_us(long int wait)
+{
+	struct timespec delay = {0, wait * 1000};
+	nanosleep(&delay, NULL);
+}
+
+/* Function: map_feed
+ * 	----------------------------
+ *   Maps the depth region, waiting until the exchange has created and set it up.
+ *
+ *   name: the shared memory object name
+ *   returns: the header of the mapped region, or NULL if interrupted
+ */
+struct spx_depth_header *map_feed(char *name)
+{
+	while (!stopping)
+	{
+		int fd = shm_open(name, O_RDONLY, 0);
+		struct stat info;
+		if (fd != -1 && fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(struct spx_depth_header))
+		{
+			void *region = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (region == MAP_FAILED)
+			{
+				perror("mmap failed");
+				return NULL;
+			}
+			struct spx_depth_header *header = region;
+			while (!stopping && __atomic_load_n(&(header->products), __ATOMIC_ACQUIRE) == 0)
+			{
+				pause_us(POLL_WAIT);
+			}
+			if (header->levels != SPX_DEPTH_LEVELS)
+			{
+				fprintf(stderr, "Unsupported depth of %u levels\n", header->levels);
+				return NULL;
+			}
+			return header;
+		}
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		pause_us(POLL_WAIT * 10);
+	}
+	return NULL;
+}
+
+/* Function: print_snapshot
+ * 	----------------------------
+ *   Prints the levels of a snapshot side by side, bids on the left.
+ *
+ *   snapshot: the copied snapshot
+ *   sequence: its sequence
+ */
+void print_snapshot(struct spx_depth_snapshot *snapshot, uint32_t sequence)
+{
+	printf("%s (%u)\n", snapshot->product, sequence);
+	int levels = snapshot->buy_levels > snapshot->sell_levels ? snapshot->buy_levels : snapshot->sell_levels;
+	for (int i = 0; i < levels; i++)
+	{
+		if (i < snapshot->buy_levels)
+		{
+			printf("  %4d %8ld @ %-8ld", snapshot->bid[i].orders, (long)snapshot->bid[i].quantity, (long)snapshot->bid[i].price);
+		}
+		else
+		{
+			printf("  %24s", "");
+		}
+		if (i < snapshot->sell_levels)
+		{
+			printf(" | %8ld @ %-8ld %4d", (long)snapshot->ask[i].quantity, (long)snapshot->ask[i].price, snapshot->ask[i].orders);
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2 && argc != 3)
+	{
+		fprintf(stderr, "Usage: %s <shared memory name> [product]\n", argv[0]);
+		return 1;
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	struct spx_depth_header *header = map_feed(argv[1]);
+	if (header == NULL)
+	{
+		return 1;
+	}
+	struct spx_depth_snapshot *snapshots = (struct spx_depth_snapshot *)(header + 1);
+	int products = header->products;
+	uint32_t *seen = calloc(products, sizeof(uint32_t));
+	struct spx_depth_snapshot copy;
+
+	while (!stopping)
+	{
+		for (int i = 0; i < products; i++)
+		{
+			if (argc == 3 && strcmp(snapshots[i].product, argv[2]) != 0)
+			{
+				continue;
+			}
+			// Nothing to copy until the exchange republishes the product
+			if (__atomic_load_n(&(snapshots[i].sequence), __ATOMIC_ACQUIRE) == seen[i])
+			{
+				continue;
+			}
+			seen[i] = spx_read_depth_snapshot(&(snapshots[i]), &copy);
+			print_snapshot(&copy, seen[i]);
+		}
+		fflush(stdout);
+		pause_us(POLL_WAIT);
+	}
+
+	free(seen);
+	return 0;
+}
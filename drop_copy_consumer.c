@@ -0,0 +1,180 @@
+#include "spx_drop_copy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Sample consumer of the SPX drop-copy feed: follows the execution ring of a running
+ * exchange and appends every record to a CSV file until the exchange closes the feed.
+ *
+ *   drop_copy_consumer <shared memory name> <output file>
+ */
+
+#define TRUE 1
+#define FALSE 0
+// Longest wait between looks at an idle ring, in microseconds
+#define IDLE_WAIT_MAX 1000
+
+volatile sig_atomic_t stopping = FALSE;
+
+/* Function: stop
+ * 	----------------------------
+ *   SIGINT/SIGTERM handler, finishes the current pass and exits.
+ *
+ *   signo: the signal number
+ */
+void stop(int signo)
+{
+	stopping = TRUE;
+}
+
+/* Function: pause_us
+ * 	----------------------------
+ *   Sleeps for the given number of microseconds.
+ *
+ *   wait: microseconds to sleep
+ */
+void pause_us(long int wait)
+{
+	struct timespec delay = {0, wait * 1000};
+	nanosleep(&delay, NULL);
+}
+
+/* Function: map_feed
+ * 	----------------------------
+ *   Maps the drop-copy region, waiting until the exchange has created and set it up.
+ *
+ *   name: the shared memory object name
+ *   returns: the header of the mapped region, or NULL if interrupted
+ */
+struct spx_drop_copy_header *map_feed(char *name)
+{
+	while (!stopping)
+	{
+		int fd = shm_open(name, O_RDONLY, 0);
+		struct stat info;
+		if (fd != -1 && fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(struct spx_drop_copy_header))
+		{
+			void *region = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (region == MAP_FAILED)
+			{
+				perror("mmap failed");
+				return NULL;
+			}
+			struct spx_drop_copy_header *header = region;
+			while (!stopping && __atomic_load_n(&(header->version), __ATOMIC_ACQUIRE) == 0)
+			{
+				pause_us(IDLE_WAIT_MAX);
+			}
+			if (header->version != SPX_DROP_COPY_VERSION)
+			{
+				fprintf(stderr, "Unsupported drop copy version %u\n", header->version);
+				return NULL;
+			}
+			return header;
+		}
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		pause_us(IDLE_WAIT_MAX * 10);
+	}
+	return NULL;
+}
+
+/* Function: write_record
+ * 	----------------------------
+ *   Appends an execution record to the output as a CSV line.
+ *
+ *   fp: the output file
+ *   record: the record
+ */
+void write_record(FILE *fp, struct spx_execution *record)
+{
+	fprintf(fp, "%lu,%ld,%d,%d,%d,%d,%d,%s,%ld,%ld,%ld\n", (unsigned long)record->sequence, (long)record->time,
+			record->product_index, record->buy_trader, record->buy_order, record->sell_trader, record->sell_order,
+			record->aggressor == SPX_AGGRESSOR_BUY ? "BUY" : "SELL", (long)record->price, (long)record->quantity, (long)record->fee);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: %s <shared memory name> <output file>\n", argv[0]);
+		return 1;
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	FILE *fp = fopen(argv[2], "w");
+	if (fp == NULL)
+	{
+		perror("fopen failed");
+		return 1;
+	}
+	fprintf(fp, "sequence,time_ns,product_index,buy_trader,buy_order,sell_trader,sell_order,aggressor,price,quantity,fee\n");
+
+	struct spx_drop_copy_header *header = map_feed(argv[1]);
+	if (header == NULL)
+	{
+		fclose(fp);
+		return 1;
+	}
+	struct spx_execution *records = (struct spx_execution *)(header + 1);
+	uint64_t capacity = header->capacity;
+	uint64_t next = 1;
+	uint64_t lost = 0;
+	long int wait = 1;
+
+	while (!stopping)
+	{
+		struct spx_execution *slot = &(records[(next - 1) & (capacity - 1)]);
+		uint64_t before = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+		if (before == next)
+		{
+			struct spx_execution record;
+			memcpy(&record, slot, sizeof(struct spx_execution));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&(slot->sequence), __ATOMIC_RELAXED) == next)
+			{
+				write_record(fp, &record);
+				next++;
+				wait = 1;
+				continue;
+			}
+		}
+
+		// Either nothing new yet, or the exchange has lapped this consumer
+		uint64_t written = __atomic_load_n(&(header->written), __ATOMIC_ACQUIRE);
+		if (written >= next + capacity || before > next)
+		{
+			uint64_t oldest = written - capacity + 1;
+			// Stay clear of the slot the exchange may be writing next
+			oldest = oldest + 1 > next ? oldest + 1 : next + 1;
+			lost += oldest - next;
+			fprintf(stderr, "Fell behind, lost records %lu to %lu\n", (unsigned long)next, (unsigned long)(oldest - 1));
+			next = oldest;
+			continue;
+		}
+		if (written < next)
+		{
+			if (__atomic_load_n(&(header->closed), __ATOMIC_ACQUIRE) && __atomic_load_n(&(header->written), __ATOMIC_ACQUIRE) < next)
+			{
+				break;
+			}
+			fflush(fp);
+			pause_us(wait);
+			wait = wait * 2 > IDLE_WAIT_MAX ? IDLE_WAIT_MAX : wait * 2;
+		}
+	}
+
+	fclose(fp);
+	fprintf(stderr, "Wrote %lu records, lost %lu\n", (unsigned long)(next - 1 - lost), (unsigned long)lost);
+	return 0;
+}
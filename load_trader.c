@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+#include "spx_exchange.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Synthetic load-generator trader for end-to-end benchmarks of the SPX exchange.
+ *
+ * Started by the exchange like any trader (pipe transport), or on its own against the
+ * Unix domain socket gateway:
+ *
+ *   spx_exchange products.txt ./load_trader ./load_trader
+ *   load_trader <gateway socket> <login name> [key=value ...]
+ *
+ * It sends BUY, SELL and CANCEL commands at a target rate, keeping at most window
+ * commands waiting for their reply, timestamps every send and every reply, and at the end
+ * reports the throughput and latency percentiles. Settings are key=value pairs taken from
+ * the SPX_LOAD environment variable, then from the command line in gateway mode:
+ *
+ *   products=GPU,Router  products to trade (required)
+ *   rate=1000            commands per second
+ *   orders=10000         commands to send, or
+ *   duration=0           milliseconds to send for, if not 0
+ *   price=100            centre of the price distribution
+ *   width=10             half width (uniform) or standard deviation (normal) of prices
+ *   distribution=uniform uniform or normal
+ *   tick=1               prices are rounded to a multiple of the tick
+ *   quantity=1-100       range of order quantities
+ *   buy=0.5              share of orders that are buys
+ *   cancel=0.2           share of commands that cancel one of our resting orders
+ *   window=64            commands in flight at most
+ *   seed=1               random seed, mixed with the trader id
+ *   report=              file to append the report to, stderr if not set
+ *
+ * Latency is from the write of a command to its reply (ACCEPTED, CANCELLED or INVALID),
+ * and for an order that trades on arrival, from its write to its first FILL.
+ */
+
+#define LOAD_ENV "SPX_LOAD"
+#define MAX_PRODUCTS 64
+#define COMMAND_NEW 0
+#define COMMAND_CANCEL 1
+// Give up waiting for replies this long after the last send
+#define DRAIN_TIMEOUT_NS 5000000000LL
+// A send more than this late against the schedule counts as late
+#define LATE_NS 1000000LL
+// Wait this long for the gateway to close the session after LOGOUT
+#define LOGOUT_TIMEOUT_MS 1000
+#define IN_SIZE 65536
+#define OUT_SIZE 65536
+
+/* Struct: load_config
+ * ----------------------------
+ *   Settings of the load generator, see the top of the file.
+ */
+struct load_config
+{
+	char *products[MAX_PRODUCTS];
+	int number_products;
+	double rate;
+	long int orders;
+	long int duration;
+	long int price;
+	long int width;
+	int normal;
+	long int tick;
+	long int quantity_min;
+	long int quantity_max;
+	double buy;
+	double cancel;
+	int window;
+	uint64_t seed;
+	char *report;
+};
+
+/* Struct: sent_command
+ * ----------------------------
+ *   A command waiting for its reply. The exchange replies to a trader's commands in
+ *   order, so these sit in a FIFO. generation tells INVALIDs of orders sent before the
+ *   last order id resync apart from new ones.
+ */
+struct sent_command
+{
+	int64_t sent;
+	int kind;
+	int order_id;
+	int generation;
+};
+
+/* Struct: latency_samples
+ * ----------------------------
+ *   Latencies in nanoseconds, sorted when reported.
+ */
+struct latency_samples
+{
+	int64_t *samples;
+	long int number_samples;
+	long int samples_size;
+};
+
+/* Struct: load_trader
+ * ----------------------------
+ *   State of the load generator. Order ids index remaining and sent_at, and live holds
+ *   the ids of our resting orders so one can be picked to cancel in O(1).
+ */
+struct load_trader
+{
+	struct load_config config;
+	int trader_id;
+	int read_fd;
+	int write_fd;
+	pid_t exchange;
+	char in[IN_SIZE];
+	int in_length;
+	char out[OUT_SIZE];
+	int out_length;
+	int started;
+	int64_t start;
+	int64_t last_send;
+	int64_t last_reply;
+	uint64_t random;
+
+	int next_id;
+	int generation;
+	struct sent_command *pending;
+	int pending_head;
+	int pending_count;
+
+	long int *remaining;
+	int64_t *sent_at;
+	int *live_index;
+	int *live;
+	int number_live;
+	int ids_size;
+	int immediate_id;
+
+	long int sent_orders;
+	long int sent_cancels;
+	long int late;
+	long int accepted;
+	long int cancelled;
+	long int invalid;
+	long int fills;
+	long int market;
+	struct latency_samples ack_latency;
+	struct latency_samples fill_latency;
+};
+
+/* Function: now_ns
+ * 	----------------------------
+ *   returns: CLOCK_MONOTONIC in nanoseconds
+ */
+int64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Function: next_random
+ * 	----------------------------
+ *   xorshift64* generator, so a seed gives the same command stream on every machine.
+ *
+ *   trader: the load trader
+ *   returns: a uniform number in [0, 1)
+ */
+double next_random(struct load_trader *trader)
+{
+	trader->random ^= trader->random >> 12;
+	trader->random ^= trader->random << 25;
+	trader->random ^= trader->random >> 27;
+	return ((trader->random * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Function: parse_setting
+ * 	----------------------------
+ *   Applies one key=value setting.
+ *
+ *   config: the settings
+ *   setting: the key=value pair, products are kept pointing into it
+ *   returns: 0, or -1 for an unknown key
+ */
+int parse_setting(struct load_config *config, char *setting)
+{
+	char *value = strchr(setting, '=');
+	if (value == NULL)
+	{
+		return -1;
+	}
+	*value++ = '\0';
+	if (strcmp(setting, "products") == 0)
+	{
+		config->number_products = 0;
+		char *product;
+		while ((product = strsep(&value, ",")) != NULL && config->number_products < MAX_PRODUCTS)
+		{
+			if (product[0] != '\0')
+			{
+				config->products[config->number_products++] = product;
+			}
+		}
+	}
+	else if (strcmp(setting, "rate") == 0)
+	{
+		config->rate = atof(value);
+	}
+	else if (strcmp(setting, "orders") == 0)
+	{
+		config->orders = atol(value);
+	}
+	else if (strcmp(setting, "duration") == 0)
+	{
+		config->duration = atol(value);
+	}
+	else if (strcmp(setting, "price") == 0)
+	{
+		config->price = atol(value);
+	}
+	else if (strcmp(setting, "width") == 0)
+	{
+		config->width = atol(value);
+	}
+	else if (strcmp(setting, "distribution") == 0)
+	{
+		config->normal = strcmp(value, "normal") == 0;
+	}
+	else if (strcmp(setting, "tick") == 0)
+	{
+		config->tick = atol(value) > 0 ? atol(value) : 1;
+	}
+	else if (strcmp(setting, "quantity") == 0)
+	{
+		sscanf(value, "%ld-%ld", &(config->quantity_min), &(config->quantity_max));
+	}
+	else if (strcmp(setting, "buy") == 0)
+	{
+		config->buy = atof(value);
+	}
+	else if (strcmp(setting, "cancel") == 0)
+	{
+		config->cancel = atof(value);
+	}
+	else if (strcmp(setting, "window") == 0)
+	{
+		config->window = atoi(value) > 0 ? atoi(value) : 1;
+	}
+	else if (strcmp(setting, "seed") == 0)
+	{
+		config->seed = strtoull(value, NULL, 10);
+	}
+	else if (strcmp(setting, "report") == 0)
+	{
+		config->report = value;
+	}
+	else
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Function: load_settings
+ * 	----------------------------
+ *   Sets the defaults, then applies the settings in SPX_LOAD and the given arguments.
+ *
+ *   config: the settings
+ *   argc: number of extra arguments
+ *   argv: the extra key=value arguments
+ *   returns: 0, or -1 if a setting is bad or no products were given
+ */
+int load_settings(struct load_config *config, int argc, char **argv)
+{
+	memset(config, 0, sizeof(struct load_config));
+	config->rate = 1000;
+	config->orders = 10000;
+	config->price = 100;
+	config->width = 10;
+	config->tick = 1;
+	config->quantity_min = 1;
+	config->quantity_max = 100;
+	config->buy = 0.5;
+	config->cancel = 0.2;
+	config->window = 64;
+	config->seed = 1;
+
+	if (getenv(LOAD_ENV) != NULL)
+	{
+		char *settings = strdup(getenv(LOAD_ENV));
+		char *setting;
+		while ((setting = strsep(&settings, " ")) != NULL)
+		{
+			if (setting[0] != '\0' && parse_setting(config, setting) == -1)
+			{
+				fprintf(stderr, "Unknown load setting: %s\n", setting);
+				return -1;
+			}
+		}
+	}
+	for (int i = 0; i < argc; i++)
+	{
+		if (parse_setting(config, argv[i]) == -1)
+		{
+			fprintf(stderr, "Unknown load setting: %s\n", argv[i]);
+			return -1;
+		}
+	}
+	if (config->number_products == 0 || config->rate <= 0 || config->quantity_min <= 0 || config->quantity_max < config->quantity_min)
+	{
+		fprintf(stderr, "Load settings need products=..., a positive rate and a quantity range\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Function: add_sample
+ * 	----------------------------
+ *   Records a latency.
+ *
+ *   latency: the samples
+ *   sample: the latency in nanoseconds
+ */
+void add_sample(struct latency_samples *latency, int64_t sample)
+{
+	if (latency->number_samples == latency->samples_size)
+	{
+		latency->samples_size = latency->samples_size == 0 ? 4096 : latency->samples_size * 2;
+		latency->samples = realloc(latency->samples, sizeof(int64_t) * latency->samples_size);
+	}
+	latency->samples[latency->number_samples++] = sample;
+}
+
+/* Function: compare_samples
+ * 	----------------------------
+ *   qsort comparison of two latencies.
+ */
+int compare_samples(const void *first, const void *second)
+{
+	int64_t a = *(const int64_t *)first;
+	int64_t b = *(const int64_t *)second;
+	return a < b ? -1 : a > b;
+}
+
+/* Function: print_percentiles
+ * 	----------------------------
+ *   Prints the p50, p90, p99, p99.9 and maximum of the samples in microseconds.
+ *
+ *   fp: where to print
+ *   trader_id: our trader id
+ *   name: what was measured
+ *   latency: the samples
+ */
+void print_percentiles(FILE *fp, int trader_id, char *name, struct latency_samples *latency)
+{
+	if (latency->number_samples == 0)
+	{
+		fprintf(fp, "[LOAD T%d] %s latency: no samples\n", trader_id, name);
+		return;
+	}
+	qsort(latency->samples, latency->number_samples, sizeof(int64_t), compare_samples);
+	double percentiles[] = {50, 90, 99, 99.9};
+	fprintf(fp, "[LOAD T%d] %s latency us:", trader_id, name);
+	for (int i = 0; i < 4; i++)
+	{
+		long int index = (long int)ceil(percentiles[i] / 100 * latency->number_samples) - 1;
+		index = index < 0 ? 0 : index;
+		fprintf(fp, " p%g %.1f", percentiles[i], latency->samples[index] / 1000.0);
+	}
+	fprintf(fp, " max %.1f (%ld samples)\n", latency->samples[latency->number_samples - 1] / 1000.0, latency->number_samples);
+}
+
+/* Function: reserve_id
+ * 	----------------------------
+ *   Makes room in the per order arrays for an order id.
+ *
+ *   trader: the load trader
+ *   order_id: the order id
+ */
+void reserve_id(struct load_trader *trader, int order_id)
+{
+	if (order_id < trader->ids_size)
+	{
+		return;
+	}
+	int size = trader->ids_size == 0 ? 4096 : trader->ids_size;
+	while (size <= order_id)
+	{
+		size *= 2;
+	}
+	trader->remaining = realloc(trader->remaining, sizeof(long int) * size);
+	trader->sent_at = realloc(trader->sent_at, sizeof(int64_t) * size);
+	trader->live_index = realloc(trader->live_index, sizeof(int) * size);
+	trader->live = realloc(trader->live, sizeof(int) * size);
+	for (int i = trader->ids_size; i < size; i++)
+	{
+		trader->remaining[i] = 0;
+		trader->sent_at[i] = 0;
+		trader->live_index[i] = -1;
+	}
+	trader->ids_size = size;
+}
+
+/* Function: forget_live
+ * 	----------------------------
+ *   Takes an order off the list of resting orders that may be cancelled.
+ *
+ *   trader: the load trader
+ *   order_id: the order id
+ */
+void forget_live(struct load_trader *trader, int order_id)
+{
+	int index = trader->live_index[order_id];
+	if (index == -1)
+	{
+		return;
+	}
+	int last = trader->live[--trader->number_live];
+	trader->live[index] = last;
+	trader->live_index[last] = index;
+	trader->live_index[order_id] = -1;
+}
+
+/* Function: send_command
+ * 	----------------------------
+ *   Builds the next command from the distributions and queues it for writing.
+ *
+ *   trader: the load trader
+ *   now: the time of the send
+ */
+void send_command(struct load_trader *trader, int64_t now)
+{
+	struct load_config *config = &(trader->config);
+	struct sent_command *command = &(trader->pending[(trader->pending_head + trader->pending_count) % config->window]);
+	char line[BUFFSIZE];
+	int length;
+
+	command->sent = now;
+	command->generation = trader->generation;
+	if (trader->number_live > 0 && next_random(trader) < config->cancel)
+	{
+		int order_id = trader->live[(int)(next_random(trader) * trader->number_live)];
+		forget_live(trader, order_id);
+		command->kind = COMMAND_CANCEL;
+		command->order_id = order_id;
+		length = snprintf(line, BUFFSIZE, "CANCEL %d;", order_id);
+		trader->sent_cancels++;
+	}
+	else
+	{
+		char *side = next_random(trader) < config->buy ? "BUY" : "SELL";
+		char *product = config->products[(int)(next_random(trader) * config->number_products)];
+		long int quantity = config->quantity_min + (long int)(next_random(trader) * (config->quantity_max - config->quantity_min + 1));
+		double offset;
+		if (config->normal)
+		{
+			// Box-Muller
+			double u = next_random(trader);
+			double v = next_random(trader);
+			offset = sqrt(-2 * log(1 - u)) * cos(2 * M_PI * v) * config->width;
+		}
+		else
+		{
+			offset = (2 * next_random(trader) - 1) * config->width;
+		}
+		long int price = (long int)llround((config->price + offset) / config->tick) * config->tick;
+		price = price < config->tick ? config->tick : price;
+
+		reserve_id(trader, trader->next_id);
+		trader->remaining[trader->next_id] = quantity;
+		trader->sent_at[trader->next_id] = now;
+		command->kind = COMMAND_NEW;
+		command->order_id = trader->next_id++;
+		length = snprintf(line, BUFFSIZE, "%s %d %s %ld %ld;", side, command->order_id, product, quantity, price);
+		trader->sent_orders++;
+	}
+	trader->pending_count++;
+	if (trader->out_length + length <= OUT_SIZE)
+	{
+		memcpy(trader->out + trader->out_length, line, length);
+		trader->out_length += length;
+	}
+}
+
+/* Function: flush_out
+ * 	----------------------------
+ *   Writes as much of the queued commands as the transport takes without blocking, and
+ *   signals the exchange in the pipe transport.
+ *
+ *   trader: the load trader
+ */
+void flush_out(struct load_trader *trader)
+{
+	if (trader->out_length == 0)
+	{
+		return;
+	}
+	ssize_t written = write(trader->write_fd, trader->out, trader->out_length);
+	if (written <= 0)
+	{
+		return;
+	}
+	memmove(trader->out, trader->out + written, trader->out_length - written);
+	trader->out_length -= written;
+	if (trader->exchange > 0)
+	{
+		kill(trader->exchange, SIGUSR1);
+	}
+}
+
+/* Function: take_reply
+ * 	----------------------------
+ *   Matches a reply to the oldest command waiting for one and records its latency.
+ *
+ *   trader: the load trader
+ *   now: when the reply was read
+ *   returns: the command, or NULL if nothing was waiting
+ */
+struct sent_command *take_reply(struct load_trader *trader, int64_t now)
+{
+	if (trader->pending_count == 0)
+	{
+		return NULL;
+	}
+	struct sent_command *command = &(trader->pending[trader->pending_head]);
+	trader->pending_head = (trader->pending_head + 1) % trader->config.window;
+	trader->pending_count--;
+	add_sample(&(trader->ack_latency), now - command->sent);
+	trader->last_reply = now;
+	trader->immediate_id = -1;
+	return command;
+}
+
+/* Function: handle_message
+ * 	----------------------------
+ *   Handles one message from the exchange.
+ *
+ *   trader: the load trader
+ *   message: the message without its ;
+ *   now: when it was read
+ *   returns: 0, or -1 if the gateway refused the login
+ */
+int handle_message(struct load_trader *trader, char *message, int64_t now)
+{
+	int order_id;
+	long int quantity;
+	if (sscanf(message, "LOGGED_IN %d", &(trader->trader_id)) == 1 || strcmp(message, "MARKET OPEN") == 0)
+	{
+		if (!trader->started)
+		{
+			trader->started = TRUE;
+			trader->start = now;
+			trader->last_send = now;
+		}
+	}
+	else if (strncmp(message, "LOGIN_REJECTED", strlen("LOGIN_REJECTED")) == 0)
+	{
+		fprintf(stderr, "[LOAD] %s\n", message);
+		return -1;
+	}
+	else if (sscanf(message, "ACCEPTED %d", &order_id) == 1)
+	{
+		take_reply(trader, now);
+		trader->accepted++;
+		reserve_id(trader, order_id);
+		if (trader->remaining[order_id] > 0 && trader->live_index[order_id] == -1)
+		{
+			trader->live_index[order_id] = trader->number_live;
+			trader->live[trader->number_live++] = order_id;
+		}
+		// Fills before the next reply are from trading on arrival
+		trader->immediate_id = order_id;
+	}
+	else if (sscanf(message, "CANCELLED %d", &order_id) == 1)
+	{
+		take_reply(trader, now);
+		trader->cancelled++;
+	}
+	else if (strcmp(message, "INVALID") == 0)
+	{
+		struct sent_command *command = take_reply(trader, now);
+		trader->invalid++;
+		// A refused order leaves the exchange expecting its id again, and every later
+		// order already in flight is refused too: carry on from the refused id
+		if (command != NULL && command->kind == COMMAND_NEW && command->generation == trader->generation)
+		{
+			trader->next_id = command->order_id;
+			trader->generation++;
+		}
+	}
+	else if (sscanf(message, "FILL %d %ld", &order_id, &quantity) == 2)
+	{
+		trader->fills++;
+		if (order_id >= 0 && order_id < trader->ids_size)
+		{
+			if (order_id == trader->immediate_id && trader->sent_at[order_id] != 0)
+			{
+				add_sample(&(trader->fill_latency), now - trader->sent_at[order_id]);
+			}
+			trader->sent_at[order_id] = 0;
+			trader->remaining[order_id] -= quantity;
+			if (trader->remaining[order_id] <= 0)
+			{
+				forget_live(trader, order_id);
+			}
+		}
+	}
+	else
+	{
+		trader->market++;
+	}
+	return 0;
+}
+
+/* Function: read_in
+ * 	----------------------------
+ *   Reads what the exchange sent and handles every complete message.
+ *
+ *   trader: the load trader
+ *   returns: 0, or -1 once the exchange has closed the transport or refused the login
+ */
+int read_in(struct load_trader *trader)
+{
+	ssize_t length = read(trader->read_fd, trader->in + trader->in_length, IN_SIZE - trader->in_length);
+	if (length == 0)
+	{
+		return -1;
+	}
+	if (length < 0)
+	{
+		return 0;
+	}
+	trader->in_length += length;
+	int64_t now = now_ns();
+	int start = 0;
+	for (int i = 0; i < trader->in_length; i++)
+	{
+		if (trader->in[i] == ';')
+		{
+			trader->in[i] = '\0';
+			if (handle_message(trader, trader->in + start, now) == -1)
+			{
+				return -1;
+			}
+			start = i + 1;
+		}
+	}
+	memmove(trader->in, trader->in + start, trader->in_length - start);
+	trader->in_length -= start;
+	return 0;
+}
+
+/* Function: connect_pipes
+ * 	----------------------------
+ *   Opens the pipes the exchange made for this trader.
+ *
+ *   trader: the load trader
+ *   returns: 0, or -1 if a pipe could not be opened
+ */
+int connect_pipes(struct load_trader *trader)
+{
+	char exchange_pipe[BUFFSIZE];
+	char trader_pipe[BUFFSIZE];
+	snprintf(exchange_pipe, BUFFSIZE, FIFO_EXCHANGE, trader->trader_id);
+	snprintf(trader_pipe, BUFFSIZE, FIFO_TRADER, trader->trader_id);
+	// Read end first, the exchange waits for it before opening its write end
+	trader->read_fd = open(exchange_pipe, O_RDONLY);
+	trader->write_fd = open(trader_pipe, O_WRONLY);
+	if (trader->read_fd == -1 || trader->write_fd == -1)
+	{
+		perror("open failed pipe");
+		return -1;
+	}
+	trader->exchange = getppid();
+	return 0;
+}
+
+/* Function: connect_gateway
+ * 	----------------------------
+ *   Connects to the exchange gateway and logs in.
+ *
+ *   trader: the load trader
+ *   path: the gateway socket
+ *   name: the login name
+ *   returns: 0, or -1 if the gateway could not be reached
+ */
+int connect_gateway(struct load_trader *trader, char *path, char *name)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == -1)
+	{
+		perror("connect failed gateway");
+		return -1;
+	}
+	trader->read_fd = fd;
+	trader->write_fd = fd;
+	trader->exchange = 0;
+	trader->out_length = snprintf(trader->out, OUT_SIZE, "LOGIN %s;", name);
+	return 0;
+}
+
+/* Function: print_report
+ * 	----------------------------
+ *   Prints the throughput and latency report.
+ *
+ *   trader: the load trader
+ */
+void print_report(struct load_trader *trader)
+{
+	FILE *fp = trader->config.report != NULL ? fopen(trader->config.report, "a") : stderr;
+	fp = fp != NULL ? fp : stderr;
+	int id = trader->trader_id;
+	double sending = (trader->last_send - trader->start) / 1e9;
+	double elapsed = (trader->last_reply - trader->start) / 1e9;
+	long int replies = trader->accepted + trader->cancelled + trader->invalid;
+	fprintf(fp, "[LOAD T%d] sent %ld orders and %ld cancels in %.3f s, %ld late (target %.1f/s)\n", id, trader->sent_orders, trader->sent_cancels, sending, trader->late, trader->config.rate);
+	fprintf(fp, "[LOAD T%d] %ld replies in %.3f s: %.1f commands/s sustained\n", id, replies, elapsed, elapsed > 0 ? replies / elapsed : 0.0);
+	fprintf(fp, "[LOAD T%d] %ld accepted, %ld cancelled, %ld invalid, %ld fills, %ld market messages\n", id, trader->accepted, trader->cancelled, trader->invalid, trader->fills, trader->market);
+	print_percentiles(fp, id, "reply", &(trader->ack_latency));
+	print_percentiles(fp, id, "fill on arrival", &(trader->fill_latency));
+	if (fp != stderr)
+	{
+		fclose(fp);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static struct load_trader trader;
+	int gateway = argc >= 3;
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <trader id> | %s <gateway socket> <name> [key=value ...]\n", argv[0], argv[0]);
+		return 1;
+	}
+	if (load_settings(&(trader.config), gateway ? argc - 3 : 0, argv + 3) == -1)
+	{
+		return 1;
+	}
+	// The exchange signals every message, the pipe is polled instead
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	trader.trader_id = gateway ? 0 : atoi(argv[1]);
+	if ((gateway ? connect_gateway(&trader, argv[1], argv[2]) : connect_pipes(&trader)) == -1)
+	{
+		return 1;
+	}
+	fcntl(trader.read_fd, F_SETFL, fcntl(trader.read_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(trader.write_fd, F_SETFL, fcntl(trader.write_fd, F_GETFL) | O_NONBLOCK);
+	trader.random = (trader.config.seed + 1) * 0x9E3779B97F4A7C15ULL ^ (uint64_t)(trader.trader_id + 1) * 0xBF58476D1CE4E5B9ULL;
+	trader.random = trader.random == 0 ? 1 : trader.random;
+	trader.pending = malloc(sizeof(struct sent_command) * trader.config.window);
+	trader.immediate_id = -1;
+
+	int64_t interval = (int64_t)(1e9 / trader.config.rate);
+	int sending = TRUE;
+	int64_t finished = 0;
+	while (TRUE)
+	{
+		int64_t now = now_ns();
+		if (trader.started && sending)
+		{
+			long int sent = trader.sent_orders + trader.sent_cancels;
+			int64_t due = trader.start + sent * interval;
+			while (sending && due <= now && trader.pending_count < trader.config.window && OUT_SIZE - trader.out_length >= BUFFSIZE)
+			{
+				if (now - due > LATE_NS)
+				{
+					trader.late++;
+				}
+				send_command(&trader, now);
+				trader.last_send = now;
+				sent++;
+				due += interval;
+				if ((trader.config.duration > 0 && now - trader.start >= trader.config.duration * 1000000LL) || (trader.config.duration == 0 && sent >= trader.config.orders))
+				{
+					sending = FALSE;
+					finished = now;
+				}
+			}
+		}
+		flush_out(&trader);
+		if (!sending && trader.pending_count == 0 && trader.out_length == 0)
+		{
+			break;
+		}
+		if (!sending && now - finished > DRAIN_TIMEOUT_NS)
+		{
+			fprintf(stderr, "[LOAD T%d] gave up on %d replies\n", trader.trader_id, trader.pending_count);
+			break;
+		}
+
+		// Sleep until the next send is due, or a reply comes in
+		struct timespec timeout = {0, 0};
+		int64_t wait = 1000000;
+		if (trader.started && sending && trader.pending_count < trader.config.window)
+		{
+			wait = trader.start + (trader.sent_orders + trader.sent_cancels) * interval - now_ns();
+			wait = wait < 0 ? 0 : wait;
+		}
+		timeout.tv_sec = wait / 1000000000;
+		timeout.tv_nsec = wait % 1000000000;
+		struct pollfd fds[2] = {{trader.read_fd, POLLIN, 0}, {trader.write_fd, trader.out_length > 0 ? POLLOUT : 0, 0}};
+		ppoll(fds, gateway ? 1 : 2, &timeout, NULL);
+		if (gateway && trader.out_length > 0)
+		{
+			fds[0].events |= POLLOUT;
+		}
+		if ((fds[0].revents & (POLLIN | POLLHUP)) && read_in(&trader) == -1)
+		{
+			break;
+		}
+	}
+
+	if (gateway)
+	{
+		trader.out_length = snprintf(trader.out, OUT_SIZE, "LOGOUT;");
+		flush_out(&trader);
+		// Keep reading until the gateway closes the session, a connection that stops
+		// reading can be dropped before its LOGOUT is seen
+		struct pollfd logout = {trader.read_fd, POLLIN, 0};
+		while (poll(&logout, 1, LOGOUT_TIMEOUT_MS) > 0 && read_in(&trader) == 0)
+		{
+		}
+	}
+	print_report(&trader);
+	close(trader.read_fd);
+	if (trader.write_fd != trader.read_fd)
+	{
+		close(trader.write_fd);
+	}
+	return 0;
+}
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include "spx_capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Replays a session capture (see spx_capture.h) into an SPX exchange through its socket
+ * gateway, to reproduce a production session offline:
+ *
+ *   session_replay <capture file> <gateway socket> [speed]
+ *
+ * speed is 1 for the original pace (the default), N for N times faster, or max to send
+ * every command as soon as the exchange takes it. Run the exchange with no trader
+ * processes and a gateway session for each trader in the capture:
+ *
+ *   SPX_GATEWAY=/tmp/spx.sock SPX_GATEWAY_SESSIONS=<traders> spx_exchange products.txt
+ *
+ * One session is logged in per captured trader, in trader id order, so the exchange
+ * gives each the id it had when captured. Commands go out in capture order, each with the
+ * time it was read offset from the start of the replay. A capture trader that
+ * disconnected logs out at that point, and the rest log out at the end. Everything the
+ * exchange sends back is read and thrown away.
+ */
+
+#define TRUE 1
+#define FALSE 0
+#define SPEED_MAX 0
+// Bytes of commands queued for a session before waiting for the exchange to read them
+#define OUT_SIZE 65536
+#define IN_SIZE 65536
+// How long to wait for a login reply, and for the exchange to close sessions at the end
+#define LOGIN_TIMEOUT_MS 5000
+#define CLOSE_TIMEOUT_NS 5000000000LL
+// A command sent more than this after its time counts as late
+#define LATE_NS 1000000LL
+// At full speed, look for replies to throw away once every this many commands
+#define MAX_DRAIN_EVERY 64
+
+/* Struct: replay_session
+ * ----------------------------
+ *   A gateway connection standing in for one captured trader.
+ */
+struct replay_session
+{
+	int fd;
+	char out[OUT_SIZE];
+	int out_length;
+	int logged_out;
+	int closed;
+	long int received;
+};
+
+/* Function: now_ns
+ * 	----------------------------
+ *   returns: CLOCK_MONOTONIC in nanoseconds
+ */
+int64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Function: map_capture
+ * 	----------------------------
+ *   Maps a capture file and checks its header.
+ *
+ *   path: the capture file
+ *   length: set to the file length
+ *   returns: the header, or NULL if the file is not a capture
+ */
+struct spx_capture_header *map_capture(char *path, size_t *length)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd == -1 || fstat(fd, &info) == -1)
+	{
+		perror("open failed capture");
+		return NULL;
+	}
+	if (info.st_size < (off_t)sizeof(struct spx_capture_header))
+	{
+		fprintf(stderr, "%s is not a capture file\n", path);
+		close(fd);
+		return NULL;
+	}
+	void *region = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED)
+	{
+		perror("mmap failed");
+		return NULL;
+	}
+	struct spx_capture_header *header = region;
+	if (memcmp(header->magic, SPX_CAPTURE_MAGIC, sizeof(header->magic)) != 0 || header->version != SPX_CAPTURE_VERSION)
+	{
+		fprintf(stderr, "%s is not a version %d capture file\n", path, SPX_CAPTURE_VERSION);
+		munmap(region, info.st_size);
+		return NULL;
+	}
+	madvise(region, info.st_size, MADV_SEQUENTIAL);
+	*length = info.st_size;
+	return header;
+}
+
+/* Function: open_session
+ * 	----------------------------
+ *   Connects to the gateway and logs in as T<trader id>.
+ *
+ *   session: the session
+ *   path: the gateway socket
+ *   trader_id: the captured trader id
+ *   returns: 0, or -1 if the login failed
+ */
+int open_session(struct replay_session *session, char *path, int trader_id)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	session->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (session->fd == -1 || connect(session->fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) == -1)
+	{
+		perror("connect failed gateway");
+		return -1;
+	}
+	char reply[IN_SIZE];
+	int length = snprintf(reply, IN_SIZE, "LOGIN T%d;", trader_id);
+	if (write(session->fd, reply, length) != length)
+	{
+		perror("write failed login");
+		return -1;
+	}
+
+	// Only the reply is needed, whatever follows it is thrown away later anyway
+	struct pollfd ready = {session->fd, POLLIN, 0};
+	length = 0;
+	while (memchr(reply, ';', length) == NULL && length < IN_SIZE - 1)
+	{
+		if (poll(&ready, 1, LOGIN_TIMEOUT_MS) <= 0)
+		{
+			fprintf(stderr, "No login reply for trader %d\n", trader_id);
+			return -1;
+		}
+		ssize_t got = read(session->fd, reply + length, IN_SIZE - 1 - length);
+		if (got <= 0)
+		{
+			fprintf(stderr, "Gateway closed the login of trader %d\n", trader_id);
+			return -1;
+		}
+		length += got;
+	}
+	reply[length] = '\0';
+	int given_id;
+	if (sscanf(reply, "LOGGED_IN %d;", &given_id) != 1)
+	{
+		fprintf(stderr, "Login of trader %d refused: %.*s\n", trader_id, (int)strcspn(reply, ";"), reply);
+		return -1;
+	}
+	if (given_id != trader_id)
+	{
+		fprintf(stderr, "Trader %d replays as trader %d, the exchange should have no trader processes\n", trader_id, given_id);
+	}
+	fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/* Function: flush_session
+ * 	----------------------------
+ *   Writes as much of a session's queued commands as the socket takes.
+ *
+ *   session: the session
+ */
+void flush_session(struct replay_session *session)
+{
+	if (session->out_length == 0 || session->closed)
+	{
+		return;
+	}
+	ssize_t written = write(session->fd, session->out, session->out_length);
+	if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	{
+		session->closed = TRUE;
+		return;
+	}
+	if (written > 0)
+	{
+		memmove(session->out, session->out + written, session->out_length - written);
+		session->out_length -= written;
+	}
+}
+
+/* Function: drain_sessions
+ * 	----------------------------
+ *   Waits up to the timeout for the exchange, throwing away what it sent and writing
+ *   queued commands as the sockets take them.
+ *
+ *   sessions: the sessions
+ *   number_sessions: the number of sessions
+ *   fds: poll set, one per session
+ *   timeout: nanoseconds to wait at most, 0 to only look
+ */
+void drain_sessions(struct replay_session *sessions, int number_sessions, struct pollfd *fds, int64_t timeout)
+{
+	for (int i = 0; i < number_sessions; i++)
+	{
+		fds[i].fd = sessions[i].closed ? -1 : sessions[i].fd;
+		fds[i].events = POLLIN | (sessions[i].out_length > 0 ? POLLOUT : 0);
+		fds[i].revents = 0;
+	}
+	struct timespec wait = {timeout / 1000000000, timeout % 1000000000};
+	if (ppoll(fds, number_sessions, &wait, NULL) <= 0)
+	{
+		return;
+	}
+	char scratch[IN_SIZE];
+	for (int i = 0; i < number_sessions; i++)
+	{
+		if (fds[i].revents & POLLOUT)
+		{
+			flush_session(&(sessions[i]));
+		}
+		if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			ssize_t length;
+			while ((length = read(sessions[i].fd, scratch, IN_SIZE)) > 0)
+			{
+				sessions[i].received += length;
+			}
+			if (length == 0 || (length == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			{
+				sessions[i].closed = TRUE;
+			}
+		}
+	}
+}
+
+/* Function: queue_command
+ * 	----------------------------
+ *   Queues a command for a session and writes it, waiting for room if need be.
+ *
+ *   sessions: the sessions
+ *   number_sessions: the number of sessions
+ *   fds: poll set, one per session
+ *   trader_id: the session to send on
+ *   text: the command, without its ;
+ *   length: length of the command
+ */
+void queue_command(struct replay_session *sessions, int number_sessions, struct pollfd *fds, int trader_id, const char *text, int length)
+{
+	struct replay_session *session = &(sessions[trader_id]);
+	while (!session->closed && session->out_length + length + 1 > OUT_SIZE)
+	{
+		flush_session(session);
+		drain_sessions(sessions, number_sessions, fds, 1000000);
+	}
+	if (session->closed)
+	{
+		return;
+	}
+	memcpy(session->out + session->out_length, text, length);
+	session->out[session->out_length + length] = ';';
+	session->out_length += length + 1;
+	flush_session(session);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3 || argc > 4)
+	{
+		fprintf(stderr, "Usage: %s <capture file> <gateway socket> [speed|max]\n", argv[0]);
+		return 1;
+	}
+	double speed = 1;
+	if (argc == 4)
+	{
+		speed = strcmp(argv[3], "max") == 0 ? SPEED_MAX : atof(argv[3]);
+		if (strcmp(argv[3], "max") != 0 && speed <= 0)
+		{
+			fprintf(stderr, "Speed must be a positive number or max\n");
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	size_t length;
+	struct spx_capture_header *header = map_capture(argv[1], &length);
+	if (header == NULL)
+	{
+		return 1;
+	}
+	int number_sessions = header->number_traders;
+	struct replay_session *sessions = calloc(number_sessions, sizeof(struct replay_session));
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * (number_sessions > 0 ? number_sessions : 1));
+	for (int i = 0; i < number_sessions; i++)
+	{
+		if (open_session(&(sessions[i]), argv[2], i) == -1)
+		{
+			return 1;
+		}
+	}
+
+	char *position = (char *)(header + 1);
+	char *end = (char *)header + length;
+	long int commands = 0;
+	long int late = 0;
+	int64_t worst_lag = 0;
+	int64_t span = 0;
+	int64_t start = now_ns();
+	while (position + sizeof(struct spx_capture_record) <= end)
+	{
+		struct spx_capture_record *record = (struct spx_capture_record *)position;
+		char *text = position + sizeof(struct spx_capture_record);
+		if (text + record->length > end)
+		{
+			fprintf(stderr, "Capture ends inside a record, it was not closed\n");
+			break;
+		}
+		position = text + record->length;
+		if (record->trader_id < 0 || record->trader_id >= number_sessions)
+		{
+			continue;
+		}
+		span = record->time;
+
+		if (speed != SPEED_MAX)
+		{
+			int64_t due = start + (int64_t)(record->time / speed);
+			int64_t now;
+			while ((now = now_ns()) < due)
+			{
+				drain_sessions(sessions, number_sessions, fds, due - now);
+			}
+			worst_lag = now - due > worst_lag ? now - due : worst_lag;
+			late += now - due > LATE_NS;
+		}
+		else if (commands % MAX_DRAIN_EVERY == 0)
+		{
+			drain_sessions(sessions, number_sessions, fds, 0);
+		}
+
+		struct replay_session *session = &(sessions[record->trader_id]);
+		if (record->type == SPX_CAPTURE_DISCONNECT)
+		{
+			queue_command(sessions, number_sessions, fds, record->trader_id, "LOGOUT", strlen("LOGOUT"));
+			session->logged_out = TRUE;
+		}
+		// A session's own LOGOUT is followed by its disconnect
+		else if (record->type == SPX_CAPTURE_COMMAND && !(record->length == strlen("LOGOUT") && memcmp(text, "LOGOUT", record->length) == 0))
+		{
+			queue_command(sessions, number_sessions, fds, record->trader_id, text, record->length);
+			commands++;
+		}
+	}
+	int64_t sent = now_ns();
+
+	for (int i = 0; i < number_sessions; i++)
+	{
+		if (!sessions[i].logged_out)
+		{
+			queue_command(sessions, number_sessions, fds, i, "LOGOUT", strlen("LOGOUT"));
+		}
+	}
+	// The exchange closes a session once its LOGOUT is done, which is after all its commands
+	int open_sessions = number_sessions;
+	while (open_sessions > 0 && now_ns() - sent < CLOSE_TIMEOUT_NS)
+	{
+		drain_sessions(sessions, number_sessions, fds, 10000000);
+		open_sessions = 0;
+		for (int i = 0; i < number_sessions; i++)
+		{
+			open_sessions += !sessions[i].closed;
+		}
+	}
+	int64_t finished = now_ns();
+
+	double elapsed = (finished - start) / 1e9;
+	long int received = 0;
+	for (int i = 0; i < number_sessions; i++)
+	{
+		received += sessions[i].received;
+		close(sessions[i].fd);
+	}
+	fprintf(stderr, "Replayed %ld commands of %d traders in %.3f s (captured over %.3f s), %.1f commands/s\n", commands, number_sessions, elapsed, span / 1e9, elapsed > 0 ? commands / elapsed : 0.0);
+	if (speed != SPEED_MAX)
+	{
+		fprintf(stderr, "%ld commands sent over 1 ms late, worst by %.3f ms\n", late, worst_lag / 1e6);
+	}
+	fprintf(stderr, "Sending took %.3f s, %ld bytes came back\n", (sent - start) / 1e9, received);
+	if (open_sessions > 0)
+	{
+		fprintf(stderr, "%d sessions were still open at the end\n", open_sessions);
+	}
+	free(fds);
+	free(sessions);
+	munmap(header, length);
+	return 0;
+}
@@ -0,0 +1,105 @@
+#ifndef SPX_ARCHIVE_H
+#define SPX_ARCHIVE_H
+
+#include <stdint.h>
+
+/* Columnar event archive of the SPX exchange.
+ *
+ * With SPX_ARCHIVE=<file> set, the exchange keeps every order event (a new order, an
+ * amend, a cancel) and every fill as a row, and a background thread writes the rows out
+ * in chunks, one column after another, for analysis after the session. archive_query
+ * maps the file and reads columns from it.
+ *
+ * The file is an spx_archive_header, the product names, then chunks. A chunk is an
+ * spx_archive_chunk followed by the data of its columns. Each column holds one int64
+ * value per row and is kept as:
+ *
+ *   SPX_ARCHIVE_PACKED  value[i] = base + packed[i]
+ *   SPX_ARCHIVE_DELTA   value[0] = first, value[i] = value[i - 1] + base + packed[i]
+ *
+ * where packed[i] is an unsigned number of width bits, 0 to 64, at bit i * width of the
+ * column's little-endian 64-bit words (packed[0] of a delta column is 0). A width of 0
+ * stores no data at all. The writer picks whichever encoding is narrower, so times and
+ * order ids come out as small deltas and sides and kinds as a bit or two.
+ *
+ * A fill is a row of the aggressor: the trader and order that took liquidity, its side,
+ * and the resting trader and order in the contra columns. Order events have -1 contra
+ * columns. A cancel keeps the quantity that was left. Times are CLOCK_MONOTONIC
+ * nanoseconds since the market opened.
+ */
+
+#define SPX_ARCHIVE_MAGIC "SPXARCH"
+#define SPX_ARCHIVE_CHUNK_MAGIC "SPXCHNK"
+#define SPX_ARCHIVE_VERSION 1
+// Bytes of each product name after the header
+#define SPX_ARCHIVE_PRODUCT 32
+
+// Row kinds
+#define SPX_ARCHIVE_NEW 1
+#define SPX_ARCHIVE_AMEND 2
+#define SPX_ARCHIVE_CANCEL 3
+#define SPX_ARCHIVE_FILL 4
+
+// Columns, in the order of a chunk's column table
+#define SPX_ARCHIVE_TIME 0
+#define SPX_ARCHIVE_KIND 1
+#define SPX_ARCHIVE_TRADER 2
+#define SPX_ARCHIVE_ORDER 3
+#define SPX_ARCHIVE_PRODUCT_INDEX 4
+// BUY 1 or SELL 2
+#define SPX_ARCHIVE_SIDE 5
+#define SPX_ARCHIVE_PRICE 6
+#define SPX_ARCHIVE_QUANTITY 7
+#define SPX_ARCHIVE_CONTRA_TRADER 8
+#define SPX_ARCHIVE_CONTRA_ORDER 9
+#define SPX_ARCHIVE_COLUMNS 10
+
+// Column encodings
+#define SPX_ARCHIVE_PACKED 1
+#define SPX_ARCHIVE_DELTA 2
+
+/* Struct: spx_archive_header
+ * ----------------------------
+ *   Start of an archive file, followed by number_products names of SPX_ARCHIVE_PRODUCT
+ *   bytes. start is CLOCK_REALTIME of the market open in nanoseconds.
+ */
+struct spx_archive_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t number_products;
+	int64_t start;
+};
+
+/* Struct: spx_archive_column
+ * ----------------------------
+ *   Where a column of a chunk is and how to decode it. offset is from the start of the
+ *   file, length in bytes.
+ */
+struct spx_archive_column
+{
+	uint32_t encoding;
+	uint32_t width;
+	int64_t base;
+	int64_t first;
+	uint64_t offset;
+	uint64_t length;
+};
+
+/* Struct: spx_archive_chunk
+ * ----------------------------
+ *   Start of a chunk of rows. length covers the chunk and its column data, so the next
+ *   chunk starts length bytes on.
+ */
+struct spx_archive_chunk
+{
+	char magic[8];
+	uint32_t rows;
+	uint32_t number_columns;
+	int64_t first_time;
+	int64_t last_time;
+	uint64_t length;
+	struct spx_archive_column columns[SPX_ARCHIVE_COLUMNS];
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SPX_CAPTURE_H
+#define SPX_CAPTURE_H
+
+#include <stdint.h>
+
+/* Session capture file of the SPX exchange.
+ *
+ * With SPX_CAPTURE=<file> set, the exchange records every command that reaches it from a
+ * trader process or a gateway session, in the order it read them, so session_replay can
+ * send the same traffic to another exchange later. Commands of in-process plugins are not
+ * recorded: the plugins are loaded again and make them again.
+ *
+ * The file is an spx_capture_header followed by records, each an spx_capture_record and
+ * then length bytes of command text without the ;. A record is stamped with the
+ * CLOCK_MONOTONIC time its command was read, in nanoseconds since the market opened.
+ * Commands read by one read share its time.
+ */
+
+#define SPX_CAPTURE_MAGIC "SPXCAPT"
+#define SPX_CAPTURE_VERSION 1
+
+// Record types
+#define SPX_CAPTURE_COMMAND 1
+// The trader disconnected: its pipe closed or its session logged out
+#define SPX_CAPTURE_DISCONNECT 2
+
+/* Struct: spx_capture_header
+ * ----------------------------
+ *   Start of a capture file. start is CLOCK_REALTIME of the market open in nanoseconds,
+ *   for reference only.
+ */
+struct spx_capture_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t number_traders;
+	int64_t start;
+};
+
+/* Struct: spx_capture_record
+ * ----------------------------
+ *   One recorded event, followed by its command text.
+ */
+struct spx_capture_record
+{
+	int64_t time;
+	int32_t trader_id;
+	uint16_t type;
+	uint16_t length;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SPX_DEPTH_FEED_H
+#define SPX_DEPTH_FEED_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Market depth feed of the SPX exchange.
+ *
+ * With SPX_DEPTH_FEED=<shared memory name> set, the exchange keeps the top
+ * SPX_DEPTH_LEVELS price levels of both sides of every product in that shared memory
+ * object: an spx_depth_header followed by one spx_depth_snapshot per product in products
+ * file order. A trader that sends DEPTH, or DEPTH <product>, is answered with
+ * "DEPTH <name> <levels>;" and stops receiving MARKET messages; it maps the region
+ * read-only and reads snapshots with spx_read_depth_snapshot. Behind spx_router the
+ * product is required: each partition has a region of its own, named <name>.<partition>,
+ * with only its products, and the answer names the region of the product's partition.
+ *
+ * The header's products field is 0 until the region is ready. Each snapshot is guarded
+ * by a seqlock: its sequence is odd while the exchange rewrites it and goes up by two
+ * each time it is republished, so a reader that sees the same even sequence before and
+ * after copying has a consistent snapshot.
+ */
+
+#define SPX_DEPTH_LEVELS 10
+// Bytes of the product name of a snapshot
+#define SPX_DEPTH_PRODUCT 32
+
+/* Struct: spx_depth_level
+ * ----------------------------
+ *   One aggregated price level of the depth feed.
+ */
+struct spx_depth_level
+{
+	int64_t price;
+	int64_t quantity;
+	int32_t orders;
+	int32_t padding;
+};
+
+/* Struct: spx_depth_snapshot
+ * ----------------------------
+ *   Top SPX_DEPTH_LEVELS levels of both sides of one product, best level first.
+ */
+struct spx_depth_snapshot
+{
+	uint32_t sequence;
+	int32_t buy_levels;
+	int32_t sell_levels;
+	char product[SPX_DEPTH_PRODUCT];
+	struct spx_depth_level bid[SPX_DEPTH_LEVELS];
+	struct spx_depth_level ask[SPX_DEPTH_LEVELS];
+} __attribute__((aligned(64)));
+
+/* Struct: spx_depth_header
+ * ----------------------------
+ *   Start of the depth feed region, followed by products snapshots.
+ */
+struct spx_depth_header
+{
+	uint32_t products;
+	uint32_t levels;
+} __attribute__((aligned(64)));
+
+/* Function: spx_read_depth_snapshot
+ * 	----------------------------
+ *   Copies a consistent snapshot out of the shared region without any system call,
+ *   retrying while the exchange is writing it.
+ *
+ *   shared: the product's snapshot in the mapped region
+ *   copy: where to copy the snapshot to
+ *   returns: the sequence of the copied snapshot
+ */
+static inline uint32_t spx_read_depth_snapshot(const struct spx_depth_snapshot *shared, struct spx_depth_snapshot *copy)
+{
+	while (1)
+	{
+		uint32_t before = __atomic_load_n(&(shared->sequence), __ATOMIC_ACQUIRE);
+		if (before & 1)
+		{
+			continue;
+		}
+		memcpy(copy, shared, sizeof(struct spx_depth_snapshot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(shared->sequence), __ATOMIC_RELAXED) == before)
+		{
+			return before;
+		}
+	}
+}
+
+#endif
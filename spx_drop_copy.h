@@ -0,0 +1,61 @@
+#ifndef SPX_DROP_COPY_H
+#define SPX_DROP_COPY_H
+
+#include <stdint.h>
+
+/* Drop-copy execution feed of the SPX exchange.
+ *
+ * With SPX_DROP_COPY=<shared memory name> set, the exchange writes one spx_execution per
+ * fill into a ring of SPX_DROP_COPY_RECORDS records in that shared memory object, after
+ * an spx_drop_copy_header. The exchange never waits for a consumer: once the ring is full
+ * the oldest record is overwritten, and a consumer that falls behind sees a gap in the
+ * sequence numbers.
+ *
+ * Records are numbered from 1. Record n sits in slot (n - 1) % capacity. Its sequence
+ * field is 0 while the exchange is writing it and n once it is complete, so a consumer
+ * waiting for record n reads the slot's sequence, copies the record, and checks the
+ * sequence again: a sequence below n means not written yet, above n means overwritten.
+ */
+
+#define SPX_DROP_COPY_VERSION 1
+// Records in the ring, a power of two
+#define SPX_DROP_COPY_RECORDS 65536
+
+/* Struct: spx_drop_copy_header
+ * ----------------------------
+ *   Start of the drop-copy region. written is the sequence of the last complete record.
+ *   closed is set once the exchange has written its last record.
+ */
+struct spx_drop_copy_header
+{
+	uint32_t version;
+	uint32_t capacity;
+	uint64_t written;
+	uint32_t closed;
+} __attribute__((aligned(64)));
+
+/* Struct: spx_execution
+ * ----------------------------
+ *   One fill. The aggressor is the order that took liquidity and paid the fee, or in a
+ *   call auction the order that arrived later. time is CLOCK_REALTIME in nanoseconds.
+ */
+struct spx_execution
+{
+	uint64_t sequence;
+	int64_t time;
+	int32_t buy_trader;
+	int32_t buy_order;
+	int32_t sell_trader;
+	int32_t sell_order;
+	int32_t product_index;
+	int32_t aggressor;
+	int64_t price;
+	int64_t quantity;
+	int64_t fee;
+} __attribute__((aligned(64)));
+
+// Values of spx_execution.aggressor
+#define SPX_AGGRESSOR_BUY 1
+#define SPX_AGGRESSOR_SELL 2
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef SPX_PARTITION_H
+#define SPX_PARTITION_H
+
+#include <stdint.h>
+
+/* Queues between the SPX router and its partitions.
+ *
+ * spx_router runs one exchange process per partition, each matching a subset of the
+ * products, and stands in front of them as the exchange the traders see. Each partition
+ * is started with SPX_PARTITION=<shared memory name> and SPX_PARTITION_FDS=<in>,<out>:
+ * the shared memory object holds an spx_partition_queues, and the two inherited eventfds
+ * ring the doorbell of the commands ring (router to partition) and the messages ring
+ * (partition to router).
+ *
+ * Both rings have one producer and one consumer. The producer fills the slot at head and
+ * then moves head on with a release store; the consumer reads slots up to head and then
+ * moves tail on. A producer that finds the ring full waits for the consumer. Whoever
+ * pushes writes to the ring's eventfd once per batch, the consumer reads it to clear it.
+ */
+
+#define SPX_PARTITION_VERSION 1
+// Slots in a ring, a power of two
+#define SPX_PARTITION_SLOTS 4096
+#define SPX_PARTITION_TEXT 116
+
+// Commands ring: a trader's command, without its ;
+#define SPX_PARTITION_COMMAND 1
+// Commands ring: the trader has disconnected
+#define SPX_PARTITION_DISCONNECT 2
+// Messages ring: a message for the trader, with its ;
+#define SPX_PARTITION_MESSAGE 3
+// Messages ring: the partition is done with the trader's oldest command it was sent
+#define SPX_PARTITION_DONE 4
+// Messages ring, after the session: "<product> <quantity> <cash>" of a trader's position
+#define SPX_PARTITION_POSITION 5
+// Messages ring, after the session: "<fees>" the partition collected, its last record
+#define SPX_PARTITION_CLOSED 6
+
+/* Struct: spx_partition_record
+ * ----------------------------
+ *   One slot of a ring.
+ */
+struct spx_partition_record
+{
+	int32_t trader_id;
+	uint16_t type;
+	uint16_t length;
+	char text[SPX_PARTITION_TEXT];
+};
+
+/* Struct: spx_partition_ring
+ * ----------------------------
+ *   A single producer, single consumer ring of records. head and tail count records
+ *   ever pushed and popped, and sit on their own cache lines.
+ */
+struct spx_partition_ring
+{
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	struct spx_partition_record records[SPX_PARTITION_SLOTS] __attribute__((aligned(64)));
+};
+
+/* Struct: spx_partition_queues
+ * ----------------------------
+ *   The shared memory object of one partition, set up by the router before it starts
+ *   the partition.
+ */
+struct spx_partition_queues
+{
+	uint32_t version;
+	uint32_t number_traders;
+	struct spx_partition_ring commands;
+	struct spx_partition_ring messages;
+};
+
+#endif
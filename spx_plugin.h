@@ -0,0 +1,92 @@
+#ifndef SPX_PLUGIN_H
+#define SPX_PLUGIN_H
+
+/* In-process trader plugins for the SPX exchange.
+ *
+ * A plugin is a shared object given on the exchange command line in place of a trader
+ * executable (any path ending in .so). It runs inside the exchange and gets the same
+ * messages a trader process reads from its pipe, passed as structs to its callbacks.
+ * Every callback is optional except plugin_init:
+ *
+ *   void *plugin_init(const struct spx_exchange_api *api);
+ *   void on_market_open(void *state);
+ *   void on_market(void *state, const struct spx_message *message);
+ *   void on_accepted(void *state, const struct spx_message *message);
+ *   void on_amended(void *state, const struct spx_message *message);
+ *   void on_cancelled(void *state, const struct spx_message *message);
+ *   void on_invalid(void *state, const struct spx_message *message);
+ *   void on_fill(void *state, const struct spx_message *message);
+ *   void plugin_finish(void *state);
+ *
+ * Callbacks run on the exchange thread and must not block. Orders are handed back with
+ * api->submit, which only queues them: they are processed after the callback returns,
+ * in turn with the commands of trader processes. The product of a message is only valid
+ * during the callback.
+ */
+
+#define SPX_PLUGIN_API_VERSION 1
+
+#define SPX_BUY 1
+#define SPX_SELL 2
+
+// Message types
+#define SPX_MARKET_OPEN 0
+#define SPX_MARKET 1
+#define SPX_ACCEPTED 2
+#define SPX_AMENDED 3
+#define SPX_CANCELLED 4
+#define SPX_INVALID 5
+#define SPX_FILL 6
+
+// Commands
+#define SPX_COMMAND_BUY 0
+#define SPX_COMMAND_SELL 1
+#define SPX_COMMAND_AMEND 2
+#define SPX_COMMAND_CANCEL 3
+// No more commands will follow, the trader counts as disconnected
+#define SPX_COMMAND_DISCONNECT 4
+
+/* Struct: spx_message
+ * ----------------------------
+ *   A message from the exchange. Fields a message type does not carry are 0:
+ *   MARKET has side, product, quantity and price, ACCEPTED, AMENDED and CANCELLED
+ *   have order_id, FILL has order_id and quantity.
+ */
+struct spx_message
+{
+	int type;
+	int order_id;
+	int side;
+	const char *product;
+	long quantity;
+	long price;
+};
+
+/* Struct: spx_order
+ * ----------------------------
+ *   A command to the exchange, as the BUY, SELL, AMEND and CANCEL text commands.
+ *   Fields a command does not use are ignored.
+ */
+struct spx_order
+{
+	int command;
+	int order_id;
+	const char *product;
+	long quantity;
+	long price;
+};
+
+/* Struct: spx_exchange_api
+ * ----------------------------
+ *   What the exchange gives a plugin at plugin_init. submit returns 0 once the
+ *   command is queued, -1 if it could not be.
+ */
+struct spx_exchange_api
+{
+	int api_version;
+	int trader_id;
+	void *exchange;
+	int (*submit)(void *exchange, int trader_id, const struct spx_order *order);
+};
+
+#endif
@@ -0,0 +1,1107 @@
+#define _GNU_SOURCE
+#include "spx_exchange.h"
+#include "spx_partition.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+/* Front end of a partitioned SPX exchange. Runs one exchange process per partition, each
+ * matching a share of the products, and stands in front of them as the exchange the
+ * traders see:
+ *
+ *   spx_router <partitions> <exchange binary> <products file> <trader> ...
+ *
+ * Product i of the products file goes to partition i % partitions. The traders are started
+ * and spoken to over FIFOs just as the exchange does. Each command is routed by its
+ * product: BUY and SELL by their product, AMEND and CANCEL to the partition that has the
+ * order, QUOTE, DEPTH and REPLAY by the product asked for (DEPTH <product> subscribes to
+ * the depth feed of that product's partition). The router keeps each trader's order ids
+ * in sequence, since no one partition sees them all.
+ *
+ * What comes back is merged per trader in the order of the trader's commands: a partition
+ * says when it is done with a command, and messages for a trader from a partition are held
+ * while the trader still waits on an earlier command of another partition. Market data
+ * and fills from other traders' orders are passed on as they come.
+ *
+ * At the end the positions each partition reports are added up per trader across the
+ * partitions for the report of the session. SPX_JOURNAL, SPX_CHECKPOINT, SPX_CAPTURE,
+ * SPX_BARS, SPX_DEPTH_FEED, SPX_DROP_COPY and SPX_ARCHIVE name one file or region per
+ * partition, suffixed .<partition>, and SPX_BUSY_POLL pins partition p to the given
+ * core + p.
+ */
+
+// Bytes of commands read from a trader and not yet routed
+#define ROUTER_INPUT 4096
+#define PARTITION_NAME "/spx_partition_%d_%d"
+#define PARTITION_PRODUCTS "/tmp/spx_partition_%d_%d.txt"
+// Longest wait for a full commands ring to drain, in milliseconds
+#define BACKLOG_WAIT 1
+
+/* Struct: record_queue
+ * ----------------------------
+ *   A growable FIFO of records, for messages held back from a trader and commands
+ *   waiting for room in a partition's ring.
+ */
+struct record_queue
+{
+	struct spx_partition_record *records;
+	int first;
+	int count;
+	int capacity;
+};
+
+/* Struct: command_entry
+ * ----------------------------
+ *   A command of a trader that a partition has not finished yet. A new order takes an
+ *   order id, which is handed back if the partition rejects it and no later order has
+ *   taken the next one.
+ */
+struct command_entry
+{
+	int partition;
+	int new_order;
+	int previous_id;
+	int64_t sequence;
+	int invalid;
+};
+
+/* Struct: router_trader
+ * ----------------------------
+ *   A trader process and what the router knows of it: its pipes, its unrouted input, its
+ *   commands in flight in order, and per partition the number of them there and the
+ *   messages held back.
+ */
+struct router_trader
+{
+	int trader_id;
+	char *pipe_exchange_t;
+	char *pipe_trader_e;
+	FILE *fp_exchange_t;
+	int trader_fd;
+	pid_t pid_child;
+	int eof;
+	int unsignalled;
+	char input[ROUTER_INPUT];
+	int length;
+
+	int next_order_id;
+	int64_t new_orders;
+	// Partition of each order id, -1 for none
+	signed char *order_partition;
+	int order_capacity;
+	int upper_partition;
+
+	struct command_entry *in_flight;
+	int in_flight_first;
+	int in_flight_count;
+	int in_flight_capacity;
+	int *outstanding;
+	struct record_queue *held;
+};
+
+/* Struct: router_partition
+ * ----------------------------
+ *   One exchange process and its queues. backlog holds commands the ring had no room
+ *   for, in order.
+ */
+struct router_partition
+{
+	pid_t pid;
+	char name[64];
+	char products_file[64];
+	struct spx_partition_queues *queues;
+	int command_fd;
+	int message_fd;
+	struct record_queue backlog;
+	int pushed;
+	int open;
+	int closed;
+	long int fees;
+};
+
+/* Struct: router
+ * ----------------------------
+ *   The router. Partition number_partitions is a stand-in for commands the router
+ *   answers itself, so their INVALID takes its turn like any other reply.
+ */
+struct router
+{
+	int number_partitions;
+	struct router_partition *partitions;
+	int number_traders;
+	struct router_trader *traders;
+	int size;
+	char **product_array;
+	int epoll_fd;
+	int market_open;
+	int disconnected;
+	int closed;
+	int64_t *quantity;
+	int64_t *cash;
+};
+
+struct router router;
+volatile sig_atomic_t child_exited = FALSE;
+
+// Environment variables naming a file or region, one per partition
+const char *PARTITION_SUFFIXED[] = {"SPX_JOURNAL", "SPX_CHECKPOINT", "SPX_CAPTURE", "SPX_BARS", "SPX_DEPTH_FEED", "SPX_DROP_COPY", "SPX_ARCHIVE"};
+
+/* Function: child_sig
+ * ----------------------------
+ *   SIGCHLD handler, the loop reaps the child.
+ *
+ *   signo: the signal number
+ */
+void child_sig(int signo)
+{
+	child_exited = TRUE;
+}
+
+/* Function: queue_push
+ * 	----------------------------
+ *   Adds a record to the back of a queue.
+ *
+ *   queue: the queue
+ *   trader_id: the record's trader
+ *   type: the record's type
+ *   text: the record's text
+ *   length: length of the text, at most SPX_PARTITION_TEXT
+ */
+void queue_push(struct record_queue *queue, int trader_id, int type, const char *text, int length)
+{
+	if (queue->count == queue->capacity)
+	{
+		int capacity = queue->capacity > 0 ? queue->capacity * 2 : 16;
+		struct spx_partition_record *records = malloc(sizeof(struct spx_partition_record) * capacity);
+		for (int i = 0; i < queue->count; i++)
+		{
+			records[i] = queue->records[(queue->first + i) % queue->capacity];
+		}
+		free(queue->records);
+		queue->records = records;
+		queue->first = 0;
+		queue->capacity = capacity;
+	}
+	struct spx_partition_record *record = &(queue->records[(queue->first + queue->count) % queue->capacity]);
+	record->trader_id = trader_id;
+	record->type = type;
+	record->length = length;
+	memcpy(record->text, text, length);
+	queue->count++;
+}
+
+/* Function: queue_pop
+ * 	----------------------------
+ *   Takes the record at the front of a queue. The record stays valid until the next push.
+ *
+ *   queue: the queue, which must not be empty
+ *   returns: the record
+ */
+struct spx_partition_record *queue_pop(struct record_queue *queue)
+{
+	struct spx_partition_record *record = &(queue->records[queue->first]);
+	queue->first = (queue->first + 1) % queue->capacity;
+	queue->count--;
+	return record;
+}
+
+/* Function: load_products
+ * 	----------------------------
+ *   Reads the products file: the number of products, then one product per line.
+ *
+ *   path: the products file
+ *   size: set to the number of products
+ *   returns: the product names, NULL if the file cannot be read
+ */
+char **load_products(char *path, int *size)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		perror("fopen failed products");
+		return NULL;
+	}
+	char line[BUFFSIZE];
+	*size = fgets(line, BUFFSIZE, fp) != NULL ? atoi(line) : 0;
+	char **product_array = malloc(sizeof(char *) * (*size > 0 ? *size : 1));
+	int loaded = 0;
+	while (loaded < *size && fgets(line, BUFFSIZE, fp) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		product_array[loaded++] = strdup(line);
+	}
+	fclose(fp);
+	*size = loaded;
+	return product_array;
+}
+
+/* Function: get_product_index
+ * 	----------------------------
+ *   Finds a product in the products file.
+ *
+ *   product: the product name
+ *   returns: its index, -1 if there is no such product
+ */
+int get_product_index(const char *product)
+{
+	for (int i = 0; i < router.size; i++)
+	{
+		if (strcmp(router.product_array[i], product) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Function: start_partition
+ * 	----------------------------
+ *   Writes the partition's products file, sets up its queues and doorbells and starts
+ *   an exchange process on them.
+ *
+ *   index: the partition
+ *   exchange: the exchange binary
+ *   returns: 0 on success, -1 on error
+ */
+int start_partition(int index, char *exchange)
+{
+	struct router_partition *part = &(router.partitions[index]);
+	snprintf(part->products_file, sizeof(part->products_file), PARTITION_PRODUCTS, getpid(), index);
+	FILE *fp = fopen(part->products_file, "w");
+	if (fp == NULL)
+	{
+		perror("fopen failed partition products");
+		return -1;
+	}
+	fprintf(fp, "%d\n", (router.size - index + router.number_partitions - 1) / router.number_partitions);
+	for (int i = index; i < router.size; i += router.number_partitions)
+	{
+		fprintf(fp, "%s\n", router.product_array[i]);
+	}
+	fclose(fp);
+
+	snprintf(part->name, sizeof(part->name), PARTITION_NAME, getpid(), index);
+	int fd = shm_open(part->name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+	if (fd == -1 || ftruncate(fd, sizeof(struct spx_partition_queues)) == -1)
+	{
+		perror("shm_open failed partition");
+		return -1;
+	}
+	part->queues = mmap(NULL, sizeof(struct spx_partition_queues), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (part->queues == MAP_FAILED)
+	{
+		perror("mmap failed partition");
+		part->queues = NULL;
+		return -1;
+	}
+	part->queues->number_traders = router.number_traders;
+	part->queues->version = SPX_PARTITION_VERSION;
+	part->command_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	part->message_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	fflush(stdout);
+	part->pid = fork();
+	if (part->pid == 0)
+	{
+		// Only this partition's doorbells are passed on
+		fcntl(part->command_fd, F_SETFD, 0);
+		fcntl(part->message_fd, F_SETFD, 0);
+		char value[BUFFSIZE];
+		setenv("SPX_PARTITION", part->name, 1);
+		snprintf(value, BUFFSIZE, "%d,%d", part->command_fd, part->message_fd);
+		setenv("SPX_PARTITION_FDS", value, 1);
+		for (size_t i = 0; i < sizeof(PARTITION_SUFFIXED) / sizeof(PARTITION_SUFFIXED[0]); i++)
+		{
+			if (getenv(PARTITION_SUFFIXED[i]) != NULL)
+			{
+				snprintf(value, BUFFSIZE, "%s.%d", getenv(PARTITION_SUFFIXED[i]), index);
+				setenv(PARTITION_SUFFIXED[i], value, 1);
+			}
+		}
+		if (getenv("SPX_BUSY_POLL") != NULL && atoi(getenv("SPX_BUSY_POLL")) >= 0)
+		{
+			snprintf(value, BUFFSIZE, "%d", atoi(getenv("SPX_BUSY_POLL")) + index);
+			setenv("SPX_BUSY_POLL", value, 1);
+		}
+		// The router is the only gateway, and starts the traders itself
+		unsetenv("SPX_GATEWAY");
+		unsetenv("SPX_TRADER_CORES");
+		execl(exchange, exchange, part->products_file, NULL);
+		perror("execl failed partition");
+		_exit(1);
+	}
+	if (part->pid == -1)
+	{
+		perror("fork failed partition");
+		return -1;
+	}
+	printf("%s Starting partition %d (%s) for", LOG_PREFIX, index, exchange);
+	for (int i = index; i < router.size; i += router.number_partitions)
+	{
+		printf(" %s", router.product_array[i]);
+	}
+	printf("\n");
+
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.u32 = index;
+	epoll_ctl(router.epoll_fd, EPOLL_CTL_ADD, part->message_fd, &event);
+	return 0;
+}
+
+/* Function: start_trader
+ * 	----------------------------
+ *   Creates the pipes for a trader and starts it, as the exchange does.
+ *
+ *   binary: the executable file name of the trader
+ *   trader: the trader to set up
+ */
+void start_trader(char *binary, struct router_trader *trader)
+{
+	int trader_length = snprintf(NULL, 0, "%d", trader->trader_id);
+	trader->pipe_exchange_t = malloc(strlen(FIFO_EXCHANGE) - 1 + trader_length);
+	trader->pipe_trader_e = malloc(strlen(FIFO_TRADER) - 1 + trader_length);
+	sprintf(trader->pipe_exchange_t, FIFO_EXCHANGE, trader->trader_id);
+	sprintf(trader->pipe_trader_e, FIFO_TRADER, trader->trader_id);
+	mkfifo(trader->pipe_exchange_t, MKFIFO_PERMISSION);
+	mkfifo(trader->pipe_trader_e, MKFIFO_PERMISSION);
+
+	fflush(stdout);
+	trader->pid_child = fork();
+	if (trader->pid_child == 0)
+	{
+		printf("%s Starting trader %d (%s)\n", LOG_PREFIX, trader->trader_id, binary);
+		fflush(stdout);
+		execl(binary, binary, trader->pipe_exchange_t + strlen(FIFO_EXCHANGE) - 2, NULL);
+		_exit(1);
+	}
+	// The trader opens its write end after its read end, so ours never has to wait
+	trader->trader_fd = open(trader->pipe_trader_e, O_RDONLY | O_NONBLOCK);
+	trader->fp_exchange_t = NULL;
+}
+
+/* Function: connect_traders
+ * 	----------------------------
+ *   Opens the write end of every trader's pipe as the traders open their read ends, and
+ *   registers their pipes with epoll.
+ */
+void connect_traders()
+{
+	int waiting = router.number_traders;
+	while (waiting > 0)
+	{
+		for (int i = 0; i < router.number_traders; i++)
+		{
+			struct router_trader *trader = &(router.traders[i]);
+			if (trader->fp_exchange_t != NULL)
+			{
+				continue;
+			}
+			int exchange_fd = open(trader->pipe_exchange_t, O_WRONLY | O_NONBLOCK);
+			if (exchange_fd == -1)
+			{
+				continue;
+			}
+			fcntl(exchange_fd, F_SETFL, fcntl(exchange_fd, F_GETFL) & ~O_NONBLOCK);
+			trader->fp_exchange_t = fdopen(exchange_fd, "w");
+			struct epoll_event event = {0};
+			event.events = EPOLLIN;
+			event.data.u32 = router.number_partitions + i;
+			epoll_ctl(router.epoll_fd, EPOLL_CTL_ADD, trader->trader_fd, &event);
+			printf("%s Connected to %s\n", LOG_PREFIX, trader->pipe_exchange_t);
+			printf("%s Connected to %s\n", LOG_PREFIX, trader->pipe_trader_e);
+			waiting--;
+		}
+		if (waiting > 0)
+		{
+			struct timespec pause_time = {0, 200000};
+			nanosleep(&pause_time, NULL);
+		}
+	}
+}
+
+/* Function: send_partition
+ * 	----------------------------
+ *   Queues a record for a partition, behind whatever is waiting for room in its ring.
+ *
+ *   index: the partition
+ *   trader_id: the trader
+ *   type: SPX_PARTITION_COMMAND or SPX_PARTITION_DISCONNECT
+ *   text: the command, without its ;
+ *   length: length of the command
+ */
+void send_partition(int index, int trader_id, int type, const char *text, int length)
+{
+	struct router_partition *part = &(router.partitions[index]);
+	struct spx_partition_ring *ring = &(part->queues->commands);
+	uint64_t head = ring->head;
+	if (part->backlog.count > 0 || head - __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) == SPX_PARTITION_SLOTS)
+	{
+		queue_push(&(part->backlog), trader_id, type, text, length);
+		return;
+	}
+	struct spx_partition_record *record = &(ring->records[head & (SPX_PARTITION_SLOTS - 1)]);
+	record->trader_id = trader_id;
+	record->type = type;
+	record->length = length;
+	memcpy(record->text, text, length);
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+	part->pushed = TRUE;
+}
+
+/* Function: flush_backlog
+ * 	----------------------------
+ *   Moves waiting commands into a partition's ring as far as it has room.
+ *
+ *   part: the partition
+ *   returns: TRUE if commands are still waiting
+ */
+int flush_backlog(struct router_partition *part)
+{
+	struct spx_partition_ring *ring = &(part->queues->commands);
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+	while (part->backlog.count > 0 && head - tail < SPX_PARTITION_SLOTS)
+	{
+		ring->records[head & (SPX_PARTITION_SLOTS - 1)] = *queue_pop(&(part->backlog));
+		head++;
+		part->pushed = TRUE;
+	}
+	__atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+	return part->backlog.count > 0;
+}
+
+/* Function: add_in_flight
+ * 	----------------------------
+ *   Adds a command to the back of a trader's commands in flight.
+ *
+ *   trader: the trader
+ *   entry: the command
+ */
+void add_in_flight(struct router_trader *trader, struct command_entry *entry)
+{
+	if (trader->in_flight_count == trader->in_flight_capacity)
+	{
+		int capacity = trader->in_flight_capacity > 0 ? trader->in_flight_capacity * 2 : 16;
+		struct command_entry *in_flight = malloc(sizeof(struct command_entry) * capacity);
+		for (int i = 0; i < trader->in_flight_count; i++)
+		{
+			in_flight[i] = trader->in_flight[(trader->in_flight_first + i) % trader->in_flight_capacity];
+		}
+		free(trader->in_flight);
+		trader->in_flight = in_flight;
+		trader->in_flight_first = 0;
+		trader->in_flight_capacity = capacity;
+	}
+	trader->in_flight[(trader->in_flight_first + trader->in_flight_count) % trader->in_flight_capacity] = *entry;
+	trader->in_flight_count++;
+	trader->outstanding[entry->partition]++;
+}
+
+/* Function: deliver
+ * 	----------------------------
+ *   Passes on a trader's held messages in the order of the trader's commands. A
+ *   partition's messages go out while the trader has no command waiting there, or its
+ *   oldest command waiting is there. A DONE ends the oldest command and may let another
+ *   partition's messages go.
+ *
+ *   trader: the trader
+ */
+void deliver(struct router_trader *trader)
+{
+	int progressed = TRUE;
+	while (progressed)
+	{
+		progressed = FALSE;
+		for (int p = 0; p <= router.number_partitions; p++)
+		{
+			struct record_queue *held = &(trader->held[p]);
+			while (held->count > 0)
+			{
+				struct command_entry *oldest = trader->in_flight_count > 0 ? &(trader->in_flight[trader->in_flight_first]) : NULL;
+				int at_oldest = oldest != NULL && oldest->partition == p;
+				if (trader->outstanding[p] > 0 && !at_oldest)
+				{
+					break;
+				}
+				struct spx_partition_record *record = queue_pop(held);
+				if (record->type == SPX_PARTITION_DONE)
+				{
+					if (!at_oldest)
+					{
+						continue;
+					}
+					// A rejected order hands its id back unless a later order has taken the next one
+					if (oldest->new_order && oldest->invalid && oldest->sequence == trader->new_orders)
+					{
+						trader->next_order_id = oldest->previous_id;
+					}
+					trader->in_flight_first = (trader->in_flight_first + 1) % trader->in_flight_capacity;
+					trader->in_flight_count--;
+					trader->outstanding[p]--;
+					progressed = TRUE;
+					continue;
+				}
+				if (at_oldest && record->length == 8 && memcmp(record->text, "INVALID;", 8) == 0)
+				{
+					oldest->invalid = TRUE;
+				}
+				if (!trader->eof)
+				{
+					fwrite(record->text, 1, record->length, trader->fp_exchange_t);
+					trader->unsignalled = TRUE;
+				}
+			}
+		}
+	}
+}
+
+/* Function: answer_invalid
+ * 	----------------------------
+ *   Rejects a command the router cannot route. The INVALID waits its turn behind the
+ *   trader's earlier commands.
+ *
+ *   trader: the trader
+ */
+void answer_invalid(struct router_trader *trader)
+{
+	int local = router.number_partitions;
+	struct command_entry entry = {local, FALSE, 0, 0, FALSE};
+	add_in_flight(trader, &entry);
+	queue_push(&(trader->held[local]), trader->trader_id, SPX_PARTITION_MESSAGE, "INVALID;", 8);
+	queue_push(&(trader->held[local]), trader->trader_id, SPX_PARTITION_DONE, "", 0);
+	deliver(trader);
+}
+
+/* Function: check_new_order
+ * 	----------------------------
+ *   Checks what a partition cannot check on its own of a BUY or SELL: the order id
+ *   against the trader's across all partitions, and the fields, so an order rejected for
+ *   them never takes an id. Price steps and risk limits are left to the partition.
+ *
+ *   trader: the trader
+ *   fields: the command's first LINE_ITEMS fields
+ *   rest: what follows them, NULL if nothing
+ *   returns: the product's index, -1 if the order is invalid
+ */
+int check_new_order(struct router_trader *trader, char **fields, char *rest)
+{
+	int order_id = atoi(fields[1]);
+	if (trader->next_order_id != order_id && order_id != UPPER_BOUND)
+	{
+		return -1;
+	}
+	int product_index = get_product_index(fields[2]);
+	long int quantity = atoi(fields[3]);
+	double price = strtod(fields[4], NULL);
+	if (product_index == -1 || quantity <= 0 || quantity >= UPPER_BOUND || price <= 0 || price >= UPPER_BOUND)
+	{
+		return -1;
+	}
+	char *time_in_force = strsep(&rest, " ");
+	if (time_in_force == NULL)
+	{
+		return product_index;
+	}
+	if (strcmp(time_in_force, "GTT") == 0)
+	{
+		char *lifetime = strsep(&rest, " ");
+		if (lifetime == NULL || atol(lifetime) <= 0)
+		{
+			return -1;
+		}
+	}
+	else if (strcmp(time_in_force, "IOC") != 0 && strcmp(time_in_force, "FOK") != 0)
+	{
+		return -1;
+	}
+	return rest == NULL ? product_index : -1;
+}
+
+/* Function: route_command
+ * 	----------------------------
+ *   Sends a trader's command to the partition of its product, or answers it INVALID.
+ *
+ *   trader: the trader
+ *   command: the command, without its ;
+ *   length: length of the command
+ */
+void route_command(struct router_trader *trader, char *command, int length)
+{
+	char copy[SPX_PARTITION_TEXT + 1];
+	if (length > SPX_PARTITION_TEXT)
+	{
+		answer_invalid(trader);
+		return;
+	}
+	memcpy(copy, command, length);
+	copy[length] = '\0';
+	char *rest = copy;
+	char *fields[LINE_ITEMS];
+	int number_fields = 0;
+	while (number_fields < LINE_ITEMS && (fields[number_fields] = strsep(&rest, " ")) != NULL)
+	{
+		number_fields++;
+	}
+
+	struct command_entry entry = {-1, FALSE, 0, 0, FALSE};
+	if ((strcmp(fields[0], "BUY") == 0 || strcmp(fields[0], "SELL") == 0) && number_fields == LINE_ITEMS)
+	{
+		int product_index = check_new_order(trader, fields, rest);
+		if (product_index != -1)
+		{
+			int order_id = atoi(fields[1]);
+			entry.partition = product_index % router.number_partitions;
+			entry.new_order = TRUE;
+			entry.previous_id = trader->next_order_id;
+			entry.sequence = ++trader->new_orders;
+			trader->next_order_id++;
+			if (order_id == UPPER_BOUND)
+			{
+				trader->upper_partition = entry.partition;
+			}
+			else
+			{
+				if (order_id >= trader->order_capacity)
+				{
+					int capacity = trader->order_capacity > 0 ? trader->order_capacity : 64;
+					while (capacity <= order_id)
+					{
+						capacity *= 2;
+					}
+					trader->order_partition = realloc(trader->order_partition, capacity);
+					memset(trader->order_partition + trader->order_capacity, -1, capacity - trader->order_capacity);
+					trader->order_capacity = capacity;
+				}
+				trader->order_partition[order_id] = entry.partition;
+			}
+		}
+	}
+	else if ((strcmp(fields[0], "AMEND") == 0 || strcmp(fields[0], "CANCEL") == 0) && number_fields >= 2)
+	{
+		int order_id = atoi(fields[1]);
+		if (order_id == UPPER_BOUND)
+		{
+			entry.partition = trader->upper_partition;
+		}
+		else if (order_id >= 0 && order_id < trader->order_capacity)
+		{
+			entry.partition = trader->order_partition[order_id];
+		}
+	}
+	else if ((strcmp(fields[0], "QUOTE") == 0 || strcmp(fields[0], "DEPTH") == 0 || strcmp(fields[0], "REPLAY") == 0) && number_fields >= 2)
+	{
+		int product_index = get_product_index(fields[1]);
+		entry.partition = product_index == -1 ? -1 : product_index % router.number_partitions;
+	}
+
+	if (entry.partition == -1)
+	{
+		answer_invalid(trader);
+		return;
+	}
+	add_in_flight(trader, &entry);
+	send_partition(entry.partition, trader->trader_id, SPX_PARTITION_COMMAND, command, length);
+}
+
+/* Function: read_trader
+ * 	----------------------------
+ *   Reads what a trader has written and routes its complete commands. At the end of its
+ *   pipe the trader is disconnected from every partition.
+ *
+ *   trader: the trader
+ */
+void read_trader(struct router_trader *trader)
+{
+	while (!trader->eof)
+	{
+		ssize_t length = read(trader->trader_fd, trader->input + trader->length, ROUTER_INPUT - trader->length);
+		if (length == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		if (length <= 0)
+		{
+			trader->eof = TRUE;
+			epoll_ctl(router.epoll_fd, EPOLL_CTL_DEL, trader->trader_fd, NULL);
+			printf("%s Trader %d disconnected\n", LOG_PREFIX, trader->trader_id);
+			for (int p = 0; p < router.number_partitions; p++)
+			{
+				send_partition(p, trader->trader_id, SPX_PARTITION_DISCONNECT, "", 0);
+			}
+			router.disconnected++;
+			return;
+		}
+		trader->length += length;
+		char *start = trader->input;
+		char *end;
+		while ((end = memchr(start, ';', trader->length - (start - trader->input))) != NULL)
+		{
+			route_command(trader, start, end - start);
+			start = end + 1;
+		}
+		trader->length -= start - trader->input;
+		memmove(trader->input, start, trader->length);
+		if (trader->length == ROUTER_INPUT)
+		{
+			// No command is this long
+			trader->length = 0;
+		}
+	}
+}
+
+/* Function: add_position
+ * 	----------------------------
+ *   Adds a partition's position of a trader in one product to the totals.
+ *
+ *   trader_id: the trader
+ *   text: "<product> <quantity> <cash>"
+ *   length: length of the text
+ */
+void add_position(int trader_id, char *text, int length)
+{
+	char line[SPX_PARTITION_TEXT + 1];
+	char product[SPX_PARTITION_TEXT + 1];
+	int64_t quantity;
+	int64_t cash;
+	memcpy(line, text, length);
+	line[length] = '\0';
+	if (trader_id < 0 || trader_id >= router.number_traders || sscanf(line, "%s %" SCNd64 " %" SCNd64, product, &quantity, &cash) != 3)
+	{
+		return;
+	}
+	int product_index = get_product_index(product);
+	if (product_index != -1)
+	{
+		router.quantity[trader_id * router.size + product_index] += quantity;
+		router.cash[trader_id * router.size + product_index] += cash;
+	}
+}
+
+/* Function: read_partition
+ * 	----------------------------
+ *   Takes everything a partition has sent: messages and DONEs go to the trader's held
+ *   messages, positions and fees to the totals.
+ *
+ *   index: the partition
+ */
+void read_partition(int index)
+{
+	struct router_partition *part = &(router.partitions[index]);
+	uint64_t count;
+	while (read(part->message_fd, &count, sizeof(uint64_t)) == -1 && errno == EINTR)
+	{
+	}
+	struct spx_partition_ring *ring = &(part->queues->messages);
+	uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+	for (; tail != head; tail++)
+	{
+		struct spx_partition_record *record = &(ring->records[tail & (SPX_PARTITION_SLOTS - 1)]);
+		part->open = TRUE;
+		if (record->type == SPX_PARTITION_CLOSED)
+		{
+			char fees[SPX_PARTITION_TEXT + 1];
+			memcpy(fees, record->text, record->length);
+			fees[record->length] = '\0';
+			part->fees = atol(fees);
+			part->closed = TRUE;
+			router.closed++;
+		}
+		else if (record->type == SPX_PARTITION_POSITION)
+		{
+			add_position(record->trader_id, record->text, record->length);
+		}
+		else if (record->trader_id >= 0 && record->trader_id < router.number_traders)
+		{
+			// The router opens the market itself once every partition is up
+			if (record->type == SPX_PARTITION_MESSAGE && record->length == 12 && memcmp(record->text, "MARKET OPEN;", 12) == 0)
+			{
+				continue;
+			}
+			struct router_trader *trader = &(router.traders[record->trader_id]);
+			queue_push(&(trader->held[index]), record->trader_id, record->type, record->text, record->length);
+			deliver(trader);
+		}
+	}
+	__atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+}
+
+/* Function: open_market
+ * 	----------------------------
+ *   Sends MARKET OPEN to every trader once every partition is up.
+ */
+void open_market()
+{
+	for (int p = 0; p < router.number_partitions; p++)
+	{
+		if (!router.partitions[p].open)
+		{
+			return;
+		}
+	}
+	for (int i = 0; i < router.number_traders; i++)
+	{
+		fprintf(router.traders[i].fp_exchange_t, "MARKET OPEN;");
+		router.traders[i].unsignalled = TRUE;
+	}
+	router.market_open = TRUE;
+}
+
+/* Function: reap_children
+ * 	----------------------------
+ *   Reaps exited children. A partition that exits before it has reported is fatal.
+ *
+ *   returns: -1 if a partition failed, 0 otherwise
+ */
+int reap_children()
+{
+	child_exited = FALSE;
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		for (int p = 0; p < router.number_partitions; p++)
+		{
+			if (router.partitions[p].pid == pid)
+			{
+				router.partitions[p].pid = 0;
+				if (!router.partitions[p].closed)
+				{
+					// It may have reported just before exiting
+					read_partition(p);
+				}
+				if (!router.partitions[p].closed)
+				{
+					fprintf(stderr, "%s Partition %d exited before the end of the session\n", LOG_PREFIX, p);
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/* Function: end_pass
+ * 	----------------------------
+ *   Signals the traders with new messages and rings the partitions with new commands.
+ */
+void end_pass()
+{
+	for (int i = 0; i < router.number_traders; i++)
+	{
+		struct router_trader *trader = &(router.traders[i]);
+		if (trader->unsignalled)
+		{
+			trader->unsignalled = FALSE;
+			fflush(trader->fp_exchange_t);
+			kill(trader->pid_child, SIGUSR1);
+		}
+	}
+	for (int p = 0; p < router.number_partitions; p++)
+	{
+		struct router_partition *part = &(router.partitions[p]);
+		if (part->pushed)
+		{
+			uint64_t one = 1;
+			if (write(part->command_fd, &one, sizeof(uint64_t)) == -1 && errno != EAGAIN)
+			{
+				perror("write failed partition doorbell");
+			}
+			part->pushed = FALSE;
+		}
+	}
+}
+
+/* Function: print_report
+ * 	----------------------------
+ *   Prints the fees of all partitions and every trader's positions across them.
+ */
+void print_report()
+{
+	long int fees = 0;
+	for (int p = 0; p < router.number_partitions; p++)
+	{
+		fees += router.partitions[p].fees;
+	}
+	printf("%s Trading completed\n", LOG_PREFIX);
+	printf("%s Exchange fees collected: $%ld\n", LOG_PREFIX, fees);
+	printf("%s\t--POSITIONS--\n", LOG_PREFIX);
+	for (int i = 0; i < router.number_traders; i++)
+	{
+		printf("%s\tTrader %d: ", LOG_PREFIX, i);
+		for (int j = 0; j < router.size; j++)
+		{
+			printf("%s%s %" PRId64 " ($%" PRId64 ")", j == 0 ? "" : ", ", router.product_array[j], router.quantity[i * router.size + j], router.cash[i * router.size + j]);
+		}
+		printf("\n");
+	}
+}
+
+/* Function: free_router
+ * 	----------------------------
+ *   Stops what is still running and removes the pipes, queues and products files.
+ */
+void free_router()
+{
+	for (int p = 0; p < router.number_partitions; p++)
+	{
+		struct router_partition *part = &(router.partitions[p]);
+		if (part->pid > 0)
+		{
+			kill(part->pid, SIGKILL);
+			waitpid(part->pid, NULL, 0);
+		}
+		if (part->queues != NULL)
+		{
+			munmap(part->queues, sizeof(struct spx_partition_queues));
+			shm_unlink(part->name);
+			close(part->command_fd);
+			close(part->message_fd);
+		}
+		remove(part->products_file);
+		free(part->backlog.records);
+	}
+	for (int i = 0; i < router.number_traders; i++)
+	{
+		struct router_trader *trader = &(router.traders[i]);
+		if (trader->pipe_exchange_t == NULL)
+		{
+			continue;
+		}
+		if (trader->fp_exchange_t != NULL)
+		{
+			fclose(trader->fp_exchange_t);
+		}
+		close(trader->trader_fd);
+		remove(trader->pipe_exchange_t);
+		remove(trader->pipe_trader_e);
+		free(trader->pipe_exchange_t);
+		free(trader->pipe_trader_e);
+		free(trader->order_partition);
+		free(trader->in_flight);
+		for (int p = 0; p <= router.number_partitions; p++)
+		{
+			free(trader->held[p].records);
+		}
+		free(trader->held);
+		free(trader->outstanding);
+	}
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+	{
+	}
+	for (int i = 0; i < router.size; i++)
+	{
+		free(router.product_array[i]);
+	}
+	free(router.product_array);
+	free(router.partitions);
+	free(router.traders);
+	free(router.quantity);
+	free(router.cash);
+	close(router.epoll_fd);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 5 || atoi(argv[1]) < 1)
+	{
+		fprintf(stderr, "Usage: %s <partitions> <exchange binary> <products file> <trader> ...\n", argv[0]);
+		return 1;
+	}
+	printf("%s Starting\n", LOG_PREFIX);
+	router.product_array = load_products(argv[3], &(router.size));
+	if (router.product_array == NULL)
+	{
+		return 1;
+	}
+	router.number_partitions = atoi(argv[1]);
+	if (router.number_partitions > router.size)
+	{
+		fprintf(stderr, "%s %d partitions for %d products\n", LOG_PREFIX, router.number_partitions, router.size);
+		return 1;
+	}
+	router.number_traders = argc - 4;
+	router.partitions = calloc(router.number_partitions, sizeof(struct router_partition));
+	router.traders = calloc(router.number_traders, sizeof(struct router_trader));
+	router.quantity = calloc(router.number_traders * router.size, sizeof(int64_t));
+	router.cash = calloc(router.number_traders * router.size, sizeof(int64_t));
+	router.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	struct sigaction child_sign;
+	memset(&child_sign, 0, sizeof(struct sigaction));
+	child_sign.sa_handler = child_sig;
+	sigaction(SIGCHLD, &child_sign, NULL);
+	// Traders signal the router after writing, but it waits on their pipes
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int p = 0; p < router.number_partitions; p++)
+	{
+		if (start_partition(p, argv[2]) == -1)
+		{
+			free_router();
+			return 1;
+		}
+	}
+	for (int i = 0; i < router.number_traders; i++)
+	{
+		struct router_trader *trader = &(router.traders[i]);
+		trader->trader_id = i;
+		trader->upper_partition = -1;
+		trader->outstanding = calloc(router.number_partitions + 1, sizeof(int));
+		trader->held = calloc(router.number_partitions + 1, sizeof(struct record_queue));
+		start_trader(argv[i + 4], trader);
+	}
+	connect_traders();
+
+	// --------------------PROCESSING----------------------------
+	struct epoll_event *events = malloc(sizeof(struct epoll_event) * (router.number_partitions + router.number_traders));
+	int failed = FALSE;
+	while (router.closed < router.number_partitions && !failed)
+	{
+		int backlog = FALSE;
+		for (int p = 0; p < router.number_partitions; p++)
+		{
+			backlog |= router.partitions[p].backlog.count > 0 && flush_backlog(&(router.partitions[p]));
+		}
+		int ready = epoll_wait(router.epoll_fd, events, router.number_partitions + router.number_traders, backlog ? BACKLOG_WAIT : -1);
+		for (int i = 0; i < ready; i++)
+		{
+			int tag = events[i].data.u32;
+			if (tag < router.number_partitions)
+			{
+				read_partition(tag);
+			}
+			else
+			{
+				read_trader(&(router.traders[tag - router.number_partitions]));
+			}
+		}
+		if (!router.market_open)
+		{
+			open_market();
+		}
+		end_pass();
+		if (child_exited)
+		{
+			failed = reap_children() == -1;
+		}
+	}
+	free(events);
+
+	if (!failed)
+	{
+		print_report();
+	}
+	free_router();
+	return failed ? 1 : 0;
+}